@@ -223,6 +223,10 @@ errno_t CR2tomov()
 
     if(CR2toFITSrgb == 1)
     {
+        RAWBAYER_RGB_CTX  rgbctx = RAWBAYER_RGB_CTX_INIT;
+        RAWBAYER_RGB_OPTS rgbopt = RAWBAYER_RGB_OPTS_DEFAULT;
+        rawbayer_rgb_opts_CLIvariables(&rgbopt);
+
         load_fits("bias.fits", "bias", 1, NULL);
         load_fits("dark.fits", "dark", 1, NULL);
         load_fits("badpix.fits", "badpix", 1, NULL);
@@ -259,7 +263,12 @@ errno_t CR2tomov()
                     MKim = 1;
                     printf("[%ld] working on file %s\n", cnt, fname);
                     fname[strlen(fname) - 1] = '\0';
-                    loadCR2toFITSRGB(fname, "imr", "img", "imb");
+                    loadCR2toFITSRGB(fname,
+                                     "imr",
+                                     "img",
+                                     "imb",
+                                     &rgbopt,
+                                     &rgbctx);
                     /*		  if(binfact!=1)
                       {
                         basic_contract("imr","imrc",binfact,binfact);
@@ -483,6 +492,8 @@ errno_t CR2tomov()
         }
 
         printf("%ld images processed\n", cnt);
+
+        rawbayer_rgb_ctx_free(&rgbctx);
     }
 
     if(system("rm imgstats.txt") != 0)
@@ -7,681 +7,584 @@
 
 #include "COREMOD_memory/COREMOD_memory.h"
 
-static float FLUXFACTOR = 1.0;
-
-// convers a single raw bayer FITS frame into RGB FITS
-// uses "bias", "badpix" and "flat" if they exist
-// output is imr, img, imb
-// this is a simple interpolation routine
-// IMPORTANT: input will be modified
-// Sampling factor : 0=full resolution (slow), 1=half resolution (fast), 2=quarter resolution (very fast)
-// Fast mode does not reject bad pixels
-errno_t convert_rawbayerFITStorgbFITS_simple(const char *__restrict ID_name,
-        const char *__restrict ID_name_r,
-        const char *__restrict ID_name_g,
-        const char *__restrict ID_name_b,
-        int SamplFactor)
+#include "FITStorgbFITSsimple.h"
+#include "rawbayer_demosaic.h"
+
+// Full resolution bad pixel / missing color interpolation
+// Each color channel is interpolated at the sites it does not sample and at
+// its bad pixels, from the good same-color sites of the 5x5 neighborhood
+// weighted by exp(-5 r^2). Away from the frame edges and from bad pixels
+// the neighborhood only depends on the CFA phase, so the normalized weights
+// are tabulated per phase. The remaining sites (frame border, bad pixels and
+// their neighbors) are listed with their own normalized weights. Tables are
+// built once and cached until the bad pixel index of the calibration context
+// or the geometry changes.
+#define BPI_NCOLOR 3 // R, G, B
+#define BPI_HALF   2
+#define BPI_NTAP   24
+
+typedef struct
 {
-    imageID ID;
-    long    Xsize, Ysize;
-    imageID IDr, IDg, IDb, IDrc, IDgc, IDbc, IDbp;
-    imageID IDbadpix;
-    imageID IDflat;
-    imageID IDdark;
-    imageID IDbias;
-    long   ii, jj, ii1, jj1, ii2, jj2, iistart, iiend, jjstart, jjend, dii, djj;
-    double v1, v2, v, vc, tmp1;
-    long   cnt;
-    double coeff;
-    imageID ID00, ID01, ID10, ID11;
-    imageID ID00c, ID01c, ID10c, ID11c;
-    double  eps     = 1.0e-8;
-    int     RGBmode = 0;
-
-    int FastMode = 0;
-
-    if(variable_ID("_RGBfast") != -1)
-    {
-        FastMode = 1;
-    }
-
-    ID    = image_ID(ID_name);
-    Xsize = data.image[ID].md[0].size[0];
-    Ysize = data.image[ID].md[0].size[1];
+    // Regular sites, per CFA phase [jj & 1][ii & 1]
+    int   target[2][2]; // phase does not sample this color
+    int   ntap[2][2];
+    long  tapoff[2][2][BPI_NTAP]; // neighbor pixel offset
+    float tapw[2][2][BPI_NTAP];   // normalized weight
+
+    // Sparse sites
+    long   nsparse;
+    long  *pix;    // target pixel index
+    long  *wstart; // nsparse + 1 offsets into nb and w
+    long  *nb;     // neighbor pixel index
+    float *w;      // normalized weight
+} BPI_COLOR;
+
+typedef struct BPI_CACHE
+{
+    // cache key
+    int      built;
+    uint64_t badpix_version;
+    long     xsize;
+    long     ysize;
+    int      pattern;
 
-    printf("X Y  = %ld %ld\n", Xsize, Ysize);
+    BPI_COLOR color[BPI_NCOLOR];
+} BPI_CACHE;
 
-    if((Xsize == 4290) && (Ysize == 2856))
-    {
-        RGBmode = 1;
-    }
-    if((Xsize == 4770) && (Ysize == 3178))
-    {
-        RGBmode = 1;
-    }
-    if((Xsize == 5202) && (Ysize == 3465))
-    {
-        RGBmode = 2;
-    }
-    if((Xsize == 5208) && (Ysize == 3476))
+static void bpi_free(BPI_CACHE *bpi)
+{
+    for(int k = 0; k < BPI_NCOLOR; k++)
     {
-        RGBmode = 1;
+        free(bpi->color[k].pix);
+        free(bpi->color[k].wstart);
+        free(bpi->color[k].nb);
+        free(bpi->color[k].w);
     }
+    memset(bpi->color, 0, sizeof(bpi->color));
+    bpi->built = 0;
+}
 
-    if(RGBmode == 0)
+static errno_t bpi_build_color(BPI_COLOR        *col,
+                               int               k,
+                               const int         cfa[2][2],
+                               const RAWCAL_CTX *rcal,
+                               long              xsize,
+                               long              ysize)
+{
+    // Only complete 2x2 cells are sampled
+    long xe = 2 * (xsize / 2);
+    long ye = 2 * (ysize / 2);
+
+    // Per pixel state: 1 = good site of this color, 2 = target;
+    // bit 2 = needs a sparse entry
+    uint8_t *state = (uint8_t *) malloc(xsize * ysize);
+    if(state == NULL)
     {
-        printf("image size : %ld %ld\n", Xsize, Ysize);
-        RGBmode = 1;
-        //PRINT_ERROR("Unknown RGB image mode\n");
-        //exit(0);
+        PRINT_ERROR("malloc returns NULL pointer");
+        return RETURN_FAILURE;
     }
 
-    printf("FAST MODE = %d\n", FastMode);
-    printf("RGBmode   = %d\n", RGBmode);
-    //exit(0);
-
-    if(FastMode == 0)
-    {
-        // bias
-        IDbias = image_ID("bias");
-        if(IDbias == -1)
+    for(long jj = 0; jj < ysize; jj++)
+        for(long ii = 0; ii < xsize; ii++)
         {
-            create_2Dimage_ID("bias", Xsize, Ysize, &IDbias);
-            for(ii = 0; ii < Xsize * Ysize; ii++)
+            uint8_t s = 2;
+            if((ii < xe) && (jj < ye) && (cfa[jj & 1][ii & 1] == k))
             {
-                data.image[IDbias].array.F[ii] = 0.0;
+                s = 1;
             }
-        }
-
-        // dark
-        IDdark = image_ID("dark");
-        if(IDdark == -1)
-        {
-            create_2Dimage_ID("dark", Xsize, Ysize, &IDdark);
-            for(ii = 0; ii < Xsize * Ysize; ii++)
+            if((ii < BPI_HALF) || (ii >= xe - BPI_HALF) || (jj < BPI_HALF) ||
+                    (jj >= ye - BPI_HALF))
             {
-                data.image[IDdark].array.F[ii] = 0.0;
+                s |= 4;
             }
+            state[jj * xsize + ii] = s;
         }
 
-        // bad pixel map
-        IDbadpix = image_ID("badpix");
-        if(IDbadpix == -1)
+    // Bad sites of this color are targets, their neighborhoods go sparse
+    for(long b = 0; b < rcal->nbadpix; b++)
+    {
+        long p  = rcal->badidx[b];
+        long ii = p % xsize;
+        long jj = p / xsize;
+        if((state[p] & 3) != 1)
         {
-            create_2Dimage_ID("badpix", Xsize, Ysize, &IDbadpix);
-            for(ii = 0; ii < Xsize * Ysize; ii++)
-            {
-                data.image[IDbadpix].array.F[ii] = 0.0;
-            }
+            continue;
         }
+        state[p] = 2 | 4;
+        for(long jj1 = jj - BPI_HALF; jj1 <= jj + BPI_HALF; jj1++)
+            for(long ii1 = ii - BPI_HALF; ii1 <= ii + BPI_HALF; ii1++)
+                if((ii1 > -1) && (jj1 > -1) && (ii1 < xsize) && (jj1 < ysize))
+                {
+                    state[jj1 * xsize + ii1] |= 4;
+                }
+    }
 
-        copy_image_ID("badpix", "badpix1", 0);
-        IDbp = image_ID("badpix1");
-
-        // flat field
-        IDflat = image_ID("flat");
-        if(IDflat == -1)
+    // Regular tap tables
+    for(int pj = 0; pj < 2; pj++)
+        for(int pi = 0; pi < 2; pi++)
         {
-            create_2Dimage_ID("flat", Xsize, Ysize, &IDflat);
-            for(ii = 0; ii < Xsize * Ysize; ii++)
+            double wsum = 0.0;
+            int    n    = 0;
+            for(int djj = -BPI_HALF; djj <= BPI_HALF; djj++)
+                for(int dii = -BPI_HALF; dii <= BPI_HALF; dii++)
+                    if(((dii != 0) || (djj != 0)) &&
+                            (cfa[(pj + djj) & 1][(pi + dii) & 1] == k))
+                    {
+                        col->tapoff[pj][pi][n] = djj * xsize + dii;
+                        col->tapw[pj][pi][n]   = exp(-5.0 *
+                                                     (dii * dii + djj * djj));
+                        wsum += col->tapw[pj][pi][n];
+                        n++;
+                    }
+            for(int t = 0; t < n; t++)
             {
-                data.image[IDflat].array.F[ii] = 1.0;
+                col->tapw[pj][pi][t] /= wsum;
             }
-            //      arith_image_cstadd_inplace("flat",1.0);
+            col->ntap[pj][pi]   = n;
+            col->target[pj][pi] = (cfa[pj][pi] != k);
         }
 
-        // remove bias
-        if(IDbias != -1)
-        {
-            for(ii = 0; ii < Xsize; ii++)
-                for(jj = 0; jj < Ysize; jj++)
-                {
-                    data.image[ID].array.F[jj * Xsize + ii] -=
-                        data.image[IDbias].array.F[jj * Xsize + ii];
-                }
-        }
-        // remove dark
-        if(IDdark != -1)
+    // Sparse sites: count, then fill
+    long nsparse = 0;
+    long nw      = 0;
+    for(int pass = 0; pass < 2; pass++)
+    {
+        if(pass == 1)
         {
-            for(ii = 0; ii < Xsize; ii++)
-                for(jj = 0; jj < Ysize; jj++)
-                {
-                    data.image[ID].array.F[jj * Xsize + ii] -=
-                        data.image[IDdark].array.F[jj * Xsize + ii];
-                }
+            col->pix    = (long *) malloc(sizeof(long) * (nsparse + 1));
+            col->wstart = (long *) malloc(sizeof(long) * (nsparse + 1));
+            col->nb     = (long *) malloc(sizeof(long) * (nw + 1));
+            col->w      = (float *) malloc(sizeof(float) * (nw + 1));
+            if((col->pix == NULL) || (col->wstart == NULL) ||
+                    (col->nb == NULL) || (col->w == NULL))
+            {
+                PRINT_ERROR("malloc returns NULL pointer");
+                free(state);
+                return RETURN_FAILURE;
+            }
+            col->nsparse = nsparse;
+            nsparse      = 0;
+            nw           = 0;
         }
 
-        // remove obvious isolated hot pixels
-        cnt = 0;
-        for(ii = 0; ii < Xsize; ii++)
-            for(jj = 0; jj < Ysize; jj++)
+        for(long jj = 0; jj < ysize; jj++)
+            for(long ii = 0; ii < xsize; ii++)
             {
-                v1      = data.image[ID].array.F[jj * Xsize + ii];
-                iistart = ii - 2;
-                iiend   = ii + 2;
-                if(iistart < 0)
-                {
-                    iistart = 0;
-                }
-                if(iiend > Xsize - 1)
+                long p = jj * xsize + ii;
+                if(state[p] != (2 | 4))
                 {
-                    iiend = Xsize - 1;
+                    continue;
                 }
-                jjstart = jj - 2;
-                jjend   = jj + 2;
-                if(jjstart < 0)
-                {
-                    jjstart = 0;
-                }
-                if(jjend > Ysize - 1)
-                {
-                    jjend = Ysize - 1;
-                }
-                v2 = 0.0;
-                for(ii1 = iistart; ii1 < iiend; ii1++)
-                    for(jj1 = jjstart; jj1 < jjend; jj1++)
-                        if((ii1 != ii) || (jj1 != jj))
+                long   w0   = nw;
+                double wsum = 0.0;
+                for(long djj = -BPI_HALF; djj <= BPI_HALF; djj++)
+                    for(long dii = -BPI_HALF; dii <= BPI_HALF; dii++)
+                    {
+                        long ii1 = ii + dii;
+                        long jj1 = jj + djj;
+                        if((ii1 > -1) && (jj1 > -1) && (ii1 < xsize) &&
+                                (jj1 < ysize) && ((dii != 0) || (djj != 0)) &&
+                                ((state[jj1 * xsize + ii1] & 3) == 1))
                         {
-                            tmp1 = data.image[ID].array.F[jj1 * Xsize + ii1];
-                            if(tmp1 > v2)
+                            if(pass == 1)
                             {
-                                v2 = tmp1;
+                                col->nb[nw] = jj1 * xsize + ii1;
+                                col->w[nw]  = exp(-5.0 *
+                                                  (dii * dii + djj * djj));
+                                wsum += col->w[nw];
                             }
+                            nw++;
                         }
-                if(v1 > 4.0 * v2 + 500.0)
+                    }
+                if(pass == 1)
                 {
-                    data.image[ID].array.F[jj * Xsize + ii] = v2;
-                    //		data.image[IDbp].array.F[jj*Xsize+ii] = 1.0;
-                    cnt++;
+                    for(long t = w0; t < nw; t++)
+                    {
+                        col->w[t] /= wsum;
+                    }
+                    col->pix[nsparse]    = p;
+                    col->wstart[nsparse] = w0;
                 }
+                nsparse++;
             }
-        printf("%ld hot pixels removed\n", cnt);
+    }
+    col->wstart[nsparse] = nw;
 
-        for(ii = 0; ii < Xsize; ii++)
-            for(jj = 0; jj < Ysize; jj++)
-            {
-                data.image[ID].array.F[jj * Xsize + ii] *= FLUXFACTOR;
-            }
+    free(state);
+
+    return RETURN_SUCCESS;
+}
+
+// (Re)build the cache if the bad pixel index or the geometry changed
+static errno_t bpi_update(BPI_CACHE        *bpi,
+                          const RAWCAL_CTX *rcal,
+                          long              xsize,
+                          long              ysize,
+                          const RAWBAYER_CFA *frame_cfa)
+{
+    int pattern = rawbayer_cfa_pattern(frame_cfa);
+
+    if(bpi->built && (bpi->badpix_version == rcal->badpix_version) &&
+            (bpi->xsize == xsize) && (bpi->ysize == ysize) &&
+            (bpi->pattern == pattern))
+    {
+        return RETURN_SUCCESS;
     }
 
-    switch(SamplFactor)
+    bpi_free(bpi);
+
+    int cfa[2][2];
+    rawbayer_cfa_layout(frame_cfa, cfa);
+    long nsparse = 0;
+    for(int k = 0; k < BPI_NCOLOR; k++)
     {
+        if(bpi_build_color(&bpi->color[k], k, cfa, rcal, xsize, ysize) !=
+                RETURN_SUCCESS)
+        {
+            bpi_free(bpi);
+            return RETURN_FAILURE;
+        }
+        nsparse += bpi->color[k].nsparse;
+    }
+    printf("bad pixel interpolation tables: %ld sparse sites\n", nsparse);
 
-        case 0:
+    bpi->built          = 1;
+    bpi->badpix_version = rcal->badpix_version;
+    bpi->xsize          = xsize;
+    bpi->ysize          = ysize;
+    bpi->pattern        = pattern;
 
-            if(image_ID(ID_name_r) != -1)
-            {
-                delete_image_ID(ID_name_r, DELETE_IMAGE_ERRMODE_WARNING);
-            }
-            create_2Dimage_ID(ID_name_r, Xsize, Ysize, &IDr);
-            create_2Dimage_ID("imrc", Xsize, Ysize, &IDrc);
+    return RETURN_SUCCESS;
+}
 
-            if(image_ID(ID_name_g) != -1)
-            {
-                delete_image_ID(ID_name_g, DELETE_IMAGE_ERRMODE_WARNING);
-            }
-            create_2Dimage_ID(ID_name_g, Xsize, Ysize, &IDg);
-            create_2Dimage_ID("imgc", Xsize, Ysize, &IDgc);
+static void bpi_apply_color(const BPI_COLOR *col,
+                            float *__restrict im,
+                            long xsize,
+                            long ysize)
+{
+    long xe = 2 * (xsize / 2);
+    long ye = 2 * (ysize / 2);
 
-            if(image_ID(ID_name_b) != -1)
+    // Regular sites only read good sites of this color, which are never
+    // written, so the order does not matter
+    for(long jj = BPI_HALF; jj < ye - BPI_HALF; jj++)
+        for(int pi = 0; pi < 2; pi++)
+        {
+            if(!col->target[jj & 1][pi])
             {
-                delete_image_ID(ID_name_b, DELETE_IMAGE_ERRMODE_WARNING);
+                continue;
             }
-            create_2Dimage_ID(ID_name_b, Xsize, Ysize, &IDb);
-            create_2Dimage_ID("imbc", Xsize, Ysize, &IDbc);
-
-            if(RGBmode == 1)  // GBRG
+            int          n   = col->ntap[jj & 1][pi];
+            const long  *off = col->tapoff[jj & 1][pi];
+            const float *w   = col->tapw[jj & 1][pi];
+            for(long ii = BPI_HALF + pi; ii < xe - BPI_HALF; ii += 2)
             {
-                ID00  = IDg;
-                ID00c = IDgc;
-
-                ID10  = IDb;
-                ID10c = IDbc;
-
-                ID01  = IDr;
-                ID01c = IDrc;
-
-                ID11  = IDg;
-                ID11c = IDgc;
+                const float *src = im + jj * xsize + ii;
+                float        v   = 0.0f;
+                for(int t = 0; t < n; t++)
+                {
+                    v += w[t] * src[off[t]];
+                }
+                im[jj * xsize + ii] = v;
             }
+        }
 
-            if(RGBmode == 2)
-            {
-                ID00  = IDr;
-                ID00c = IDrc;
+    for(long s = 0; s < col->nsparse; s++)
+    {
+        float v = 0.0f;
+        for(long t = col->wstart[s]; t < col->wstart[s + 1]; t++)
+        {
+            v += col->w[t] * im[col->nb[t]];
+        }
+        // no good neighbor: NaN, as the direct v / vc evaluation gave
+        im[col->pix[s]] = (col->wstart[s + 1] > col->wstart[s]) ? v : NAN;
+    }
+}
 
-                ID10  = IDg;
-                ID10c = IDgc;
+// Legacy CLI variables: RGBfullres selects full resolution, _RGBfast skips
+// calibration
+void rawbayer_rgb_opts_CLIvariables(RAWBAYER_RGB_OPTS *opt)
+{
+    opt->sampling = (variable_ID("RGBfullres") == -1) ? 1 : 0;
+    opt->fast     = (variable_ID("_RGBfast") != -1) ? 1 : 0;
+}
 
-                ID01  = IDg;
-                ID01c = IDgc;
+// Rebuild calibration maps and bad pixel tables if their sources, the
+// geometry or the CFA changed. Not to be called during conversions using ctx.
+errno_t rawbayer_rgb_ctx_update(RAWBAYER_RGB_CTX   *ctx,
+                                long                xsize,
+                                long                ysize,
+                                const RAWBAYER_CFA *cfa)
+{
+    if(rawbayer_ctx_update(&ctx->rcal, xsize, ysize) != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
 
-                ID11  = IDb;
-                ID11c = IDbc;
-            }
+    if(ctx->bpi == NULL)
+    {
+        ctx->bpi = (BPI_CACHE *) calloc(1, sizeof(BPI_CACHE));
+        if(ctx->bpi == NULL)
+        {
+            PRINT_ERROR("calloc returns NULL pointer");
+            return RETURN_FAILURE;
+        }
+    }
 
-            if(FastMode == 0)
-            {
-                for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                    for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                    {
-                        ii = ii1 * 2;
-                        jj = jj1 * 2;
-
-                        ii2 = ii;
-                        jj2 = jj + 1;
-                        data.image[ID01].array.F[jj2 * Xsize + ii2] =
-                            data.image[ID].array.F[jj2 * Xsize + ii2] /
-                            data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                        data.image[ID01c].array.F[jj2 * Xsize + ii2] =
-                            1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                        ii2 = ii + 1;
-                        jj2 = jj + 1;
-                        data.image[ID11].array.F[jj2 * Xsize + ii2] =
-                            data.image[ID].array.F[jj2 * Xsize + ii2] /
-                            data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                        data.image[ID11c].array.F[jj2 * Xsize + ii2] =
-                            1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                        ii2 = ii;
-                        jj2 = jj;
-                        data.image[ID00].array.F[jj2 * Xsize + ii2] =
-                            data.image[ID].array.F[jj2 * Xsize + ii2] /
-                            data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                        data.image[ID00c].array.F[jj2 * Xsize + ii2] =
-                            1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                        ii2 = ii + 1;
-                        jj2 = jj;
-                        data.image[ID10].array.F[jj2 * Xsize + ii2] =
-                            data.image[ID].array.F[jj2 * Xsize + ii2] /
-                            data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                        data.image[ID10c].array.F[jj2 * Xsize + ii2] =
-                            1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-                    }
+    return bpi_update(ctx->bpi, &ctx->rcal, xsize, ysize, cfa);
+}
 
-                for(ii = 0; ii < Xsize; ii++)
-                    for(jj = 0; jj < Ysize; jj++)
-                    {
-                        if(data.image[IDrc].array.F[jj * Xsize + ii] < 0.5)
-                        {
-                            v  = 0.0;
-                            vc = 0.0;
-                            for(dii = -2; dii < 3; dii++)
-                                for(djj = -2; djj < 3; djj++)
-                                {
-                                    ii1 = ii + dii;
-                                    jj1 = jj + djj;
-                                    if((ii1 > -1) && (jj1 > -1) && (ii1 < Xsize) &&
-                                            (jj1 < Ysize))
-                                        if((dii != 0) || (djj != 0))
-                                        {
-                                            if(data.image[IDrc]
-                                                    .array.F[jj1 * Xsize + ii1] >
-                                                    0.5)
-                                            {
-                                                coeff = exp(
-                                                            -5.0 * (dii * dii + djj * djj));
-                                                vc += coeff;
-                                                v += data.image[IDr]
-                                                     .array
-                                                     .F[jj1 * Xsize + ii1] *
-                                                     coeff;
-                                            }
-                                        }
-                                }
-                            data.image[IDr].array.F[jj * Xsize + ii] = v / vc;
-                        }
+void rawbayer_rgb_ctx_free(RAWBAYER_RGB_CTX *ctx)
+{
+    rawbayer_ctx_free(&ctx->rcal);
+    if(ctx->bpi != NULL)
+    {
+        bpi_free(ctx->bpi);
+        free(ctx->bpi);
+        ctx->bpi = NULL;
+    }
+}
 
-                        if(data.image[IDgc].array.F[jj * Xsize + ii] < 0.5)
-                        {
-                            v  = 0.0;
-                            vc = 0.0;
-                            for(dii = -2; dii < 3; dii++)
-                                for(djj = -2; djj < 3; djj++)
-                                {
-                                    ii1 = ii + dii;
-                                    jj1 = jj + djj;
-                                    if((ii1 > -1) && (jj1 > -1) && (ii1 < Xsize) &&
-                                            (jj1 < Ysize))
-                                        if((dii != 0) || (djj != 0))
-                                        {
-                                            if(data.image[IDgc]
-                                                    .array.F[jj1 * Xsize + ii1] >
-                                                    0.5)
-                                            {
-                                                coeff = exp(
-                                                            -5.0 * (dii * dii + djj * djj));
-                                                vc += coeff;
-                                                v += data.image[IDg]
-                                                     .array
-                                                     .F[jj1 * Xsize + ii1] *
-                                                     coeff;
-                                            }
-                                        }
-                                }
-                            data.image[IDg].array.F[jj * Xsize + ii] = v / vc;
-                        }
+// Converts a raw bayer frame into R, G, B planes
+// raw: xsize x ysize, calibrated in place unless opt->fast
+// out: xsize x ysize (sampling 0) or xsize/2 x ysize/2 (sampling 1)
+// ctx: updated for this geometry and CFA, may be NULL in fast mode
+// Sampling 0 interpolates the missing colors and bad pixels; sampling 1
+// averages the good pixels of each color over 2x2 cells.
+// Fast mode does not calibrate nor reject bad pixels.
+// Only reads ctx and opt: conversions may run concurrently.
+errno_t rawbayer_rgb_convert(const RAWBAYER_RGB_CTX  *ctx,
+                             const RAWBAYER_RGB_OPTS *opt,
+                             float                   *raw,
+                             long                     xsize,
+                             long                     ysize,
+                             float                   *outr,
+                             float                   *outg,
+                             float                   *outb,
+                             long                    *nhotpix)
+{
+    int layout[2][2]; // color of CFA phase [jj & 1][ii & 1]
 
-                        if(data.image[IDbc].array.F[jj * Xsize + ii] < 0.5)
-                        {
-                            v  = 0.0;
-                            vc = 0.0;
-                            for(dii = -2; dii < 3; dii++)
-                                for(djj = -2; djj < 3; djj++)
-                                {
-                                    ii1 = ii + dii;
-                                    jj1 = jj + djj;
-                                    if((ii1 > -1) && (jj1 > -1) && (ii1 < Xsize) &&
-                                            (jj1 < Ysize))
-                                        if((dii != 0) || (djj != 0))
-                                        {
-                                            if(data.image[IDbc]
-                                                    .array.F[jj1 * Xsize + ii1] >
-                                                    0.5)
-                                            {
-                                                coeff = exp(
-                                                            -5.0 * (dii * dii + djj * djj));
-                                                vc += coeff;
-                                                v += data.image[IDb]
-                                                     .array
-                                                     .F[jj1 * Xsize + ii1] *
-                                                     coeff;
-                                            }
-                                        }
-                                }
-                            data.image[IDb].array.F[jj * Xsize + ii] = v / vc;
-                        }
-                    }
-            }
-            else
-            {
-                if(RGBmode == 1)  // GBRG
-                {
-                    // G
-                    for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii;
-                            jj2 = jj;
-                            data.image[IDg].array.F[jj2 * Xsize + ii2] =
-                                data.image[ID].array.F[jj2 * Xsize + ii2];
-                            ii2 = ii + 1;
-                            jj2 = jj + 1;
-                            data.image[IDg].array.F[jj2 * Xsize + ii2] =
-                                data.image[ID].array.F[jj2 * Xsize + ii2];
-                        }
-                    // replace blue pixels
-                    for(ii1 = 0; ii1 < Xsize / 2 - 1; ii1++)
-                        for(jj1 = 1; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii + 1;
-                            jj2 = jj;
-                            data.image[IDg].array.F[jj2 * Xsize + ii2] =
-                                0.25 *
-                                (data.image[ID].array.F[jj2 * Xsize + (ii2 - 1)] +
-                                 data.image[ID].array.F[jj2 * Xsize + (ii2 + 1)] +
-                                 data.image[ID].array.F[(jj2 + 1) * Xsize + ii2] +
-                                 data.image[ID].array.F[(jj2 - 1) * Xsize + ii2]);
-                        }
-                    // replace red pixels
-                    for(ii1 = 1; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2 - 1; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii;
-                            jj2 = jj + 1;
-                            data.image[IDg].array.F[jj2 * Xsize + ii2] =
-                                0.25 *
-                                (data.image[ID].array.F[jj2 * Xsize + (ii2 - 1)] +
-                                 data.image[ID].array.F[jj2 * Xsize + (ii2 + 1)] +
-                                 data.image[ID].array.F[(jj2 + 1) * Xsize + ii2] +
-                                 data.image[ID].array.F[(jj2 - 1) * Xsize + ii2]);
-                        }
+    // bad pixel map, NULL if none or in fast mode
+    const float *bp = NULL;
 
-                    // R
-                    for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii  = ii1 * 2;
-                            jj  = jj1 * 2;
-                            ii2 = ii;
-                            jj2 = jj + 1;
-                            data.image[IDr].array.F[jj2 * Xsize + ii2] =
-                                data.image[ID].array.F[jj2 * Xsize + ii2];
-                        }
-                    // replace g1 pixels
-                    for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 1; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii;
-                            jj2 = jj;
-                            data.image[IDr].array.F[jj2 * Xsize + ii2] =
-                                0.5 *
-                                (data.image[ID].array.F[(jj2 - 1) * Xsize + ii2] +
-                                 data.image[ID].array.F[(jj2 + 1) * Xsize + ii2]);
-                        }
-                    // replace g2 pixels
-                    for(ii1 = 0; ii1 < Xsize / 2 - 1; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii + 1;
-                            jj2 = jj + 1;
-                            data.image[IDr].array.F[jj2 * Xsize + ii2] =
-                                0.5 *
-                                (data.image[ID].array.F[jj2 * Xsize + (ii2 - 1)] +
-                                 data.image[ID].array.F[jj2 * Xsize + (ii2 + 1)]);
-                        }
-                    // replace b pixels
-                    for(ii1 = 0; ii1 < Xsize / 2 - 1; ii1++)
-                        for(jj1 = 1; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii + 1;
-                            jj2 = jj;
-                            data.image[IDr].array.F[jj2 * Xsize + ii2] =
-                                0.25 *
-                                (data.image[ID]
-                                 .array.F[(jj2 - 1) * Xsize + (ii2 - 1)] +
-                                 data.image[ID]
-                                 .array.F[(jj2 - 1) * Xsize + (ii2 + 1)] +
-                                 data.image[ID]
-                                 .array.F[(jj2 + 1) * Xsize + (ii2 - 1)] +
-                                 data.image[ID]
-                                 .array.F[(jj2 + 1) * Xsize + (ii2 + 1)]);
-                        }
+    if((opt->cfa.pattern < RAWBAYER_CFA_RGGB) ||
+            (opt->cfa.pattern > RAWBAYER_CFA_BGGR))
+    {
+        PRINT_ERROR("CFA pattern not resolved");
+        return RETURN_FAILURE;
+    }
+    rawbayer_cfa_layout(&opt->cfa, layout);
 
-                    // B
-                    for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii  = ii1 * 2;
-                            jj  = jj1 * 2;
-                            ii2 = ii + 1;
-                            jj2 = jj;
-                            data.image[IDb].array.F[jj2 * Xsize + ii2] =
-                                data.image[ID].array.F[jj2 * Xsize + ii2];
-                        }
+    if(opt->fast == 0)
+    {
+        if((ctx == NULL) || (!ctx->rcal.built) || (ctx->rcal.xsize != xsize) ||
+                (ctx->rcal.ysize != ysize))
+        {
+            PRINT_ERROR("calibration context not updated for %ld x %ld",
+                        xsize,
+                        ysize);
+            return RETURN_FAILURE;
+        }
+        bp = ctx->rcal.badpix;
+
+        // bias, dark, hot pixels, flux and flat in one pass
+        if(rawbayer_calibrate(raw,
+                              raw,
+                              ctx->rcal.offset,
+                              NULL,
+                              ctx->rcal.invflat,
+                              opt->fluxfactor,
+                              1,
+                              xsize,
+                              ysize,
+                              opt->nthreads,
+                              nhotpix) != RETURN_SUCCESS)
+        {
+            return RETURN_FAILURE;
+        }
+    }
+    else if(nhotpix != NULL)
+    {
+        *nhotpix = 0;
+    }
 
-                    // replace g2 pixels
-                    for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2 - 1; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii + 1;
-                            jj2 = jj + 1;
-                            data.image[IDb].array.F[jj2 * Xsize + ii2] =
-                                0.5 *
-                                (data.image[ID].array.F[(jj2 - 1) * Xsize + ii2] +
-                                 data.image[ID].array.F[(jj2 + 1) * Xsize + ii2]);
-                        }
-                    // replace g1 pixels
-                    for(ii1 = 1; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii;
-                            jj2 = jj;
-                            data.image[IDb].array.F[jj2 * Xsize + ii2] =
-                                0.5 *
-                                (data.image[ID].array.F[jj2 * Xsize + (ii2 - 1)] +
-                                 data.image[ID].array.F[jj2 * Xsize + (ii2 + 1)]);
-                        }
-                    // replace r pixels
-                    for(ii1 = 1; ii1 < Xsize / 2; ii1++)
-                        for(jj1 = 0; jj1 < Ysize / 2 - 1; jj1++)
-                        {
-                            ii = ii1 * 2;
-                            jj = jj1 * 2;
-
-                            ii2 = ii;
-                            jj2 = jj + 1;
-                            data.image[IDb].array.F[jj2 * Xsize + ii2] =
-                                0.25 *
-                                (data.image[ID]
-                                 .array.F[(jj2 - 1) * Xsize + (ii2 - 1)] +
-                                 data.image[ID]
-                                 .array.F[(jj2 - 1) * Xsize + (ii2 + 1)] +
-                                 data.image[ID]
-                                 .array.F[(jj2 + 1) * Xsize + (ii2 - 1)] +
-                                 data.image[ID]
-                                 .array.F[(jj2 + 1) * Xsize + (ii2 + 1)]);
-                        }
-                }
-            }
+    float *chan[3] = {outr, outg, outb};
 
-            //  delete_image_ID("badpix1");
+    if(opt->sampling == 0)
+    {
+        if(opt->fast == 1)
+        {
+            return rawbayer_demosaic(raw,
+                                     xsize,
+                                     ysize,
+                                     &opt->cfa,
+                                     RAWBAYER_DEMOSAIC_BILINEAR,
+                                     opt->nthreads,
+                                     outr,
+                                     outg,
+                                     outb);
+        }
 
-            delete_image_ID("imrc", DELETE_IMAGE_ERRMODE_WARNING);
-            delete_image_ID("imgc", DELETE_IMAGE_ERRMODE_WARNING);
-            delete_image_ID("imbc", DELETE_IMAGE_ERRMODE_WARNING);
-            //  delete_image_ID("imraw");
-            break;
+        const BPI_CACHE *bpi = ctx->bpi;
+        if((bpi == NULL) || (!bpi->built) ||
+                (bpi->pattern != rawbayer_cfa_pattern(&opt->cfa)) ||
+                (bpi->badpix_version != ctx->rcal.badpix_version))
+        {
+            PRINT_ERROR("bad pixel tables not updated for this CFA");
+            return RETURN_FAILURE;
+        }
 
-        case 1:
-            if(image_ID(ID_name_r) != -1)
+        // raw pixels to the plane of their color
+        for(int k = 0; k < 3; k++)
+        {
+            memset(chan[k], 0, sizeof(float) * xsize * ysize);
+        }
+        for(long jj = 0; jj < 2 * (ysize / 2); jj++)
+        {
+            const float *in   = raw + jj * xsize;
+            float       *out0 = chan[layout[jj & 1][0]] + jj * xsize;
+            float       *out1 = chan[layout[jj & 1][1]] + jj * xsize;
+            for(long ii = 0; ii < 2 * (xsize / 2); ii += 2)
             {
-                delete_image_ID(ID_name_r, DELETE_IMAGE_ERRMODE_WARNING);
+                out0[ii]     = in[ii];
+                out1[ii + 1] = in[ii + 1];
             }
-            create_2Dimage_ID(ID_name_r, Xsize / 2, Ysize / 2, &IDr);
-            create_2Dimage_ID("imrc", Xsize / 2, Ysize / 2, &IDrc);
+        }
 
-            if(image_ID(ID_name_g) != -1)
-            {
-                delete_image_ID(ID_name_g, DELETE_IMAGE_ERRMODE_WARNING);
-            }
-            create_2Dimage_ID(ID_name_g, Xsize / 2, Ysize / 2, &IDg);
-            create_2Dimage_ID("imgc", Xsize / 2, Ysize / 2, &IDgc);
+        for(int k = 0; k < 3; k++)
+        {
+            bpi_apply_color(&bpi->color[k], chan[k], xsize, ysize);
+        }
+    }
+    else
+    {
+        // 2x2 cells: sum of each color over its good pixels coverage
+        const double eps = 1.0e-8;
+        const long   x2  = xsize / 2;
+        const long   y2  = ysize / 2;
 
-            if(image_ID(ID_name_b) != -1)
+        for(long jj1 = 0; jj1 < y2; jj1++)
+        {
+            const float *in[2] = {raw + 2 * jj1 * xsize,
+                                  raw + (2 * jj1 + 1) * xsize
+                                 };
+            for(long ii1 = 0; ii1 < x2; ii1++)
             {
-                delete_image_ID(ID_name_b, DELETE_IMAGE_ERRMODE_WARNING);
+                float v[3] = {0.0f, 0.0f, 0.0f};
+                float c[3] = {0.0f, 0.0f, 0.0f};
+                for(int py = 1; py >= 0; py--)
+                    for(int px = 0; px < 2; px++)
+                    {
+                        long ii = 2 * ii1 + px;
+                        int  k  = layout[py][px];
+                        v[k] += in[py][ii];
+                        c[k] += (bp != NULL)
+                                ? 1.0 - bp[(2 * jj1 + py) * xsize + ii]
+                                : 1.0;
+                    }
+                for(int k = 0; k < 3; k++)
+                {
+                    chan[k][jj1 * x2 + ii1] = v[k] / (c[k] + eps);
+                }
             }
-            create_2Dimage_ID(ID_name_b, Xsize / 2, Ysize / 2, &IDb);
-            create_2Dimage_ID("imbc", Xsize / 2, Ysize / 2, &IDbc);
+        }
+    }
 
-            if(RGBmode == 1)  // GBRG
-            {
-                ID00  = IDg;
-                ID00c = IDgc;
+    return RETURN_SUCCESS;
+}
 
-                ID10  = IDb;
-                ID10c = IDbc;
+// convers a single raw bayer FITS frame into RGB FITS
+// uses "bias", "badpix" and "flat" if they exist, through ctx
+// output is imr, img, imb
+// this is a simple interpolation routine
+// IMPORTANT: input will be modified
+// opt: NULL for defaults; CFA pattern RAWBAYER_CFA_AUTO resolves it from
+// the image keywords
+// ctx: NULL for a context local to this frame (maps rebuilt every call)
+errno_t convert_rawbayerFITStorgbFITS_simple(const char *__restrict ID_name,
+        const char *__restrict ID_name_r,
+        const char *__restrict ID_name_g,
+        const char *__restrict ID_name_b,
+        const RAWBAYER_RGB_OPTS *opt,
+        RAWBAYER_RGB_CTX        *ctx)
+{
+    RAWBAYER_RGB_OPTS frame_opt = RAWBAYER_RGB_OPTS_DEFAULT;
+    if(opt != NULL)
+    {
+        frame_opt = *opt;
+    }
 
-                ID01  = IDr;
-                ID01c = IDrc;
+    IMGID img = mkIMGID_from_name(ID_name);
+    resolveIMGID(&img, ERRMODE_ABORT);
+    long Xsize = img.md->size[0];
+    long Ysize = img.md->size[1];
 
-                ID11  = IDg;
-                ID11c = IDgc;
-            }
+    printf("X Y  = %ld %ld\n", Xsize, Ysize);
 
-            if(RGBmode == 2)
-            {
-                ID00  = IDr;
-                ID00c = IDrc;
+    if(frame_opt.cfa.pattern == RAWBAYER_CFA_AUTO)
+    {
+        if(rawbayer_cfa_resolve(NULL, img, &frame_opt.cfa) != RETURN_SUCCESS)
+        {
+            return RETURN_FAILURE;
+        }
+    }
 
-                ID10  = IDg;
-                ID10c = IDgc;
+    printf("FAST MODE = %d\n", frame_opt.fast);
+    printf("CFA       = %s\n",
+           rawbayer_cfa_name(rawbayer_cfa_pattern(&frame_opt.cfa)));
 
-                ID01  = IDg;
-                ID01c = IDgc;
+    RAWBAYER_RGB_CTX localctx = RAWBAYER_RGB_CTX_INIT;
+    if(ctx == NULL)
+    {
+        ctx = &localctx;
+    }
 
-                ID11  = IDb;
-                ID11c = IDbc;
-            }
+    if(frame_opt.fast == 0)
+    {
+        // bias, dark, flat and bad pixel maps, rebuilt only if changed
+        if(rawbayer_rgb_ctx_update(ctx, Xsize, Ysize, &frame_opt.cfa) !=
+                RETURN_SUCCESS)
+        {
+            rawbayer_rgb_ctx_free(&localctx);
+            return RETURN_FAILURE;
+        }
+    }
 
-            for(ii1 = 0; ii1 < Xsize / 2; ii1++)
-                for(jj1 = 0; jj1 < Ysize / 2; jj1++)
-                {
-                    ii = ii1 * 2;
-                    jj = jj1 * 2;
-
-                    ii2 = ii;
-                    jj2 = jj + 1;
-                    data.image[ID01].array.F[jj1 * Xsize / 2 + ii1] +=
-                        data.image[ID].array.F[jj2 * Xsize + ii2] /
-                        data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                    data.image[ID01c].array.F[jj1 * Xsize / 2 + ii1] +=
-                        1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                    ii2 = ii + 1;
-                    jj2 = jj + 1;
-                    data.image[ID11].array.F[jj1 * Xsize / 2 + ii1] +=
-                        data.image[ID].array.F[jj2 * Xsize + ii2] /
-                        data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                    data.image[ID11c].array.F[jj1 * Xsize / 2 + ii1] +=
-                        1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                    ii2 = ii;
-                    jj2 = jj;
-                    data.image[ID00].array.F[jj1 * Xsize / 2 + ii1] +=
-                        data.image[ID].array.F[jj2 * Xsize + ii2] /
-                        data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                    data.image[ID00c].array.F[jj1 * Xsize / 2 + ii1] +=
-                        1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                    ii2 = ii + 1;
-                    jj2 = jj;
-                    data.image[ID10].array.F[jj1 * Xsize / 2 + ii1] +=
-                        data.image[ID].array.F[jj2 * Xsize + ii2] /
-                        data.image[IDflat].array.F[jj2 * Xsize + ii2];
-                    data.image[ID10c].array.F[jj1 * Xsize / 2 + ii1] +=
-                        1.0 - data.image[IDbp].array.F[jj2 * Xsize + ii2];
-
-                    data.image[IDr].array.F[jj1 * Xsize / 2 + ii1] /=
-                        data.image[IDrc].array.F[jj1 * Xsize / 2 + ii1] + eps;
-                    data.image[IDg].array.F[jj1 * Xsize / 2 + ii1] /=
-                        data.image[IDgc].array.F[jj1 * Xsize / 2 + ii1] + eps;
-                    data.image[IDb].array.F[jj1 * Xsize / 2 + ii1] /=
-                        data.image[IDbc].array.F[jj1 * Xsize / 2 + ii1] + eps;
-                }
+    long xsize1 = (frame_opt.sampling == 0) ? Xsize : Xsize / 2;
+    long ysize1 = (frame_opt.sampling == 0) ? Ysize : Ysize / 2;
 
-            delete_image_ID("imrc", DELETE_IMAGE_ERRMODE_WARNING);
-            delete_image_ID("imgc", DELETE_IMAGE_ERRMODE_WARNING);
-            delete_image_ID("imbc", DELETE_IMAGE_ERRMODE_WARNING);
+    const char *outname[3] = {ID_name_r, ID_name_g, ID_name_b};
+    float      *out[3];
+    for(int k = 0; k < 3; k++)
+    {
+        imageID IDout;
+        if(image_ID(outname[k]) != -1)
+        {
+            delete_image_ID(outname[k], DELETE_IMAGE_ERRMODE_WARNING);
+        }
+        create_2Dimage_ID(outname[k], xsize1, ysize1, &IDout);
+        out[k] = data.image[IDout].array.F;
+    }
 
-            break;
+    long    cnt;
+    errno_t status = rawbayer_rgb_convert(ctx,
+                                          &frame_opt,
+                                          img.im->array.F,
+                                          Xsize,
+                                          Ysize,
+                                          out[0],
+                                          out[1],
+                                          out[2],
+                                          &cnt);
+    rawbayer_rgb_ctx_free(&localctx);
+    if(status != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+    if(frame_opt.fast == 0)
+    {
+        printf("%ld hot pixels removed\n", cnt);
     }
 
     return RETURN_SUCCESS;
@@ -1,8 +1,69 @@
 /** @file FITStorgbFITSsimple.h
  */
 
+#ifndef IMAGE_FORMAT_FITSTORGBFITSSIMPLE_H
+#define IMAGE_FORMAT_FITSTORGBFITSSIMPLE_H
+
+#include "rawbayer_calib.h"
+#include "rawbayer_cfa.h"
+
+// Raw to RGB conversion options
+typedef struct
+{
+    int          sampling;   // 0: full resolution, 1: half resolution
+    int          fast;       // 1: no calibration, bilinear interpolation
+    float        fluxfactor; // flux scaling, applied with the flat
+    RAWBAYER_CFA cfa;        // pattern RAWBAYER_CFA_AUTO: image keywords
+    int          nthreads;   // <= 0: all online CPUs
+} RAWBAYER_RGB_OPTS;
+
+#define RAWBAYER_RGB_OPTS_DEFAULT                                              \
+    {                                                                          \
+        .sampling = 1, .fast = 0, .fluxfactor = 1.0f,                          \
+        .cfa = {RAWBAYER_CFA_AUTO, 0, 0}, .nthreads = 0                        \
+    }
+
+// Calibration maps and bad pixel interpolation tables
+// Updated by rawbayer_rgb_ctx_update(), read only during conversions: one
+// context can serve concurrent conversions of frames of the same geometry
+struct BPI_CACHE;
+typedef struct
+{
+    RAWCAL_CTX        rcal;
+    struct BPI_CACHE *bpi;
+} RAWBAYER_RGB_CTX;
+
+#define RAWBAYER_RGB_CTX_INIT                                                  \
+    {                                                                          \
+        .rcal = {.srcname = {"bias", "dark", "flat", "badpix"}}, .bpi = NULL   \
+    }
+
+void rawbayer_rgb_opts_CLIvariables(RAWBAYER_RGB_OPTS *opt);
+
+errno_t rawbayer_rgb_ctx_update(RAWBAYER_RGB_CTX   *ctx,
+                                long                xsize,
+                                long                ysize,
+                                const RAWBAYER_CFA *cfa);
+
+void rawbayer_rgb_ctx_free(RAWBAYER_RGB_CTX *ctx);
+
+errno_t rawbayer_rgb_convert(const RAWBAYER_RGB_CTX  *ctx,
+                             const RAWBAYER_RGB_OPTS *opt,
+                             float                   *raw,
+                             long                     xsize,
+                             long                     ysize,
+                             float                   *outr,
+                             float                   *outg,
+                             float                   *outb,
+                             long                    *nhotpix);
+
+// opt: NULL for defaults
+// ctx: NULL for a context local to the call, which rebuilds the maps
 errno_t convert_rawbayerFITStorgbFITS_simple(const char *__restrict ID_name,
         const char *__restrict ID_name_r,
         const char *__restrict ID_name_g,
         const char *__restrict ID_name_b,
-        int SamplFactor);
+        const RAWBAYER_RGB_OPTS *opt,
+        RAWBAYER_RGB_CTX        *ctx);
+
+#endif // IMAGE_FORMAT_FITSTORGBFITSSIMPLE_H
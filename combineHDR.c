@@ -1,7 +1,10 @@
 /** @file combineHDR.c
  */
 
+#include <arpa/inet.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "CommandLineInterface/CLIcore.h"
 
@@ -9,11 +12,53 @@
 
 #include "image_filter/image_filter.h"
 
+#include "combineHDR.h"
+#include "combineHDR_kernels.h"
+#include "fitsmap.h"
+
+// Layer map smoothing modes
+#define HDR_SMOOTH_ITER 0 // reference: iterated 0.3/0.4/0.3 filter
+#define HDR_SMOOTH_IIR  1 // recursive gaussian, cost independent of width
+
+// Output rows composed per tile (work item of the compose threads)
+#define HDR_TILEROWS 64
+
+// Output scaling 1 / alpha0^layerg, layerg capped at HDR_LAYERG_MAX
+#define HDR_ALPHA0     10.0
+#define HDR_LAYERG_MAX 3.0
+
+// Compose kernel: columns per segment sharing the same range of layers
+#define HDR_COMPOSE_SEG 256
+
+// Exposure list: entries printed at read
+#define HDR_FLIST_NPRINT 20
+
+// Blending modes
+#define HDR_BLEND_LAYER   0 // smoothed low resolution layer map
+#define HDR_BLEND_PYRAMID 1 // Laplacian pyramid
+
+#define HDR_PYR_MAXLEVELS 16
+#define HDR_PYR_MINSIZE   4    // top level minimum size (pix)
+#define HDR_PYR_WMIN      1e-6 // shortest exposure minimum weight / etime
+
 // Local variables pointers
 static char   *flistname;
 static double *satlevel;
 static double *biaslevel;
 static char   *outimname;
+static int32_t *smoothmode;
+static int32_t *tiledmode;
+static int32_t *nthreads;
+static int32_t *binstepparam;
+static int32_t *blendmode;
+static int32_t *nlevels;
+static int32_t *mapsflag;
+static double  *gainparam;
+static double  *rdnoiseparam;
+static char    *outfname;
+static int32_t *rawxsizeparam;
+static int32_t *rawysizeparam;
+static char    *spooldir;
 
 static CLICMDARGDEF farg[] = {{
         CLIARG_STR,
@@ -50,6 +95,123 @@ static CLICMDARGDEF farg[] = {{
         CLIARG_VISIBLE_DEFAULT,
         (void **) &outimname,
         NULL
+    },
+    {
+        CLIARG_INT32,
+        ".smoothmode",
+        "0: iterative, 1: recursive",
+        "1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &smoothmode,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".tiled",
+        "1: bounded memory, 2 passes",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &tiledmode,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".nthreads",
+        "Threads (<=0: all CPUs)",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &nthreads,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".binstep",
+        "Layer map bin step",
+        "5",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &binstepparam,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".blend",
+        "0: layer map, 1: pyramid",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &blendmode,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".nlevels",
+        "Pyramid levels",
+        "6",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &nlevels,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".maps",
+        "Layer index and inverse variance maps",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &mapsflag,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".gain",
+        "Gain [e-/ADU]",
+        "1.0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &gainparam,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".rdnoise",
+        "Readout noise [ADU]",
+        "0.0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &rdnoiseparam,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".outfname",
+        "Output FITS file, none to skip",
+        "none",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &outfname,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".rawxsize",
+        "Raw exposures x size, 0: as first",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &rawxsizeparam,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".rawysize",
+        "Raw exposures y size, 0: as first",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &rawysizeparam,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".spooldir",
+        "spool directory, on disk (auto: TMPDIR or /var/tmp)",
+        "auto",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &spooldir,
+        NULL
     }
 };
 
@@ -62,193 +224,271 @@ static CLICMDDATA CLIcmddata =
 static errno_t help_function()
 {
     printf("combine HDR image\n");
+    printf("smoothmode 0: iterated 3-tap filter (reference)\n");
+    printf("smoothmode 1: recursive gaussian of same width\n");
+    printf("tiled 1: no cube in memory; exposures binned in a first pass,\n");
+    printf("         output composed per tile from the rows of the mapped\n");
+    printf("         exposures (compressed ones are spooled to spooldir,\n");
+    printf("         auto: $TMPDIR, else /var/tmp; must be on disk)\n");
+    printf("Exposures are read/binned and tiles composed by nthreads;\n");
+    printf("mapped exposures are read in parallel, one band of rows per\n");
+    printf("thread. Compressed FITS go through load_fits, one at a time,\n");
+    printf("and each such exposure is resident in full while binned\n");
+    printf("blend 1: Laplacian pyramid fusion over nlevels levels, row\n");
+    printf("         tiles of each level on nthreads (no binning pass)\n");
+    printf("maps 1: also <outimname>_layer (layer index of each pixel) and\n");
+    printf("        <outimname>_ivar (inverse variance from gain and\n");
+    printf("        rdnoise); two more full size images, off by default\n");
+    printf("outfname: multi-extension FITS file with the HDR image (primary\n");
+    printf("          HDU) and the maps (extensions LAYER and IVAR)\n");
+    printf("Any number of exposures; uncompressed FITS and raw float32\n");
+    printf("(.raw/.bin, rawxsize x rawysize) files are memory mapped\n");
 
     return RETURN_SUCCESS;
 }
 
-errno_t combine_HDR_image(const char *__restrict flistname,
-                          float satvalue,
-                          float biasvalue,
-                          char *__restrict outimname)
+/*
+One or more passes of the separable 0.3/0.4/0.3 filter, edge pixels kept
+If immin is not NULL, im is clamped to immin after each pass
+*/
+static void hdr_tap3_smooth(
+    float *im, uint32_t xsize, uint32_t ysize, int NBfiter, const float *immin)
 {
-    int HDRmaxindex = 100;
-
-    // Read input files and exposure times
-    int     NB_HDRindex = 0;
-    float   etimearray[HDRmaxindex];
-    imageID IDarray[HDRmaxindex];
+    float *pixcol  = (float *) malloc(sizeof(float) * ysize);
+    float *pixline = (float *) malloc(sizeof(float) * xsize);
 
+    for(int fiter = 0; fiter < NBfiter; fiter++)
     {
-        FILE *fpin;
-
-        fpin = fopen(flistname, "r");
-        char FITSfname[200];
+        printf(".");
+        fflush(stdout);
 
-        float etime;
-        int   HDRindex = 0;
-        char  imHDRin[200];
-        char  timestring[200];
-        while(fscanf(fpin, "%s %f %s\n", FITSfname, &etime, timestring) == 3)
+        for(uint32_t jj = 0; jj < ysize; jj++)
         {
-            imageID ID;
-            printf("Input file [%11.6f] : %s\n", etime, FITSfname);
-            etimearray[HDRindex] = etime;
-            sprintf(imHDRin, "imHRDin_%03d", HDRindex);
-            load_fits(FITSfname, imHDRin, 2, &ID);
-            IDarray[HDRindex] = ID;
-            HDRindex++;
+            for(uint32_t ii = 1; ii < xsize - 1; ii++)
+            {
+                pixline[ii] = 0.3 * im[jj * xsize + ii - 1] +
+                              0.4 * im[jj * xsize + ii] +
+                              0.3 * im[jj * xsize + ii + 1];
+            }
+            for(uint32_t ii = 1; ii < xsize - 1; ii++)
+            {
+                im[jj * xsize + ii] = pixline[ii];
+            }
         }
-        fclose(fpin);
-        NB_HDRindex = HDRindex;
-    }
 
-    printf("PARAMS : %20f %20f\n", biasvalue, 1.0 * satvalue);
-
-    uint32_t xsize = data.image[IDarray[0]].md->size[0];
-    uint32_t ysize = data.image[IDarray[0]].md->size[1];
-    uint32_t zsize = NB_HDRindex;
-
-    int      binstep = 5;
-    uint32_t xsize1  = (uint32_t)(xsize / binstep);
-    uint32_t ysize1  = (uint32_t)(ysize / binstep);
-    //
-    // Assemble cube and subsampled cube
-    //
-    imageID IDimHDRc;
-    create_3Dimage_ID("imHDRc", xsize, ysize, zsize, &IDimHDRc);
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            for(uint32_t jj = 1; jj < ysize - 1; jj++)
+            {
+                pixcol[jj] = 0.3 * im[(jj - 1) * xsize + ii] +
+                             0.4 * im[jj * xsize + ii] +
+                             0.3 * im[(jj + 1) * xsize + ii];
+            }
+            for(uint32_t jj = 1; jj < ysize - 1; jj++)
+            {
+                im[jj * xsize + ii] = pixcol[jj];
+            }
+        }
 
-    imageID IDimHDRc1;
-    create_3Dimage_ID("imHDRc1", xsize1, ysize1, zsize, &IDimHDRc1);
+        if(immin != NULL)
+        {
+            for(uint32_t ii = 0; ii < xsize; ii++)
+            {
+                for(uint32_t jj = 1; jj < ysize - 1; jj++)
+                {
+                    if(im[jj * xsize + ii] < immin[jj * xsize + ii])
+                    {
+                        im[jj * xsize + ii] = immin[jj * xsize + ii];
+                    }
+                }
+            }
+        }
+    }
+    printf("\n");
 
-    imageID IDimHDRc1w;
-    create_3Dimage_ID("imHDRc1w", xsize1, ysize1, zsize, &IDimHDRc1w);
+    free(pixcol);
+    free(pixline);
+}
 
-    for(uint32_t kk = 0; kk < zsize; kk++)
+/*
+Recursive gaussian filter (Young & van Vliet), in place
+3rd order forward and backward recursions along rows, then along columns
+(all columns at once, row-major). Cost per pixel does not depend on sigma.
+Recursion states are kept in double, edges are replicated.
+*/
+void hdr_gauss_iir(float *im, uint32_t xsize, uint32_t ysize, float sigma)
+{
+    if(sigma < 0.5)
     {
-        for(uint32_t jj = 0; jj < ysize; jj++)
-        {
-            float    y   = 1.0 * jj / ysize;
-            uint32_t jj1 = (uint32_t)(y * ysize1);
+        return;
+    }
 
-            for(uint32_t ii = 0; ii < xsize; ii++)
-            {
-                float    x   = 1.0 * ii / xsize;
-                uint32_t ii1 = (uint32_t)(x * xsize1);
+    // Poles of Young, van Vliet & van Ginkel (2002), accurate variance
+    double m0    = 1.16680;
+    double m1    = 1.10783;
+    double m2    = 1.40586;
+    double q     = 1.31564 * (sqrt(1.0 + 0.490811 * sigma * sigma) - 1.0);
+    double scale = (m0 + q) * (m1 * m1 + m2 * m2 + 2.0 * m1 * q + q * q);
+    double a1    = q *
+                   (2.0 * m0 * m1 + m1 * m1 + m2 * m2 +
+                    (2.0 * m0 + 4.0 * m1) * q + 3.0 * q * q) /
+                   scale;
+    double a2 = -q * q * (m0 + 2.0 * m1 + 3.0 * q) / scale;
+    double a3 = q * q * q / scale;
+    double B  = 1.0 - (a1 + a2 + a3);
 
-                float pval =
-                    1.0 * data.image[IDarray[kk]].array.F[jj * xsize + ii] -
-                    biasvalue;
+    // Rows
+    for(uint32_t jj = 0; jj < ysize; jj++)
+    {
+        float *row = im + (long) jj * xsize;
 
-                data.image[IDimHDRc]
-                .array.F[kk * xsize * ysize + jj * xsize + ii] = pval;
+        double w1 = row[0];
+        double w2 = w1;
+        double w3 = w1;
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            double w = B * row[ii] + a1 * w1 + a2 * w2 + a3 * w3;
+            w3       = w2;
+            w2       = w1;
+            w1       = w;
+            row[ii]  = w;
+        }
 
-                data.image[IDimHDRc1]
-                .array.F[kk * xsize1 * ysize1 + jj1 * xsize1 + ii1] += pval;
-                data.image[IDimHDRc1w]
-                .array.F[kk * xsize1 * ysize1 + jj1 * xsize1 + ii1] += 1.0;
-            }
+        w1 = row[xsize - 1];
+        w2 = w1;
+        w3 = w1;
+        for(long ii = xsize - 1; ii >= 0; ii--)
+        {
+            double w = B * row[ii] + a1 * w1 + a2 * w2 + a3 * w3;
+            w3       = w2;
+            w2       = w1;
+            w1       = w;
+            row[ii]  = w;
         }
     }
 
-    for(uint32_t kk = 0; kk < zsize; kk++)
+    // Columns: three rows of recursion states, rotated every row
+    double *state = (double *) malloc(sizeof(double) * 3 * xsize);
+    double *s1    = state;
+    double *s2    = state + xsize;
+    double *s3    = state + 2 * xsize;
+
+    for(int pass = 0; pass < 2; pass++)
     {
-        for(uint32_t jj1 = 0; jj1 < ysize1; jj1++)
+        // pass 0 forward (top to bottom), pass 1 backward
+        long jstart = (pass == 0) ? 0 : (long) ysize - 1;
+        long jstep  = (pass == 0) ? 1 : -1;
+
+        for(uint32_t ii = 0; ii < xsize; ii++)
         {
-            for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
+            s1[ii] = im[jstart * xsize + ii];
+            s2[ii] = s1[ii];
+            s3[ii] = s1[ii];
+        }
+        for(long n = 0, jj = jstart; n < ysize; n++, jj += jstep)
+        {
+            float *row = im + jj * xsize;
+            for(uint32_t ii = 0; ii < xsize; ii++)
             {
-                data.image[IDimHDRc1]
-                .array.F[kk * xsize1 * ysize1 + jj1 * xsize1 + ii1] /=
-                    data.image[IDimHDRc1w]
-                    .array.F[kk * xsize1 * ysize1 + jj1 * xsize1 + ii1];
+                double w =
+                    B * row[ii] + a1 * s1[ii] + a2 * s2[ii] + a3 * s3[ii];
+                s3[ii]   = w; // oldest state becomes the newest
+                row[ii]  = w;
             }
+            double *tmp = s3;
+            s3          = s2;
+            s2          = s1;
+            s1          = tmp;
         }
     }
+    free(state);
+}
+
+/*
+Bias-subtract one row into orow (may be prow), and add it into its binned
+row c1row; xbin maps full resolution columns to bins
+*/
+static inline void hdr_bin_row(const float *prow,
+                               float        biasvalue,
+                               float       *orow,
+                               float *__restrict c1row,
+                               const uint32_t *xbin,
+                               uint32_t        xsize)
+{
+    for(uint32_t ii = 0; ii < xsize; ii++)
+    {
+        float pval = 1.0 * prow[ii] - biasvalue;
+        orow[ii]   = pval;
+        c1row[xbin[ii]] += pval;
+    }
+}
 
+// Binned sums to averages, pixel counts per bin in c1w
+static void hdr_bin_normalize(float *__restrict c1,
+                              float *__restrict c1w,
+                              const uint32_t *xcount,
+                              const uint32_t *ycount,
+                              uint32_t        xsize1,
+                              uint32_t        ysize1)
+{
+    for(uint32_t jj1 = 0; jj1 < ysize1; jj1++)
     {
-        printf("---------------- Convolve binned image ------------\n");
-        fflush(stdout);
-        int    NBfiter = 5;
-        float *pixcol  = (float *) malloc(sizeof(float) * ysize1);
-        float *pixline = (float *) malloc(sizeof(float) * xsize1);
-        for(int fiter = 0; fiter < NBfiter; fiter++)
+        for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
         {
-            printf(".");
-            fflush(stdout);
-
-            for(uint32_t kk = 0; kk < zsize; kk++)
-            {
-                for(uint32_t jj1 = 0; jj1 < ysize1; jj1++)
-                {
-                    for(uint32_t ii1 = 1; ii1 < xsize1 - 1; ii1++)
-                    {
-                        pixline[ii1] =
-                            0.3 * data.image[IDimHDRc1]
-                            .array.F[kk * xsize1 * ysize1 +
-                                        jj1 * xsize1 + ii1 - 1] +
-                            0.4 * data.image[IDimHDRc1]
-                            .array.F[kk * xsize1 * ysize1 +
-                                        jj1 * xsize1 + ii1] +
-                            0.3 * data.image[IDimHDRc1]
-                            .array.F[kk * xsize1 * ysize1 +
-                                        jj1 * xsize1 + ii1 + 1];
-                    }
-                    for(uint32_t ii1 = 1; ii1 < xsize1 - 1; ii1++)
-                    {
-                        data.image[IDimHDRc1].array.F[kk * xsize1 * ysize1 +
-                                                      jj1 * xsize1 + ii1] =
-                                                          pixline[ii1];
-                    }
-                }
-
-                for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
-                {
-                    for(uint32_t jj1 = 1; jj1 < ysize1 - 1; jj1++)
-                    {
-                        pixcol[jj1] =
-                            0.3 * data.image[IDimHDRc1]
-                            .array.F[kk * xsize1 * ysize1 +
-                                        (jj1 - 1) * xsize1 + ii1] +
-                            0.4 * data.image[IDimHDRc1]
-                            .array.F[kk * xsize1 * ysize1 +
-                                        jj1 * xsize1 + ii1] +
-                            0.3 * data.image[IDimHDRc1]
-                            .array.F[kk * xsize1 * ysize1 +
-                                        (jj1 + 1) * xsize1 + ii1];
-                    }
-                    for(uint32_t jj1 = 1; jj1 < ysize1 - 1; jj1++)
-                    {
-                        data.image[IDimHDRc1].array.F[kk * xsize1 * ysize1 +
-                                                      jj1 * xsize1 + ii1] =
-                                                          pixcol[jj1];
-                    }
-                }
-            }
+            c1w[jj1 * xsize1 + ii1] = 1.0 * xcount[ii1] * ycount[jj1];
+            c1[jj1 * xsize1 + ii1] /= c1w[jj1 * xsize1 + ii1];
         }
-        free(pixcol);
-        free(pixline);
-        printf("\n");
-        printf("---------------- DONE ------------\n");
-        fflush(stdout);
     }
+}
 
-    //double alpha1 = 1.0;
-
-    // contruct layer image
-    imageID IDlayer;
-    create_2Dimage_ID("imlayer", xsize1, ysize1, &IDlayer);
-
-    imageID IDlayermin;
-    create_2Dimage_ID("imlayermin", xsize1, ysize1, &IDlayermin);
+/*
+Bias-subtract one exposure into pixout (may be pix), and average it into
+its binned layer c1, with pixel counts in c1w
+xbin/ybin map full resolution columns/rows to bins, xcount/ycount are the
+number of columns/rows per bin. Rows are accumulated contiguously.
+*/
+void hdr_bin_exposure(const float *pix,
+                      float        biasvalue,
+                      float       *pixout,
+                      float *__restrict c1,
+                      float *__restrict c1w,
+                      const uint32_t *xbin,
+                      const uint32_t *ybin,
+                      const uint32_t *xcount,
+                      const uint32_t *ycount,
+                      uint32_t        xsize,
+                      uint32_t        ysize,
+                      uint32_t        xsize1,
+                      uint32_t        ysize1)
+{
+    for(uint32_t jj = 0; jj < ysize; jj++)
+    {
+        hdr_bin_row(pix + (long) jj * xsize,
+                    biasvalue,
+                    pixout + (long) jj * xsize,
+                    c1 + (long) ybin[jj] * xsize1,
+                    xbin,
+                    xsize);
+    }
+    hdr_bin_normalize(c1, c1w, xcount, ycount, xsize1, ysize1);
+}
 
-    for(uint32_t ij1 = 0; ij1 < xsize1 * ysize1; ij1++)
+/*
+Per bin, index of the first (longest) exposure that is not saturated in the
+binned cube c1 (n1 bins per layer): the layer map never goes below it
+*/
+void hdr_layermin(const float *__restrict c1,
+                  uint32_t n1,
+                  uint32_t zsize,
+                  float    satvalue,
+                  float *__restrict layermin)
+{
+    for(uint32_t ij1 = 0; ij1 < n1; ij1++)
     {
-        //float layer = 0.0;
         uint32_t layer0 = 0;
         uint32_t layer1 = 0;
         uint32_t kk     = 0;
-        while((kk < zsize) &&
-                (data.image[IDimHDRc1].array.F[kk * xsize1 * ysize1 + ij1] >
-                 satvalue))
+        while((kk < zsize) && (c1[(long) kk * n1 + ij1] > satvalue))
         {
             layer0 = kk;
             kk++;
@@ -260,189 +500,2073 @@ errno_t combine_HDR_image(const char *__restrict flistname,
             layer1 = zsize - 1;
         }
 
-        float valmax =
-            data.image[IDimHDRc1].array.F[layer0 * xsize1 * ysize1 + ij1];
+        float valmax = c1[(long) layer0 * n1 + ij1];
         if((valmax > satvalue) && (layer1 < zsize - 1))
         {
             // increment layers
             layer0++;
-            layer1++;
-            valmax =
-                data.image[IDimHDRc1].array.F[layer0 * xsize1 * ysize1 + ij1];
         }
-        //float valmin = data.image[IDimHDRc1].array.F[layer1*xsize1*ysize1+ij1];
 
-        //float x = valmax/satvalue;
-        //float c1 = pow( 0.5*(1.0+cos(x*M_PI)), alpha1);
-        //float c2 = 1.0-c1;
+        layermin[ij1] = 1.0 * layer0; // don't go below this layer
+    }
+}
+
+/*
+Layer map interpolation, shared by the compose kernel and the tile layer
+range (hdr_tile_layers) so that both see the same values
+Column bin ii1tab[ii] and coefficient fxtab[ii] of each column; the last bin
+extrapolates
+*/
+static void hdr_layer_xtab(uint32_t  xsize,
+                           uint32_t  xsize1,
+                           uint32_t *ii1tab,
+                           float    *fxtab)
+{
+    for(uint32_t ii = 0; ii < xsize; ii++)
+    {
+        float    x   = 1.0 * ii / xsize;
+        uint32_t ii1 = (uint32_t)(x * xsize1);
+        if(ii1 == xsize1 - 1)
+        {
+            ii1 = xsize1 - 2;
+        }
+        ii1tab[ii] = ii1;
+        fxtab[ii]  = x * xsize1 - ii1;
+    }
+}
+
+// Layer map interpolated to row jj, into lv (xsize1); returns the binned row
+static inline uint32_t hdr_layer_lv(const float *__restrict layermap,
+                                    uint32_t ysize,
+                                    uint32_t xsize1,
+                                    uint32_t ysize1,
+                                    uint32_t jj,
+                                    float *__restrict lv)
+{
+    float    y   = 1.0 * jj / ysize;
+    uint32_t jj1 = (uint32_t)(y * ysize1);
+    if(jj1 == ysize1 - 1)
+    {
+        jj1 = ysize1 - 2;
+    }
+    float jj1frac = y * ysize1 - jj1;
 
-        data.image[IDlayer].array.F[ij1] = 1.0 * layer0;
-        data.image[IDlayermin].array.F[ij1] =
-            1.0 * layer0; // don't go below this layer
+    const float *l0 = layermap + (long) jj1 * xsize1;
+    const float *l1 = l0 + xsize1;
+    for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
+    {
+        lv[ii1] = l0[ii1] + jj1frac * (l1[ii1] - l0[ii1]);
     }
+    return jj1;
+}
 
+// Layer index of each column from lv, clamped to [0, layermax]
+static inline void hdr_layer_row(const float *__restrict lv,
+                                 const uint32_t *__restrict ii1tab,
+                                 const float *__restrict fxtab,
+                                 uint32_t xsize,
+                                 float    layermax,
+                                 float *__restrict lrow)
+{
+    for(uint32_t ii = 0; ii < xsize; ii++)
     {
-        printf("---------------- Convolve layer image ------------\n");
-        fflush(stdout);
-        int    NBfiter = 500;
-        float *pixcol  = (float *) malloc(sizeof(float) * ysize1);
-        float *pixline = (float *) malloc(sizeof(float) * xsize1);
-        for(int fiter = 0; fiter < NBfiter; fiter++)
-        {
-            printf(".");
-            fflush(stdout);
-            for(uint32_t jj1 = 0; jj1 < ysize1; jj1++)
+        uint32_t ii1   = ii1tab[ii];
+        float    layer = lv[ii1] + fxtab[ii] * (lv[ii1 + 1] - lv[ii1]);
+        layer          = (layer < 0.0f) ? 0.0f : layer;
+        layer          = (layer > layermax) ? layermax : layer;
+        lrow[ii]       = layer;
+    }
+}
+
+/*
+Compose output rows jjstart to jjend (excluded) from the bias-subtracted
+cube, the binned layer map and its smoothed version, row by row
+In the last bin row/column the interpolation extrapolates: the layer is
+clamped to [0, zsize - 1]
+- column bin indices and interpolation coefficients tabulated once,
+  layer map interpolated vertically once per output row
+- output scaling 1 / alpha0^layerg computed with exp2f once per binned row
+- reciprocal exposure times
+- per segment of HDR_COMPOSE_SEG columns, the layers used are found from
+  the binned layer map; two adjacent layers (usual case) are blended in one
+  pass, more layers accumulated with their linear interpolation (tent)
+  weights: contiguous, branch-free inner loops the compiler vectorizes
+If not NULL, layerout receives the (interpolated) layer index of each pixel
+and ivarout its inverse variance, from the weights of the layers and their
+variance p / gain + rdnoise^2 (ADU, p clipped at 0): 0 where undefined
+layers[kk] points to row jjstart of the bias-subtracted exposure kk, rows
+jjstart to jjend contiguous; layers the tile does not use may be NULL
+*/
+void hdr_compose_rows(float *__restrict out,
+                      float *__restrict layerout,
+                      float *__restrict ivarout,
+                      const float *const *layers,
+                      const float *__restrict layermap,
+                      const float *__restrict layermapg,
+                      const float *etimearray,
+                      float        gain,
+                      float        rdnoise,
+                      uint32_t     xsize,
+                      uint32_t     ysize,
+                      uint32_t     xsize1,
+                      uint32_t     ysize1,
+                      uint32_t     zsize,
+                      uint32_t     jjstart,
+                      uint32_t     jjend)
+{
+    uint32_t *ii1tab = (uint32_t *) malloc(sizeof(uint32_t) * xsize);
+    float    *fxtab  = (float *) malloc(sizeof(float) * xsize);
+    float    *lv     = (float *) malloc(sizeof(float) * xsize1);
+    float    *gv     = (float *) malloc(sizeof(float) * xsize1);
+    float    *lrow   = (float *) malloc(sizeof(float) * xsize);
+    float    *crow   = (float *) malloc(sizeof(float) * xsize);
+    float    *invexp = (float *) malloc(sizeof(float) * zsize);
+
+    for(uint32_t kk = 0; kk < zsize; kk++)
+    {
+        invexp[kk] = 1.0 / etimearray[kk];
+    }
+    hdr_layer_xtab(xsize, xsize1, ii1tab, fxtab);
+
+    float    log2alpha0 = log2f(HDR_ALPHA0);
+    float    layermax   = zsize - 1;
+    float    invgain    = (gain > 0.0) ? 1.0 / gain : 0.0;
+    float    rn2        = rdnoise * rdnoise;
+    uint32_t jj1g       = ysize1; // binned row of gv
+
+    for(uint32_t jj = jjstart; jj < jjend; jj++)
+    {
+        uint32_t jj1 = hdr_layer_lv(layermap, ysize, xsize1, ysize1, jj, lv);
+        if(jj1 != jj1g)
+        {
+            // output scaling is not interpolated: once per binned row
+            const float *g0 = layermapg + (long) jj1 * xsize1;
+            for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
+            {
+                float lg =
+                    (g0[ii1] > HDR_LAYERG_MAX) ? HDR_LAYERG_MAX : g0[ii1];
+                gv[ii1] = exp2f(-lg * log2alpha0);
+            }
+            for(uint32_t ii = 0; ii < xsize; ii++)
+            {
+                crow[ii] = gv[ii1tab[ii]];
+            }
+            jj1g = jj1;
+        }
+
+        hdr_layer_row(lv, ii1tab, fxtab, xsize, layermax, lrow);
+
+        if(layerout != NULL)
+        {
+            memcpy(layerout + (long) jj * xsize, lrow, sizeof(float) * xsize);
+        }
+
+        float *orow   = out + (long) jj * xsize;
+        float *vrow   = NULL;
+        long   rowoff = (long)(jj - jjstart) * xsize;
+        if(ivarout != NULL)
+        {
+            vrow = ivarout + (long) jj * xsize;
+        }
+
+        // Layers used by each segment (the layer map is smooth: one or two)
+        for(uint32_t ii0 = 0; ii0 < xsize; ii0 += HDR_COMPOSE_SEG)
+        {
+            uint32_t ii1 = ii0 + HDR_COMPOSE_SEG;
+            ii1          = (ii1 > xsize) ? xsize : ii1;
+
+            // Piecewise linear along the row: extremes at the bin knots
+            // or at the segment ends
+            float lsegmin = fminf(lrow[ii0], lrow[ii1 - 1]);
+            float lsegmax = fmaxf(lrow[ii0], lrow[ii1 - 1]);
+            for(uint32_t kn = ii1tab[ii0] + 1; kn <= ii1tab[ii1 - 1]; kn++)
             {
-                for(uint32_t ii1 = 1; ii1 < xsize1 - 1; ii1++)
+                lsegmin = (lv[kn] < lsegmin) ? lv[kn] : lsegmin;
+                lsegmax = (lv[kn] > lsegmax) ? lv[kn] : lsegmax;
+            }
+            lsegmin = (lsegmin < 0.0f) ? 0.0f : lsegmin;
+            lsegmax = (lsegmax > layermax) ? layermax : lsegmax;
+
+            uint32_t kkstart = (uint32_t) lsegmin;
+            uint32_t kkend   = (uint32_t) ceilf(lsegmax);
+            if(kkend <= kkstart + 1)
+            {
+                // Usual case, two layers (or one): single pass
+                const float *p0     = layers[kkstart] + rowoff;
+                const float *p1     = layers[kkend] + rowoff;
+                float        layerk = kkstart;
+                float        ie0    = invexp[kkstart];
+                float        ie1    = invexp[kkend];
+                for(uint32_t ii = ii0; ii < ii1; ii++)
                 {
-                    pixline[ii1] =
-                        0.3 * data.image[IDlayer]
-                        .array.F[jj1 * xsize1 + ii1 - 1] +
-                        0.4 * data.image[IDlayer].array.F[jj1 * xsize1 + ii1] +
-                        0.3 *
-                        data.image[IDlayer].array.F[jj1 * xsize1 + ii1 + 1];
+                    float f  = lrow[ii] - layerk;
+                    orow[ii] = crow[ii] *
+                               ((ie0 - ie0 * f) * p0[ii] + (ie1 * f) * p1[ii]);
                 }
-                for(uint32_t ii1 = 1; ii1 < xsize1 - 1; ii1++)
+                if(vrow != NULL)
                 {
-                    data.image[IDlayer].array.F[jj1 * xsize1 + ii1] =
-                        pixline[ii1];
+                    for(uint32_t ii = ii0; ii < ii1; ii++)
+                    {
+                        float f  = lrow[ii] - layerk;
+                        float a0 = crow[ii] * (ie0 - ie0 * f);
+                        float a1 = crow[ii] * (ie1 * f);
+                        float v0 = fmaxf(p0[ii], 0.0f) * invgain + rn2;
+                        float v1 = fmaxf(p1[ii], 0.0f) * invgain + rn2;
+                        float v  = a0 * a0 * v0 + a1 * a1 * v1;
+                        vrow[ii] = (v > 0.0f) ? 1.0f / v : 0.0f;
+                    }
                 }
+                continue;
             }
 
-            for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
+            memset(orow + ii0, 0, sizeof(float) * (ii1 - ii0));
+            if(vrow != NULL)
+            {
+                memset(vrow + ii0, 0, sizeof(float) * (ii1 - ii0));
+            }
+            for(uint32_t kk = kkstart; kk <= kkend; kk++)
             {
-                for(uint32_t jj1 = 1; jj1 < ysize1 - 1; jj1++)
+                const float *prow   = layers[kk] + rowoff;
+                float        layerk = kk;
+                float        ie     = invexp[kk];
+                for(uint32_t ii = ii0; ii < ii1; ii++)
                 {
-                    pixcol[jj1] =
-                        0.3 * data.image[IDlayer]
-                        .array.F[(jj1 - 1) * xsize1 + ii1] +
-                        0.4 * data.image[IDlayer].array.F[jj1 * xsize1 + ii1] +
-                        0.3 * data.image[IDlayer]
-                        .array.F[(jj1 + 1) * xsize1 + ii1];
+                    float w = 1.0f - fabsf(lrow[ii] - layerk);
+                    w       = (w > 0.0f) ? w : 0.0f;
+                    orow[ii] += (crow[ii] * ie * w) * prow[ii];
                 }
-                for(uint32_t jj1 = 1; jj1 < ysize1 - 1; jj1++)
+                if(vrow != NULL)
                 {
-                    data.image[IDlayer].array.F[jj1 * xsize1 + ii1] =
-                        pixcol[jj1];
+                    // variance first, inverted below
+                    for(uint32_t ii = ii0; ii < ii1; ii++)
+                    {
+                        float w = 1.0f - fabsf(lrow[ii] - layerk);
+                        float a = crow[ii] * ie * ((w > 0.0f) ? w : 0.0f);
+                        vrow[ii] +=
+                            a * a * (fmaxf(prow[ii], 0.0f) * invgain + rn2);
+                    }
                 }
             }
-
-            for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
+            if(vrow != NULL)
             {
-                for(uint32_t jj1 = 1; jj1 < ysize1 - 1; jj1++)
+                for(uint32_t ii = ii0; ii < ii1; ii++)
                 {
-                    if(data.image[IDlayer].array.F[jj1 * xsize1 + ii1] <
-                            data.image[IDlayermin].array.F[jj1 * xsize1 + ii1])
-                    {
-                        data.image[IDlayer].array.F[jj1 * xsize1 + ii1] =
-                            data.image[IDlayermin].array.F[jj1 * xsize1 + ii1];
-                    }
+                    vrow[ii] = (vrow[ii] > 0.0f) ? 1.0f / vrow[ii] : 0.0f;
                 }
             }
         }
-        free(pixcol);
-        free(pixline);
-        printf("\n");
-        printf("---------------- DONE ------------\n");
-        fflush(stdout);
     }
 
-    gauss_filter("imlayer", "imlayerg", 50.0, 150);
-    imageID IDlayerg = image_ID("imlayerg");
+    free(ii1tab);
+    free(fxtab);
+    free(lv);
+    free(gv);
+    free(lrow);
+    free(crow);
+    free(invexp);
+}
 
-    // construct HDR image
-    imageID IDout;
-    create_2Dimage_ID(outimname, xsize, ysize, &IDout);
+/*
+Laplacian pyramid blending (exposure fusion of radiance images)
 
-    for(uint32_t jj = 0; jj < ysize; jj++)
+Per exposure k, radiance r_k = (pix - bias) / etime_k, and weight
+w_k = etime_k * (1 - (v / satvalue)^4) for v below saturation, 0 above:
+longer exposures (higher SNR) dominate until they approach saturation.
+The shortest exposure keeps a small weight so that the weights never all
+vanish. Normalized weights are blended through a gaussian pyramid, the
+radiances through a Laplacian pyramid, and the fused pyramid collapsed.
+Layer index and inverse variance maps (layerout / ivarout, both or none,
+zeroed by the caller) are the full resolution weighted averages: they
+ignore the smoothing of the weights across levels.
+
+Down/up sampling use the separable 5-tap binomial kernel (1 4 6 4 1)/16,
+vertical pass over whole rows then horizontal pass, edges clamped.
+All loops are row-major and unit stride, cost is O(N) per exposure.
+*/
+
+/*
+Reduce rows jo0 to jo1 (excluded) of the ((w + 1) / 2) x ((h + 1) / 2) output
+out receives row jo0 first, trow holds w floats
+*/
+static void hdr_pyr_down(
+    const float *__restrict in, uint32_t w, uint32_t h, float *__restrict out,
+    float *__restrict trow, uint32_t jo0, uint32_t jo1)
+{
+    uint32_t wo = (w + 1) / 2;
+
+    for(uint32_t jo = jo0; jo < jo1; jo++)
     {
-        float    y   = 1.0 * jj / ysize;
-        uint32_t jj1 = (uint32_t)(y * ysize1);
-        if(jj1 == ysize1 - 1)
+        long         j  = 2 * (long) jo;
+        const float *r0 = in + (long) (j - 2 < 0 ? 0 : j - 2) * w;
+        const float *r1 = in + (long) (j - 1 < 0 ? 0 : j - 1) * w;
+        const float *r2 = in + j * w;
+        const float *r3 = in + (long) (j + 1 >= h ? h - 1 : j + 1) * w;
+        const float *r4 = in + (long) (j + 2 >= h ? h - 1 : j + 2) * w;
+
+        for(uint32_t i = 0; i < w; i++)
         {
-            jj1 = ysize1 - 2;
+            trow[i] = (r0[i] + r4[i] + 4.0f * (r1[i] + r3[i]) + 6.0f * r2[i]) *
+                      (1.0f / 16.0f);
         }
-        float jj1frac = y * ysize1 - jj1;
 
-        for(uint32_t ii = 0; ii < xsize; ii++)
+        float *orow = out + (long)(jo - jo0) * wo;
+        for(uint32_t io = 0; io < wo; io++)
         {
-            float    x   = 1.0 * ii / xsize;
-            uint32_t ii1 = (uint32_t)(x * xsize1);
-            if(ii1 == xsize1 - 1)
-            {
-                ii1 = xsize1 - 2;
-            }
-            float ii1frac = x * xsize1 - ii1;
-
-            // get layer
-            float layer00 = data.image[IDlayer].array.F[jj1 * xsize1 + ii1];
-            float layer10 = data.image[IDlayer].array.F[jj1 * xsize1 + ii1 + 1];
-            float layer01 =
-                data.image[IDlayer].array.F[(jj1 + 1) * xsize1 + ii1];
-            float layer11 =
-                data.image[IDlayer].array.F[(jj1 + 1) * xsize1 + ii1 + 1];
-
-            float layer = layer00 * (1.0 - ii1frac) * (1.0 - jj1frac) +
-                          layer01 * (1.0 - ii1frac) * jj1frac +
-                          layer10 * ii1frac * (1.0 - jj1frac) +
-                          layer11 * ii1frac * jj1frac;
-
-            uint32_t layer0 = (uint32_t) layer;
-            uint32_t layer1 = layer0 + 1;
-            if(layer1 == zsize)
-            {
-                layer1 = layer0;
-            }
-            float layercoeff = layer - 1.0 * layer0;
-
-            float pval0 =
-                data.image[IDimHDRc]
-                .array.F[layer0 * xsize * ysize + jj * xsize + ii] /
-                etimearray[layer0];
-            float pval1 =
-                data.image[IDimHDRc]
-                .array.F[layer1 * xsize * ysize + jj * xsize + ii] /
-                etimearray[layer1];
-
-            double alpha0 = 10.0;
-            //double alpha1 = 2.5;
-            /*
-            double alpha1 = 6.0;
-            double alpha3 = 3.0;
-            double alpha4 = 3.0;
-            double layermax = 2.0;
-            if(layer>layermax)
-            {
-                layer = layermax;
-            }
-            double x1 = 1.0 / pow( 1.0 + 1.0/pow(layer/alpha0,alpha1), 1.0/alpha1);
-            double layercoeff1 = 1.0 / ( 1.0 + alpha3*pow(6.0, alpha4*x1) );
-            */
-            double layerg = data.image[IDlayerg].array.F[jj1 * xsize1 + ii1];
-            if(layerg > 3.0)
-            {
-                layerg = 3.0;
-            }
-            double layercoeff1 = 1.0 / pow(alpha0, layerg);
-
-            //data.image[IDout].array.F[jj*xsize+ii] = (pval0 * (1.0-layercoeff) + pval1 * layercoeff);
-            data.image[IDout].array.F[jj * xsize + ii] =
-                layercoeff1 * (pval0 * (1.0 - layercoeff) + pval1 * layercoeff);
+            long i  = 2 * (long) io;
+            long i0 = (i - 2 < 0) ? 0 : i - 2;
+            long i1 = (i - 1 < 0) ? 0 : i - 1;
+            long i3 = (i + 1 >= w) ? w - 1 : i + 1;
+            long i4 = (i + 2 >= w) ? w - 1 : i + 2;
+            orow[io] = (trow[i0] + trow[i4] + 4.0f * (trow[i1] + trow[i3]) +
+                        6.0f * trow[i]) *
+                       (1.0f / 16.0f);
         }
     }
-
-    return RETURN_SUCCESS;
 }
 
-static errno_t compute_function()
+/*
+Expand rows j0 to j1 (excluded) of the w x h output, from the
+((w + 1) / 2) x ((h + 1) / 2) input
+out receives row j0 first, trow holds (w + 1) / 2 floats
+*/
+static void hdr_pyr_up(
+    const float *__restrict in, uint32_t w, uint32_t h, float *__restrict out,
+    float *__restrict trow, uint32_t j0, uint32_t j1)
 {
-    DEBUG_TRACE_FSTART();
-    INSERT_STD_PROCINFO_COMPUTEFUNC_START
+    uint32_t wi = (w + 1) / 2;
+    uint32_t hi = (h + 1) / 2;
 
-    printf("satlevel  = %f\n", *satlevel);
+    for(uint32_t j = j0; j < j1; j++)
+    {
+        long         jc = j / 2;
+        const float *rc = in + jc * wi;
+        if(j % 2 == 0)
+        {
+            // even rows: (1 6 1) / 8 of the rows around
+            const float *rm = in + (jc - 1 < 0 ? 0 : jc - 1) * wi;
+            const float *rp = in + (jc + 1 >= hi ? hi - 1 : jc + 1) * wi;
+            for(uint32_t i = 0; i < wi; i++)
+            {
+                trow[i] = (rm[i] + 6.0f * rc[i] + rp[i]) * (1.0f / 8.0f);
+            }
+        }
+        else
+        {
+            // odd rows: mean of the two rows around
+            const float *rp = in + (jc + 1 >= hi ? hi - 1 : jc + 1) * wi;
+            for(uint32_t i = 0; i < wi; i++)
+            {
+                trow[i] = 0.5f * (rc[i] + rp[i]);
+            }
+        }
+
+        // even columns 2 ic: (1 6 1) / 8 of the columns around, first and
+        // last clamped
+        float *orow = out + (long)(j - j0) * w;
+        for(long ic = 1; ic + 1 < wi; ic++)
+        {
+            orow[2 * ic] =
+                (trow[ic - 1] + 6.0f * trow[ic] + trow[ic + 1]) * (1.0f / 8.0f);
+        }
+        for(int e = 0; e < 2; e++)
+        {
+            long ic = e ? wi - 1 : 0;
+            long im = (ic - 1 < 0) ? 0 : ic - 1;
+            long ip = (ic + 1 >= wi) ? wi - 1 : ic + 1;
+            orow[2 * ic] =
+                (trow[im] + 6.0f * trow[ic] + trow[ip]) * (1.0f / 8.0f);
+        }
+
+        // odd columns 2 ic + 1: mean of the two columns around, last one
+        // clamped if w is even
+        for(long ic = 0; ic + 1 < wi; ic++)
+        {
+            orow[2 * ic + 1] = 0.5f * (trow[ic] + trow[ic + 1]);
+        }
+        if(w % 2 == 0)
+        {
+            orow[w - 1] = 0.5f * (trow[wi - 1] + trow[wi - 1]);
+        }
+    }
+}
+
+static inline float
+hdr_fusion_weight(float v, float satvalue, float etime, float wmin)
+{
+    float w = 0.0;
+    if(v < satvalue)
+    {
+        float x  = v / satvalue;
+        float x2 = x * x;
+        w        = etime * (1.0f - x2 * x2);
+    }
+    return (w > wmin) ? w : wmin;
+}
+
+/*
+Pyramid blending state, shared by the pool workers
+Each step is one pool run over row tiles (HDR_TILEROWS rows) of a level
+*/
+#define HDR_PYR_WSUM     0 // weight sum of all exposures
+#define HDR_PYR_BASE     1 // level 0 weights and radiances of exposure kk
+#define HDR_PYR_DOWN     2 // gaussian level from the level below
+#define HDR_PYR_LAPLACE  3 // Laplacian levels, all at once, into the fused
+#define HDR_PYR_COLLAPSE 4 // fused level += expanded level above
+
+typedef struct
+{
+    int      nl;
+    uint32_t w[HDR_PYR_MAXLEVELS];
+    uint32_t h[HDR_PYR_MAXLEVELS];
+    uint32_t ntiles[HDR_PYR_MAXLEVELS];
+    float   *wp[HDR_PYR_MAXLEVELS]; // weight
+    float   *rp[HDR_PYR_MAXLEVELS]; // radiance
+    float   *fp[HDR_PYR_MAXLEVELS]; // fused
+    float   *wsum;
+    float    satvalue;
+    float    wmin; // shortest exposure minimum weight
+    uint32_t kshort;
+
+    // current step
+    int      step;
+    int      level;
+    uint32_t kk;
+} HDR_PYR;
+
+/*
+Multi-extension FITS writer
+Primary HDU and IMAGE extensions, all float32 2D, written in one sequential
+pass through a single buffer (big-endian conversion in the buffer). Each
+extension holds whole rows, readers can seek to the rows they need.
+*/
+#define HDR_FITS_BLOCK   2880
+#define HDR_FITS_BUFSIZE (HDR_FITS_BLOCK * 512)
+
+typedef struct
+{
+    FILE  *fp;
+    char  *buf;
+    size_t n;     // bytes in buffer
+    size_t total; // bytes written into the HDU so far
+    int    nhdu;
+    int    err;
+} HDR_FITSW;
+
+static void hdr_fitsw_flush(HDR_FITSW *fw)
+{
+    if(fw->n > 0 && fwrite(fw->buf, 1, fw->n, fw->fp) != fw->n)
+    {
+        fw->err = 1;
+    }
+    fw->n = 0;
+}
+
+static void hdr_fitsw_put(HDR_FITSW *fw, const void *src, size_t n)
+{
+    const char *ptr = (const char *) src;
+    while(n > 0)
+    {
+        size_t m = HDR_FITS_BUFSIZE - fw->n;
+        m        = (m > n) ? n : m;
+        memcpy(fw->buf + fw->n, ptr, m);
+        fw->n += m;
+        fw->total += m;
+        ptr += m;
+        n -= m;
+        if(fw->n == HDR_FITS_BUFSIZE)
+        {
+            hdr_fitsw_flush(fw);
+        }
+    }
+}
+
+// Pad the header (spaces) or data (zeros) to a whole number of blocks
+static void hdr_fitsw_pad(HDR_FITSW *fw, char fill)
+{
+    char block[HDR_FITS_BLOCK];
+    memset(block, fill, HDR_FITS_BLOCK);
+    size_t rem = fw->total % HDR_FITS_BLOCK;
+    if(rem > 0)
+    {
+        hdr_fitsw_put(fw, block, HDR_FITS_BLOCK - rem);
+    }
+    fw->total = 0;
+}
+
+// Header card, fixed format; string values start with a quote
+static void hdr_fitsw_card(HDR_FITSW *fw, const char *key, const char *value)
+{
+    char card[81];
+    if(value == NULL)
+    {
+        snprintf(card, 81, "%-80s", key);
+    }
+    else if(value[0] == '\'')
+    {
+        snprintf(card, 81, "%-8.8s= %-70s", key, value);
+    }
+    else
+    {
+        snprintf(card, 81, "%-8.8s= %20s%50s", key, value, "");
+    }
+    hdr_fitsw_put(fw, card, 80);
+}
+
+static void hdr_fitsw_hdu(HDR_FITSW  *fw,
+                          const float *im,
+                          uint32_t     xsize,
+                          uint32_t     ysize,
+                          const char  *extname)
+{
+    char val[80];
+
+    if(fw->nhdu == 0)
+    {
+        hdr_fitsw_card(fw, "SIMPLE", "T");
+    }
+    else
+    {
+        hdr_fitsw_card(fw, "XTENSION", "'IMAGE   '");
+    }
+    hdr_fitsw_card(fw, "BITPIX", "-32");
+    hdr_fitsw_card(fw, "NAXIS", "2");
+    snprintf(val, 80, "%u", xsize);
+    hdr_fitsw_card(fw, "NAXIS1", val);
+    snprintf(val, 80, "%u", ysize);
+    hdr_fitsw_card(fw, "NAXIS2", val);
+    if(fw->nhdu == 0)
+    {
+        hdr_fitsw_card(fw, "EXTEND", "T");
+    }
+    else
+    {
+        hdr_fitsw_card(fw, "PCOUNT", "0");
+        hdr_fitsw_card(fw, "GCOUNT", "1");
+    }
+    snprintf(val, 80, "'%-8.68s'", extname);
+    hdr_fitsw_card(fw, "EXTNAME", val);
+    hdr_fitsw_card(fw, "END", NULL);
+    hdr_fitsw_pad(fw, ' ');
+
+    uint32_t be[1024];
+    long     npix = (long) xsize * ysize;
+    for(long ii0 = 0; ii0 < npix; ii0 += 1024)
+    {
+        long n = (npix - ii0 < 1024) ? npix - ii0 : 1024;
+        memcpy(be, im + ii0, sizeof(float) * n);
+        for(long ii = 0; ii < n; ii++)
+        {
+            be[ii] = htonl(be[ii]);
+        }
+        hdr_fitsw_put(fw, be, sizeof(float) * n);
+    }
+    hdr_fitsw_pad(fw, 0);
+    fw->nhdu++;
+}
+
+static errno_t hdr_write_mef(const char   *fname,
+                             int           nim,
+                             const float **ims,
+                             const char  **extnames,
+                             uint32_t      xsize,
+                             uint32_t      ysize)
+{
+    HDR_FITSW fw;
+    memset(&fw, 0, sizeof(HDR_FITSW));
+
+    fw.fp = fopen(fname, "w");
+    if(fw.fp == NULL)
+    {
+        PRINT_ERROR("cannot create file %s", fname);
+        return RETURN_FAILURE;
+    }
+    fw.buf = (char *) malloc(HDR_FITS_BUFSIZE);
+
+    for(int im = 0; im < nim; im++)
+    {
+        hdr_fitsw_hdu(&fw, ims[im], xsize, ysize, extnames[im]);
+    }
+    hdr_fitsw_flush(&fw);
+
+    free(fw.buf);
+    if(fclose(fw.fp) != 0 || fw.err)
+    {
+        PRINT_ERROR("error writing file %s", fname);
+        return RETURN_FAILURE;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/*
+Exposure inputs
+Files fitsmap reads (uncompressed 2D FITS, raw float32) are memory mapped and
+converted row by row, without an image table slot. Other files (compressed
+FITS...) are loaded with load_fits, under the pool mutex if any. In tiled
+mode, loaded exposures are spooled to disk and read back by rows.
+*/
+#define HDR_IN_MAP   0
+#define HDR_IN_IMAGE 1
+#define HDR_IN_SPOOL 2
+
+typedef struct
+{
+    int      kind;
+    FITSMAP  fm; // HDR_IN_MAP
+    imageID  ID; // HDR_IN_IMAGE
+    int      spoolfd; // HDR_IN_SPOOL
+    long     slot;
+    uint32_t xsize;
+    uint32_t ysize;
+    char     imname[200];
+} HDR_INPUT;
+
+/*
+Open exposure fname; raw files are xsize x ysize
+mutex (may be NULL) serializes the image table for the fallback
+*/
+static errno_t hdr_input_open(const char      *fname,
+                              uint32_t         xsize,
+                              uint32_t         ysize,
+                              pthread_mutex_t *mutex,
+                              const char      *imname,
+                              HDR_INPUT       *in)
+{
+    memset(in, 0, sizeof(HDR_INPUT));
+    in->ID = -1;
+
+    if(fitsmap_open(fname, xsize, ysize, &in->fm) != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+    if(in->fm.map != NULL)
+    {
+        in->kind  = HDR_IN_MAP;
+        in->xsize = in->fm.xsize;
+        in->ysize = in->fm.ysize;
+        return RETURN_SUCCESS;
+    }
+
+    // Fallback: load into the image table
+    in->kind = HDR_IN_IMAGE;
+    strncpy(in->imname, imname, 199);
+    if(mutex != NULL)
+    {
+        pthread_mutex_lock(mutex);
+    }
+    load_fits(fname, in->imname, 2, &in->ID);
+    if(in->ID != -1)
+    {
+        in->xsize = data.image[in->ID].md->size[0];
+        in->ysize = data.image[in->ID].md->size[1];
+    }
+    if(mutex != NULL)
+    {
+        pthread_mutex_unlock(mutex);
+    }
+
+    return (in->ID == -1) ? RETURN_FAILURE : RETURN_SUCCESS;
+}
+
+static void hdr_input_close(HDR_INPUT *in, pthread_mutex_t *mutex)
+{
+    if(in->kind == HDR_IN_IMAGE)
+    {
+        if(mutex != NULL)
+        {
+            pthread_mutex_lock(mutex);
+        }
+        delete_image_ID(in->imname, DELETE_IMAGE_ERRMODE_WARNING);
+        if(mutex != NULL)
+        {
+            pthread_mutex_unlock(mutex);
+        }
+    }
+    else if(in->kind == HDR_IN_MAP)
+    {
+        fitsmap_close(&in->fm);
+    }
+}
+
+// Row jj of an input, as float
+static errno_t hdr_input_row(const HDR_INPUT *in, uint32_t jj, float *row)
+{
+    if(in->kind == HDR_IN_MAP)
+    {
+        fitsmap_row(&in->fm, jj, row);
+        return RETURN_SUCCESS;
+    }
+    if(in->kind == HDR_IN_IMAGE)
+    {
+        memcpy(row,
+               data.image[in->ID].array.F + (long) jj * in->xsize,
+               sizeof(float) * in->xsize);
+        return RETURN_SUCCESS;
+    }
+
+    size_t bytes  = sizeof(float) * in->xsize;
+    off_t  offset = ((off_t) in->slot * in->ysize + jj) * (off_t) bytes;
+    size_t done   = 0;
+    while(done < bytes)
+    {
+        ssize_t n = pread(in->spoolfd,
+                          (char *) row + done,
+                          bytes - done,
+                          offset + done);
+        if(n <= 0)
+        {
+            PRINT_ERROR("spool read failed, slot %ld row %u", in->slot, jj);
+            return RETURN_FAILURE;
+        }
+        done += n;
+    }
+    return RETURN_SUCCESS;
+}
+
+// Release the mapped pages of rows jj0 to jj1 (excluded), if mapped
+static void hdr_input_release(const HDR_INPUT *in, uint32_t jj0, uint32_t jj1)
+{
+    if(in->kind == HDR_IN_MAP)
+    {
+        fitsmap_release(&in->fm, jj0, jj1);
+    }
+}
+
+// Spool rows jj0 to jj1 (excluded) of the input, into its slot
+static errno_t hdr_input_spool(const HDR_INPUT *in,
+                               int              spoolfd,
+                               long             slot,
+                               uint32_t         jj0,
+                               uint32_t         jj1,
+                               const float     *rows)
+{
+    size_t bytes  = sizeof(float) * (size_t)(jj1 - jj0) * in->xsize;
+    off_t  offset = ((off_t) slot * in->ysize + jj0) * in->xsize *
+                   (off_t) sizeof(float);
+    size_t done   = 0;
+    while(done < bytes)
+    {
+        ssize_t n = pwrite(spoolfd,
+                           (const char *) rows + done,
+                           bytes - done,
+                           offset + done);
+        if(n <= 0)
+        {
+            PRINT_ERROR("spool write failed, slot %ld", slot);
+            return RETURN_FAILURE;
+        }
+        done += n;
+    }
+    return RETURN_SUCCESS;
+}
+
+/*
+Exposure list: file name, exposure time and time string per line, until the
+first incomplete line. Arrays grow as needed.
+*/
+typedef struct
+{
+    long   n;
+    char **fnames;
+    float *etime;
+} HDR_FLIST;
+
+static void hdr_flist_free(HDR_FLIST *flist)
+{
+    for(long kk = 0; kk < flist->n; kk++)
+    {
+        free(flist->fnames[kk]);
+    }
+    free(flist->fnames);
+    free(flist->etime);
+}
+
+static errno_t hdr_flist_read(const char *flistname, HDR_FLIST *flist)
+{
+    memset(flist, 0, sizeof(HDR_FLIST));
+
+    FILE *fpin = fopen(flistname, "r");
+    if(fpin == NULL)
+    {
+        PRINT_ERROR("cannot open file list %s", flistname);
+        return RETURN_FAILURE;
+    }
+
+    long   nalloc = 0;
+    char  *line   = NULL;
+    size_t len    = 0;
+    while(getline(&line, &len, fpin) != -1)
+    {
+        char *saveptr    = NULL;
+        char *fname      = strtok_r(line, " \t\n", &saveptr);
+        char *etimestr   = strtok_r(NULL, " \t\n", &saveptr);
+        char *timestring = strtok_r(NULL, " \t\n", &saveptr);
+        if(timestring == NULL)
+        {
+            break;
+        }
+
+        if(flist->n == nalloc)
+        {
+            nalloc        = (nalloc == 0) ? 64 : 2 * nalloc;
+            flist->fnames =
+                (char **) realloc(flist->fnames, sizeof(char *) * nalloc);
+            flist->etime =
+                (float *) realloc(flist->etime, sizeof(float) * nalloc);
+        }
+        flist->fnames[flist->n] = strdup(fname);
+        flist->etime[flist->n]  = strtof(etimestr, NULL);
+        if(flist->n < HDR_FLIST_NPRINT)
+        {
+            printf("Input file [%11.6f] : %s\n",
+                   flist->etime[flist->n],
+                   fname);
+        }
+        flist->n++;
+    }
+    free(line);
+    fclose(fpin);
+
+    printf("%ld exposures\n", flist->n);
+    if(flist->n == 0)
+    {
+        PRINT_ERROR("no exposure in %s", flistname);
+        return RETURN_FAILURE;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/*
+Thread pool shared by pass 1 (one exposure per work item), the compose pass
+and the pyramid blending steps (one row tile per work item)
+Mapped inputs are read by the workers in parallel, outside the mutex, one
+band of rows at a time: a worker holds one band, reading overlaps with the
+binning of the other workers, and the mapped pages are released per band.
+The image table is not thread-safe: fallback load_fits and delete_image_ID
+calls are serialized by the mutex, so compressed exposures are read one at a
+time and each loading worker holds a full exposure until it is binned.
+*/
+typedef struct
+{
+    pthread_mutex_t mutex;
+    uint32_t        next; // next work item
+    errno_t         status;
+
+    int      tiled;
+    uint32_t xsize;
+    uint32_t ysize;
+    uint32_t xsize1;
+    uint32_t ysize1;
+    uint32_t zsize;
+
+    // pass 1
+    char      **fnames;
+    float       biasvalue;
+    float      *cube;   // in memory (tiled = 0)
+    HDR_INPUT  *inputs; // tiled: kept open for the compose pass
+    const char *spooldir;
+    int         spoolfd; // tiled, loaded exposures; -1 until needed
+    long        nspool;
+    float      *c1;
+    float    *c1w;
+    uint32_t *xbin;
+    uint32_t *ybin;
+    uint32_t *xcount;
+    uint32_t *ycount;
+
+    // compose
+    float       *out;
+    float       *layerout; // NULL if no maps
+    float       *ivarout;
+    float        gain;
+    float        rdnoise;
+    const float *layermap;
+    const float *layermapg;
+    const float *etimearray;
+
+    // pyramid blending
+    HDR_PYR *pyr;
+} HDR_POOL;
+
+// Next work item, or -1 if none left (or after a failure)
+static long hdr_pool_next(HDR_POOL *pool, uint32_t nitems)
+{
+    long item = -1;
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->status == RETURN_SUCCESS && pool->next < nitems)
+    {
+        item = pool->next++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return item;
+}
+
+static void hdr_pool_fail(HDR_POOL *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->status = RETURN_FAILURE;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static errno_t
+hdr_pool_run(HDR_POOL *pool, void *(*worker)(void *), int nthreads)
+{
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+    if(threads == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        return RETURN_FAILURE;
+    }
+
+    // The caller is worker 0 and drains whatever items are left if some
+    // threads could not be started
+    pool->next   = 0;
+    int nstarted = 1;
+    while(nstarted < nthreads &&
+            pthread_create(&threads[nstarted], NULL, worker, pool) == 0)
+    {
+        nstarted++;
+    }
+    worker(pool);
+    for(int t = 1; t < nstarted; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    return pool->status;
+}
+
+// Inputs still open (tiled), spool file and mutex
+static void hdr_pool_free(HDR_POOL *pool)
+{
+    if(pool->tiled)
+    {
+        for(uint32_t kk = 0; kk < pool->zsize; kk++)
+        {
+            hdr_input_close(&pool->inputs[kk], &pool->mutex);
+        }
+    }
+    free(pool->inputs);
+    if(pool->spoolfd != -1)
+    {
+        close(pool->spoolfd);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+/*
+Rows jj0 to jj1 (excluded) of exposure kk, bias-subtracted into dst (tiled)
+Mapped pages are released once read
+*/
+static errno_t
+hdr_pool_rows(HDR_POOL *pool, uint32_t kk, uint32_t jj0, uint32_t jj1,
+              float *dst)
+{
+    HDR_INPUT *in = &pool->inputs[kk];
+    for(uint32_t jj = jj0; jj < jj1; jj++)
+    {
+        float *row = dst + (long)(jj - jj0) * pool->xsize;
+        if(hdr_input_row(in, jj, row) != RETURN_SUCCESS)
+        {
+            return RETURN_FAILURE;
+        }
+        for(uint32_t ii = 0; ii < pool->xsize; ii++)
+        {
+            row[ii] = 1.0 * row[ii] - pool->biasvalue;
+        }
+    }
+    hdr_input_release(in, jj0, jj1);
+    return RETURN_SUCCESS;
+}
+
+/*
+Pass 1: load, bias-subtract and bin exposure kk
+tiled: the input stays open for the compose pass, an exposure loaded into
+the image table is spooled to disk and released
+Pyramid blending (no binned cube): only fills the cube, or (tiled) opens
+and spools the inputs
+*/
+static void *hdr_pass1_worker(void *ptr)
+{
+    HDR_POOL *pool = (HDR_POOL *) ptr;
+    long      kk;
+
+    // Band of bias-subtracted rows (tiled)
+    float *band = (float *) malloc(sizeof(float) * HDR_TILEROWS * pool->xsize);
+
+    while((kk = hdr_pool_next(pool, pool->zsize)) != -1)
+    {
+        char imHDRin[200];
+        sprintf(imHDRin, "imHRDin_%03ld", kk);
+
+        HDR_INPUT *in = &pool->inputs[kk];
+        if(hdr_input_open(pool->fnames[kk],
+                          pool->xsize,
+                          pool->ysize,
+                          &pool->mutex,
+                          imHDRin,
+                          in) != RETURN_SUCCESS)
+        {
+            hdr_pool_fail(pool);
+            break;
+        }
+        if(in->xsize != pool->xsize || in->ysize != pool->ysize)
+        {
+            PRINT_ERROR("%s is %u x %u, expected %u x %u",
+                        pool->fnames[kk],
+                        in->xsize,
+                        in->ysize,
+                        pool->xsize,
+                        pool->ysize);
+            hdr_input_close(in, &pool->mutex);
+            memset(in, 0, sizeof(HDR_INPUT)); // closed
+            hdr_pool_fail(pool);
+            break;
+        }
+
+        int  spool  = pool->tiled && (in->kind == HDR_IN_IMAGE);
+        long slot   = -1;
+        int  status = RETURN_SUCCESS;
+        if(spool)
+        {
+            pthread_mutex_lock(&pool->mutex);
+            if(pool->spoolfd == -1)
+            {
+                pool->spoolfd =
+                    fitsmap_spool_open(pool->spooldir, "milk_HDRc_");
+            }
+            slot = pool->nspool++;
+            pthread_mutex_unlock(&pool->mutex);
+            status = (pool->spoolfd == -1) ? RETURN_FAILURE : RETURN_SUCCESS;
+        }
+
+        // Pyramid blending: no binning, tiled mapped inputs are not read
+        int    bin    = (pool->c1 != NULL);
+        long   layer1 = (long) kk * pool->xsize1 * pool->ysize1;
+        float *c1     = bin ? pool->c1 + layer1 : NULL;
+        int    read   = bin || !pool->tiled || spool;
+
+        for(uint32_t jj0 = 0;
+                read && jj0 < pool->ysize && status == RETURN_SUCCESS;
+                jj0 += HDR_TILEROWS)
+        {
+            uint32_t jj1 = jj0 + HDR_TILEROWS;
+            jj1          = (jj1 > pool->ysize) ? pool->ysize : jj1;
+
+            float *bandout =
+                pool->tiled
+                ? band
+                : pool->cube + (long) kk * pool->xsize * pool->ysize +
+                  (long) jj0 * pool->xsize;
+            for(uint32_t jj = jj0; jj < jj1; jj++)
+            {
+                hdr_input_row(in, jj, bandout + (long)(jj - jj0) * pool->xsize);
+            }
+            if(spool)
+            {
+                status = hdr_input_spool(in,
+                                         pool->spoolfd,
+                                         slot,
+                                         jj0,
+                                         jj1,
+                                         bandout);
+            }
+            for(uint32_t jj = jj0; jj < jj1; jj++)
+            {
+                float *orow = bandout + (long)(jj - jj0) * pool->xsize;
+                if(bin)
+                {
+                    hdr_bin_row(orow,
+                                pool->biasvalue,
+                                orow,
+                                c1 + (long) pool->ybin[jj] * pool->xsize1,
+                                pool->xbin,
+                                pool->xsize);
+                }
+                else if(!pool->tiled)
+                {
+                    for(uint32_t ii = 0; ii < pool->xsize; ii++)
+                    {
+                        orow[ii] = 1.0 * orow[ii] - pool->biasvalue;
+                    }
+                }
+            }
+            hdr_input_release(in, jj0, jj1);
+        }
+
+        if(!pool->tiled || spool)
+        {
+            hdr_input_close(in, &pool->mutex);
+        }
+        if(spool)
+        {
+            in->kind    = HDR_IN_SPOOL;
+            in->spoolfd = pool->spoolfd;
+            in->slot    = slot;
+        }
+        if(status != RETURN_SUCCESS)
+        {
+            hdr_pool_fail(pool);
+            break;
+        }
+
+        if(bin)
+        {
+            hdr_bin_normalize(c1,
+                              pool->c1w + layer1,
+                              pool->xcount,
+                              pool->ycount,
+                              pool->xsize1,
+                              pool->ysize1);
+        }
+    }
+
+    free(band);
+    return NULL;
+}
+
+/*
+Layers a tile of rows jj0 to jj1 (excluded) may use: the range of the
+interpolated layer map over the tile, as the compose kernel computes it
+(the last bin row and column extrapolate). ii1tab, fxtab from
+hdr_layer_xtab, lv and lrow are scratch rows
+*/
+static void hdr_tile_layers(HDR_POOL       *pool,
+                            uint32_t        jj0,
+                            uint32_t        jj1,
+                            const uint32_t *ii1tab,
+                            const float    *fxtab,
+                            float          *lv,
+                            float          *lrow,
+                            uint32_t       *kkmin,
+                            uint32_t       *kkmax)
+{
+    float layermax = pool->zsize - 1;
+    float lmin     = layermax;
+    float lmax     = 0.0f;
+    for(uint32_t jj = jj0; jj < jj1; jj++)
+    {
+        hdr_layer_lv(pool->layermap,
+                     pool->ysize,
+                     pool->xsize1,
+                     pool->ysize1,
+                     jj,
+                     lv);
+        hdr_layer_row(lv, ii1tab, fxtab, pool->xsize, layermax, lrow);
+        for(uint32_t ii1 = 0; ii1 < pool->xsize1; ii1++)
+        {
+            lmin = (lv[ii1] < lmin) ? lv[ii1] : lmin;
+            lmax = (lv[ii1] > lmax) ? lv[ii1] : lmax;
+        }
+        for(uint32_t ii = 0; ii < pool->xsize; ii++)
+        {
+            lmin = (lrow[ii] < lmin) ? lrow[ii] : lmin;
+            lmax = (lrow[ii] > lmax) ? lrow[ii] : lmax;
+        }
+    }
+
+    lmin   = (lmin < 0.0f) ? 0.0f : lmin;
+    lmax   = (lmax > layermax) ? layermax : lmax;
+    *kkmin = (uint32_t) lmin;
+    *kkmax = (uint32_t) ceilf(lmax);
+}
+
+/*
+Compose pass: one tile of HDR_TILEROWS rows per work item
+tiled: the rows of the tile are read from the inputs, only for the layers
+the tile uses, into per-layer tile buffers of the thread
+*/
+static void *hdr_compose_worker(void *ptr)
+{
+    HDR_POOL *pool   = (HDR_POOL *) ptr;
+    uint32_t  ntiles = (pool->ysize + HDR_TILEROWS - 1) / HDR_TILEROWS;
+    long      npix   = (long) pool->xsize * pool->ysize;
+    long      tile;
+
+    const float **layers =
+        (const float **) calloc(pool->zsize, sizeof(float *));
+    float **tbuf = (float **) calloc(pool->zsize, sizeof(float *));
+
+    // Layer map interpolation scratch (tiled)
+    uint32_t *ii1tab = NULL;
+    float    *fxtab  = NULL;
+    float    *lv     = NULL;
+    float    *lrow   = NULL;
+    if(pool->tiled)
+    {
+        ii1tab = (uint32_t *) malloc(sizeof(uint32_t) * pool->xsize);
+        fxtab  = (float *) malloc(sizeof(float) * pool->xsize);
+        lv     = (float *) malloc(sizeof(float) * pool->xsize1);
+        lrow   = (float *) malloc(sizeof(float) * pool->xsize);
+        hdr_layer_xtab(pool->xsize, pool->xsize1, ii1tab, fxtab);
+    }
+
+    while((tile = hdr_pool_next(pool, ntiles)) != -1)
+    {
+        uint32_t jj0 = tile * HDR_TILEROWS;
+        uint32_t jj1 = jj0 + HDR_TILEROWS;
+        if(jj1 > pool->ysize)
+        {
+            jj1 = pool->ysize;
+        }
+
+        if(!pool->tiled)
+        {
+            for(uint32_t kk = 0; kk < pool->zsize; kk++)
+            {
+                layers[kk] = pool->cube + kk * npix + (long) jj0 * pool->xsize;
+            }
+        }
+        else
+        {
+            uint32_t kkmin;
+            uint32_t kkmax;
+            hdr_tile_layers(pool,
+                            jj0,
+                            jj1,
+                            ii1tab,
+                            fxtab,
+                            lv,
+                            lrow,
+                            &kkmin,
+                            &kkmax);
+
+            int status = RETURN_SUCCESS;
+            for(uint32_t kk = 0; kk < pool->zsize; kk++)
+            {
+                if(kk < kkmin || kk > kkmax)
+                {
+                    free(tbuf[kk]);
+                    tbuf[kk]   = NULL;
+                    layers[kk] = NULL;
+                    continue;
+                }
+                if(tbuf[kk] == NULL)
+                {
+                    tbuf[kk] = (float *) malloc(sizeof(float) * HDR_TILEROWS *
+                                                pool->xsize);
+                }
+                if(status == RETURN_SUCCESS)
+                {
+                    status = hdr_pool_rows(pool, kk, jj0, jj1, tbuf[kk]);
+                }
+                layers[kk] = tbuf[kk];
+            }
+            if(status != RETURN_SUCCESS)
+            {
+                hdr_pool_fail(pool);
+                break;
+            }
+        }
+
+        hdr_compose_rows(pool->out,
+                         pool->layerout,
+                         pool->ivarout,
+                         layers,
+                         pool->layermap,
+                         pool->layermapg,
+                         pool->etimearray,
+                         pool->gain,
+                         pool->rdnoise,
+                         pool->xsize,
+                         pool->ysize,
+                         pool->xsize1,
+                         pool->ysize1,
+                         pool->zsize,
+                         jj0,
+                         jj1);
+    }
+
+    for(uint32_t kk = 0; kk < pool->zsize; kk++)
+    {
+        free(tbuf[kk]);
+    }
+    free(tbuf);
+    free(layers);
+    free(ii1tab);
+    free(fxtab);
+    free(lv);
+    free(lrow);
+
+    return NULL;
+}
+
+/*
+Bias-subtracted rows jj0 to jj1 (excluded) of exposure kk: in the cube, or
+(tiled) read from its input into buf. NULL on read error
+*/
+static const float *hdr_pool_band(HDR_POOL *pool,
+                                  uint32_t  kk,
+                                  uint32_t  jj0,
+                                  uint32_t  jj1,
+                                  float    *buf)
+{
+    if(!pool->tiled)
+    {
+        return pool->cube + (long) kk * pool->xsize * pool->ysize +
+               (long) jj0 * pool->xsize;
+    }
+    if(hdr_pool_rows(pool, kk, jj0, jj1, buf) != RETURN_SUCCESS)
+    {
+        return NULL;
+    }
+    return buf;
+}
+
+// Weight sum of rows jj0 to jj1 (excluded), exposures in order
+static errno_t
+hdr_pyr_wsum(HDR_POOL *pool, uint32_t jj0, uint32_t jj1, float *band)
+{
+    HDR_PYR *pyr  = pool->pyr;
+    long     n    = (long)(jj1 - jj0) * pool->xsize;
+    float   *wsum = pyr->wsum + (long) jj0 * pool->xsize;
+
+    for(uint32_t kk = 0; kk < pool->zsize; kk++)
+    {
+        const float *rows = hdr_pool_band(pool, kk, jj0, jj1, band);
+        if(rows == NULL)
+        {
+            return RETURN_FAILURE;
+        }
+        float satvalue = pyr->satvalue;
+        float etime    = pool->etimearray[kk];
+        float wmink    = (kk == pyr->kshort) ? pyr->wmin : 0.0;
+        for(long ii = 0; ii < n; ii++)
+        {
+            wsum[ii] += hdr_fusion_weight(rows[ii], satvalue, etime, wmink);
+        }
+    }
+    return RETURN_SUCCESS;
+}
+
+/*
+Level 0 normalized weights and radiances of exposure pyr->kk, rows jj0 to
+jj1 (excluded), and its contribution to the maps (variance in ivarout)
+*/
+static errno_t
+hdr_pyr_base(HDR_POOL *pool, uint32_t jj0, uint32_t jj1, float *band)
+{
+    HDR_PYR *pyr = pool->pyr;
+    uint32_t kk  = pyr->kk;
+    long     off = (long) jj0 * pool->xsize;
+    long     n   = (long)(jj1 - jj0) * pool->xsize;
+
+    const float *rows = hdr_pool_band(pool, kk, jj0, jj1, band);
+    if(rows == NULL)
+    {
+        return RETURN_FAILURE;
+    }
+
+    float *__restrict wp0  = pyr->wp[0] + off;
+    float *__restrict rp0  = pyr->rp[0] + off;
+    const float *wsum      = pyr->wsum + off;
+    float        etime     = pool->etimearray[kk];
+    float        wmink     = (kk == pyr->kshort) ? pyr->wmin : 0.0;
+    float        invexp    = 1.0 / etime;
+    for(long ii = 0; ii < n; ii++)
+    {
+        wp0[ii] = hdr_fusion_weight(rows[ii], pyr->satvalue, etime, wmink) /
+                  wsum[ii];
+        rp0[ii] = rows[ii] * invexp;
+    }
+
+    if(pool->layerout != NULL)
+    {
+        float *layerout = pool->layerout + off;
+        float *ivarout  = pool->ivarout + off;
+        float  layerk   = kk;
+        float  invgain  = (pool->gain > 0.0) ? 1.0 / pool->gain : 0.0;
+        float  rn2      = pool->rdnoise * pool->rdnoise;
+        for(long ii = 0; ii < n; ii++)
+        {
+            float a = wp0[ii] * invexp;
+            layerout[ii] += wp0[ii] * layerk;
+            ivarout[ii] += a * a * (fmaxf(rows[ii], 0.0f) * invgain + rn2);
+        }
+    }
+    return RETURN_SUCCESS;
+}
+
+/*
+Laplacian of level l, rows jj0 to jj1 (excluded), weighted into the fused
+level: rp[l] - expand(rp[l + 1]), the top level is its gaussian
+*/
+static void hdr_pyr_laplace(HDR_PYR *pyr,
+                            int      l,
+                            uint32_t jj0,
+                            uint32_t jj1,
+                            float   *band,
+                            float   *trow)
+{
+    long         off = (long) jj0 * pyr->w[l];
+    long         n   = (long)(jj1 - jj0) * pyr->w[l];
+    const float *wpl = pyr->wp[l] + off;
+    const float *rpl = pyr->rp[l] + off;
+    float *__restrict fpl = pyr->fp[l] + off;
+
+    if(l == pyr->nl - 1)
+    {
+        for(long ii = 0; ii < n; ii++)
+        {
+            fpl[ii] += wpl[ii] * rpl[ii];
+        }
+        return;
+    }
+    hdr_pyr_up(pyr->rp[l + 1], pyr->w[l], pyr->h[l], band, trow, jj0, jj1);
+    for(long ii = 0; ii < n; ii++)
+    {
+        fpl[ii] += wpl[ii] * (rpl[ii] - band[ii]);
+    }
+}
+
+/*
+Collapse fused level l, rows jj0 to jj1 (excluded); level 0 rows go to the
+output, with the variance inverted
+*/
+static void hdr_pyr_collapse(HDR_POOL *pool,
+                             int       l,
+                             uint32_t  jj0,
+                             uint32_t  jj1,
+                             float    *band,
+                             float    *trow)
+{
+    HDR_PYR *pyr = pool->pyr;
+    long     off = (long) jj0 * pyr->w[l];
+    long     n   = (long)(jj1 - jj0) * pyr->w[l];
+    float   *fpl = pyr->fp[l] + off;
+
+    if(l < pyr->nl - 1)
+    {
+        hdr_pyr_up(pyr->fp[l + 1], pyr->w[l], pyr->h[l], band, trow, jj0, jj1);
+        for(long ii = 0; ii < n; ii++)
+        {
+            fpl[ii] += band[ii];
+        }
+    }
+    if(l == 0)
+    {
+        memcpy(pool->out + off, fpl, sizeof(float) * n);
+        if(pool->ivarout != NULL)
+        {
+            float *ivarout = pool->ivarout + off;
+            for(long ii = 0; ii < n; ii++)
+            {
+                ivarout[ii] = (ivarout[ii] > 0.0f) ? 1.0f / ivarout[ii] : 0.0f;
+            }
+        }
+    }
+}
+
+/*
+Pyramid step pyr->step: one row tile of level pyr->level per work item
+(HDR_PYR_LAPLACE: the tiles of all levels)
+*/
+static void *hdr_pyr_worker(void *ptr)
+{
+    HDR_POOL *pool = (HDR_POOL *) ptr;
+    HDR_PYR  *pyr  = pool->pyr;
+    long      tile;
+
+    // Band of rows of a level, expand / reduce row (level 0 is the widest)
+    float *band = (float *) malloc(sizeof(float) * HDR_TILEROWS * pool->xsize);
+    float *trow = (float *) malloc(sizeof(float) * pool->xsize);
+
+    uint32_t nitems = pyr->ntiles[pyr->level];
+    if(pyr->step == HDR_PYR_LAPLACE)
+    {
+        nitems = 0;
+        for(int l = 0; l < pyr->nl; l++)
+        {
+            nitems += pyr->ntiles[l];
+        }
+    }
+
+    while((tile = hdr_pool_next(pool, nitems)) != -1)
+    {
+        int l = pyr->level;
+        if(pyr->step == HDR_PYR_LAPLACE)
+        {
+            for(l = 0; tile >= pyr->ntiles[l]; l++)
+            {
+                tile -= pyr->ntiles[l];
+            }
+        }
+        uint32_t jj0 = tile * HDR_TILEROWS;
+        uint32_t jj1 = jj0 + HDR_TILEROWS;
+        if(jj1 > pyr->h[l])
+        {
+            jj1 = pyr->h[l];
+        }
+
+        errno_t status = RETURN_SUCCESS;
+        long    off    = (long) jj0 * pyr->w[l];
+        switch(pyr->step)
+        {
+        case HDR_PYR_WSUM:
+            status = hdr_pyr_wsum(pool, jj0, jj1, band);
+            break;
+        case HDR_PYR_BASE:
+            status = hdr_pyr_base(pool, jj0, jj1, band);
+            break;
+        case HDR_PYR_DOWN:
+            hdr_pyr_down(pyr->wp[l - 1],
+                         pyr->w[l - 1],
+                         pyr->h[l - 1],
+                         pyr->wp[l] + off,
+                         trow,
+                         jj0,
+                         jj1);
+            hdr_pyr_down(pyr->rp[l - 1],
+                         pyr->w[l - 1],
+                         pyr->h[l - 1],
+                         pyr->rp[l] + off,
+                         trow,
+                         jj0,
+                         jj1);
+            break;
+        case HDR_PYR_LAPLACE:
+            hdr_pyr_laplace(pyr, l, jj0, jj1, band, trow);
+            break;
+        case HDR_PYR_COLLAPSE:
+            hdr_pyr_collapse(pool, l, jj0, jj1, band, trow);
+            break;
+        }
+        if(status != RETURN_SUCCESS)
+        {
+            hdr_pool_fail(pool);
+            break;
+        }
+    }
+
+    free(band);
+    free(trow);
+    return NULL;
+}
+
+static errno_t
+hdr_pyr_run(HDR_POOL *pool, int step, int level, uint32_t kk, int nthreads)
+{
+    pool->pyr->step  = step;
+    pool->pyr->level = level;
+    pool->pyr->kk    = kk;
+    return hdr_pool_run(pool, hdr_pyr_worker, nthreads);
+}
+
+/*
+Laplacian pyramid blending of the exposures of the pool (see above), into
+pool->out and the maps
+Each step runs on the pool threads, over row tiles. tiled: the rows of each
+tile are read from the inputs, once for the weight sum and once for the
+level 0 pyramids
+*/
+static errno_t hdr_pyramid_blend(HDR_POOL *pool,
+                                 float     satvalue,
+                                 int       nlevels,
+                                 int       nthreads)
+{
+    HDR_PYR pyr;
+    memset(&pyr, 0, sizeof(HDR_PYR));
+    pool->pyr = &pyr;
+
+    // Levels, top level at least HDR_PYR_MINSIZE pixels wide
+    pyr.w[0] = pool->xsize;
+    pyr.h[0] = pool->ysize;
+    pyr.nl   = 1;
+    while(pyr.nl < nlevels && pyr.nl < HDR_PYR_MAXLEVELS &&
+            (pyr.w[pyr.nl - 1] + 1) / 2 >= HDR_PYR_MINSIZE &&
+            (pyr.h[pyr.nl - 1] + 1) / 2 >= HDR_PYR_MINSIZE)
+    {
+        pyr.w[pyr.nl] = (pyr.w[pyr.nl - 1] + 1) / 2;
+        pyr.h[pyr.nl] = (pyr.h[pyr.nl - 1] + 1) / 2;
+        pyr.nl++;
+    }
+    printf("Pyramid blending, %d levels\n", pyr.nl);
+
+    int nl = pyr.nl;
+    for(int l = 0; l < nl; l++)
+    {
+        long n        = (long) pyr.w[l] * pyr.h[l];
+        pyr.ntiles[l] = (pyr.h[l] + HDR_TILEROWS - 1) / HDR_TILEROWS;
+        pyr.wp[l]     = (float *) malloc(sizeof(float) * n);
+        pyr.rp[l]     = (float *) malloc(sizeof(float) * n);
+        pyr.fp[l]     = (float *) calloc(n, sizeof(float));
+    }
+    pyr.wsum     = (float *) calloc((long) pool->xsize * pool->ysize,
+                                    sizeof(float));
+    pyr.satvalue = satvalue;
+
+    // Shortest exposure keeps a minimum weight
+    const float *etimearray = pool->etimearray;
+    for(uint32_t kk = 1; kk < pool->zsize; kk++)
+    {
+        if(etimearray[kk] < etimearray[pyr.kshort])
+        {
+            pyr.kshort = kk;
+        }
+    }
+    pyr.wmin = HDR_PYR_WMIN * etimearray[pyr.kshort];
+
+    errno_t status = hdr_pyr_run(pool, HDR_PYR_WSUM, 0, 0, nthreads);
+
+    for(uint32_t kk = 0; kk < pool->zsize && status == RETURN_SUCCESS; kk++)
+    {
+        printf(".");
+        fflush(stdout);
+
+        status = hdr_pyr_run(pool, HDR_PYR_BASE, 0, kk, nthreads);
+        for(int l = 1; l < nl && status == RETURN_SUCCESS; l++)
+        {
+            status = hdr_pyr_run(pool, HDR_PYR_DOWN, l, kk, nthreads);
+        }
+        if(status == RETURN_SUCCESS)
+        {
+            status = hdr_pyr_run(pool, HDR_PYR_LAPLACE, 0, kk, nthreads);
+        }
+    }
+    printf("\n");
+
+    // Collapse, down to level 0 into the output
+    for(int l = (nl > 1) ? nl - 2 : 0; l >= 0 && status == RETURN_SUCCESS;
+            l--)
+    {
+        status = hdr_pyr_run(pool, HDR_PYR_COLLAPSE, l, 0, nthreads);
+    }
+
+    for(int l = 0; l < nl; l++)
+    {
+        free(pyr.wp[l]);
+        free(pyr.rp[l]);
+        free(pyr.fp[l]);
+    }
+    free(pyr.wsum);
+    pool->pyr = NULL;
+
+    return status;
+}
+
+/*
+Output image, and layer index / inverse variance maps (maps = 1)
+Map pointers are NULL if no maps
+*/
+static void hdr_create_outputs(const char *outimname,
+                               uint32_t    xsize,
+                               uint32_t    ysize,
+                               int         maps,
+                               float     **out,
+                               float     **layerout,
+                               float     **ivarout)
+{
+    imageID ID;
+    create_2Dimage_ID(outimname, xsize, ysize, &ID);
+    *out      = data.image[ID].array.F;
+    *layerout = NULL;
+    *ivarout  = NULL;
+
+    if(maps)
+    {
+        char name[STRINGMAXLEN_IMGNAME];
+        snprintf(name, STRINGMAXLEN_IMGNAME, "%s_layer", outimname);
+        create_2Dimage_ID(name, xsize, ysize, &ID);
+        *layerout = data.image[ID].array.F;
+        snprintf(name, STRINGMAXLEN_IMGNAME, "%s_ivar", outimname);
+        create_2Dimage_ID(name, xsize, ysize, &ID);
+        *ivarout = data.image[ID].array.F;
+        memset(*layerout, 0, sizeof(float) * xsize * ysize);
+        memset(*ivarout, 0, sizeof(float) * xsize * ysize);
+    }
+}
+
+// Single file with all outputs, unless outfname is "none"
+static errno_t hdr_save_outputs(const char  *outfname,
+                                const float *out,
+                                const float *layerout,
+                                const float *ivarout,
+                                uint32_t     xsize,
+                                uint32_t     ysize)
+{
+    if(strcmp(outfname, "none") == 0)
+    {
+        return RETURN_SUCCESS;
+    }
+
+    const float *ims[3]      = {out, layerout, ivarout};
+    const char  *extnames[3] = {"HDR", "LAYER", "IVAR"};
+    int          nim         = (layerout != NULL) ? 3 : 1;
+
+    printf("Writing %s (%d HDU)\n", outfname, nim);
+    return hdr_write_mef(outfname, nim, ims, extnames, xsize, ysize);
+}
+
+static errno_t hdr_combine(const HDR_FLIST *flist,
+                           float             satvalue,
+                           float             biasvalue,
+                           int               smoothmode,
+                           int               tiled,
+                           int               nthreads,
+                           int               binstep,
+                           int               blend,
+                           int               nlevels,
+                           int               maps,
+                           float             gain,
+                           float             rdnoise,
+                           uint32_t          rawxsize,
+                           uint32_t          rawysize,
+                           char *__restrict outimname,
+                           const char *__restrict outfname,
+                           const char *spooldir)
+{
+    const float *etimearray = flist->etime;
+
+    // Geometry from the first exposure (raw: rawxsize x rawysize)
+    uint32_t xsize = 0;
+    uint32_t ysize = 0;
+    {
+        HDR_INPUT in;
+        if(hdr_input_open(flist->fnames[0],
+                          rawxsize,
+                          rawysize,
+                          NULL,
+                          "imHRDin_000",
+                          &in) != RETURN_SUCCESS)
+        {
+            return RETURN_FAILURE;
+        }
+        xsize = in.xsize;
+        ysize = in.ysize;
+        hdr_input_close(&in, NULL);
+    }
+
+    printf("PARAMS : %20f %20f\n", biasvalue, 1.0 * satvalue);
+
+    uint32_t zsize = flist->n;
+
+    // At least 2 x 2 bins for the layer map interpolation
+    if(binstep < 1 || xsize / binstep < 2 || ysize / binstep < 2)
+    {
+        PRINT_WARNING("binstep %d out of range, using 1", binstep);
+        binstep = 1;
+    }
+    uint32_t xsize1  = (uint32_t)(xsize / binstep);
+    uint32_t ysize1  = (uint32_t)(ysize / binstep);
+    //
+    // Assemble cube and subsampled cube
+    // tiled: no cube; pass 1 only fills the binned cube, the inputs stay
+    // mapped and the compose pass reads the rows of each tile from them
+    // (exposures only load_fits reads are spooled to spooldir)
+    //
+    float  *cube = NULL;
+    imageID IDimHDRc;
+    if(tiled == 0)
+    {
+        create_3Dimage_ID("imHDRc", xsize, ysize, zsize, &IDimHDRc);
+        cube = data.image[IDimHDRc].array.F;
+    }
+
+    // Binned cube: layer blending only
+    int     bin = (blend != HDR_BLEND_PYRAMID);
+    imageID IDimHDRc1;
+    imageID IDimHDRc1w;
+    if(bin)
+    {
+        create_3Dimage_ID("imHDRc1", xsize1, ysize1, zsize, &IDimHDRc1);
+        create_3Dimage_ID("imHDRc1w", xsize1, ysize1, zsize, &IDimHDRc1w);
+    }
+
+    if(nthreads <= 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    HDR_POOL pool;
+    memset(&pool, 0, sizeof(HDR_POOL));
+    pthread_mutex_init(&pool.mutex, NULL);
+    pool.status    = RETURN_SUCCESS;
+    pool.tiled     = tiled;
+    pool.xsize     = xsize;
+    pool.ysize     = ysize;
+    pool.xsize1    = xsize1;
+    pool.ysize1    = ysize1;
+    pool.zsize     = zsize;
+    pool.fnames    = flist->fnames;
+    pool.biasvalue = biasvalue;
+    pool.cube      = cube;
+    pool.inputs    = (HDR_INPUT *) calloc(zsize, sizeof(HDR_INPUT));
+    pool.spooldir  = spooldir;
+    pool.spoolfd   = -1;
+
+    // Full resolution column/row to bin maps, and pixel counts per bin
+    if(bin)
+    {
+        pool.c1     = data.image[IDimHDRc1].array.F;
+        pool.c1w    = data.image[IDimHDRc1w].array.F;
+        pool.xbin   = (uint32_t *) malloc(sizeof(uint32_t) * xsize);
+        pool.ybin   = (uint32_t *) malloc(sizeof(uint32_t) * ysize);
+        pool.xcount = (uint32_t *) calloc(xsize1, sizeof(uint32_t));
+        pool.ycount = (uint32_t *) calloc(ysize1, sizeof(uint32_t));
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            float x       = 1.0 * ii / xsize;
+            pool.xbin[ii] = (uint32_t)(x * xsize1);
+            pool.xcount[pool.xbin[ii]]++;
+        }
+        for(uint32_t jj = 0; jj < ysize; jj++)
+        {
+            float y       = 1.0 * jj / ysize;
+            pool.ybin[jj] = (uint32_t)(y * ysize1);
+            pool.ycount[pool.ybin[jj]]++;
+        }
+    }
+
+    errno_t pass1status = hdr_pool_run(&pool, hdr_pass1_worker, nthreads);
+
+    free(pool.xbin);
+    free(pool.ybin);
+    free(pool.xcount);
+    free(pool.ycount);
+
+    if(pass1status != RETURN_SUCCESS)
+    {
+        hdr_pool_free(&pool);
+        return RETURN_FAILURE;
+    }
+
+    float *out      = NULL;
+    float *layerout = NULL;
+    float *ivarout  = NULL;
+
+    if(blend == HDR_BLEND_PYRAMID)
+    {
+        hdr_create_outputs(outimname,
+                           xsize,
+                           ysize,
+                           maps,
+                           &out,
+                           &layerout,
+                           &ivarout);
+        pool.out        = out;
+        pool.layerout   = layerout;
+        pool.ivarout    = ivarout;
+        pool.gain       = gain;
+        pool.rdnoise    = rdnoise;
+        pool.etimearray = etimearray;
+        errno_t status =
+            hdr_pyramid_blend(&pool, satvalue, nlevels, nthreads);
+        hdr_pool_free(&pool);
+        if(status != RETURN_SUCCESS)
+        {
+            return RETURN_FAILURE;
+        }
+        return hdr_save_outputs(outfname,
+                                out,
+                                layerout,
+                                ivarout,
+                                xsize,
+                                ysize);
+    }
+
+    {
+        printf("---------------- Convolve binned image ------------\n");
+        fflush(stdout);
+        int NBfiter = HDR_BIN_NBFITER;
+        for(uint32_t kk = 0; kk < zsize; kk++)
+        {
+            float *im1 =
+                data.image[IDimHDRc1].array.F + (long) kk * xsize1 * ysize1;
+            if(smoothmode == HDR_SMOOTH_ITER)
+            {
+                hdr_tap3_smooth(im1, xsize1, ysize1, NBfiter, NULL);
+            }
+            else
+            {
+                hdr_gauss_iir(im1,
+                              xsize1,
+                              ysize1,
+                              sqrt(HDR_TAP3_VAR * NBfiter));
+            }
+        }
+        printf("---------------- DONE ------------\n");
+        fflush(stdout);
+    }
+
+    //double alpha1 = 1.0;
+
+    // contruct layer image
+    imageID IDlayer;
+    create_2Dimage_ID("imlayer", xsize1, ysize1, &IDlayer);
+
+    imageID IDlayermin;
+    create_2Dimage_ID("imlayermin", xsize1, ysize1, &IDlayermin);
+
+    hdr_layermin(data.image[IDimHDRc1].array.F,
+                 xsize1 * ysize1,
+                 zsize,
+                 satvalue,
+                 data.image[IDlayermin].array.F);
+    memcpy(data.image[IDlayer].array.F,
+           data.image[IDlayermin].array.F,
+           sizeof(float) * xsize1 * ysize1);
+
+    {
+        printf("---------------- Convolve layer image ------------\n");
+        fflush(stdout);
+        int NBfiter = HDR_LAYER_NBFITER;
+        if(smoothmode == HDR_SMOOTH_ITER)
+        {
+            hdr_tap3_smooth(data.image[IDlayer].array.F,
+                            xsize1,
+                            ysize1,
+                            NBfiter,
+                            data.image[IDlayermin].array.F);
+        }
+        else
+        {
+            // Same total variance, clamped to the minimum layer per round
+            float sigma =
+                sqrt(HDR_TAP3_VAR * NBfiter / HDR_LAYER_CLAMPROUNDS);
+            for(int round = 0; round < HDR_LAYER_CLAMPROUNDS; round++)
+            {
+                hdr_gauss_iir(data.image[IDlayer].array.F,
+                              xsize1,
+                              ysize1,
+                              sigma);
+                for(uint32_t ij1 = 0; ij1 < xsize1 * ysize1; ij1++)
+                {
+                    if(data.image[IDlayer].array.F[ij1] <
+                            data.image[IDlayermin].array.F[ij1])
+                    {
+                        data.image[IDlayer].array.F[ij1] =
+                            data.image[IDlayermin].array.F[ij1];
+                    }
+                }
+            }
+        }
+        printf("---------------- DONE ------------\n");
+        fflush(stdout);
+    }
+
+    imageID IDlayerg;
+    if(smoothmode == HDR_SMOOTH_ITER)
+    {
+        gauss_filter("imlayer", "imlayerg", HDR_LAYERG_SIGMA, 150);
+        IDlayerg = image_ID("imlayerg");
+    }
+    else
+    {
+        create_2Dimage_ID("imlayerg", xsize1, ysize1, &IDlayerg);
+        memcpy(data.image[IDlayerg].array.F,
+               data.image[IDlayer].array.F,
+               sizeof(float) * xsize1 * ysize1);
+        hdr_gauss_iir(data.image[IDlayerg].array.F,
+                      xsize1,
+                      ysize1,
+                      HDR_LAYERG_SIGMA);
+    }
+
+    // construct HDR image
+    hdr_create_outputs(outimname,
+                       xsize,
+                       ysize,
+                       maps,
+                       &out,
+                       &layerout,
+                       &ivarout);
+
+    // Pass 2 (tiled): rows of the inputs are read per tile, only for the
+    // layers used by the tile, mapped pages released after the tile
+    pool.out        = out;
+    pool.layerout   = layerout;
+    pool.ivarout    = ivarout;
+    pool.gain       = gain;
+    pool.rdnoise    = rdnoise;
+    pool.layermap   = data.image[IDlayer].array.F;
+    pool.layermapg  = data.image[IDlayerg].array.F;
+    pool.etimearray = etimearray;
+    errno_t status = hdr_pool_run(&pool, hdr_compose_worker, nthreads);
+    hdr_pool_free(&pool);
+    if(status != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+
+    return hdr_save_outputs(outfname, out, layerout, ivarout, xsize, ysize);
+}
+
+errno_t combine_HDR_image(const char *__restrict flistname,
+                          float satvalue,
+                          float biasvalue,
+                          int   smoothmode,
+                          int   tiled,
+                          int   nthreads,
+                          int   binstep,
+                          int   blend,
+                          int   nlevels,
+                          int   maps,
+                          float gain,
+                          float rdnoise,
+                          uint32_t rawxsize,
+                          uint32_t rawysize,
+                          char *__restrict outimname,
+                          const char *__restrict outfname,
+                          const char *spooldir)
+{
+    HDR_FLIST flist;
+    if(hdr_flist_read(flistname, &flist) != RETURN_SUCCESS)
+    {
+        hdr_flist_free(&flist);
+        return RETURN_FAILURE;
+    }
+
+    errno_t status = hdr_combine(&flist,
+                                 satvalue,
+                                 biasvalue,
+                                 smoothmode,
+                                 tiled,
+                                 nthreads,
+                                 binstep,
+                                 blend,
+                                 nlevels,
+                                 maps,
+                                 gain,
+                                 rdnoise,
+                                 rawxsize,
+                                 rawysize,
+                                 outimname,
+                                 outfname,
+                                 spooldir);
+
+    hdr_flist_free(&flist);
+    return status;
+}
+
+static errno_t compute_function()
+{
+    DEBUG_TRACE_FSTART();
+    INSERT_STD_PROCINFO_COMPUTEFUNC_START
+
+    printf("satlevel  = %f\n", *satlevel);
     printf("biaslevel = %f\n", *biaslevel);
 
-    combine_HDR_image(flistname, *satlevel, *biaslevel, outimname);
+    printf("smoothmode = %d\n", *smoothmode);
+
+    combine_HDR_image(flistname,
+                      *satlevel,
+                      *biaslevel,
+                      *smoothmode,
+                      *tiledmode,
+                      *nthreads,
+                      *binstepparam,
+                      *blendmode,
+                      *nlevels,
+                      *mapsflag,
+                      *gainparam,
+                      *rdnoiseparam,
+                      *rawxsizeparam,
+                      *rawysizeparam,
+                      outimname,
+                      outfname,
+                      spooldir);
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_END
 
@@ -0,0 +1,59 @@
+#ifndef IMAGE_FORMAT_COMBINEHDR_KERNELS_H
+#define IMAGE_FORMAT_COMBINEHDR_KERNELS_H
+
+// Module-internal: not installed
+// Layer map steps of combineHDR, shared with the streaming HDR command
+
+// Variance (pix^2) added by one pass of the 0.3/0.4/0.3 filter
+#define HDR_TAP3_VAR 0.6
+
+// Smoothing of the binned exposures and of the layer map, in 3-tap passes
+#define HDR_BIN_NBFITER   5
+#define HDR_LAYER_NBFITER 500
+
+// Width (bins) of the smoothed layer map setting the output scaling
+#define HDR_LAYERG_SIGMA 50.0
+
+// Recursive mode: layer map smoothed in rounds, clamped after each round
+#define HDR_LAYER_CLAMPROUNDS 4
+
+void hdr_gauss_iir(float *im, uint32_t xsize, uint32_t ysize, float sigma);
+
+void hdr_bin_exposure(const float *pix,
+                      float        biasvalue,
+                      float       *pixout,
+                      float *__restrict c1,
+                      float *__restrict c1w,
+                      const uint32_t *xbin,
+                      const uint32_t *ybin,
+                      const uint32_t *xcount,
+                      const uint32_t *ycount,
+                      uint32_t        xsize,
+                      uint32_t        ysize,
+                      uint32_t        xsize1,
+                      uint32_t        ysize1);
+
+void hdr_layermin(const float *__restrict c1,
+                  uint32_t n1,
+                  uint32_t zsize,
+                  float    satvalue,
+                  float *__restrict layermin);
+
+void hdr_compose_rows(float *__restrict out,
+                      float *__restrict layerout,
+                      float *__restrict ivarout,
+                      const float *const *layers,
+                      const float *__restrict layermap,
+                      const float *__restrict layermapg,
+                      const float *etimearray,
+                      float        gain,
+                      float        rdnoise,
+                      uint32_t     xsize,
+                      uint32_t     ysize,
+                      uint32_t     xsize1,
+                      uint32_t     ysize1,
+                      uint32_t     zsize,
+                      uint32_t     jjstart,
+                      uint32_t     jjend);
+
+#endif // IMAGE_FORMAT_COMBINEHDR_KERNELS_H
@@ -5,6 +5,8 @@
 
 #include "COREMOD_memory/COREMOD_memory.h"
 
+#include "rawbayer_cfa.h"
+
 
 
 
@@ -23,6 +25,9 @@ static long  fpi_outimG2;
 static char *outimB;
 static long  fpi_outimB;
 
+static char *cfaspec;
+static long  fpi_cfaspec;
+
 
 
 
@@ -70,6 +75,15 @@ static CLICMDARGDEF farg[] = {{
         CLIARG_VISIBLE_DEFAULT,
         (void **) &outimB,
         &fpi_outimB
+    },
+    {
+        CLIARG_STR,
+        ".cfa",
+        "CFA pattern[,x,y], auto: keywords",
+        "auto",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &cfaspec,
+        &fpi_cfaspec
     }
 };
 
@@ -102,15 +116,29 @@ static errno_t help_function()
 //
 // separates a single RGB image into its 4 channels
 // output written in im_r, im_g1, im_g2 and im_b
+// G1 is the G site of the even rows, G2 of the odd rows
 //
-errno_t image_format_extract_RGGBchan(
-    IMGID imgin, IMGID imgoutR, IMGID imgoutG1, IMGID imgoutG2, IMGID imgoutB)
+errno_t image_format_extract_RGGBchan(IMGID       imgin,
+                                      IMGID       imgoutR,
+                                      IMGID       imgoutG1,
+                                      IMGID       imgoutG2,
+                                      IMGID       imgoutB,
+                                      const char *cfa_spec)
 {
     DEBUG_TRACE_FSTART();
 
     // input image is required
     resolveIMGID(&imgin, ERRMODE_ABORT);
 
+    RAWBAYER_CFA cfa;
+    if(rawbayer_cfa_resolve(cfa_spec, imgin, &cfa) != RETURN_SUCCESS)
+    {
+        PRINT_WARNING("assuming GBRG");
+        cfa.pattern = RAWBAYER_CFA_GBRG;
+        cfa.xoffset = 0;
+        cfa.yoffset = 0;
+    }
+
 
 
     copyIMGID(&imgin, &imgoutR);
@@ -128,6 +156,34 @@ errno_t image_format_extract_RGGBchan(
 
     uint32_t xsize = imgin.size[0];
 
+    // input offset of each channel from the top left pixel of its 2x2 cell
+    int      layout[2][2];
+    uint64_t offR = 0, offG1 = 0, offG2 = 0, offB = 0;
+    rawbayer_cfa_layout(&cfa, layout);
+    for(int py = 0; py < 2; py++)
+        for(int px = 0; px < 2; px++)
+        {
+            uint64_t off = py * xsize + px;
+            switch(layout[py][px])
+            {
+            case 0:
+                offR = off;
+                break;
+            case 2:
+                offB = off;
+                break;
+            default:
+                if(py == 0)
+                {
+                    offG1 = off;
+                }
+                else
+                {
+                    offG2 = off;
+                }
+            }
+        }
+
     list_image_ID();
 
 
@@ -144,13 +200,13 @@ errno_t image_format_extract_RGGBchan(
                     uint64_t pixi = jj * imgoutR.size[0] + ii;
 
                     imgoutR.im->array.F[pixi] =
-                        imgin.im->array.F[(jj1 + 1) * xsize + ii1];
+                        imgin.im->array.F[jj1 * xsize + ii1 + offR];
                     imgoutG1.im->array.F[pixi] =
-                        imgin.im->array.F[jj1 * xsize + ii1];
+                        imgin.im->array.F[jj1 * xsize + ii1 + offG1];
                     imgoutG2.im->array.F[pixi] =
-                        imgin.im->array.F[(jj1 + 1) * xsize + (ii1 + 1)];
+                        imgin.im->array.F[jj1 * xsize + ii1 + offG2];
                     imgoutB.im->array.F[pixi] =
-                        imgin.im->array.F[jj1 * xsize + (ii1 + 1)];
+                        imgin.im->array.F[jj1 * xsize + ii1 + offB];
                 }
             break;
 
@@ -163,13 +219,13 @@ errno_t image_format_extract_RGGBchan(
                     uint64_t pixi = jj * imgoutR.size[0] + ii;
 
                     imgoutR.im->array.D[pixi] =
-                        imgin.im->array.D[(jj1 + 1) * xsize + ii1];
+                        imgin.im->array.D[jj1 * xsize + ii1 + offR];
                     imgoutG1.im->array.D[pixi] =
-                        imgin.im->array.D[jj1 * xsize + ii1];
+                        imgin.im->array.D[jj1 * xsize + ii1 + offG1];
                     imgoutG2.im->array.D[pixi] =
-                        imgin.im->array.D[(jj1 + 1) * xsize + (ii1 + 1)];
+                        imgin.im->array.D[jj1 * xsize + ii1 + offG2];
                     imgoutB.im->array.D[pixi] =
-                        imgin.im->array.D[jj1 * xsize + (ii1 + 1)];
+                        imgin.im->array.D[jj1 * xsize + ii1 + offB];
                 }
             break;
 
@@ -183,13 +239,13 @@ errno_t image_format_extract_RGGBchan(
                     uint64_t pixi = jj * imgoutR.size[0] + ii;
 
                     imgoutR.im->array.UI16[pixi] =
-                        imgin.im->array.UI16[(jj1 + 1) * xsize + ii1];
+                        imgin.im->array.UI16[jj1 * xsize + ii1 + offR];
                     imgoutG1.im->array.UI16[pixi] =
-                        imgin.im->array.UI16[jj1 * xsize + ii1];
+                        imgin.im->array.UI16[jj1 * xsize + ii1 + offG1];
                     imgoutG2.im->array.UI16[pixi] =
-                        imgin.im->array.UI16[(jj1 + 1) * xsize + (ii1 + 1)];
+                        imgin.im->array.UI16[jj1 * xsize + ii1 + offG2];
                     imgoutB.im->array.UI16[pixi] =
-                        imgin.im->array.UI16[jj1 * xsize + (ii1 + 1)];
+                        imgin.im->array.UI16[jj1 * xsize + ii1 + offB];
                 }
             break;
     }
@@ -219,7 +275,8 @@ static errno_t compute_function()
                                   mkIMGID_from_name(outimR),
                                   mkIMGID_from_name(outimG1),
                                   mkIMGID_from_name(outimG2),
-                                  mkIMGID_from_name(outimB));
+                                  mkIMGID_from_name(outimB),
+                                  cfaspec);
 
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_END
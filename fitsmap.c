@@ -0,0 +1,323 @@
+/**
+ * @file    fitsmap.c
+ * @brief   Memory-mapped image file reader
+ *
+ * Uncompressed 2D FITS files (BITPIX 8, 16, 32, -32, -64, with BZERO/BSCALE)
+ * and raw native float32 files (.raw, .bin) are memory mapped and converted
+ * row by row, without an image table slot. Other files (compressed FITS...)
+ * are left to load_fits.
+ *
+ * Mapped pages are file-backed: rows already read can be released to bound
+ * the resident size when streaming through large files.
+ */
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "fitsmap.h"
+
+#define FITSMAP_BLOCK 2880
+
+static int fitsmap_has_suffix(const char *fname, const char *suffix)
+{
+    size_t n  = strlen(fname);
+    size_t ns = strlen(suffix);
+    return (n >= ns) && (strcmp(fname + n - ns, suffix) == 0);
+}
+
+// Raw native float32 file, by name
+int fitsmap_israw(const char *fname)
+{
+    return fitsmap_has_suffix(fname, ".raw") ||
+           fitsmap_has_suffix(fname, ".bin");
+}
+
+/*
+Primary header of a mapped FITS file
+Returns 0 if the primary HDU is a 2D image this reader handles
+*/
+static int fitsmap_header(FITSMAP *fm)
+{
+    const char *map = (const char *) fm->map;
+    if(fm->maplen < FITSMAP_BLOCK || strncmp(map, "SIMPLE  =", 9) != 0)
+    {
+        return 1;
+    }
+
+    long   naxis   = -1;
+    long   naxis1  = 0;
+    long   naxis2  = 0;
+    long   naxis3  = 1;
+    size_t hdrsize = 0;
+    fm->bitpix     = 0;
+    fm->bzero      = 0.0;
+    fm->bscale     = 1.0;
+
+    for(size_t off = 0; off + 80 <= fm->maplen; off += 80)
+    {
+        const char *card = map + off;
+        if(strncmp(card, "END     ", 8) == 0)
+        {
+            hdrsize = (off / FITSMAP_BLOCK + 1) * FITSMAP_BLOCK;
+            break;
+        }
+        if(strncmp(card + 8, "= ", 2) != 0)
+        {
+            continue;
+        }
+        char value[71];
+        memcpy(value, card + 10, 70);
+        value[70] = '\0';
+
+        if(strncmp(card, "BITPIX  ", 8) == 0)
+        {
+            fm->bitpix = strtol(value, NULL, 10);
+        }
+        else if(strncmp(card, "NAXIS   ", 8) == 0)
+        {
+            naxis = strtol(value, NULL, 10);
+        }
+        else if(strncmp(card, "NAXIS1  ", 8) == 0)
+        {
+            naxis1 = strtol(value, NULL, 10);
+        }
+        else if(strncmp(card, "NAXIS2  ", 8) == 0)
+        {
+            naxis2 = strtol(value, NULL, 10);
+        }
+        else if(strncmp(card, "NAXIS3  ", 8) == 0)
+        {
+            naxis3 = strtol(value, NULL, 10);
+        }
+        else if(strncmp(card, "BZERO   ", 8) == 0)
+        {
+            fm->bzero = strtod(value, NULL);
+        }
+        else if(strncmp(card, "BSCALE  ", 8) == 0)
+        {
+            fm->bscale = strtod(value, NULL);
+        }
+    }
+
+    int bytepix = abs(fm->bitpix) / 8;
+    if(hdrsize == 0 || !(naxis == 2 || (naxis == 3 && naxis3 == 1)) ||
+            naxis1 <= 0 || naxis2 <= 0 ||
+            !(fm->bitpix == 8 || fm->bitpix == 16 || fm->bitpix == 32 ||
+              fm->bitpix == -32 || fm->bitpix == -64) ||
+            hdrsize + (size_t) naxis1 * naxis2 * bytepix > fm->maplen)
+    {
+        return 1;
+    }
+
+    fm->xsize  = naxis1;
+    fm->ysize  = naxis2;
+    fm->pixels = map + hdrsize;
+
+    return 0;
+}
+
+/**
+ * @brief Map image file fname
+ *
+ * Raw files must be float32 xsize x ysize. Returns RETURN_SUCCESS with
+ * fm->map NULL if the file is a valid candidate for load_fits only
+ * (compressed FITS, extensions...).
+ */
+errno_t fitsmap_open(const char *fname,
+                     uint32_t    xsize,
+                     uint32_t    ysize,
+                     FITSMAP    *fm)
+{
+    memset(fm, 0, sizeof(FITSMAP));
+    fm->raw = fitsmap_israw(fname);
+
+    int fd = open(fname, O_RDONLY);
+    if(fd == -1)
+    {
+        PRINT_ERROR("cannot open %s", fname);
+        return RETURN_FAILURE;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        fm->maplen = st.st_size;
+        fm->map    = mmap(NULL, fm->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(fm->map == MAP_FAILED)
+        {
+            fm->map = NULL;
+        }
+    }
+    close(fd); // mapping stays valid
+
+    if(fm->map == NULL)
+    {
+        if(fm->raw)
+        {
+            PRINT_ERROR("cannot map %s", fname);
+            return RETURN_FAILURE;
+        }
+        return RETURN_SUCCESS;
+    }
+
+    madvise(fm->map, fm->maplen, MADV_SEQUENTIAL);
+    if(fm->raw)
+    {
+        if(xsize == 0 || ysize == 0 ||
+                fm->maplen != sizeof(float) * xsize * ysize)
+        {
+            PRINT_ERROR("%s: %zu bytes, expected float32 %u x %u",
+                        fname,
+                        fm->maplen,
+                        xsize,
+                        ysize);
+            fitsmap_close(fm);
+            return RETURN_FAILURE;
+        }
+        fm->bitpix = -32;
+        fm->xsize  = xsize;
+        fm->ysize  = ysize;
+        fm->pixels = (const char *) fm->map;
+        return RETURN_SUCCESS;
+    }
+
+    if(fitsmap_header(fm) != 0)
+    {
+        fitsmap_close(fm);
+    }
+
+    return RETURN_SUCCESS;
+}
+
+void fitsmap_close(FITSMAP *fm)
+{
+    if(fm->map != NULL)
+    {
+        munmap(fm->map, fm->maplen);
+        fm->map = NULL;
+    }
+}
+
+// Row jj, as float
+void fitsmap_row(const FITSMAP *fm, uint32_t jj, float *row)
+{
+    uint32_t    xsize = fm->xsize;
+    const char *src =
+        fm->pixels + (size_t) jj * xsize * (abs(fm->bitpix) / 8);
+
+    if(fm->raw)
+    {
+        memcpy(row, src, sizeof(float) * xsize);
+        return;
+    }
+
+    // FITS data are big-endian
+    float bzero  = fm->bzero;
+    float bscale = fm->bscale;
+    switch(fm->bitpix)
+    {
+    case 8:
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            row[ii] = bzero + bscale * ((const uint8_t *) src)[ii];
+        }
+        break;
+    case 16:
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            uint16_t v;
+            memcpy(&v, src + 2 * ii, 2);
+            row[ii] = bzero + bscale * (int16_t) ntohs(v);
+        }
+        break;
+    case 32:
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            uint32_t v;
+            memcpy(&v, src + 4 * ii, 4);
+            row[ii] = bzero + bscale * (int32_t) ntohl(v);
+        }
+        break;
+    case -32:
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            uint32_t v;
+            float    f;
+            memcpy(&v, src + 4 * ii, 4);
+            v = ntohl(v);
+            memcpy(&f, &v, 4);
+            row[ii] = bzero + bscale * f;
+        }
+        break;
+    case -64:
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            uint64_t v;
+            double   d;
+            memcpy(&v, src + 8 * ii, 8);
+            v = be64toh(v);
+            memcpy(&d, &v, 8);
+            row[ii] = bzero + bscale * d;
+        }
+        break;
+    }
+}
+
+/*
+Drop the mapped pages of rows jj0 to jj1 (excluded) from the resident set
+Pages are file-backed: a later read faults them back in
+*/
+void fitsmap_release(const FITSMAP *fm, uint32_t jj0, uint32_t jj1)
+{
+    size_t rowbytes = (size_t) fm->xsize * (abs(fm->bitpix) / 8);
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t start    = (fm->pixels - (const char *) fm->map) + jj0 * rowbytes;
+    size_t end      = (fm->pixels - (const char *) fm->map) + jj1 * rowbytes;
+
+    start -= start % pagesize;
+    if(end > fm->maplen)
+    {
+        end = fm->maplen;
+    }
+    if(end > start)
+    {
+        madvise((char *) fm->map + start, end - start, MADV_DONTNEED);
+    }
+}
+
+/*
+Unlinked spool file for the frames that cannot be mapped, in spooldir
+("auto": $TMPDIR, else /var/tmp). The directory must be on disk: on a tmpfs
+the spooled frames would be held in memory.
+Returns the file descriptor, -1 on error
+*/
+int fitsmap_spool_open(const char *spooldir, const char *prefix)
+{
+    const char *dir = spooldir;
+    if(strcmp(dir, "auto") == 0)
+    {
+        dir = getenv("TMPDIR");
+        if(dir == NULL || dir[0] == '\0')
+        {
+            dir = "/var/tmp";
+        }
+    }
+
+    char fname[STRINGMAXLEN_FULLFILENAME];
+    snprintf(fname, STRINGMAXLEN_FULLFILENAME, "%s/%sXXXXXX", dir, prefix);
+    int fd = mkstemp(fname);
+    if(fd == -1)
+    {
+        PRINT_ERROR("cannot create spool file %s", fname);
+        return -1;
+    }
+    // File is removed on close
+    unlink(fname);
+
+    return fd;
+}
@@ -0,0 +1,35 @@
+#ifndef IMAGE_FORMAT_FITSMAP_H
+#define IMAGE_FORMAT_FITSMAP_H
+
+// Module-internal: not installed
+
+// Memory-mapped 2D image file, read row by row
+typedef struct
+{
+    int         raw; // native float32, no header
+    void       *map; // NULL if the file cannot be mapped
+    size_t      maplen;
+    const char *pixels; // first data byte
+    int         bitpix;
+    double      bzero;
+    double      bscale;
+    uint32_t    xsize;
+    uint32_t    ysize;
+} FITSMAP;
+
+int fitsmap_israw(const char *fname);
+
+errno_t fitsmap_open(const char *fname,
+                     uint32_t    xsize,
+                     uint32_t    ysize,
+                     FITSMAP    *fm);
+
+void fitsmap_close(FITSMAP *fm);
+
+void fitsmap_row(const FITSMAP *fm, uint32_t jj, float *row);
+
+void fitsmap_release(const FITSMAP *fm, uint32_t jj0, uint32_t jj1);
+
+int fitsmap_spool_open(const char *spooldir, const char *prefix);
+
+#endif // IMAGE_FORMAT_FITSMAP_H
@@ -16,10 +16,16 @@
 #include "FITS_to_ushortintbin_lock.h"
 #include "combineHDR.h"
 #include "stream_temporal_stats.h"
+#include "stream_temporal_psd.h"
+#include "stream_HDR.h"
+#include "stream_debayer.h"
 #include "extract_RGGBchan.h"
 #include "extract_utr.h"
 #include "imtoASCII.h"
 #include "loadCR2toFITSRGB.h"
+#include "mastercal_combine.h"
+#include "rawbayer_cfa.h"
+#include "rawbayer_demosaic.h"
 #include "read_binary32f.h"
 #include "writeBMP.h"
 
@@ -48,6 +54,11 @@ static errno_t init_module_CLI()
     CLIADDCMD_image_format__combineHDR();
     CLIADDCMD_image_format__cred_cds_utr();
     CLIADDCMD_image_format__temporal_stats();
+    CLIADDCMD_image_format__temporal_psd();
+    CLIADDCMD_image_format__mkmastercal();
+    CLIADDCMD_image_format__streamHDR();
+    CLIADDCMD_image_format__demosaic();
+    CLIADDCMD_image_format__streamdebayer();
 
     imtoASCII_addCLIcmd();
 
@@ -364,20 +375,22 @@ long CR2toFITS_strfilter(
 
 //
 // assembles 4 channels into a single image (inverse operation of routine above)
+// G1 is the G site of the even rows, G2 of the odd rows
 //
 imageID image_format_reconstruct_from_RGGBchan(
     const char *IDr_name,
     const char *IDg1_name,
     const char *IDg2_name,
     const char *IDb_name,
-    const char *IDout_name
+    const char *IDout_name,
+    const RAWBAYER_CFA *cfa
 )
 {
     imageID ID;
     imageID IDr, IDg1, IDg2, IDb;
     long xsize1, ysize1, xsize2, ysize2;
     long ii1, jj1;
-    int RGBmode = 0;
+    int layout[2][2];
     imageID ID00, ID01, ID10, ID11;
 
 
@@ -391,36 +404,12 @@ imageID image_format_reconstruct_from_RGGBchan(
     xsize2 = 2 * xsize1;
     ysize2 = 2 * ysize1;
 
-    if((xsize2 == 4770) && (ysize2 == 3178))
-    {
-        RGBmode = 1;
-    }
-    if((xsize2 == 5202) && (ysize2 == 3465))
-    {
-        RGBmode = 2;
-    }
-
-    if(RGBmode == 0)
-    {
-        PRINT_ERROR("Unknown RGB image mode\n");
-        exit(0);
-    }
-
-    if(RGBmode == 1) // GBRG
-    {
-        ID00 = IDg1;
-        ID10 = IDb;
-        ID01 = IDr;
-        ID11 = IDg2;
-    }
-
-    if(RGBmode == 2)
-    {
-        ID00 = IDr;
-        ID10 = IDg1;
-        ID01 = IDg2;
-        ID11 = IDb;
-    }
+    // channel of each CFA phase
+    rawbayer_cfa_layout(cfa, layout);
+    ID00 = (layout[0][0] == 0) ? IDr : ((layout[0][0] == 2) ? IDb : IDg1);
+    ID10 = (layout[0][1] == 0) ? IDr : ((layout[0][1] == 2) ? IDb : IDg1);
+    ID01 = (layout[1][0] == 0) ? IDr : ((layout[1][0] == 2) ? IDb : IDg2);
+    ID11 = (layout[1][1] == 0) ? IDr : ((layout[1][1] == 2) ? IDb : IDg2);
 
     ID = create_2Dimage_ID(IDout_name, xsize2, ysize2);
 
@@ -12,8 +12,15 @@ void __attribute__((constructor)) libinit_image_format();
 #include "image_format/extract_utr.h"
 #include "image_format/imtoASCII.h"
 #include "image_format/loadCR2toFITSRGB.h"
+#include "image_format/mastercal_combine.h"
+#include "image_format/rawbayer_calib.h"
+#include "image_format/rawbayer_cfa.h"
+#include "image_format/rawbayer_demosaic.h"
 #include "image_format/readPGM.h"
 #include "image_format/read_binary32f.h"
+#include "image_format/stream_HDR.h"
+#include "image_format/stream_debayer.h"
+#include "image_format/stream_temporal_psd.h"
 #include "image_format/stream_temporal_stats.h"
 #include "image_format/writeBMP.h"
 
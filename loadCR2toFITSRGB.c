@@ -6,13 +6,12 @@
 #include "COREMOD_memory/COREMOD_memory.h"
 
 #include "FITStorgbFITSsimple.h"
+#include "rawbayer_cfa.h"
 #include "readPGM.h"
 
 static int CR2toFITS_NORM = 0;
 // 1 if FITS should be normalized to ISO = 1, exposure = 1 sec, and F/1.0
 
-static float FLUXFACTOR = 1.0;
-
 // ==========================================
 // Forward declaration(s)
 // ==========================================
@@ -20,7 +19,9 @@ static float FLUXFACTOR = 1.0;
 errno_t loadCR2toFITSRGB(const char *__restrict fnameCR2,
                          const char *__restrict fnameFITSr,
                          const char *__restrict fnameFITSg,
-                         const char *__restrict fnameFITSb);
+                         const char *__restrict fnameFITSb,
+                         const RAWBAYER_RGB_OPTS *opt,
+                         RAWBAYER_RGB_CTX        *ctx);
 
 // ==========================================
 // Command line interface wrapper function(s)
@@ -32,11 +33,17 @@ static errno_t IMAGE_FORMAT_loadCR2toFITSRGB_cli()
             CLI_checkarg(4, 3) ==
             0)
     {
-        loadCR2toFITSRGB(data.cmdargtoken[1].val.string,
-                         data.cmdargtoken[2].val.string,
-                         data.cmdargtoken[3].val.string,
-                         data.cmdargtoken[4].val.string);
-        return RETURN_SUCCESS;
+        // calibration maps are kept across calls
+        static RAWBAYER_RGB_CTX ctx = RAWBAYER_RGB_CTX_INIT;
+        RAWBAYER_RGB_OPTS       opt = RAWBAYER_RGB_OPTS_DEFAULT;
+        rawbayer_rgb_opts_CLIvariables(&opt);
+
+        return loadCR2toFITSRGB(data.cmdargtoken[1].val.string,
+                                data.cmdargtoken[2].val.string,
+                                data.cmdargtoken[3].val.string,
+                                data.cmdargtoken[4].val.string,
+                                &opt,
+                                &ctx);
     }
     else
     {
@@ -64,123 +71,208 @@ errno_t loadCR2toFITSRGB_addCLIcmd()
     return RETURN_SUCCESS;
 }
 
-// assumes dcraw is installed
-errno_t loadCR2toFITSRGB(const char *__restrict fnameCR2,
-                         const char *__restrict fnameFITSr,
-                         const char *__restrict fnameFITSg,
-                         const char *__restrict fnameFITSb)
+// Metadata of a CR2 file, from a single dcraw -i -v pass
+// Exposure values not found are left at 0, hascfa is 0 without a filter
+// pattern
+typedef struct
+{
+    float        iso;
+    float        shutter;
+    float        aperture;
+    int          hascfa;
+    RAWBAYER_CFA cfa;
+} CR2_METADATA;
+
+static errno_t CR2_metadata(const char *__restrict fnameCR2,
+                            CR2_METADATA *meta)
 {
-    EXECUTE_SYSTEM_COMMAND("dcraw -t 0 -D -4 -c %s > _tmppgm.pgm", fnameCR2);
+    char  command[STRINGMAXLEN_FULLFILENAME + 32];
+    char  line[200];
+    FILE *fp;
 
-    read_PGMimage("_tmppgm.pgm", "tmpfits1");
-    //  r = system("rm _tmppgm.pgm");
+    memset(meta, 0, sizeof(CR2_METADATA));
 
-    if(CR2toFITS_NORM == 1)
+    snprintf(command, sizeof(command), "dcraw -i -v \"%s\"", fnameCR2);
+    if((fp = popen(command, "r")) == NULL)
+    {
+        PRINT_ERROR("popen failed: %s", command);
+        return RETURN_FAILURE;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL)
     {
-        FILE *fp;
-        float iso;
-        float shutter;
-        float aperture;
-        //imageID ID;
-        //long xsize,ysize;
-
-        EXECUTE_SYSTEM_COMMAND(
-            "dcraw -i -v %s | grep \"ISO speed\"| awk '{print $3}' > "
-            "iso_tmp.txt",
-            fnameCR2);
-
-        if((fp = fopen("iso_tmp.txt", "r")) == NULL)
+        float num, den;
+
+        sscanf(line, "ISO speed: %f", &meta->iso);
+        sscanf(line, "Aperture: f/%f", &meta->aperture);
+        // "Shutter: 1/250.0 sec" or "Shutter: 2.0 sec"
+        if(sscanf(line, "Shutter: %f/%f", &num, &den) == 2)
         {
-            PRINT_ERROR("Cannot open file");
+            meta->shutter = num / den;
         }
-        if(fscanf(fp, "%f\n", &iso) != 1)
+        else if(sscanf(line, "Shutter: %f", &num) == 1)
         {
-            PRINT_ERROR("fscanf returns value != 1");
+            meta->shutter = num;
         }
-        fclose(fp);
-
-        if(system("rm iso_tmp.txt") != 0)
+        if(strncmp(line, "Filter pattern:", 15) == 0)
         {
-            PRINT_ERROR("system() returns non-zero value");
+            meta->hascfa =
+                (rawbayer_cfa_from_dcraw(line + 15, &meta->cfa) ==
+                 RETURN_SUCCESS);
         }
-        printf("iso = %f\n", iso);
-
-        EXECUTE_SYSTEM_COMMAND(
-            "dcraw -i -v %s | grep \"Shutter\"| awk '{print $2}' > "
-            "shutter_tmp.txt",
-            fnameCR2);
+    }
+    pclose(fp);
 
-        if((fp = fopen("shutter_tmp.txt", "r")) == NULL)
-        {
-            PRINT_ERROR("Cannot open file");
-        }
+    return RETURN_SUCCESS;
+}
 
-        if(fscanf(fp, "%f\n", &shutter) != 1)
-        {
-            PRINT_ERROR("fscanf returns value != 1");
-        }
-        fclose(fp);
+// Exposure normalization to ISO = 1, exposure = 1 sec, and F/1.0
+// 1 if the metadata are incomplete
+static float CR2_fluxfactor(const char *__restrict fnameCR2,
+                            const CR2_METADATA *meta)
+{
+    printf("iso = %f\n", meta->iso);
+    printf("shutter = %f\n", meta->shutter);
+    printf("aperture = %f\n", meta->aperture);
 
-        if(system("rm shutter_tmp.txt") != 0)
-        {
-            PRINT_ERROR("system() returns non-zero value");
-        }
-        printf("shutter = %f\n", shutter);
+    if((meta->iso <= 0.0) || (meta->shutter <= 0.0) ||
+            (meta->aperture <= 0.0))
+    {
+        PRINT_WARNING("%s: missing exposure metadata, flux factor 1",
+                      fnameCR2);
+        return 1.0;
+    }
+    return meta->aperture * meta->aperture / (meta->shutter * meta->iso);
+}
 
-        EXECUTE_SYSTEM_COMMAND(
-            "dcraw -i -v %s | grep \"Aperture\"| awk '{print $2}' > "
-            "aperture_tmp.txt",
-            fnameCR2);
+// Reads the raw frame of a CR2 file into a newly allocated array, to be
+// freed by the caller. Completes opt from the file metadata: CFA pattern if
+// RAWBAYER_CFA_AUTO, flux factor if CR2toFITS_NORM.
+// assumes dcraw is installed
+errno_t CR2_read(const char *__restrict fnameCR2,
+                 RAWBAYER_RGB_OPTS *opt,
+                 float            **raw,
+                 long              *xsize,
+                 long              *ysize)
+{
+    char  command[STRINGMAXLEN_FULLFILENAME + 32];
+    FILE *fp;
+
+    snprintf(command,
+             sizeof(command),
+             "dcraw -t 0 -D -4 -c \"%s\"",
+             fnameCR2);
+    if((fp = popen(command, "r")) == NULL)
+    {
+        PRINT_ERROR("popen failed: %s", command);
+        return RETURN_FAILURE;
+    }
+    errno_t status = read_PGMstream(fp, raw, xsize, ysize);
+    pclose(fp);
+    if(status != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
 
-        if((fp = fopen("aperture_tmp.txt", "r")) == NULL)
+    int needcfa = (opt->cfa.pattern == RAWBAYER_CFA_AUTO);
+    if(needcfa || (CR2toFITS_NORM == 1))
+    {
+        CR2_METADATA meta;
+        if(CR2_metadata(fnameCR2, &meta) != RETURN_SUCCESS)
         {
-            PRINT_ERROR("Cannot open file");
+            free(*raw);
+            return RETURN_FAILURE;
         }
-        if(fscanf(fp, "f/%f\n", &aperture) != 1)
+        if(needcfa)
         {
-            PRINT_ERROR("fscanf returns value != 1");
+            if(!meta.hascfa)
+            {
+                PRINT_ERROR("%s: no CFA pattern in metadata", fnameCR2);
+                free(*raw);
+                return RETURN_FAILURE;
+            }
+            opt->cfa = meta.cfa;
+            // the PGM reader flips rows
+            opt->cfa.yoffset = (*ysize - 1) & 1;
         }
-        fclose(fp);
-
-        if(system("rm aperture_tmp.txt") != 0)
+        if(CR2toFITS_NORM == 1)
         {
-            PRINT_ERROR("system() returns non-zero value");
+            opt->fluxfactor = CR2_fluxfactor(fnameCR2, &meta);
         }
-        printf("aperture = %f\n", aperture);
+    }
+    printf("FLUXFACTOR = %g\n", opt->fluxfactor);
 
-        //ID = image_ID("tmpfits1");
-        //        xsize = data.image[ID].md[0].size[0];
-        //        ysize = data.image[ID].md[0].size[1];
+    return RETURN_SUCCESS;
+}
 
-        FLUXFACTOR = aperture * aperture / (shutter * iso);
-    }
-    else
+// Loads a CR2 file into R, G and B images
+// opt: NULL for defaults
+// ctx: calibration maps, kept by the caller across calls
+errno_t loadCR2toFITSRGB(const char *__restrict fnameCR2,
+                         const char *__restrict fnameFITSr,
+                         const char *__restrict fnameFITSg,
+                         const char *__restrict fnameFITSb,
+                         const RAWBAYER_RGB_OPTS *opt,
+                         RAWBAYER_RGB_CTX        *ctx)
+{
+    RAWBAYER_RGB_OPTS frame_opt = RAWBAYER_RGB_OPTS_DEFAULT;
+    float            *raw;
+    long              xsize, ysize;
+
+    if(opt != NULL)
     {
-        FLUXFACTOR = 1.0;
+        frame_opt = *opt;
     }
 
-    printf("FLUXFACTOR = %g\n", FLUXFACTOR);
-
-    if(variable_ID("RGBfullres") == -1)
+    if(CR2_read(fnameCR2, &frame_opt, &raw, &xsize, &ysize) != RETURN_SUCCESS)
     {
-        convert_rawbayerFITStorgbFITS_simple("tmpfits1",
-                                             fnameFITSr,
-                                             fnameFITSg,
-                                             fnameFITSb,
-                                             1);
+        return RETURN_FAILURE;
     }
-    else
+
+    if(frame_opt.fast == 0)
     {
-        convert_rawbayerFITStorgbFITS_simple("tmpfits1",
-                                             fnameFITSr,
-                                             fnameFITSg,
-                                             fnameFITSb,
-                                             0);
+        if(rawbayer_rgb_ctx_update(ctx, xsize, ysize, &frame_opt.cfa) !=
+                RETURN_SUCCESS)
+        {
+            free(raw);
+            return RETURN_FAILURE;
+        }
     }
 
-    delete_image_ID("tmpfits1", DELETE_IMAGE_ERRMODE_WARNING);
+    long xsize1 = (frame_opt.sampling == 0) ? xsize : xsize / 2;
+    long ysize1 = (frame_opt.sampling == 0) ? ysize : ysize / 2;
 
-    FLUXFACTOR = 1.0;
+    const char *outname[3] = {fnameFITSr, fnameFITSg, fnameFITSb};
+    float      *out[3];
+    for(int k = 0; k < 3; k++)
+    {
+        imageID IDout;
+        if(image_ID(outname[k]) != -1)
+        {
+            delete_image_ID(outname[k], DELETE_IMAGE_ERRMODE_WARNING);
+        }
+        create_2Dimage_ID(outname[k], xsize1, ysize1, &IDout);
+        out[k] = data.image[IDout].array.F;
+    }
+
+    long    cnt;
+    errno_t status = rawbayer_rgb_convert(ctx,
+                                          &frame_opt,
+                                          raw,
+                                          xsize,
+                                          ysize,
+                                          out[0],
+                                          out[1],
+                                          out[2],
+                                          &cnt);
+    free(raw);
+    if(status != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+    if(frame_opt.fast == 0)
+    {
+        printf("%ld hot pixels removed\n", cnt);
+    }
 
     return RETURN_SUCCESS;
 }
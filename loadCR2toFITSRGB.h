@@ -1,9 +1,19 @@
 /** @file loadCR2toFITSRGB.h
  */
 
+#include "FITStorgbFITSsimple.h"
+
 errno_t loadCR2toFITSRGB_addCLIcmd();
 
+errno_t CR2_read(const char *__restrict fnameCR2,
+                 RAWBAYER_RGB_OPTS *opt,
+                 float            **raw,
+                 long              *xsize,
+                 long              *ysize);
+
 errno_t loadCR2toFITSRGB(const char *__restrict fnameCR2,
                          const char *__restrict fnameFITSr,
                          const char *__restrict fnameFITSg,
-                         const char *__restrict fnameFITSb);
+                         const char *__restrict fnameFITSb,
+                         const RAWBAYER_RGB_OPTS *opt,
+                         RAWBAYER_RGB_CTX        *ctx);
@@ -0,0 +1,964 @@
+/**
+ * @file    mastercal_combine.c
+ * @brief   Robust combine of N frames into a master bias, dark or flat
+ *
+ * Frames come from a stream (the next N frames written to it) or from a
+ * file list (one FITS file name per line). Uncompressed FITS files are
+ * memory mapped and read in place. Stream frames and other files are
+ * converted to float and spooled to an unlinked temporary file, on disk.
+ *
+ * Bands are then combined in parallel: each thread reads one row band of
+ * the N frames, transposes it pixel-major (N values contiguous per pixel)
+ * and combines every pixel. Only one band of N frames per thread is in
+ * memory, bands rows being sized from a memory budget.
+ *
+ * Combine methods:
+ *   0: median
+ *   1: sigma-clipped mean (iterative, first center is the median)
+ *
+ * Input: stream name or file list name (string)
+ * Input: number of frames (int), required for a stream, <= 0 for the
+ *        whole file list
+ * Input: method (int)
+ * Input: clipping threshold in sigma (float), method 1
+ * Input: clipping iterations (int), method 1
+ * Input: normalize flag (int), divide master by its median (flats)
+ * Input: number of threads (int), <= 0 for all online CPUs
+ * Input: memory budget for band buffers, MB (int)
+ *
+ * Output: master image (float32)
+ *
+ * Input: spool directory (string), "auto" for $TMPDIR, else /var/tmp
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "COREMOD_iofits/COREMOD_iofits.h"
+#include "COREMOD_memory/COREMOD_memory.h"
+
+#include "fitsmap.h"
+#include "mastercal_combine.h"
+
+#define MCAL_METHOD_MEDIAN  0
+#define MCAL_METHOD_SIGCLIP 1
+
+// Pixels per block when transposing a band pixel-major
+#define MCAL_PBLOCK 64
+
+// Local variables pointers
+static char    *src_name;
+static int32_t *ptr_n_frames;
+static int32_t *ptr_method;
+static double  *ptr_nsigma;
+static int32_t *ptr_niter;
+static int32_t *ptr_normalize;
+static int32_t *ptr_nthreads;
+static int32_t *ptr_maxmem;
+static char    *out_name;
+static char    *spooldir;
+
+static CLICMDARGDEF farg[] = {{
+        CLIARG_STR,
+        ".src_name",
+        "stream or file list",
+        "src",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &src_name,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".n_frames",
+        "Number of frames",
+        "100",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_n_frames,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".method",
+        "0: median, 1: sigma-clip",
+        "1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_method,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".nsigma",
+        "Clipping threshold (sigma)",
+        "3.0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_nsigma,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".niter",
+        "Clipping iterations",
+        "3",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_niter,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".normalize",
+        "Divide by median (flat)",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_normalize,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".nthreads",
+        "Threads (<=0: all CPUs)",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_nthreads,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".maxmem",
+        "Band buffer budget (MB)",
+        "2048",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_maxmem,
+        NULL
+    },
+    {
+        CLIARG_STR_NOT_IMG,
+        ".out_name",
+        "output master image",
+        "master",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &out_name,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".spooldir",
+        "spool directory, on disk (auto: TMPDIR or /var/tmp)",
+        "auto",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &spooldir,
+        NULL
+    }
+};
+
+static CLICMDDATA CLIcmddata = {"mkmastercal",
+                                "robust combine of frames into master",
+                                CLICMD_FIELDS_DEFAULTS
+                               };
+
+// detailed help
+static errno_t help_function()
+{
+    printf("Combine N frames (stream or FITS file list) into a master\n");
+    printf("bias/dark/flat, median or sigma-clipped mean\n");
+    printf("FITS files are read in place (memory mapped); stream frames\n");
+    printf("and compressed files are spooled as float to a temporary\n");
+    printf("file in spooldir (auto: $TMPDIR, else /var/tmp), which must\n");
+    printf("be on disk, not tmpfs. Frames are combined in parallel row\n");
+    printf("bands, within the maxmem budget\n");
+    return RETURN_SUCCESS;
+}
+
+/*
+Frame sources
+Frames fitsmap reads are combined straight from the mapped files, band by
+band. Stream frames and files only load_fits reads are converted to float and
+written to an unlinked spool file, frame after frame. The spool file lives in
+spooldir ("auto": $TMPDIR, else /var/tmp), which must be on disk: on a tmpfs
+the spooled frames would be held in memory.
+*/
+typedef struct
+{
+    FITSMAP fm;   // fm.map NULL: spooled frame
+    long    slot; // spool slot
+} MCAL_FRAME;
+
+typedef struct
+{
+    uint32_t    nx;
+    uint32_t    ny;
+    long        n_frames;
+    MCAL_FRAME *frames;
+    const char *spooldir;
+    int         spoolfd; // -1 until a frame is spooled
+    long        n_slots;
+    uint32_t    bandrows;
+    int         n_bands;
+} MCAL_SRC;
+
+static uint32_t mcal_band_rows(MCAL_SRC *src, int band)
+{
+    uint32_t row0 = band * src->bandrows;
+    return (src->ny - row0 < src->bandrows) ? src->ny - row0 : src->bandrows;
+}
+
+static errno_t mcal_spool_open(MCAL_SRC *src)
+{
+    src->spoolfd = fitsmap_spool_open(src->spooldir, "milk_mastercal_");
+    return (src->spoolfd == -1) ? RETURN_FAILURE : RETURN_SUCCESS;
+}
+
+// Spool frame k (float, nx * ny)
+static errno_t mcal_spool_frame(MCAL_SRC *src, long k, const float *frame)
+{
+    if(src->spoolfd == -1 && mcal_spool_open(src) != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+
+    size_t bytes  = (size_t) src->nx * src->ny * sizeof(float);
+    off_t  offset = (off_t) src->n_slots * bytes;
+
+    size_t done = 0;
+    while(done < bytes)
+    {
+        ssize_t n = pwrite(src->spoolfd,
+                           (const char *) frame + done,
+                           bytes - done,
+                           offset + done);
+        if(n <= 0)
+        {
+            PRINT_ERROR("spool write failed, frame %ld", k);
+            return RETURN_FAILURE;
+        }
+        done += n;
+    }
+    src->frames[k].slot = src->n_slots++;
+
+    return RETURN_SUCCESS;
+}
+
+// Rows row0 to row0 + nrows of frame k, as float
+static errno_t mcal_read_rows(MCAL_SRC *src,
+                              long      k,
+                              uint32_t  row0,
+                              uint32_t  nrows,
+                              float    *dst)
+{
+    MCAL_FRAME *frame = &src->frames[k];
+
+    if(frame->fm.map != NULL)
+    {
+        for(uint32_t jj = 0; jj < nrows; ++jj)
+        {
+            fitsmap_row(&frame->fm, row0 + jj, dst + (size_t) jj * src->nx);
+        }
+        fitsmap_release(&frame->fm, row0, row0 + nrows);
+        return RETURN_SUCCESS;
+    }
+
+    size_t bytes  = (size_t) nrows * src->nx * sizeof(float);
+    off_t  offset = ((off_t) frame->slot * src->ny + row0) * src->nx *
+                   (off_t) sizeof(float);
+
+    size_t done = 0;
+    while(done < bytes)
+    {
+        ssize_t n = pread(src->spoolfd,
+                          (char *) dst + done,
+                          bytes - done,
+                          offset + done);
+        if(n <= 0)
+        {
+            PRINT_ERROR("spool read failed, frame %ld", k);
+            return RETURN_FAILURE;
+        }
+        done += n;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+// Convert n pixels of datatype to float
+#define MCAL_TOFLOAT(in_type)                                                  \
+    for (long ii = 0; ii < n; ii++)                                            \
+    {                                                                          \
+        dst[ii] = (float) ((const in_type *) in)[ii];                          \
+    }
+
+static errno_t
+mcal_tofloat(const void *in, uint8_t datatype, long n, float *dst)
+{
+    switch(datatype)
+    {
+    case _DATATYPE_UINT8:
+        MCAL_TOFLOAT(uint8_t);
+        break;
+    case _DATATYPE_INT8:
+        MCAL_TOFLOAT(int8_t);
+        break;
+    case _DATATYPE_UINT16:
+        MCAL_TOFLOAT(uint16_t);
+        break;
+    case _DATATYPE_INT16:
+        MCAL_TOFLOAT(int16_t);
+        break;
+    case _DATATYPE_UINT32:
+        MCAL_TOFLOAT(uint32_t);
+        break;
+    case _DATATYPE_INT32:
+        MCAL_TOFLOAT(int32_t);
+        break;
+    case _DATATYPE_UINT64:
+        MCAL_TOFLOAT(uint64_t);
+        break;
+    case _DATATYPE_INT64:
+        MCAL_TOFLOAT(int64_t);
+        break;
+    case _DATATYPE_FLOAT:
+        memcpy(dst, in, n * sizeof(float));
+        break;
+    case _DATATYPE_DOUBLE:
+        MCAL_TOFLOAT(double);
+        break;
+    default:
+        PRINT_ERROR("TYPE UNSUPPORTED");
+        return RETURN_FAILURE;
+    }
+    return RETURN_SUCCESS;
+}
+
+/*
+Pixel combine, on the n values of one pixel (reordered in place)
+*/
+
+// k-th smallest value, quickselect
+static float mcal_select(float *v, long n, long k)
+{
+    long lo = 0;
+    long hi = n - 1;
+    while(lo < hi)
+    {
+        float pivot = v[(lo + hi) / 2];
+        long  i     = lo;
+        long  j     = hi;
+        while(i <= j)
+        {
+            while(v[i] < pivot)
+            {
+                i++;
+            }
+            while(v[j] > pivot)
+            {
+                j--;
+            }
+            if(i <= j)
+            {
+                float tmp = v[i];
+                v[i]      = v[j];
+                v[j]      = tmp;
+                i++;
+                j--;
+            }
+        }
+        if(k <= j)
+        {
+            hi = j;
+        }
+        else if(k >= i)
+        {
+            lo = i;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return v[k];
+}
+
+static float mcal_median(float *v, long n)
+{
+    long  k = n / 2;
+    float m = mcal_select(v, n, k);
+    if(n % 2 == 0)
+    {
+        // v[0..k-1] are <= v[k]: lower middle is their max
+        float lo = v[0];
+        for(long i = 1; i < k; ++i)
+        {
+            lo = (v[i] > lo) ? v[i] : lo;
+        }
+        m = 0.5 * (m + lo);
+    }
+    return m;
+}
+
+static float mcal_sigclip(float *v, long n, float nsigma, int niter)
+{
+    float center = mcal_median(v, n);
+    long  m      = n;
+
+    for(int it = 0; it < niter; ++it)
+    {
+        double s2 = 0.0;
+        for(long i = 0; i < m; ++i)
+        {
+            double d = v[i] - center;
+            s2 += d * d;
+        }
+        double sigma = sqrt(s2 / m);
+        if(sigma <= 0.0)
+        {
+            break;
+        }
+
+        // nsigma >= 1: at least the value closest to center is kept
+        long m1 = 0;
+        for(long i = 0; i < m; ++i)
+        {
+            if(fabs(v[i] - center) <= nsigma * sigma)
+            {
+                v[m1++] = v[i];
+            }
+        }
+        if(m1 == m)
+        {
+            break;
+        }
+        m = m1;
+
+        double s = 0.0;
+        for(long i = 0; i < m; ++i)
+        {
+            s += v[i];
+        }
+        center = s / m;
+    }
+
+    double s = 0.0;
+    for(long i = 0; i < m; ++i)
+    {
+        s += v[i];
+    }
+    return s / m;
+}
+
+/*
+Band workers
+*/
+typedef struct
+{
+    MCAL_SRC *src;
+    float    *out;
+    int       method;
+    float     nsigma;
+    int       niter;
+
+    pthread_mutex_t mutex;
+    int             next_band;
+    int             status;
+} MCAL_JOB;
+
+static errno_t
+mcal_combine_band(MCAL_JOB *job, int band, float *nbuf, float *tbuf)
+{
+    MCAL_SRC *src      = job->src;
+    long      n_frames = src->n_frames;
+    uint32_t  row0     = band * src->bandrows;
+    uint32_t  nrows    = mcal_band_rows(src, band);
+    long      bpix     = (long) nrows * src->nx;
+
+    for(long k = 0; k < n_frames; k++)
+    {
+        if(mcal_read_rows(src, k, row0, nrows, nbuf + k * bpix) !=
+                RETURN_SUCCESS)
+        {
+            return RETURN_FAILURE;
+        }
+    }
+
+    // Transpose: tbuf[p * N + k] = band of frame k, pixel p
+    for(long p0 = 0; p0 < bpix; p0 += MCAL_PBLOCK)
+    {
+        long p1 = (p0 + MCAL_PBLOCK < bpix) ? p0 + MCAL_PBLOCK : bpix;
+        for(long k = 0; k < n_frames; k++)
+        {
+            const float *row = nbuf + k * bpix;
+            for(long p = p0; p < p1; p++)
+            {
+                tbuf[p * n_frames + k] = row[p];
+            }
+        }
+    }
+
+    float *out = job->out + (long) row0 * src->nx;
+    for(long p = 0; p < bpix; ++p)
+    {
+        float *v = tbuf + p * n_frames;
+        if(job->method == MCAL_METHOD_MEDIAN)
+        {
+            out[p] = mcal_median(v, n_frames);
+        }
+        else
+        {
+            out[p] = mcal_sigclip(v, n_frames, job->nsigma, job->niter);
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static void *mcal_worker(void *ptr)
+{
+    MCAL_JOB *job = (MCAL_JOB *) ptr;
+    MCAL_SRC *src = job->src;
+
+    size_t bpix_max = (size_t) src->bandrows * src->nx;
+    float *nbuf = (float *) malloc(bpix_max * src->n_frames * sizeof(float));
+    float *tbuf = (float *) malloc(bpix_max * src->n_frames * sizeof(float));
+    if(nbuf == NULL || tbuf == NULL)
+    {
+        PRINT_ERROR("band buffer allocation failed");
+        pthread_mutex_lock(&job->mutex);
+        job->status = RETURN_FAILURE;
+        pthread_mutex_unlock(&job->mutex);
+        free(nbuf);
+        free(tbuf);
+        return NULL;
+    }
+
+    while(1)
+    {
+        pthread_mutex_lock(&job->mutex);
+        int band = job->next_band++;
+        int stop = (job->status != RETURN_SUCCESS);
+        pthread_mutex_unlock(&job->mutex);
+
+        if(stop || band >= src->n_bands)
+        {
+            break;
+        }
+
+        if(mcal_combine_band(job, band, nbuf, tbuf) != RETURN_SUCCESS)
+        {
+            pthread_mutex_lock(&job->mutex);
+            job->status = RETURN_FAILURE;
+            pthread_mutex_unlock(&job->mutex);
+        }
+    }
+
+    free(nbuf);
+    free(tbuf);
+
+    return NULL;
+}
+
+// Next file name of the list, skipping empty lines; NULL at end of list
+static char *mcal_flist_next(FILE *fp, char **line, size_t *len)
+{
+    while(getline(line, len, fp) != -1)
+    {
+        char *fname = strtok(*line, " \t\r\n");
+        if(fname != NULL)
+        {
+            return fname;
+        }
+    }
+    return NULL;
+}
+
+/*
+Next n_frames frames of a stream, waiting on its semaphore
+A frame is kept if it is complete (write flag cleared) and not overwritten
+while copied; cnt0 gaps between kept frames are counted as skipped.
+*/
+static errno_t mcal_acquire_stream(MCAL_SRC *src, IMGID *img)
+{
+    uint8_t datatype = img->md->datatype;
+    long    npix     = (long) src->nx * src->ny;
+    size_t  bytes    = npix * ImageStreamIO_typesize(datatype);
+
+    void  *nbuf = malloc(bytes);
+    float *fbuf = (float *) malloc(npix * sizeof(float));
+    if(nbuf == NULL || fbuf == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        abort(); // can't handle this error any other way
+    }
+
+    long semindex = ImageStreamIO_getsemwaitindex(img->im, 0);
+    ImageStreamIO_semflush(img->im, semindex);
+
+    uint64_t cnt0last = img->md->cnt0;
+    long     n_skip   = 0;
+    errno_t  status   = RETURN_SUCCESS;
+    long     k        = 0;
+    while(k < src->n_frames && status == RETURN_SUCCESS)
+    {
+        ImageStreamIO_semwait(img->im, semindex);
+
+        uint64_t cnt0 = img->md->cnt0;
+        if(cnt0 == cnt0last || img->md->write == 1)
+        {
+            continue;
+        }
+        memcpy(nbuf, img->im->array.raw, bytes);
+        if(img->md->write == 1 || img->md->cnt0 != cnt0)
+        {
+            continue;
+        }
+
+        n_skip += cnt0 - cnt0last - 1;
+        cnt0last = cnt0;
+
+        status = mcal_tofloat(nbuf, datatype, npix, fbuf);
+        if(status == RETURN_SUCCESS)
+        {
+            status = mcal_spool_frame(src, k, fbuf);
+        }
+        k++;
+    }
+
+    free(nbuf);
+    free(fbuf);
+
+    if(n_skip > 0)
+    {
+        PRINT_WARNING("%ld stream frames skipped", n_skip);
+    }
+
+    return status;
+}
+
+/*
+Frames of a file list: mapped if possible, else loaded and spooled
+Geometry is set from the first file
+*/
+static errno_t mcal_acquire_flist(MCAL_SRC *src, FILE *fp)
+{
+    char   *line    = NULL;
+    size_t  linelen = 0;
+    float  *fbuf    = NULL;
+    errno_t status  = RETURN_SUCCESS;
+
+    for(long k = 0; k < src->n_frames && status == RETURN_SUCCESS; ++k)
+    {
+        MCAL_FRAME *frame = &src->frames[k];
+        char       *fname = mcal_flist_next(fp, &line, &linelen);
+        if(fname == NULL || fitsmap_open(fname, 0, 0, &frame->fm) !=
+                RETURN_SUCCESS)
+        {
+            status = RETURN_FAILURE;
+            break;
+        }
+
+        imageID  ID = -1;
+        uint32_t nx = frame->fm.xsize;
+        uint32_t ny = frame->fm.ysize;
+        if(frame->fm.map == NULL)
+        {
+            load_fits(fname, "_mcal_in", 1, &ID);
+            if(ID == -1)
+            {
+                status = RETURN_FAILURE;
+                break;
+            }
+            nx = data.image[ID].md->size[0];
+            ny = data.image[ID].md->size[1];
+        }
+        if(k == 0)
+        {
+            src->nx = nx;
+            src->ny = ny;
+        }
+
+        if(nx != src->nx || ny != src->ny)
+        {
+            PRINT_ERROR("%s: size differs from first file", fname);
+            status = RETURN_FAILURE;
+        }
+        else if(ID != -1)
+        {
+            long npix = (long) nx * ny;
+            if(fbuf == NULL)
+            {
+                fbuf = (float *) malloc(npix * sizeof(float));
+                if(fbuf == NULL)
+                {
+                    PRINT_ERROR("malloc returns NULL pointer");
+                    abort(); // can't handle this error any other way
+                }
+            }
+            status = mcal_tofloat(data.image[ID].array.raw,
+                                  data.image[ID].md->datatype,
+                                  npix,
+                                  fbuf);
+            if(status == RETURN_SUCCESS)
+            {
+                status = mcal_spool_frame(src, k, fbuf);
+            }
+        }
+
+        if(ID != -1)
+        {
+            delete_image_ID("_mcal_in", DELETE_IMAGE_ERRMODE_WARNING);
+        }
+    }
+
+    free(fbuf);
+    free(line);
+
+    return status;
+}
+
+static void mcal_src_free(MCAL_SRC *src)
+{
+    for(long k = 0; k < src->n_frames; ++k)
+    {
+        fitsmap_close(&src->frames[k].fm);
+    }
+    free(src->frames);
+    if(src->spoolfd != -1)
+    {
+        close(src->spoolfd);
+    }
+}
+
+/**
+ * @brief Combine frames of stream or file list src into master out
+ *
+ * n_frames: frames to acquire from the stream, or maximum number of files
+ * read from the list (all if <= 0)
+ * spooldir: directory of the spool file, on disk ("auto": $TMPDIR, else
+ * /var/tmp)
+ */
+errno_t image_format_mkmastercal(const char *src,
+                                 long        n_frames,
+                                 int         method,
+                                 float       nsigma,
+                                 int         niter,
+                                 int         normalize,
+                                 int         nthreads,
+                                 long        maxmemMB,
+                                 const char *out,
+                                 const char *spooldir)
+{
+    MCAL_SRC fsrc;
+    memset(&fsrc, 0, sizeof(MCAL_SRC));
+    fsrc.spooldir = spooldir;
+    fsrc.spoolfd  = -1;
+
+    int   streammode = (image_ID(src) != -1);
+    IMGID in_img;
+    FILE *fpflist = NULL;
+
+    if(streammode)
+    {
+        if(n_frames <= 0)
+        {
+            PRINT_ERROR("number of frames required for stream %s", src);
+            return RETURN_FAILURE;
+        }
+        in_img = mkIMGID_from_name(src);
+        resolveIMGID(&in_img, ERRMODE_ABORT);
+
+        fsrc.nx = in_img.md->size[0];
+        fsrc.ny = in_img.md->size[1];
+    }
+    else
+    {
+        fpflist = fopen(src, "r");
+        if(fpflist == NULL)
+        {
+            PRINT_ERROR("%s is neither an image nor a file list", src);
+            return RETURN_FAILURE;
+        }
+
+        char  *line    = NULL;
+        size_t linelen = 0;
+        long   n_files = 0;
+        while(mcal_flist_next(fpflist, &line, &linelen) != NULL)
+        {
+            n_files++;
+        }
+        free(line);
+        if(n_frames <= 0 || n_frames > n_files)
+        {
+            n_frames = n_files;
+        }
+        if(n_frames == 0)
+        {
+            PRINT_ERROR("empty file list %s", src);
+            fclose(fpflist);
+            return RETURN_FAILURE;
+        }
+        rewind(fpflist);
+    }
+
+    fsrc.n_frames = n_frames;
+    fsrc.frames   = (MCAL_FRAME *) calloc(n_frames, sizeof(MCAL_FRAME));
+    if(fsrc.frames == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        abort(); // can't handle this error any other way
+    }
+
+    /*
+    ACQUIRE
+    */
+    errno_t status;
+    if(streammode)
+    {
+        status = mcal_acquire_stream(&fsrc, &in_img);
+    }
+    else
+    {
+        status = mcal_acquire_flist(&fsrc, fpflist);
+        fclose(fpflist);
+    }
+    if(status != RETURN_SUCCESS)
+    {
+        mcal_src_free(&fsrc);
+        return RETURN_FAILURE;
+    }
+
+    if(nthreads <= 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // Band rows from the memory budget: each thread holds one band of the
+    // N frames, frame-major and pixel-major
+    size_t rowbytes = (size_t) fsrc.nx * n_frames * 2 * sizeof(float);
+    size_t budget   = (size_t) maxmemMB * 1024 * 1024;
+    fsrc.bandrows   = budget / (nthreads * rowbytes);
+    if(fsrc.bandrows < 1)
+    {
+        PRINT_WARNING("maxmem too small for one row per thread, using 1");
+        fsrc.bandrows = 1;
+    }
+    // At least one band per thread
+    if(fsrc.bandrows > (fsrc.ny + nthreads - 1) / nthreads)
+    {
+        fsrc.bandrows = (fsrc.ny + nthreads - 1) / nthreads;
+    }
+    fsrc.n_bands = (fsrc.ny + fsrc.bandrows - 1) / fsrc.bandrows;
+
+    printf("%ld frames %u x %u (%ld spooled), %d bands of %u rows, "
+           "%d threads\n",
+           n_frames,
+           fsrc.nx,
+           fsrc.ny,
+           fsrc.n_slots,
+           fsrc.n_bands,
+           fsrc.bandrows,
+           nthreads);
+
+    /*
+    COMBINE
+    */
+    if(image_ID(out) != -1)
+    {
+        delete_image_ID(out, DELETE_IMAGE_ERRMODE_WARNING);
+    }
+    IMGID out_img    = makeIMGID_2D(out, fsrc.nx, fsrc.ny);
+    out_img.datatype = _DATATYPE_FLOAT;
+    imcreateIMGID(&out_img);
+    resolveIMGID(&out_img, ERRMODE_ABORT);
+
+    MCAL_JOB job;
+    memset(&job, 0, sizeof(MCAL_JOB));
+    job.src    = &fsrc;
+    job.out    = out_img.im->array.F;
+    job.method = method;
+    job.nsigma = (nsigma < 1.0) ? 1.0 : nsigma;
+    job.niter  = niter;
+    job.status = RETURN_SUCCESS;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if(threads == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        abort(); // can't handle this error any other way
+    }
+    // The caller is worker 0 and drains whatever bands are left if some
+    // threads could not be started
+    int nstarted = 1;
+    while(nstarted < nthreads &&
+            pthread_create(&threads[nstarted], NULL, mcal_worker, &job) == 0)
+    {
+        ++nstarted;
+    }
+    mcal_worker(&job);
+    for(int t = 1; t < nstarted; ++t)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.mutex);
+    mcal_src_free(&fsrc);
+
+    if(job.status != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+
+    if(normalize)
+    {
+        long   n_pixels = (long) fsrc.nx * fsrc.ny;
+        float *tmp      = (float *) malloc(n_pixels * sizeof(float));
+        memcpy(tmp, out_img.im->array.F, n_pixels * sizeof(float));
+        float med = mcal_median(tmp, n_pixels);
+        free(tmp);
+
+        if(med == 0.0)
+        {
+            PRINT_WARNING("master median is 0, not normalized");
+        }
+        else
+        {
+            for(long ii = 0; ii < n_pixels; ++ii)
+            {
+                out_img.im->array.F[ii] /= med;
+            }
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static errno_t compute_function()
+{
+    DEBUG_TRACE_FSTART();
+    INSERT_STD_PROCINFO_COMPUTEFUNC_START
+
+    image_format_mkmastercal(src_name,
+                             *ptr_n_frames,
+                             *ptr_method,
+                             *ptr_nsigma,
+                             *ptr_niter,
+                             *ptr_normalize,
+                             *ptr_nthreads,
+                             *ptr_maxmem,
+                             out_name,
+                             spooldir);
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    DEBUG_TRACE_FEXIT();
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_image_format__mkmastercal()
+{
+    INSERT_STD_CLIREGISTERFUNC
+    return RETURN_SUCCESS;
+}
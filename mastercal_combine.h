@@ -0,0 +1,17 @@
+#ifndef MASTERCAL_COMBINE_H
+#define MASTERCAL_COMBINE_H
+
+errno_t image_format_mkmastercal(const char *src,
+                                 long        n_frames,
+                                 int         method,
+                                 float       nsigma,
+                                 int         niter,
+                                 int         normalize,
+                                 int         nthreads,
+                                 long        maxmemMB,
+                                 const char *out,
+                                 const char *spooldir);
+
+errno_t CLIADDCMD_image_format__mkmastercal();
+
+#endif // MASTERCAL_COMBINE_H
@@ -0,0 +1,553 @@
+/**
+ * @file    rawbayer_calib.c
+ * @brief   Fused calibration of raw Bayer frames
+ *
+ * out = (raw - bias - dark) * fluxfactor * invflat, in a single row-major
+ * pass, optionally with isolated hot pixels removed after the bias and dark
+ * subtraction. bias, dark and invflat may be NULL (0, 0 and 1). out may be
+ * raw (in place).
+ *
+ * Rows are cut into bands, one per thread.
+ *
+ * Hot pixel rejection uses the 5x5 neighborhood max, center excluded and
+ * floored at 0. It is separable: per row, the pairwise max of adjacent
+ * pixels gives the 4-pixel max excluding the center (C) and the 5-pixel max
+ * (H) in 3 max operations; vertically, the neighborhood max is max(C, H of
+ * the 4 other rows). Calibrated rows, C and H are kept in a ring of 5 rows,
+ * so each input row is read and calibrated once. Tests are made on the
+ * unmodified frame: the 2 rows above and below each band are calibrated
+ * into a halo before any band is written.
+ *
+ * A calibration context holds the maps derived from the bias, dark, flat and
+ * bad pixel images (offset = bias + dark, inverse flat, bad pixel index) and
+ * rebuilds them only when a source image changes, so that converting a
+ * sequence of frames does not redo them per frame.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "rawbayer_calib.h"
+
+#define RAWCAL_HALF    2
+#define RAWCAL_RING    (2 * RAWCAL_HALF + 1)
+#define RAWCAL_MINROWS 16
+
+typedef struct
+{
+    float       *out;
+    const float *raw;
+    const float *bias;
+    const float *dark;
+    const float *invflat;
+    float        fluxfactor;
+    int          hotpix;
+    long         xsize;
+    long         ysize;
+    long         jj0; // band rows [jj0, jj1)
+    long         jj1;
+    float       *halo; // rows jj0-2, jj0-1, jj1, jj1+1, calibrated
+    long         nhotpix;
+} RAWCAL_BAND;
+
+// dst = raw - bias - dark, row jj
+static void
+rawcal_offset_row(const RAWCAL_BAND *band, long jj, float *__restrict dst)
+{
+    long         xsize = band->xsize;
+    const float *raw   = band->raw + jj * xsize;
+
+    if(band->bias != NULL && band->dark != NULL)
+    {
+        const float *bias = band->bias + jj * xsize;
+        const float *dark = band->dark + jj * xsize;
+        for(long ii = 0; ii < xsize; ii++)
+        {
+            dst[ii] = raw[ii] - bias[ii] - dark[ii];
+        }
+    }
+    else
+    {
+        const float *off = (band->bias != NULL) ? band->bias : band->dark;
+        if(off == NULL)
+        {
+            memcpy(dst, raw, sizeof(float) * xsize);
+        }
+        else
+        {
+            off += jj * xsize;
+            for(long ii = 0; ii < xsize; ii++)
+            {
+                dst[ii] = raw[ii] - off[ii];
+            }
+        }
+    }
+}
+
+// out row jj = v * fluxfactor * invflat
+static void
+rawcal_scale_row(const RAWCAL_BAND *band, long jj, const float *__restrict v)
+{
+    long   xsize = band->xsize;
+    float  ff    = band->fluxfactor;
+    float *out   = band->out + jj * xsize;
+
+    if(band->invflat != NULL)
+    {
+        const float *invflat = band->invflat + jj * xsize;
+        for(long ii = 0; ii < xsize; ii++)
+        {
+            out[ii] = v[ii] * ff * invflat[ii];
+        }
+    }
+    else
+    {
+        for(long ii = 0; ii < xsize; ii++)
+        {
+            out[ii] = v[ii] * ff;
+        }
+    }
+}
+
+// Calibrated row jj: halo rows outside the band, computed into dst inside,
+// NULL outside the frame
+static const float *
+rawcal_row(const RAWCAL_BAND *band, long jj, float *dst)
+{
+    if((jj < 0) || (jj >= band->ysize))
+    {
+        return NULL;
+    }
+    if(jj < band->jj0)
+    {
+        return band->halo + (jj - band->jj0 + RAWCAL_HALF) * band->xsize;
+    }
+    if(jj >= band->jj1)
+    {
+        return band->halo + (jj - band->jj1 + RAWCAL_HALF) * band->xsize;
+    }
+    rawcal_offset_row(band, jj, dst);
+    return dst;
+}
+
+// Horizontal pass: c[ii] = max(row[ii-2], row[ii-1], row[ii+1], row[ii+2])
+// and h[ii] = max(c[ii], row[ii]), out-of-frame pixels read as 0
+static void rawcal_hmax(const float *__restrict row,
+                        float *__restrict pad,
+                        float *__restrict c,
+                        float *__restrict h,
+                        long xsize)
+{
+    if(row == NULL)
+    {
+        memset(c, 0, sizeof(float) * xsize);
+        memset(h, 0, sizeof(float) * xsize);
+        return;
+    }
+
+    // pad[k] = row[k-2], then pairwise max in place:
+    // pad[k] = max(row[k-2], row[k-1])
+    pad[0] = 0.0f;
+    pad[1] = 0.0f;
+    memcpy(pad + RAWCAL_HALF, row, sizeof(float) * xsize);
+    pad[xsize + 2] = 0.0f;
+    pad[xsize + 3] = 0.0f;
+    for(long k = 0; k < xsize + 3; k++)
+    {
+        pad[k] = (pad[k + 1] > pad[k]) ? pad[k + 1] : pad[k];
+    }
+
+    for(long ii = 0; ii < xsize; ii++)
+    {
+        float v = (pad[ii + 3] > pad[ii]) ? pad[ii + 3] : pad[ii];
+        c[ii]   = v;
+        h[ii]   = (row[ii] > v) ? row[ii] : v;
+    }
+}
+
+static void *rawcal_worker(void *ptr)
+{
+    RAWCAL_BAND *band  = (RAWCAL_BAND *) ptr;
+    long         xsize = band->xsize;
+
+    if(!band->hotpix)
+    {
+        float *v = (float *) malloc(sizeof(float) * xsize);
+        if(v == NULL)
+        {
+            PRINT_ERROR("malloc returns NULL pointer");
+            abort(); // can't handle this error any other way
+        }
+        for(long jj = band->jj0; jj < band->jj1; jj++)
+        {
+            rawcal_offset_row(band, jj, v);
+            rawcal_scale_row(band, jj, v);
+        }
+        free(v);
+        return NULL;
+    }
+
+    // Rings of calibrated rows and of their horizontal maxima,
+    // rows jj-2 ... jj+2
+    float *buf = (float *) malloc(sizeof(float) *
+                                  ((3 * RAWCAL_RING + 1) * xsize + 4));
+    if(buf == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        abort(); // can't handle this error any other way
+    }
+    float *vring = buf;
+    float *cring = buf + RAWCAL_RING * xsize;
+    float *hring = buf + 2 * RAWCAL_RING * xsize;
+    float *vrow  = buf + 3 * RAWCAL_RING * xsize;
+    float *pad   = vrow; // pad is only used before vrow is filled
+
+    // Calibrated row pointers, indexed as the rings
+    const float *vptr[RAWCAL_RING];
+
+    for(long jj = band->jj0 - RAWCAL_HALF; jj < band->jj0 + RAWCAL_HALF;
+            jj++)
+    {
+        long r  = (jj + RAWCAL_RING) % RAWCAL_RING;
+        vptr[r] = rawcal_row(band, jj, vring + r * xsize);
+        rawcal_hmax(vptr[r], pad, cring + r * xsize, hring + r * xsize,
+                    xsize);
+    }
+
+    long nhotpix = 0;
+    for(long jj = band->jj0; jj < band->jj1; jj++)
+    {
+        long r  = (jj + RAWCAL_HALF) % RAWCAL_RING;
+        vptr[r] = rawcal_row(band, jj + RAWCAL_HALF, vring + r * xsize);
+        rawcal_hmax(vptr[r], pad, cring + r * xsize, hring + r * xsize,
+                    xsize);
+
+        const float *hm2 = hring + ((jj + 3) % RAWCAL_RING) * xsize;
+        const float *hm1 = hring + ((jj + 4) % RAWCAL_RING) * xsize;
+        const float *hp1 = hring + ((jj + 1) % RAWCAL_RING) * xsize;
+        const float *hp2 = hring + ((jj + 2) % RAWCAL_RING) * xsize;
+        const float *c   = cring + (jj % RAWCAL_RING) * xsize;
+        const float *v   = vptr[jj % RAWCAL_RING];
+
+        for(long ii = 0; ii < xsize; ii++)
+        {
+            float a  = (hm1[ii] > hm2[ii]) ? hm1[ii] : hm2[ii];
+            float b  = (hp2[ii] > hp1[ii]) ? hp2[ii] : hp1[ii];
+            float v2 = (b > a) ? b : a;
+            v2       = (c[ii] > v2) ? c[ii] : v2;
+            v2       = (v2 > 0.0f) ? v2 : 0.0f;
+            int hot  = (v[ii] > RAWCAL_HOTPIX_GAIN * v2 + RAWCAL_HOTPIX_OFFSET);
+            vrow[ii] = hot ? v2 : v[ii];
+            nhotpix += hot;
+        }
+
+        rawcal_scale_row(band, jj, vrow);
+    }
+    band->nhotpix = nhotpix;
+
+    free(buf);
+
+    return NULL;
+}
+
+// Current state of source image k; returns 1 if it differs from the state
+// the maps were built from
+static int rawcal_src_changed(const RAWCAL_CTX *ctx, int k, RAWCAL_SRCSTATE *st)
+{
+    st->ID = -1;
+    if(ctx->srcname[k] != NULL)
+    {
+        st->ID = image_ID(ctx->srcname[k]);
+    }
+    if(st->ID != -1)
+    {
+        st->cnt0         = data.image[st->ID].md->cnt0;
+        st->creationtime = data.image[st->ID].md->creationtime;
+    }
+
+    const RAWCAL_SRCSTATE *st0 = &ctx->src[k];
+    if(!ctx->built || (st->ID != st0->ID))
+    {
+        return 1;
+    }
+    return (st->ID != -1) &&
+           ((st->cnt0 != st0->cnt0) ||
+            (st->creationtime.tv_sec != st0->creationtime.tv_sec) ||
+            (st->creationtime.tv_nsec != st0->creationtime.tv_nsec));
+}
+
+// Source image k array, NULL if absent or not a float frame of the size
+static float *rawcal_src_array(const RAWCAL_CTX *ctx, int k, imageID ID)
+{
+    if(ID == -1)
+    {
+        return NULL;
+    }
+    IMAGE_METADATA *md = data.image[ID].md;
+    if((md->datatype != _DATATYPE_FLOAT) || (md->size[0] != ctx->xsize) ||
+            (md->size[1] != ctx->ysize))
+    {
+        PRINT_WARNING("%s: not a %ldx%ld float image, ignored",
+                      ctx->srcname[k],
+                      ctx->xsize,
+                      ctx->ysize);
+        return NULL;
+    }
+    return data.image[ID].array.F;
+}
+
+errno_t rawbayer_ctx_update(RAWCAL_CTX *ctx, long xsize, long ysize)
+{
+    RAWCAL_SRCSTATE st[RAWCAL_NSRC];
+    int             changed[RAWCAL_NSRC];
+    int             nchanged = 0;
+
+    if((xsize != ctx->xsize) || (ysize != ctx->ysize))
+    {
+        ctx->built = 0;
+        ctx->xsize = xsize;
+        ctx->ysize = ysize;
+    }
+    for(int k = 0; k < RAWCAL_NSRC; k++)
+    {
+        changed[k] = rawcal_src_changed(ctx, k, &st[k]);
+        nchanged += changed[k];
+    }
+    if(nchanged == 0)
+    {
+        return RETURN_SUCCESS;
+    }
+
+    // The offset needs both bias and dark if either changed
+    int offset_changed = changed[RAWCAL_BIAS] || changed[RAWCAL_DARK];
+    changed[RAWCAL_BIAS] = offset_changed;
+    changed[RAWCAL_DARK] = offset_changed;
+
+    long   n_pixels = xsize * ysize;
+    float *src[RAWCAL_NSRC];
+    for(int k = 0; k < RAWCAL_NSRC; k++)
+    {
+        src[k] = changed[k] ? rawcal_src_array(ctx, k, st[k].ID) : NULL;
+    }
+
+    if(offset_changed)
+    {
+        free(ctx->offset);
+        ctx->offset = NULL;
+        if((src[RAWCAL_BIAS] != NULL) || (src[RAWCAL_DARK] != NULL))
+        {
+            ctx->offset = (float *) malloc(sizeof(float) * n_pixels);
+            if(ctx->offset == NULL)
+            {
+                PRINT_ERROR("malloc returns NULL pointer");
+                ctx->built = 0;
+                return RETURN_FAILURE;
+            }
+            const float *bias = src[RAWCAL_BIAS];
+            const float *dark = src[RAWCAL_DARK];
+            for(long ii = 0; ii < n_pixels; ii++)
+            {
+                ctx->offset[ii] = ((bias != NULL) ? bias[ii] : 0.0f) +
+                                  ((dark != NULL) ? dark[ii] : 0.0f);
+            }
+        }
+    }
+
+    if(changed[RAWCAL_FLAT])
+    {
+        free(ctx->invflat);
+        ctx->invflat = NULL;
+        if(src[RAWCAL_FLAT] != NULL)
+        {
+            ctx->invflat = (float *) malloc(sizeof(float) * n_pixels);
+            if(ctx->invflat == NULL)
+            {
+                PRINT_ERROR("malloc returns NULL pointer");
+                ctx->built = 0;
+                return RETURN_FAILURE;
+            }
+            rawbayer_invflat(ctx->invflat, src[RAWCAL_FLAT], n_pixels);
+        }
+    }
+
+    if(changed[RAWCAL_BADPIX])
+    {
+        const float *badpix = src[RAWCAL_BADPIX];
+        long         nbad   = 0;
+        for(long ii = 0; (badpix != NULL) && (ii < n_pixels); ii++)
+        {
+            nbad += (badpix[ii] >= 0.5f);
+        }
+        free(ctx->badidx);
+        ctx->badidx  = (long *) malloc(sizeof(long) * (nbad + 1));
+        ctx->nbadpix = 0;
+        if(ctx->badidx == NULL)
+        {
+            PRINT_ERROR("malloc returns NULL pointer");
+            ctx->built = 0;
+            return RETURN_FAILURE;
+        }
+        for(long ii = 0; (badpix != NULL) && (ii < n_pixels); ii++)
+        {
+            if(badpix[ii] >= 0.5f)
+            {
+                ctx->badidx[ctx->nbadpix++] = ii;
+            }
+        }
+        ctx->badpix = badpix;
+        ctx->badpix_version++;
+    }
+
+    printf("calibration maps updated: offset %s, flat %s, %ld bad pixels\n",
+           (ctx->offset != NULL) ? "yes" : "no",
+           (ctx->invflat != NULL) ? "yes" : "no",
+           ctx->nbadpix);
+
+    for(int k = 0; k < RAWCAL_NSRC; k++)
+    {
+        ctx->src[k] = st[k];
+    }
+    ctx->built = 1;
+
+    return RETURN_SUCCESS;
+}
+
+void rawbayer_ctx_free(RAWCAL_CTX *ctx)
+{
+    free(ctx->offset);
+    free(ctx->invflat);
+    free(ctx->badidx);
+    ctx->offset  = NULL;
+    ctx->invflat = NULL;
+    ctx->badidx  = NULL;
+    ctx->badpix  = NULL;
+    ctx->nbadpix = 0;
+    ctx->built   = 0;
+}
+
+// invflat = 1 / flat
+errno_t rawbayer_invflat(float *invflat, const float *flat, long n_pixels)
+{
+    for(long ii = 0; ii < n_pixels; ii++)
+    {
+        invflat[ii] = 1.0f / flat[ii];
+    }
+
+    return RETURN_SUCCESS;
+}
+
+errno_t rawbayer_calibrate(float       *out,
+                           const float *raw,
+                           const float *bias,
+                           const float *dark,
+                           const float *invflat,
+                           float        fluxfactor,
+                           int          hotpix,
+                           long         xsize,
+                           long         ysize,
+                           int          nthreads,
+                           long        *nhotpix)
+{
+    long nbands = nthreads;
+    if(nbands <= 0)
+    {
+        nbands = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(nbands > ysize / RAWCAL_MINROWS)
+    {
+        nbands = ysize / RAWCAL_MINROWS;
+    }
+    if(nbands < 1)
+    {
+        nbands = 1;
+    }
+
+    long   halosize = 2 * RAWCAL_HALF * xsize;
+    float *halo     = NULL;
+    if(hotpix)
+    {
+        halo = (float *) malloc(sizeof(float) * nbands * halosize);
+    }
+    RAWCAL_BAND *bands = (RAWCAL_BAND *) malloc(sizeof(RAWCAL_BAND) * nbands);
+    pthread_t   *threads = (pthread_t *) malloc(sizeof(pthread_t) * nbands);
+    if((bands == NULL) || (threads == NULL) || (hotpix && (halo == NULL)))
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        free(halo);
+        free(bands);
+        free(threads);
+        return RETURN_FAILURE;
+    }
+
+    // Halo rows are calibrated before any thread starts writing out
+    for(long b = 0; b < nbands; b++)
+    {
+        RAWCAL_BAND *band = &bands[b];
+        band->out         = out;
+        band->raw         = raw;
+        band->bias        = bias;
+        band->dark        = dark;
+        band->invflat     = invflat;
+        band->fluxfactor  = fluxfactor;
+        band->hotpix      = hotpix;
+        band->xsize       = xsize;
+        band->ysize       = ysize;
+        band->jj0         = ysize * b / nbands;
+        band->jj1         = ysize * (b + 1) / nbands;
+        band->halo        = hotpix ? halo + b * halosize : NULL;
+        band->nhotpix     = 0;
+        for(long k = 0; hotpix && (k < RAWCAL_HALF); k++)
+        {
+            long jja = band->jj0 - RAWCAL_HALF + k;
+            long jjb = band->jj1 + k;
+            if(jja >= 0)
+            {
+                rawcal_offset_row(band, jja, band->halo + k * xsize);
+            }
+            if(jjb < ysize)
+            {
+                rawcal_offset_row(band,
+                                  jjb,
+                                  band->halo + (RAWCAL_HALF + k) * xsize);
+            }
+        }
+    }
+
+    // Bands whose thread could not be started run in the caller
+    long nstarted = 1;
+    while(nstarted < nbands &&
+            pthread_create(&threads[nstarted],
+                           NULL,
+                           rawcal_worker,
+                           &bands[nstarted]) == 0)
+    {
+        nstarted++;
+    }
+    for(long b = nstarted; b < nbands; b++)
+    {
+        rawcal_worker(&bands[b]);
+    }
+    rawcal_worker(&bands[0]);
+    for(long b = 1; b < nstarted; b++)
+    {
+        pthread_join(threads[b], NULL);
+    }
+    long cnt = 0;
+    for(long b = 0; b < nbands; b++)
+    {
+        cnt += bands[b].nhotpix;
+    }
+
+    if(nhotpix != NULL)
+    {
+        *nhotpix = cnt;
+    }
+
+    free(threads);
+    free(bands);
+    free(halo);
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#ifndef IMAGE_FORMAT_RAWBAYER_CALIB_H
+#define IMAGE_FORMAT_RAWBAYER_CALIB_H
+
+// Hot pixel rejection: a pixel above RAWCAL_HOTPIX_GAIN times the max of
+// its 5x5 neighborhood (floored at 0) plus RAWCAL_HOTPIX_OFFSET is replaced
+// by that max. Applies to bias and dark subtracted values.
+#define RAWCAL_HOTPIX_GAIN   4.0f
+#define RAWCAL_HOTPIX_OFFSET 500.0f
+
+// Calibration sources of a context
+#define RAWCAL_BIAS   0
+#define RAWCAL_DARK   1
+#define RAWCAL_FLAT   2
+#define RAWCAL_BADPIX 3
+#define RAWCAL_NSRC   4
+
+// Source image state when derived maps were last built
+typedef struct
+{
+    imageID         ID; // -1 if absent or unusable
+    uint64_t        cnt0;
+    struct timespec creationtime;
+} RAWCAL_SRCSTATE;
+
+// Calibration context, reused across frames
+// Derived maps are rebuilt by rawbayer_ctx_update() only when a source
+// image is created, deleted, reloaded or written (cnt0), or when the frame
+// size changes. Images updated in place must have their cnt0 incremented.
+typedef struct
+{
+    const char *srcname[RAWCAL_NSRC]; // source image names, NULL for none
+
+    long            xsize;
+    long            ysize;
+    int             built;
+    RAWCAL_SRCSTATE src[RAWCAL_NSRC];
+
+    float       *offset;  // bias + dark, NULL if neither
+    float       *invflat; // 1 / flat, NULL if no flat
+    const float *badpix;  // bad pixel map (source array), NULL if none
+    long         nbadpix;
+    long        *badidx;  // pixels with badpix >= 0.5, increasing
+    uint64_t     badpix_version; // incremented when badidx is rebuilt
+} RAWCAL_CTX;
+
+errno_t rawbayer_ctx_update(RAWCAL_CTX *ctx, long xsize, long ysize);
+
+void rawbayer_ctx_free(RAWCAL_CTX *ctx);
+
+errno_t rawbayer_invflat(float *invflat, const float *flat, long n_pixels);
+
+errno_t rawbayer_calibrate(float       *out,
+                           const float *raw,
+                           const float *bias,
+                           const float *dark,
+                           const float *invflat,
+                           float        fluxfactor,
+                           int          hotpix,
+                           long         xsize,
+                           long         ysize,
+                           int          nthreads,
+                           long        *nhotpix);
+
+#endif // IMAGE_FORMAT_RAWBAYER_CALIB_H
@@ -0,0 +1,203 @@
+/**
+ * @file    rawbayer_cfa.c
+ * @brief   Bayer color filter array descriptor
+ *
+ * The CFA layout of a raw frame is resolved, in order, from:
+ *   - an explicit specification: "RGGB", "GRBG", "GBRG" or "BGGR",
+ *     optionally followed by x and y offsets, as in "RGGB,1,0"
+ *   - the image keywords BAYERPAT, XBAYROFF and YBAYROFF
+ *   - the frame size, for the camera sensors used so far
+ *
+ * rawbayer_cfa_from_dcraw() reads the pattern of a camera raw file from
+ * dcraw metadata.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "rawbayer_cfa.h"
+
+static const char *rawbayer_cfa_names[4] = {"RGGB", "GRBG", "GBRG", "BGGR"};
+
+// Camera raw frame sizes, as written by dcraw -D
+static const struct
+{
+    long xsize;
+    long ysize;
+    int  pattern;
+} rawbayer_cfa_sensors[] = {{4290, 2856, RAWBAYER_CFA_GBRG},
+    {4770, 3178, RAWBAYER_CFA_GBRG},
+    {5202, 3465, RAWBAYER_CFA_RGGB},
+    {5208, 3476, RAWBAYER_CFA_GBRG}
+};
+
+int rawbayer_cfa_pattern(const RAWBAYER_CFA *cfa)
+{
+    return cfa->pattern ^ ((cfa->xoffset & 1) | ((cfa->yoffset & 1) << 1));
+}
+
+void rawbayer_cfa_layout(const RAWBAYER_CFA *cfa, int layout[2][2])
+{
+    static const int rggb[2][2] = {{0, 1}, {1, 2}};
+
+    int pattern = rawbayer_cfa_pattern(cfa);
+    for(int jj = 0; jj < 2; jj++)
+        for(int ii = 0; ii < 2; ii++)
+        {
+            layout[jj][ii] = rggb[jj ^ (pattern >> 1)][ii ^ (pattern & 1)];
+        }
+}
+
+const char *rawbayer_cfa_name(int pattern)
+{
+    return ((pattern >= 0) && (pattern < 4)) ? rawbayer_cfa_names[pattern]
+           : "????";
+}
+
+// Pattern index of a 4 character name, -1 if not a Bayer pattern
+static int rawbayer_cfa_lookup(const char *str)
+{
+    char name[5];
+    for(int i = 0; i < 4; i++)
+    {
+        if(str[i] == '\0')
+        {
+            return -1;
+        }
+        name[i] = toupper((unsigned char) str[i]);
+    }
+    name[4] = '\0';
+
+    for(int pattern = 0; pattern < 4; pattern++)
+    {
+        if(strcmp(name, rawbayer_cfa_names[pattern]) == 0)
+        {
+            return pattern;
+        }
+    }
+    return -1;
+}
+
+errno_t rawbayer_cfa_parse(const char *spec, RAWBAYER_CFA *cfa)
+{
+    int pattern = rawbayer_cfa_lookup(spec);
+    int xoffset = 0;
+    int yoffset = 0;
+
+    if((pattern == -1) ||
+            ((spec[4] != '\0') &&
+             (sscanf(spec + 4, ",%d,%d", &xoffset, &yoffset) != 2)))
+    {
+        PRINT_ERROR("invalid CFA \"%s\", expected RGGB|GRBG|GBRG|BGGR[,x,y]",
+                    spec);
+        return RETURN_FAILURE;
+    }
+
+    cfa->pattern = pattern;
+    cfa->xoffset = xoffset;
+    cfa->yoffset = yoffset;
+
+    return RETURN_SUCCESS;
+}
+
+errno_t rawbayer_cfa_from_keywords(IMGID img, RAWBAYER_CFA *cfa)
+{
+    int pattern = -1;
+    int xoffset = 0;
+    int yoffset = 0;
+
+    for(int kw = 0; kw < img.md->NBkw; kw++)
+    {
+        IMAGE_KEYWORD *key = &img.im->kw[kw];
+
+        if((strcmp(key->name, "BAYERPAT") == 0) && (key->type == 'S'))
+        {
+            pattern = rawbayer_cfa_lookup(key->value.valstr);
+        }
+        if((strcmp(key->name, "XBAYROFF") == 0) && (key->type == 'L'))
+        {
+            xoffset = key->value.numl;
+        }
+        if((strcmp(key->name, "YBAYROFF") == 0) && (key->type == 'L'))
+        {
+            yoffset = key->value.numl;
+        }
+    }
+
+    if(pattern == -1)
+    {
+        return RETURN_FAILURE;
+    }
+
+    cfa->pattern = pattern;
+    cfa->xoffset = xoffset;
+    cfa->yoffset = yoffset;
+
+    return RETURN_SUCCESS;
+}
+
+// Pattern from the "Filter pattern:" line of dcraw -i -v, which lists the
+// colors of the top left 2x8 pixels: "RGGBRGGBRGGBRGGB"
+// The pattern is in file row order: frames read through the PGM reader are
+// flipped, the caller sets yoffset to (ysize - 1) & 1
+errno_t rawbayer_cfa_from_dcraw(const char *filterpattern, RAWBAYER_CFA *cfa)
+{
+    while(*filterpattern == ' ')
+    {
+        filterpattern++;
+    }
+    int pattern = rawbayer_cfa_lookup(filterpattern);
+    if(pattern == -1)
+    {
+        return RETURN_FAILURE;
+    }
+
+    cfa->pattern = pattern;
+    cfa->xoffset = 0;
+    cfa->yoffset = 0;
+
+    return RETURN_SUCCESS;
+}
+
+// spec NULL, "" or "auto": keywords, then frame size
+errno_t rawbayer_cfa_resolve(const char *spec, IMGID img, RAWBAYER_CFA *cfa)
+{
+    if((spec != NULL) && (spec[0] != '\0') && (strcmp(spec, "auto") != 0))
+    {
+        return rawbayer_cfa_parse(spec, cfa);
+    }
+
+    if(rawbayer_cfa_from_keywords(img, cfa) == RETURN_SUCCESS)
+    {
+        return RETURN_SUCCESS;
+    }
+
+    long xsize = img.md->size[0];
+    long ysize = img.md->size[1];
+    for(unsigned int i = 0;
+            i < sizeof(rawbayer_cfa_sensors) / sizeof(rawbayer_cfa_sensors[0]);
+            i++)
+    {
+        if((rawbayer_cfa_sensors[i].xsize == xsize) &&
+                (rawbayer_cfa_sensors[i].ysize == ysize))
+        {
+            cfa->pattern = rawbayer_cfa_sensors[i].pattern;
+            cfa->xoffset = 0;
+            cfa->yoffset = 0;
+            printf("CFA %s from sensor size %ld x %ld\n",
+                   rawbayer_cfa_name(cfa->pattern),
+                   xsize,
+                   ysize);
+            return RETURN_SUCCESS;
+        }
+    }
+
+    PRINT_ERROR("%s: unknown CFA pattern (%ld x %ld), set BAYERPAT or pass it",
+                img.name,
+                xsize,
+                ysize);
+    return RETURN_FAILURE;
+}
@@ -0,0 +1,38 @@
+#ifndef IMAGE_FORMAT_RAWBAYER_CFA_H
+#define IMAGE_FORMAT_RAWBAYER_CFA_H
+
+// Bayer patterns, as read from the top left 2x2 cell
+// bit 0: pattern shifted by one column, bit 1: by one row, from RGGB
+#define RAWBAYER_CFA_RGGB 0
+#define RAWBAYER_CFA_GRBG 1
+#define RAWBAYER_CFA_GBRG 2
+#define RAWBAYER_CFA_BGGR 3
+#define RAWBAYER_CFA_AUTO -1 // to be resolved from the frame
+
+// CFA descriptor
+// frame pixel (ii, jj) sits on pattern cell (ii + xoffset, jj + yoffset),
+// as the FITS BAYERPAT, XBAYROFF and YBAYROFF keywords
+typedef struct
+{
+    int pattern;
+    int xoffset;
+    int yoffset;
+} RAWBAYER_CFA;
+
+// Pattern at frame pixel (0, 0), offsets applied
+int rawbayer_cfa_pattern(const RAWBAYER_CFA *cfa);
+
+// Color (0=R, 1=G, 2=B) of frame pixel [jj & 1][ii & 1]
+void rawbayer_cfa_layout(const RAWBAYER_CFA *cfa, int layout[2][2]);
+
+const char *rawbayer_cfa_name(int pattern);
+
+errno_t rawbayer_cfa_parse(const char *spec, RAWBAYER_CFA *cfa);
+
+errno_t rawbayer_cfa_from_keywords(IMGID img, RAWBAYER_CFA *cfa);
+
+errno_t rawbayer_cfa_from_dcraw(const char *filterpattern, RAWBAYER_CFA *cfa);
+
+errno_t rawbayer_cfa_resolve(const char *spec, IMGID img, RAWBAYER_CFA *cfa);
+
+#endif // IMAGE_FORMAT_RAWBAYER_CFA_H
@@ -0,0 +1,1024 @@
+/**
+ * @file    rawbayer_demosaic.c
+ * @brief   Demosaic of raw Bayer frames into planar R, G, B images
+ *
+ * Methods:
+ *   0: bilinear
+ *   1: Malvar-He-Cutler gradient-corrected linear interpolation (5x5)
+ *   2: AHD, adaptive homogeneity-directed (Hirakawa & Parks): G is
+ *      interpolated horizontally and vertically, R and B follow from the
+ *      color differences, and each pixel takes the direction whose CIELab
+ *      neighborhood is the most homogeneous
+ *
+ * The frame is cut into tiles, shared by a pool of threads. Interior tiles
+ * of the linear methods are read in place; edge tiles, and all AHD tiles,
+ * are first copied with a margin mirrored about the frame edges (mirroring
+ * about the edge pixel keeps the CFA phase). Kernels run row-major over
+ * pairs of pixels: each row kernel is compiled for the pair of CFA sites it
+ * starts on, and the CFA pattern only selects the kernel of each row, so
+ * inner loops do not branch on the pattern and vectorize.
+ *
+ * Input: raw image (any real type, converted to float)
+ * Input: method
+ * Input: CFA pattern, see rawbayer_cfa.c
+ * Input: number of threads, <= 0 for all online CPUs
+ *
+ * Output: R, G, B images (float, full resolution)
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "rawbayer_cfa.h"
+#include "rawbayer_demosaic.h"
+
+// Tile size of the linear methods, and margin of their 5x5 kernels
+#define DM_TILEX  256
+#define DM_TILEY  64
+#define DM_MARGIN 2
+
+// AHD tile size and margin: G (2) + R/B (1) + homogeneity (1) + homogeneity
+// sum (1), rounded up to keep the CFA phase
+#define DM_AHD_TILE   128
+#define DM_AHD_MARGIN 6
+
+// CIELab f(t) table over t in [0, 1]
+#define DM_LAB_NTAB 65536
+
+// CFA sites: R, B, and G with R or B as horizontal neighbors
+#define DM_SITE_R  0
+#define DM_SITE_GR 1
+#define DM_SITE_B  2
+#define DM_SITE_GB 3
+
+// Local variables pointers
+static char    *in_name;
+static int32_t *ptr_method;
+static char    *cfa_spec;
+static int32_t *ptr_nthreads;
+static char    *outr_name;
+static char    *outg_name;
+static char    *outb_name;
+
+static CLICMDARGDEF farg[] = {{
+        CLIARG_IMG,
+        ".in_name",
+        "input raw Bayer image",
+        "im1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &in_name,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".method",
+        "0: bilinear, 1: Malvar, 2: AHD",
+        "1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_method,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".cfa",
+        "CFA pattern[,x,y], auto: keywords",
+        "auto",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &cfa_spec,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".nthreads",
+        "Threads (<=0: all CPUs)",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_nthreads,
+        NULL
+    },
+    {
+        CLIARG_STR_NOT_IMG,
+        ".outr_name",
+        "output R image",
+        "imr",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &outr_name,
+        NULL
+    },
+    {
+        CLIARG_STR_NOT_IMG,
+        ".outg_name",
+        "output G image",
+        "img",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &outg_name,
+        NULL
+    },
+    {
+        CLIARG_STR_NOT_IMG,
+        ".outb_name",
+        "output B image",
+        "imb",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &outb_name,
+        NULL
+    }
+};
+
+static CLICMDDATA CLIcmddata = {"demosaic",
+                                "demosaic raw Bayer image into R G B",
+                                CLICMD_FIELDS_DEFAULTS
+                               };
+
+static errno_t help_function()
+{
+    printf("Full resolution demosaic of a raw Bayer frame into planar\n");
+    printf("R, G and B float images.\n");
+    printf("method 0: bilinear, 1: Malvar-He-Cutler, 2: AHD\n");
+    return RETURN_SUCCESS;
+}
+
+/*
+THE IMPORTANT, CUSTOM PART
+*/
+
+// Site type of CFA phase [py][px]
+static int dm_site(const int layout[2][2], int py, int px)
+{
+    switch(layout[py][px])
+    {
+    case 0:
+        return DM_SITE_R;
+    case 2:
+        return DM_SITE_B;
+    default:
+        return (layout[py][px ^ 1] == 0) ? DM_SITE_GR : DM_SITE_GB;
+    }
+}
+
+/*
+Pixel kernels, p: raw pixel, s: row stride
+site is a constant in each row kernel, so the switch folds away
+*/
+#define DM_N1 p[-s]
+#define DM_S1 p[s]
+#define DM_W1 p[-1]
+#define DM_E1 p[1]
+#define DM_N2 p[-2 * s]
+#define DM_S2 p[2 * s]
+#define DM_W2 p[-2]
+#define DM_E2 p[2]
+#define DM_DIAG (p[-s - 1] + p[-s + 1] + p[s - 1] + p[s + 1])
+
+static inline void dm_bilinear_px(const float *p,
+                                  long         s,
+                                  int          site,
+                                  float       *r,
+                                  float       *g,
+                                  float       *b)
+{
+    float h, v, d, x;
+
+    switch(site)
+    {
+    case DM_SITE_R:
+    case DM_SITE_B:
+        x = 0.25f * (DM_N1 + DM_S1 + DM_W1 + DM_E1);
+        d = 0.25f * DM_DIAG;
+        *g = x;
+        *r = (site == DM_SITE_R) ? p[0] : d;
+        *b = (site == DM_SITE_R) ? d : p[0];
+        break;
+    default:
+        h  = 0.5f * (DM_W1 + DM_E1);
+        v  = 0.5f * (DM_N1 + DM_S1);
+        *g = p[0];
+        *r = (site == DM_SITE_GR) ? h : v;
+        *b = (site == DM_SITE_GR) ? v : h;
+        break;
+    }
+}
+
+static inline void dm_malvar_px(const float *p,
+                                long         s,
+                                int          site,
+                                float       *r,
+                                float       *g,
+                                float       *b)
+{
+    float h, v, d, x;
+    float c = p[0];
+
+    switch(site)
+    {
+    case DM_SITE_R:
+    case DM_SITE_B:
+        // G at R/B: [0 0 -1 0 0; 0 0 2 0 0; -1 2 4 2 -1; ...] / 8
+        x = 0.125f * (4.0f * c + 2.0f * (DM_N1 + DM_S1 + DM_W1 + DM_E1) -
+                      (DM_N2 + DM_S2 + DM_W2 + DM_E2));
+        // B at R, R at B: [0 0 -3/2 0 0; 0 2 0 2 0; -3/2 0 6 0 -3/2; ...] / 8
+        d = 0.125f * (6.0f * c + 2.0f * DM_DIAG -
+                      1.5f * (DM_N2 + DM_S2 + DM_W2 + DM_E2));
+        *g = x;
+        *r = (site == DM_SITE_R) ? c : d;
+        *b = (site == DM_SITE_R) ? d : c;
+        break;
+    default:
+        // color of the horizontal neighbors at G:
+        // [0 0 1/2 0 0; 0 -1 0 -1 0; -1 4 5 4 -1; ...] / 8
+        h = 0.125f * (5.0f * c + 4.0f * (DM_W1 + DM_E1) - DM_DIAG -
+                      (DM_W2 + DM_E2) + 0.5f * (DM_N2 + DM_S2));
+        // color of the vertical neighbors at G: transposed
+        v = 0.125f * (5.0f * c + 4.0f * (DM_N1 + DM_S1) - DM_DIAG -
+                      (DM_N2 + DM_S2) + 0.5f * (DM_W2 + DM_E2));
+        *g = c;
+        *r = (site == DM_SITE_GR) ? h : v;
+        *b = (site == DM_SITE_GR) ? v : h;
+        break;
+    }
+}
+
+/*
+Row kernels: n pixels from an even column, sites S0 (even) and S1 (odd)
+*/
+typedef void (*DM_ROWFN)(const float *p,
+                         long         s,
+                         long         n,
+                         float *__restrict r,
+                         float *__restrict g,
+                         float *__restrict b);
+
+#define DM_ROWFN_DEF(method, S0, S1)                                           \
+    static void dm_##method##_row_##S0(const float *p,                        \
+                                       long         s,                        \
+                                       long         n,                        \
+                                       float *__restrict r,                   \
+                                       float *__restrict g,                   \
+                                       float *__restrict b)                   \
+    {                                                                          \
+        long ii = 0;                                                           \
+        for(; ii + 1 < n; ii += 2)                                             \
+        {                                                                      \
+            dm_##method##_px(p + ii, s, S0, r + ii, g + ii, b + ii);           \
+            dm_##method##_px(p + ii + 1,                                       \
+                             s,                                                \
+                             S1,                                               \
+                             r + ii + 1,                                       \
+                             g + ii + 1,                                       \
+                             b + ii + 1);                                      \
+        }                                                                      \
+        if(ii < n)                                                             \
+        {                                                                      \
+            dm_##method##_px(p + ii, s, S0, r + ii, g + ii, b + ii);           \
+        }                                                                      \
+    }
+
+DM_ROWFN_DEF(bilinear, DM_SITE_R, DM_SITE_GR)
+DM_ROWFN_DEF(bilinear, DM_SITE_GR, DM_SITE_R)
+DM_ROWFN_DEF(bilinear, DM_SITE_B, DM_SITE_GB)
+DM_ROWFN_DEF(bilinear, DM_SITE_GB, DM_SITE_B)
+DM_ROWFN_DEF(malvar, DM_SITE_R, DM_SITE_GR)
+DM_ROWFN_DEF(malvar, DM_SITE_GR, DM_SITE_R)
+DM_ROWFN_DEF(malvar, DM_SITE_B, DM_SITE_GB)
+DM_ROWFN_DEF(malvar, DM_SITE_GB, DM_SITE_B)
+
+// Row kernels indexed by the site of the even column
+static const DM_ROWFN dm_bilinear_rowfn[4] = {dm_bilinear_row_DM_SITE_R,
+                                              dm_bilinear_row_DM_SITE_GR,
+                                              dm_bilinear_row_DM_SITE_B,
+                                              dm_bilinear_row_DM_SITE_GB
+                                             };
+static const DM_ROWFN dm_malvar_rowfn[4] = {dm_malvar_row_DM_SITE_R,
+                                            dm_malvar_row_DM_SITE_GR,
+                                            dm_malvar_row_DM_SITE_B,
+                                            dm_malvar_row_DM_SITE_GB
+                                           };
+
+/*
+Tile pool
+*/
+typedef struct
+{
+    const float *raw;
+    long         xsize;
+    long         ysize;
+    int          site[2][2]; // site type of CFA phase [jj & 1][ii & 1]
+    int          method;
+    float        labscale; // AHD: 1 / frame max
+    float       *outr;
+    float       *outg;
+    float       *outb;
+
+    long tilex;
+    long tiley;
+    long ntx;
+    long ntiles;
+
+    pthread_mutex_t mutex;
+    long            next;
+} DM_JOB;
+
+static long dm_next_tile(DM_JOB *job)
+{
+    pthread_mutex_lock(&job->mutex);
+    long tile = job->next++;
+    pthread_mutex_unlock(&job->mutex);
+
+    return (tile < job->ntiles) ? tile : -1;
+}
+
+// Mirror index i about the edge pixels of [0, n)
+static long dm_mirror(long i, long n)
+{
+    if(n == 1)
+    {
+        return 0;
+    }
+    while((i < 0) || (i >= n))
+    {
+        i = (i < 0) ? -i : 2 * (n - 1) - i;
+    }
+    return i;
+}
+
+// Copy w x h raw pixels from (x0, y0), mirrored outside the frame
+static void
+dm_copy_padded(const DM_JOB *job, long x0, long y0, long w, long h, float *dst)
+{
+    long xsize = job->xsize;
+
+    // columns inside the frame
+    long ia = (x0 < 0) ? -x0 : 0;
+    long ib = (x0 + w > xsize) ? xsize - x0 : w;
+
+    for(long y = 0; y < h; y++)
+    {
+        const float *src = job->raw + dm_mirror(y0 + y, job->ysize) * xsize;
+        float       *row = dst + y * w;
+        if(ib > ia)
+        {
+            memcpy(row + ia, src + x0 + ia, sizeof(float) * (ib - ia));
+        }
+        for(long x = 0; x < ia; x++)
+        {
+            row[x] = src[dm_mirror(x0 + x, xsize)];
+        }
+        for(long x = ib; x < w; x++)
+        {
+            row[x] = src[dm_mirror(x0 + x, xsize)];
+        }
+    }
+}
+
+static void dm_linear_tile(DM_JOB *job, long x0, long y0, long tw, long th,
+                           float *pad)
+{
+    long               xsize = job->xsize;
+    const DM_ROWFN    *rowfn = (job->method == RAWBAYER_DEMOSAIC_BILINEAR) ?
+                               dm_bilinear_rowfn : dm_malvar_rowfn;
+    const float       *src;
+    long               s;
+
+    if((x0 >= DM_MARGIN) && (y0 >= DM_MARGIN) &&
+            (x0 + tw + DM_MARGIN <= xsize) &&
+            (y0 + th + DM_MARGIN <= job->ysize))
+    {
+        src = job->raw + y0 * xsize + x0;
+        s   = xsize;
+    }
+    else
+    {
+        s = tw + 2 * DM_MARGIN;
+        dm_copy_padded(job,
+                       x0 - DM_MARGIN,
+                       y0 - DM_MARGIN,
+                       s,
+                       th + 2 * DM_MARGIN,
+                       pad);
+        src = pad + DM_MARGIN * s + DM_MARGIN;
+    }
+
+    for(long y = 0; y < th; y++)
+    {
+        long o = (y0 + y) * xsize + x0;
+        rowfn[job->site[(y0 + y) & 1][x0 & 1]](src + y * s,
+                                       s,
+                                       tw,
+                                       job->outr + o,
+                                       job->outg + o,
+                                       job->outb + o);
+    }
+}
+
+/*
+AHD
+*/
+static float         dm_labtab[DM_LAB_NTAB];
+static pthread_once_t dm_labtab_once = PTHREAD_ONCE_INIT;
+
+static void dm_labtab_init()
+{
+    for(int i = 0; i < DM_LAB_NTAB; i++)
+    {
+        double t     = (double) i / (DM_LAB_NTAB - 1);
+        dm_labtab[i] = (t > 0.008856) ? cbrt(t) : 7.787 * t + 16.0 / 116.0;
+    }
+}
+
+static inline float dm_labf(float t)
+{
+    long i = (long)(t * (DM_LAB_NTAB - 1) + 0.5f);
+    i      = (i < 0) ? 0 : ((i > DM_LAB_NTAB - 1) ? DM_LAB_NTAB - 1 : i);
+    return dm_labtab[i];
+}
+
+// Hamilton-Adams G at R/B, clamped to its two neighbors
+static inline float dm_ahd_g_dir(float c, float a, float b, float a2, float b2)
+{
+    float v  = 0.5f * (a + b) + 0.25f * (2.0f * c - a2 - b2);
+    float lo = (a < b) ? a : b;
+    float hi = (a < b) ? b : a;
+    return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+static inline void
+dm_ahd_g_px(const float *p, long s, int site, float *gh, float *gv)
+{
+    if((site == DM_SITE_GR) || (site == DM_SITE_GB))
+    {
+        *gh = p[0];
+        *gv = p[0];
+    }
+    else
+    {
+        *gh = dm_ahd_g_dir(p[0], DM_W1, DM_E1, DM_W2, DM_E2);
+        *gv = dm_ahd_g_dir(p[0], DM_N1, DM_S1, DM_N2, DM_S2);
+    }
+}
+
+// R and B from the raw - G differences of the neighbors, g: G plane
+static inline void dm_ahd_rb_px(const float *p,
+                                const float *g,
+                                long         s,
+                                int          site,
+                                float       *r,
+                                float       *gg,
+                                float       *b)
+{
+    float dh, dv, dd;
+
+    *gg = g[0];
+    switch(site)
+    {
+    case DM_SITE_R:
+    case DM_SITE_B:
+        dd = 0.25f * (p[-s - 1] - g[-s - 1] + p[-s + 1] - g[-s + 1] +
+                      p[s - 1] - g[s - 1] + p[s + 1] - g[s + 1]);
+        *r = (site == DM_SITE_R) ? p[0] : g[0] + dd;
+        *b = (site == DM_SITE_R) ? g[0] + dd : p[0];
+        break;
+    default:
+        dh = 0.5f * (p[-1] - g[-1] + p[1] - g[1]);
+        dv = 0.5f * (p[-s] - g[-s] + p[s] - g[s]);
+        *r = g[0] + ((site == DM_SITE_GR) ? dh : dv);
+        *b = g[0] + ((site == DM_SITE_GR) ? dv : dh);
+        break;
+    }
+}
+
+typedef void (*DM_AHD_G_ROWFN)(const float *p,
+                               long         s,
+                               long         n,
+                               float *__restrict gh,
+                               float *__restrict gv);
+
+typedef void (*DM_AHD_RB_ROWFN)(const float *p,
+                                const float *g,
+                                long         s,
+                                long         n,
+                                float *__restrict r,
+                                float *__restrict gg,
+                                float *__restrict b);
+
+#define DM_AHD_ROWFN_DEF(S0, S1)                                               \
+    static void dm_ahd_g_row_##S0(const float *p,                             \
+                                  long         s,                             \
+                                  long         n,                             \
+                                  float *__restrict gh,                       \
+                                  float *__restrict gv)                       \
+    {                                                                          \
+        long ii = 0;                                                           \
+        for(; ii + 1 < n; ii += 2)                                             \
+        {                                                                      \
+            dm_ahd_g_px(p + ii, s, S0, gh + ii, gv + ii);                      \
+            dm_ahd_g_px(p + ii + 1, s, S1, gh + ii + 1, gv + ii + 1);          \
+        }                                                                      \
+        if(ii < n)                                                             \
+        {                                                                      \
+            dm_ahd_g_px(p + ii, s, S0, gh + ii, gv + ii);                      \
+        }                                                                      \
+    }                                                                          \
+    static void dm_ahd_rb_row_##S0(const float *p,                            \
+                                   const float *g,                            \
+                                   long         s,                            \
+                                   long         n,                            \
+                                   float *__restrict r,                       \
+                                   float *__restrict gg,                      \
+                                   float *__restrict b)                       \
+    {                                                                          \
+        long ii = 0;                                                           \
+        for(; ii + 1 < n; ii += 2)                                             \
+        {                                                                      \
+            dm_ahd_rb_px(p + ii, g + ii, s, S0, r + ii, gg + ii, b + ii);      \
+            dm_ahd_rb_px(p + ii + 1,                                           \
+                         g + ii + 1,                                           \
+                         s,                                                    \
+                         S1,                                                   \
+                         r + ii + 1,                                           \
+                         gg + ii + 1,                                          \
+                         b + ii + 1);                                          \
+        }                                                                      \
+        if(ii < n)                                                             \
+        {                                                                      \
+            dm_ahd_rb_px(p + ii, g + ii, s, S0, r + ii, gg + ii, b + ii);      \
+        }                                                                      \
+    }
+
+DM_AHD_ROWFN_DEF(DM_SITE_R, DM_SITE_GR)
+DM_AHD_ROWFN_DEF(DM_SITE_GR, DM_SITE_R)
+DM_AHD_ROWFN_DEF(DM_SITE_B, DM_SITE_GB)
+DM_AHD_ROWFN_DEF(DM_SITE_GB, DM_SITE_B)
+
+static const DM_AHD_G_ROWFN dm_ahd_g_rowfn[4] = {dm_ahd_g_row_DM_SITE_R,
+                                                 dm_ahd_g_row_DM_SITE_GR,
+                                                 dm_ahd_g_row_DM_SITE_B,
+                                                 dm_ahd_g_row_DM_SITE_GB
+                                                };
+static const DM_AHD_RB_ROWFN dm_ahd_rb_rowfn[4] = {dm_ahd_rb_row_DM_SITE_R,
+                                                   dm_ahd_rb_row_DM_SITE_GR,
+                                                   dm_ahd_rb_row_DM_SITE_B,
+                                                   dm_ahd_rb_row_DM_SITE_GB
+                                                  };
+
+// AHD work buffers, w x w each
+typedef struct
+{
+    float   *pad;
+    float   *gd[2];     // G, horizontal and vertical interpolation
+    float   *rgb[2][3]; // R G B candidates
+    float   *lab[2][3]; // CIELab of the candidates
+    uint8_t *homo[2];   // homogeneity
+} DM_AHD_BUF;
+
+static void dm_ahd_tile(DM_JOB *job, long x0, long y0, long tw, long th,
+                        DM_AHD_BUF *buf)
+{
+    const long w  = DM_AHD_TILE + 2 * DM_AHD_MARGIN;
+    const long ww = tw + 2 * DM_AHD_MARGIN; // used width
+    const long wh = th + 2 * DM_AHD_MARGIN; // used height
+    const float *pad = buf->pad;
+
+    // buffers have row stride w, the padded tile starts at
+    // (x0 - DM_AHD_MARGIN, y0 - DM_AHD_MARGIN), even
+    for(long y = 0; y < wh; y++)
+    {
+        dm_copy_padded(job,
+                       x0 - DM_AHD_MARGIN,
+                       y0 - DM_AHD_MARGIN + y,
+                       ww,
+                       1,
+                       buf->pad + y * w);
+    }
+
+    // G, horizontal (d=0) and vertical (d=1)
+    for(long y = 2; y < wh - 2; y++)
+    {
+        long o = y * w + 2;
+        dm_ahd_g_rowfn[job->site[y & 1][0]](pad + o,
+                                            w,
+                                            ww - 4,
+                                            buf->gd[0] + o,
+                                            buf->gd[1] + o);
+    }
+
+    // R and B from the color differences, then CIELab
+    const float labscale = job->labscale;
+    for(int d = 0; d < 2; d++)
+        for(long y = 3; y < wh - 3; y++)
+        {
+            long   o = y * w + 3;
+            float *r = buf->rgb[d][0] + o;
+            float *g = buf->rgb[d][1] + o;
+            float *b = buf->rgb[d][2] + o;
+            dm_ahd_rb_rowfn[job->site[y & 1][1]](pad + o,
+                                                 buf->gd[d] + o,
+                                                 w,
+                                                 ww - 6,
+                                                 r,
+                                                 g,
+                                                 b);
+
+            float *L  = buf->lab[d][0] + o;
+            float *la = buf->lab[d][1] + o;
+            float *lb = buf->lab[d][2] + o;
+            for(long x = 0; x < ww - 6; x++)
+            {
+                // linear sRGB (D65) to XYZ, normalized to the white point
+                float vr = labscale * r[x];
+                float vg = labscale * g[x];
+                float vb = labscale * b[x];
+                float fx = dm_labf((0.412453f * vr + 0.357580f * vg +
+                                    0.180423f * vb) / 0.950456f);
+                float fy = dm_labf(0.212671f * vr + 0.715160f * vg +
+                                   0.072169f * vb);
+                float fz = dm_labf((0.019334f * vr + 0.119193f * vg +
+                                    0.950227f * vb) / 1.088754f);
+                L[x]  = 116.0f * fy - 16.0f;
+                la[x] = 500.0f * (fx - fy);
+                lb[x] = 200.0f * (fy - fz);
+            }
+        }
+
+    // Homogeneity: 4-neighbors within the adaptive L and ab thresholds
+    const long nboff[4] = {-1, 1, -w, w};
+    for(long y = 4; y < wh - 4; y++)
+        for(long x = 4; x < ww - 4; x++)
+        {
+            long  p = y * w + x;
+            float ldiff[2][4];
+            float abdiff[2][4];
+            for(int d = 0; d < 2; d++)
+            {
+                const float *L  = buf->lab[d][0];
+                const float *la = buf->lab[d][1];
+                const float *lb = buf->lab[d][2];
+                for(int i = 0; i < 4; i++)
+                {
+                    long  q      = p + nboff[i];
+                    float da     = la[p] - la[q];
+                    float db     = lb[p] - lb[q];
+                    ldiff[d][i]  = fabsf(L[p] - L[q]);
+                    abdiff[d][i] = da * da + db * db;
+                }
+            }
+            float leps  = fminf(fmaxf(ldiff[0][0], ldiff[0][1]),
+                                fmaxf(ldiff[1][2], ldiff[1][3]));
+            float abeps = fminf(fmaxf(abdiff[0][0], abdiff[0][1]),
+                                fmaxf(abdiff[1][2], abdiff[1][3]));
+            for(int d = 0; d < 2; d++)
+            {
+                int h = 0;
+                for(int i = 0; i < 4; i++)
+                {
+                    h += (ldiff[d][i] <= leps) && (abdiff[d][i] <= abeps);
+                }
+                buf->homo[d][p] = h;
+            }
+        }
+
+    // Direction with the most homogeneous 3x3 neighborhood, average if tied
+    for(long y = 0; y < th; y++)
+    {
+        long o = (y0 + y) * job->xsize + x0;
+        for(long x = 0; x < tw; x++)
+        {
+            long p = (y + DM_AHD_MARGIN) * w + x + DM_AHD_MARGIN;
+            int  hm[2];
+            for(int d = 0; d < 2; d++)
+            {
+                const uint8_t *h = buf->homo[d];
+                hm[d] = h[p - w - 1] + h[p - w] + h[p - w + 1] + h[p - 1] +
+                        h[p] + h[p + 1] + h[p + w - 1] + h[p + w] +
+                        h[p + w + 1];
+            }
+            float *out[3] = {job->outr, job->outg, job->outb};
+            for(int k = 0; k < 3; k++)
+            {
+                float vh = buf->rgb[0][k][p];
+                float vv = buf->rgb[1][k][p];
+                out[k][o + x] = (hm[0] > hm[1]) ? vh :
+                                ((hm[1] > hm[0]) ? vv : 0.5f * (vh + vv));
+            }
+        }
+    }
+}
+
+static void *dm_worker(void *ptr)
+{
+    DM_JOB *job  = (DM_JOB *) ptr;
+    long    tile;
+
+    float     *mem = NULL;
+    DM_AHD_BUF ahd;
+    if(job->method == RAWBAYER_DEMOSAIC_AHD)
+    {
+        long n = (DM_AHD_TILE + 2 * DM_AHD_MARGIN) *
+                 (DM_AHD_TILE + 2 * DM_AHD_MARGIN);
+        // pad, gd[2], rgb[2][3], lab[2][3], homo[2] (as floats)
+        mem = (float *) malloc(sizeof(float) * n * 17);
+        if(mem == NULL)
+        {
+            PRINT_ERROR("malloc returns NULL pointer");
+            abort(); // can't handle this error any other way
+        }
+        float *m = mem;
+        ahd.pad  = m;
+        m += n;
+        for(int d = 0; d < 2; d++)
+        {
+            ahd.gd[d] = m;
+            m += n;
+            for(int k = 0; k < 3; k++)
+            {
+                ahd.rgb[d][k] = m;
+                m += n;
+                ahd.lab[d][k] = m;
+                m += n;
+            }
+            ahd.homo[d] = (uint8_t *) m;
+            m += n;
+        }
+    }
+    else
+    {
+        mem = (float *) malloc(sizeof(float) * (DM_TILEX + 2 * DM_MARGIN) *
+                               (DM_TILEY + 2 * DM_MARGIN));
+        if(mem == NULL)
+        {
+            PRINT_ERROR("malloc returns NULL pointer");
+            abort(); // can't handle this error any other way
+        }
+    }
+
+    while((tile = dm_next_tile(job)) != -1)
+    {
+        long x0 = (tile % job->ntx) * job->tilex;
+        long y0 = (tile / job->ntx) * job->tiley;
+        long tw = (x0 + job->tilex > job->xsize) ? job->xsize - x0 : job->tilex;
+        long th = (y0 + job->tiley > job->ysize) ? job->ysize - y0 : job->tiley;
+
+        if(job->method == RAWBAYER_DEMOSAIC_AHD)
+        {
+            dm_ahd_tile(job, x0, y0, tw, th, &ahd);
+        }
+        else
+        {
+            dm_linear_tile(job, x0, y0, tw, th, mem);
+        }
+    }
+
+    free(mem);
+
+    return NULL;
+}
+
+errno_t rawbayer_demosaic(const float        *raw,
+                          long                xsize,
+                          long                ysize,
+                          const RAWBAYER_CFA *cfa,
+                          int                 method,
+                          int                 nthreads,
+                          float              *outr,
+                          float              *outg,
+                          float              *outb)
+{
+    if((cfa->pattern < RAWBAYER_CFA_RGGB) || (cfa->pattern > RAWBAYER_CFA_BGGR))
+    {
+        PRINT_ERROR("invalid CFA pattern %d", cfa->pattern);
+        return RETURN_FAILURE;
+    }
+    if((method < RAWBAYER_DEMOSAIC_BILINEAR) ||
+            (method > RAWBAYER_DEMOSAIC_AHD))
+    {
+        PRINT_ERROR("unknown demosaic method %d", method);
+        return RETURN_FAILURE;
+    }
+
+    DM_JOB job;
+    memset(&job, 0, sizeof(DM_JOB));
+    job.raw    = raw;
+    job.xsize  = xsize;
+    job.ysize  = ysize;
+    job.method = method;
+    job.outr   = outr;
+    job.outg   = outg;
+    job.outb   = outb;
+    int layout[2][2];
+    rawbayer_cfa_layout(cfa, layout);
+    for(int py = 0; py < 2; py++)
+        for(int px = 0; px < 2; px++)
+        {
+            job.site[py][px] = dm_site(layout, py, px);
+        }
+
+    if(method == RAWBAYER_DEMOSAIC_AHD)
+    {
+        pthread_once(&dm_labtab_once, dm_labtab_init);
+
+        float vmax = 0.0f;
+        for(long ii = 0; ii < xsize * ysize; ii++)
+        {
+            vmax = (raw[ii] > vmax) ? raw[ii] : vmax;
+        }
+        job.labscale = (vmax > 0.0f) ? 1.0f / vmax : 1.0f;
+        job.tilex    = DM_AHD_TILE;
+        job.tiley    = DM_AHD_TILE;
+    }
+    else
+    {
+        job.tilex = DM_TILEX;
+        job.tiley = DM_TILEY;
+    }
+    job.ntx    = (xsize + job.tilex - 1) / job.tilex;
+    job.ntiles = job.ntx * ((ysize + job.tiley - 1) / job.tiley);
+
+    if(nthreads <= 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(nthreads > job.ntiles)
+    {
+        nthreads = job.ntiles;
+    }
+
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+    if(threads == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        pthread_mutex_destroy(&job.mutex);
+        return RETURN_FAILURE;
+    }
+    // The caller is worker 0 and drains whatever tiles are left if some
+    // threads could not be started
+    int nstarted = 1;
+    while(nstarted < nthreads &&
+            pthread_create(&threads[nstarted], NULL, dm_worker, &job) == 0)
+    {
+        nstarted++;
+    }
+    dm_worker(&job);
+    for(int t = 1; t < nstarted; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.mutex);
+
+    return RETURN_SUCCESS;
+}
+
+#define COPY_CAST_TOF(out, in, n)                                             \
+    for(long ii = 0; ii < (n); ++ii)                                          \
+    {                                                                         \
+        (out)[ii] = (float) (in)[ii];                                         \
+    }
+
+static errno_t dm_copy_cast(float *out, IMGID in_img, long n_pixels)
+{
+    switch(in_img.md->datatype)
+    {
+    case _DATATYPE_UINT8:
+        COPY_CAST_TOF(out, in_img.im->array.UI8, n_pixels);
+        break;
+    case _DATATYPE_INT8:
+        COPY_CAST_TOF(out, in_img.im->array.SI8, n_pixels);
+        break;
+    case _DATATYPE_UINT16:
+        COPY_CAST_TOF(out, in_img.im->array.UI16, n_pixels);
+        break;
+    case _DATATYPE_INT16:
+        COPY_CAST_TOF(out, in_img.im->array.SI16, n_pixels);
+        break;
+    case _DATATYPE_UINT32:
+        COPY_CAST_TOF(out, in_img.im->array.UI32, n_pixels);
+        break;
+    case _DATATYPE_INT32:
+        COPY_CAST_TOF(out, in_img.im->array.SI32, n_pixels);
+        break;
+    case _DATATYPE_UINT64:
+        COPY_CAST_TOF(out, in_img.im->array.UI64, n_pixels);
+        break;
+    case _DATATYPE_INT64:
+        COPY_CAST_TOF(out, in_img.im->array.SI64, n_pixels);
+        break;
+    case _DATATYPE_DOUBLE:
+        COPY_CAST_TOF(out, in_img.im->array.D, n_pixels);
+        break;
+    case _DATATYPE_COMPLEX_FLOAT:
+    case _DATATYPE_COMPLEX_DOUBLE:
+    default:
+        PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+        return RETURN_FAILURE;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static float *dm_create_output(const char *name, long xsize, long ysize)
+{
+    if(image_ID(name) != -1)
+    {
+        delete_image_ID(name, DELETE_IMAGE_ERRMODE_WARNING);
+    }
+    IMGID img    = makeIMGID_2D(name, xsize, ysize);
+    img.datatype = _DATATYPE_FLOAT;
+    imcreateIMGID(&img);
+    resolveIMGID(&img, ERRMODE_ABORT);
+
+    return img.im->array.F;
+}
+
+errno_t image_format_demosaic(const char *in_name,
+                              int         method,
+                              const char *cfa_spec,
+                              int         nthreads,
+                              const char *outr_name,
+                              const char *outg_name,
+                              const char *outb_name)
+{
+    IMGID in_img = mkIMGID_from_name(in_name);
+    resolveIMGID(&in_img, ERRMODE_ABORT);
+
+    RAWBAYER_CFA cfa;
+    if(rawbayer_cfa_resolve(cfa_spec, in_img, &cfa) != RETURN_SUCCESS)
+    {
+        return RETURN_FAILURE;
+    }
+
+    long xsize    = in_img.md->size[0];
+    long ysize    = in_img.md->size[1];
+    long n_pixels = xsize * ysize;
+
+    // float input is used in place
+    const float *raw   = in_img.im->array.F;
+    float       *frame = NULL;
+    if(in_img.md->datatype != _DATATYPE_FLOAT)
+    {
+        frame = (float *) malloc(sizeof(float) * n_pixels);
+        if(frame == NULL)
+        {
+            PRINT_ERROR("malloc returns NULL pointer");
+            return RETURN_FAILURE;
+        }
+        if(dm_copy_cast(frame, in_img, n_pixels) != RETURN_SUCCESS)
+        {
+            free(frame);
+            return RETURN_FAILURE;
+        }
+        raw = frame;
+    }
+
+    float *outr = dm_create_output(outr_name, xsize, ysize);
+    float *outg = dm_create_output(outg_name, xsize, ysize);
+    float *outb = dm_create_output(outb_name, xsize, ysize);
+
+    errno_t status = rawbayer_demosaic(raw,
+                                       xsize,
+                                       ysize,
+                                       &cfa,
+                                       method,
+                                       nthreads,
+                                       outr,
+                                       outg,
+                                       outb);
+    free(frame);
+
+    return status;
+}
+
+/*
+BOILERPLATE
+*/
+
+static errno_t compute_function()
+{
+    DEBUG_TRACE_FSTART();
+    INSERT_STD_PROCINFO_COMPUTEFUNC_START
+
+    image_format_demosaic(in_name,
+                          *ptr_method,
+                          cfa_spec,
+                          *ptr_nthreads,
+                          outr_name,
+                          outg_name,
+                          outb_name);
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    DEBUG_TRACE_FEXIT();
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_image_format__demosaic()
+{
+    INSERT_STD_CLIREGISTERFUNC
+    return RETURN_SUCCESS;
+}
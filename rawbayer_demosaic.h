@@ -0,0 +1,31 @@
+#ifndef IMAGE_FORMAT_RAWBAYER_DEMOSAIC_H
+#define IMAGE_FORMAT_RAWBAYER_DEMOSAIC_H
+
+#include "rawbayer_cfa.h"
+
+// Demosaic methods
+#define RAWBAYER_DEMOSAIC_BILINEAR 0
+#define RAWBAYER_DEMOSAIC_MALVAR   1
+#define RAWBAYER_DEMOSAIC_AHD      2
+
+errno_t rawbayer_demosaic(const float        *raw,
+                          long                xsize,
+                          long                ysize,
+                          const RAWBAYER_CFA *cfa,
+                          int                 method,
+                          int                 nthreads,
+                          float              *outr,
+                          float              *outg,
+                          float              *outb);
+
+errno_t image_format_demosaic(const char *in_name,
+                              int         method,
+                              const char *cfa_spec,
+                              int         nthreads,
+                              const char *outr_name,
+                              const char *outg_name,
+                              const char *outb_name);
+
+errno_t CLIADDCMD_image_format__demosaic();
+
+#endif // IMAGE_FORMAT_RAWBAYER_DEMOSAIC_H
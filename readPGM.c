@@ -8,134 +8,92 @@
 /**
  * ## Purpose
  *
- *  reads PGM images (16 bit only)
+ *  reads a PGM image (16 bit only) from an open stream into a newly
+ *  allocated float array, to be freed by the caller
  *
- * @note written to read output of "dcraw -t 0 -D -4 xxx.CR2" into FITS
+ * Rows are flipped: the first row of the file is the last row of the image.
  */
-imageID read_PGMimage(const char *__restrict fname,
-                      const char *__restrict ID_name)
+errno_t read_PGMstream(FILE *fp, float **array, long *xsize, long *ysize)
 {
-    FILE   *fp;
-    imageID ID;
+    char magic[3];
+    long maxval;
 
-    if((fp = fopen(fname, "r")) == NULL)
+    if((fscanf(fp, "%2s %ld %ld %ld", magic, xsize, ysize, &maxval) != 4) ||
+            (strcmp(magic, "P5") != 0))
     {
-        fprintf(stderr, "ERROR: cannot open file \"%s\"\n", fname);
-        ID = -1;
+        PRINT_ERROR("File is not PGM image");
+        return RETURN_FAILURE;
     }
-    else
+    if(maxval != 65535)
     {
-        char   line1[100];
-        long   xsize, ysize;
-        long   maxval;
-        long   ii, jj;
-        double val;
+        PRINT_ERROR("Not 16-bit image. Cannot read");
+        return RETURN_FAILURE;
+    }
+    fgetc(fp);
 
-        {
-            int fscanfcnt = fscanf(fp, "%s", line1);
-            if(fscanfcnt == EOF)
-            {
-                if(ferror(fp))
-                {
-                    perror("fscanf");
-                }
-                else
-                {
-                    fprintf(stderr,
-                            "Error: fscanf reached end of file, no matching "
-                            "characters, no matching failure\n");
-                }
-                exit(EXIT_FAILURE);
-            }
-            else if(fscanfcnt != 1)
-            {
-                fprintf(stderr,
-                        "Error: fscanf successfully matched and assigned %i "
-                        "input items, 1 expected\n",
-                        fscanfcnt);
-                exit(EXIT_FAILURE);
-            }
-        }
+    printf("PGM image size: %ld x %ld\n", *xsize, *ysize);
 
-        if(strcmp(line1, "P5") != 0)
+    float   *im  = (float *) malloc(sizeof(float) * (*xsize) * (*ysize));
+    uint8_t *row = (uint8_t *) malloc(2 * (*xsize));
+    if((im == NULL) || (row == NULL))
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        free(im);
+        free(row);
+        return RETURN_FAILURE;
+    }
+
+    for(long jj = 0; jj < *ysize; jj++)
+    {
+        if(fread(row, 2, *xsize, fp) != (size_t)(*xsize))
         {
-            fprintf(stderr, "ERROR: File is not PGM image\n");
+            PRINT_ERROR("PGM image truncated");
+            free(im);
+            free(row);
+            return RETURN_FAILURE;
         }
-        else
+        float *out = im + (*ysize - jj - 1) * (*xsize);
+        for(long ii = 0; ii < *xsize; ii++)
         {
-            int fscanfcnt = fscanf(fp, "%ld %ld", &xsize, &ysize);
-            if(fscanfcnt == EOF)
-            {
-                if(ferror(fp))
-                {
-                    perror("fscanf");
-                }
-                else
-                {
-                    fprintf(stderr,
-                            "Error: fscanf reached end of file, no matching "
-                            "characters, no matching failure\n");
-                }
-                exit(EXIT_FAILURE);
-            }
-            else if(fscanfcnt != 2)
-            {
-                fprintf(stderr,
-                        "Error: fscanf successfully matched and assigned %i "
-                        "input items, 2 expected\n",
-                        fscanfcnt);
-                exit(EXIT_FAILURE);
-            }
+            out[ii] = 256.0f * row[2 * ii] + row[2 * ii + 1];
+        }
+    }
+    free(row);
 
-            printf("PGM image size: %ld x %ld\n", xsize, ysize);
+    *array = im;
 
-            fscanfcnt = fscanf(fp, "%ld", &maxval);
-            if(fscanfcnt == EOF)
-            {
-                if(ferror(fp))
-                {
-                    perror("fscanf");
-                }
-                else
-                {
-                    fprintf(stderr,
-                            "Error: fscanf reached end of file, no matching "
-                            "characters, no matching failure\n");
-                }
-                exit(EXIT_FAILURE);
-            }
-            else if(fscanfcnt != 1)
-            {
-                fprintf(stderr,
-                        "Error: fscanf successfully matched and assigned %i "
-                        "input items, 1 expected\n",
-                        fscanfcnt);
-                exit(EXIT_FAILURE);
-            }
+    return RETURN_SUCCESS;
+}
 
-            if(maxval != 65535)
-            {
-                fprintf(stderr, "Not 16-bit image. Cannot read\n");
-            }
-            else
-            {
-                printf("Reading PGM image\n");
-                create_2Dimage_ID(ID_name, xsize, ysize, &ID);
-                fgetc(fp);
-                for(jj = 0; jj < ysize; jj++)
-                {
-                    for(ii = 0; ii < xsize; ii++)
-                    {
-                        val =
-                            256.0 * ((int) fgetc(fp)) + 1.0 * ((int) fgetc(fp));
-                        data.image[ID].array.F[(ysize - jj - 1) * xsize + ii] =
-                            val;
-                    }
-                }
-            }
-        }
-        fclose(fp);
+/**
+ * ## Purpose
+ *
+ *  reads PGM images (16 bit only)
+ *
+ * @note written to read output of "dcraw -t 0 -D -4 xxx.CR2" into FITS
+ */
+imageID read_PGMimage(const char *__restrict fname,
+                      const char *__restrict ID_name)
+{
+    FILE   *fp;
+    imageID ID = -1;
+    float  *array;
+    long    xsize, ysize;
+
+    if((fp = fopen(fname, "r")) == NULL)
+    {
+        fprintf(stderr, "ERROR: cannot open file \"%s\"\n", fname);
+        return ID;
+    }
+
+    if(read_PGMstream(fp, &array, &xsize, &ysize) == RETURN_SUCCESS)
+    {
+        printf("Reading PGM image\n");
+        create_2Dimage_ID(ID_name, xsize, ysize, &ID);
+        memcpy(data.image[ID].array.F, array, sizeof(float) * xsize * ysize);
+        free(array);
     }
+    fclose(fp);
 
     return ID;
 }
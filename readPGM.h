@@ -1,5 +1,7 @@
 /** @file readPGM.h
  */
 
+errno_t read_PGMstream(FILE *fp, float **array, long *xsize, long *ysize);
+
 imageID read_PGMimage(const char *__restrict fname,
                       const char *__restrict ID_name);
@@ -0,0 +1,595 @@
+/**
+ * @file    stream_HDR.c
+ * @brief   Live HDR fusion of an exposure-bracketed image stream
+ *
+ * The camera cycles through a set of exposure times, frame by frame, and
+ * writes the exposure time of each frame into a keyword.
+ *
+ * Input: raw camera stream name (2D, integer or float)
+ * Input: output HDR stream name, created (float32) if needed
+ * Input: exposure time keyword name (keyword of type L or D)
+ * Input: number of exposures per bracket K
+ * Input: saturation level, bias level (as combineHDR)
+ * Input: layer map bin step
+ * Input: layer map update gain, in ]0, 1]
+ *
+ * The last frame of each exposure time is kept in a ring of K slots, keyed
+ * by the exposure keyword and sorted by decreasing exposure time (layer 0 is
+ * the longest exposure, as in combineHDR). A frame with an exposure time not
+ * in the ring once all K slots are assigned resets the ring.
+ *
+ * Each time every slot has been refreshed since the previous output, the
+ * bracket is complete and fused into the output stream with the combineHDR
+ * layer map scheme. The layer map is built in full from the first bracket
+ * only; each following bracket moves it towards the new minimum layer map by
+ * the update gain, followed by a single smoothing round (cost of one
+ * recursive gaussian pass over the binned map).
+ */
+
+#include <math.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "combineHDR_kernels.h"
+#include "stream_HDR.h"
+
+// Relative tolerance matching an exposure keyword value to a ring slot
+#define HDRS_ETIME_RTOL 1e-3
+
+// Local variables pointers
+static char    *in_name;
+static char    *out_name;
+static char    *etime_kwname;
+static int32_t *ptr_nexp;
+static double  *ptr_satlevel;
+static double  *ptr_biaslevel;
+static int32_t *ptr_binstep;
+static double  *ptr_mapgain;
+
+static CLICMDARGDEF farg[] = {{
+        CLIARG_IMG,
+        ".in_name",
+        "input image",
+        "im1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &in_name,
+        NULL
+    },
+    {
+        CLIARG_STR_NOT_IMG,
+        ".out_name",
+        "output HDR stream",
+        "outHDR",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &out_name,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".kwname",
+        "exposure time keyword",
+        "EXPTIME",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &etime_kwname,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".nexp",
+        "Exposures per bracket",
+        "3",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_nexp,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".satlevel",
+        "Saturation level",
+        "65000",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_satlevel,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".biaslevel",
+        "Bias level",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_biaslevel,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".binstep",
+        "Layer map bin step",
+        "5",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_binstep,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".mapgain",
+        "Layer map update gain",
+        "0.25",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_mapgain,
+        NULL
+    }
+};
+
+static CLICMDDATA CLIcmddata = {"streamHDR",
+                                "live HDR from exposure-bracketed stream",
+                                CLICMD_FIELDS_DEFAULTS
+                               };
+
+static errno_t help_function()
+{
+    printf("Fuse each complete bracket of nexp exposures of a stream into\n");
+    printf("an HDR output stream. Exposure time read from keyword kwname.\n");
+    printf("Layer map built from the first bracket, then updated with gain\n");
+    printf("mapgain and one smoothing round per bracket.\n");
+    return RETURN_SUCCESS;
+}
+
+/*
+THE IMPORTANT, CUSTOM PART
+*/
+
+#define COPY_CAST_TOF(out, in, n)                                             \
+    for(long ii = 0; ii < (n); ++ii)                                          \
+    {                                                                         \
+        (out)[ii] = (float) (in)[ii];                                         \
+    }
+
+static errno_t
+hdrs_copy_cast(float *out, IMGID in_img, long n_pixels)
+{
+    switch(in_img.md->datatype)
+    {
+    case _DATATYPE_UINT8:
+        COPY_CAST_TOF(out, in_img.im->array.UI8, n_pixels);
+        break;
+    case _DATATYPE_INT8:
+        COPY_CAST_TOF(out, in_img.im->array.SI8, n_pixels);
+        break;
+    case _DATATYPE_UINT16:
+        COPY_CAST_TOF(out, in_img.im->array.UI16, n_pixels);
+        break;
+    case _DATATYPE_INT16:
+        COPY_CAST_TOF(out, in_img.im->array.SI16, n_pixels);
+        break;
+    case _DATATYPE_UINT32:
+        COPY_CAST_TOF(out, in_img.im->array.UI32, n_pixels);
+        break;
+    case _DATATYPE_INT32:
+        COPY_CAST_TOF(out, in_img.im->array.SI32, n_pixels);
+        break;
+    case _DATATYPE_UINT64:
+        COPY_CAST_TOF(out, in_img.im->array.UI64, n_pixels);
+        break;
+    case _DATATYPE_INT64:
+        COPY_CAST_TOF(out, in_img.im->array.SI64, n_pixels);
+        break;
+    case _DATATYPE_FLOAT:
+        memcpy(out, in_img.im->array.F, sizeof(float) * n_pixels);
+        break;
+    case _DATATYPE_DOUBLE:
+        COPY_CAST_TOF(out, in_img.im->array.D, n_pixels);
+        break;
+    case _DATATYPE_COMPLEX_FLOAT:
+    case _DATATYPE_COMPLEX_DOUBLE:
+    default:
+        PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+        return RETURN_FAILURE;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/*
+Exposure time of the current frame, from keyword kwname
+Returns 1 if the keyword is missing or not numeric
+*/
+static int hdrs_read_etime(IMGID in_img, const char *kwname, float *etime)
+{
+    for(int kw = 0; kw < in_img.md->NBkw; ++kw)
+    {
+        if(strcmp(in_img.im->kw[kw].name, kwname) == 0)
+        {
+            switch(in_img.im->kw[kw].type)
+            {
+            case 'L':
+                *etime = (float) in_img.im->kw[kw].value.numl;
+                return 0;
+            case 'D':
+                *etime = (float) in_img.im->kw[kw].value.numf;
+                return 0;
+            default:
+                return 1;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+Exposure ring: K layers of the full resolution cube and of the binned cube,
+sorted by decreasing exposure time
+*/
+typedef struct
+{
+    int       nexp;
+    int       nslot; // slots assigned so far
+    long      n_pixels;
+    long      n1;
+    float    *etime;
+    uint64_t *seq; // input frame count when the slot was last written
+    float    *cube;
+    float    *c1;
+} HDRS_RING;
+
+/*
+Slot for exposure time etime, inserted in decreasing exposure order if new
+Returns -1 if the ring is full and etime is not in it
+*/
+static int hdrs_ring_slot(HDRS_RING *ring, float etime)
+{
+    int pos = 0;
+    while(pos < ring->nslot && ring->etime[pos] > etime)
+    {
+        if(fabs(ring->etime[pos] - etime) <= HDRS_ETIME_RTOL * etime)
+        {
+            return pos;
+        }
+        pos++;
+    }
+    if(pos < ring->nslot &&
+            fabs(ring->etime[pos] - etime) <= HDRS_ETIME_RTOL * etime)
+    {
+        return pos;
+    }
+    if(ring->nslot == ring->nexp)
+    {
+        return -1;
+    }
+
+    // Shift shorter exposures up one layer (bracket acquisition only)
+    int nmove = ring->nslot - pos;
+    memmove(ring->etime + pos + 1, ring->etime + pos, sizeof(float) * nmove);
+    memmove(ring->seq + pos + 1, ring->seq + pos, sizeof(uint64_t) * nmove);
+    memmove(ring->cube + (pos + 1) * ring->n_pixels,
+            ring->cube + pos * ring->n_pixels,
+            sizeof(float) * ring->n_pixels * nmove);
+    memmove(ring->c1 + (pos + 1) * ring->n1,
+            ring->c1 + pos * ring->n1,
+            sizeof(float) * ring->n1 * nmove);
+    ring->etime[pos] = etime;
+    ring->seq[pos]   = 0;
+    ring->nslot++;
+
+    return pos;
+}
+
+/*
+Layer map update from the current bracket:
+full build (HDR_LAYER_CLAMPROUNDS rounds) if first, else move by mapgain
+towards the new minimum layer map and run one round
+*/
+static void hdrs_layermap_update(HDRS_RING *ring,
+                                 float     *layermap,
+                                 float     *layermapg,
+                                 float     *layermin,
+                                 uint32_t   xsize1,
+                                 uint32_t   ysize1,
+                                 float      satvalue,
+                                 float      mapgain,
+                                 int        first)
+{
+    long  n1    = ring->n1;
+    float sigma = sqrt(HDR_TAP3_VAR * HDR_LAYER_NBFITER /
+                       HDR_LAYER_CLAMPROUNDS);
+
+    hdr_layermin(ring->c1, n1, ring->nexp, satvalue, layermin);
+
+    int nround = 1;
+    if(first)
+    {
+        memcpy(layermap, layermin, sizeof(float) * n1);
+        nround = HDR_LAYER_CLAMPROUNDS;
+    }
+    else
+    {
+        for(long ij1 = 0; ij1 < n1; ij1++)
+        {
+            layermap[ij1] += mapgain * (layermin[ij1] - layermap[ij1]);
+        }
+    }
+
+    for(int round = 0; round < nround; round++)
+    {
+        hdr_gauss_iir(layermap, xsize1, ysize1, sigma);
+        for(long ij1 = 0; ij1 < n1; ij1++)
+        {
+            if(layermap[ij1] < layermin[ij1])
+            {
+                layermap[ij1] = layermin[ij1];
+            }
+        }
+    }
+
+    memcpy(layermapg, layermap, sizeof(float) * n1);
+    hdr_gauss_iir(layermapg, xsize1, ysize1, HDR_LAYERG_SIGMA);
+}
+
+/*
+BOILERPLATE
+*/
+
+static errno_t compute_function()
+{
+    DEBUG_TRACE_FSTART();
+
+    IMGID in_img = mkIMGID_from_name(in_name);
+    resolveIMGID(&in_img, ERRMODE_ABORT);
+
+    // Set in_img to be the trigger
+    strcpy(CLIcmddata.cmdsettings->triggerstreamname, in_name);
+    // for FPS mode:
+    if(data.fpsptr != NULL)
+    {
+        strcpy(data.fpsptr->cmdset.triggerstreamname, in_name);
+    }
+
+    uint32_t xsize    = in_img.md->size[0];
+    uint32_t ysize    = in_img.md->size[1];
+    long     n_pixels = (long) xsize * ysize;
+
+    int nexp = *ptr_nexp;
+    if(nexp < 1)
+    {
+        PRINT_ERROR("nexp %d: at least one exposure per bracket", nexp);
+        abort(); // can't handle this error any other way
+    }
+
+    // At least 2 x 2 bins for the layer map interpolation
+    int binstep = *ptr_binstep;
+    if(binstep < 1 || xsize / binstep < 2 || ysize / binstep < 2)
+    {
+        PRINT_WARNING("binstep %d out of range, using 1", binstep);
+        binstep = 1;
+    }
+    uint32_t xsize1 = xsize / binstep;
+    uint32_t ysize1 = ysize / binstep;
+    long     n1     = (long) xsize1 * ysize1;
+
+    float mapgain = *ptr_mapgain;
+    if(mapgain <= 0.0 || mapgain > 1.0)
+    {
+        PRINT_WARNING("mapgain %f out of ]0, 1], using 1", mapgain);
+        mapgain = 1.0;
+    }
+
+    // Resolve or create output, per need
+    IMGID out_img = mkIMGID_from_name(out_name);
+    if(resolveIMGID(&out_img, ERRMODE_WARN) ||
+            out_img.md->size[0] != xsize || out_img.md->size[1] != ysize ||
+            out_img.md->datatype != _DATATYPE_FLOAT)
+    {
+        PRINT_WARNING("WARNING - output image being (re)created");
+        out_img          = makeIMGID_2D(out_name, xsize, ysize);
+        out_img.datatype = _DATATYPE_FLOAT;
+        out_img.shared   = 1;
+        imcreateIMGID(&out_img);
+        resolveIMGID(&out_img, ERRMODE_ABORT);
+    }
+
+    /*
+    SETUP
+    */
+    HDRS_RING ring;
+    ring.nexp     = nexp;
+    ring.nslot    = 0;
+    ring.n_pixels = n_pixels;
+    ring.n1       = n1;
+    ring.etime    = (float *) malloc(sizeof(float) * nexp);
+    ring.seq      = (uint64_t *) malloc(sizeof(uint64_t) * nexp);
+    ring.cube     = (float *) malloc(sizeof(float) * n_pixels * nexp);
+    ring.c1       = (float *) malloc(sizeof(float) * n1 * nexp);
+
+    float *frame     = (float *) malloc(sizeof(float) * n_pixels);
+    float *c1w       = (float *) malloc(sizeof(float) * n1);
+    float *layermap  = (float *) malloc(sizeof(float) * n1);
+    float *layermapg = (float *) malloc(sizeof(float) * n1);
+    float *layermin  = (float *) malloc(sizeof(float) * n1);
+
+    // Compose input: the ring slots, in exposure order
+    const float **layers = (const float **) malloc(sizeof(float *) * nexp);
+    for(int kk = 0; kk < nexp; kk++)
+    {
+        layers[kk] = ring.cube + kk * n_pixels;
+    }
+
+    // Full resolution column/row to bin maps, and pixel counts per bin
+    uint32_t *xbin   = (uint32_t *) malloc(sizeof(uint32_t) * xsize);
+    uint32_t *ybin   = (uint32_t *) malloc(sizeof(uint32_t) * ysize);
+    uint32_t *xcount = (uint32_t *) calloc(xsize1, sizeof(uint32_t));
+    uint32_t *ycount = (uint32_t *) calloc(ysize1, sizeof(uint32_t));
+    for(uint32_t ii = 0; ii < xsize; ii++)
+    {
+        float x  = 1.0 * ii / xsize;
+        xbin[ii] = (uint32_t)(x * xsize1);
+        xcount[xbin[ii]]++;
+    }
+    for(uint32_t jj = 0; jj < ysize; jj++)
+    {
+        float y  = 1.0 * jj / ysize;
+        ybin[jj] = (uint32_t)(y * ysize1);
+        ycount[ybin[jj]]++;
+    }
+
+    // HOUSEKEEPING
+    uint64_t cnt0_last  = in_img.md->cnt0;
+    uint64_t seq        = 0; // frames taken into the ring
+    uint64_t seq_fused  = 0; // value of seq at the last output
+    int      map_valid  = FALSE;
+    int      kw_missing = FALSE;
+
+    PRINT_WARNING("Exposures per bracket: %d  keyword: %s",
+                  nexp,
+                  etime_kwname);
+
+    /*
+    PROCESSINFO INIT
+    */
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+    // PROCESSINFO* processinfo now available
+
+    /*
+    LOOP
+    */
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    {
+        uint64_t cnt0_now = in_img.md->cnt0;
+        if(cnt0_now == cnt0_last)
+        {
+            continue; // No new frame: do not take the same frame twice
+        }
+        cnt0_last = cnt0_now;
+
+        float etime = 0.0;
+        if(hdrs_read_etime(in_img, etime_kwname, &etime) || etime <= 0.0)
+        {
+            if(!kw_missing)
+            {
+                PRINT_WARNING("keyword %s missing or invalid, frame skipped",
+                              etime_kwname);
+                kw_missing = TRUE;
+            }
+            continue;
+        }
+        kw_missing = FALSE;
+
+        int slot = hdrs_ring_slot(&ring, etime);
+        if(slot < 0)
+        {
+            PRINT_WARNING("exposure time %g not in bracket, ring reset",
+                          etime);
+            ring.nslot = 0;
+            map_valid  = FALSE;
+            slot       = hdrs_ring_slot(&ring, etime);
+        }
+
+        /*
+        STORE
+        Bias-subtracted frame and smoothed binned frame into the slot
+        */
+        if(hdrs_copy_cast(frame, in_img, n_pixels) != RETURN_SUCCESS)
+        {
+            abort(); // can't handle this error any other way
+        }
+        float *c1 = ring.c1 + slot * n1;
+        memset(c1, 0, sizeof(float) * n1);
+        hdr_bin_exposure(frame,
+                         *ptr_biaslevel,
+                         ring.cube + slot * n_pixels,
+                         c1,
+                         c1w,
+                         xbin,
+                         ybin,
+                         xcount,
+                         ycount,
+                         xsize,
+                         ysize,
+                         xsize1,
+                         ysize1);
+        hdr_gauss_iir(c1, xsize1, ysize1, sqrt(HDR_TAP3_VAR * HDR_BIN_NBFITER));
+        ring.seq[slot] = ++seq;
+
+        /*
+        FUSE
+        Complete bracket: every slot written since the last output
+        */
+        int complete = (ring.nslot == nexp);
+        for(int k = 0; k < ring.nslot && complete; k++)
+        {
+            complete = (ring.seq[k] > seq_fused);
+        }
+        if(!complete)
+        {
+            continue;
+        }
+
+        hdrs_layermap_update(&ring,
+                             layermap,
+                             layermapg,
+                             layermin,
+                             xsize1,
+                             ysize1,
+                             *ptr_satlevel,
+                             mapgain,
+                             !map_valid);
+        map_valid = TRUE;
+        seq_fused = seq;
+
+        out_img.md->write = TRUE;
+        hdr_compose_rows(out_img.im->array.F,
+                         NULL,
+                         NULL,
+                         layers,
+                         layermap,
+                         layermapg,
+                         ring.etime,
+                         1.0,
+                         0.0,
+                         xsize,
+                         ysize,
+                         xsize1,
+                         ysize1,
+                         nexp,
+                         0,
+                         ysize);
+        processinfo_update_output_stream(processinfo, out_img.ID);
+    }
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    /*
+    TEARDOWN
+    */
+    free(ring.etime);
+    free(ring.seq);
+    free(ring.cube);
+    free(layers);
+    free(ring.c1);
+    free(frame);
+    free(c1w);
+    free(layermap);
+    free(layermapg);
+    free(layermin);
+    free(xbin);
+    free(ybin);
+    free(xcount);
+    free(ycount);
+
+    DEBUG_TRACE_FEXIT();
+    return RETURN_SUCCESS;
+}
+
+/*
+CLI boilerplate
+*/
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_image_format__streamHDR()
+{
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef STREAM_HDR_H
+#define STREAM_HDR_H
+
+errno_t CLIADDCMD_image_format__streamHDR();
+
+#endif // STREAM_HDR_H
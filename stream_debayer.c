@@ -0,0 +1,650 @@
+/**
+ * @file    stream_debayer.c
+ * @brief   Live debayer of a raw Bayer camera stream into R, G, B streams
+ *
+ * Input: raw camera stream name (2D, any real type)
+ * Input: output stream name
+ * Input: quality
+ *        0: superpixel, each 2x2 CFA cell gives one RGB pixel (G averaged),
+ *           outputs are size[0]/2 x size[1]/2
+ *        1: bilinear, full resolution (see rawbayer_demosaic.c)
+ * Input: packed flag
+ *        0: outputs <out_name>_R, <out_name>_G, <out_name>_B
+ *        1: single output <out_name>, planes R, G, B along axis 3, posted
+ *           once per frame so readers never mix colors of two frames
+ * Input: CFA pattern, see rawbayer_cfa.c, resolved once at startup
+ * Input: bias, dark and flat image names, "none" for none
+ * Input: number of threads, <= 0 for all online CPUs
+ *
+ * Calibration, (raw - bias - dark) / flat, is fused with the conversion of
+ * the input to float: each input row is read once, converted and calibrated
+ * into a row buffer, then either combined into the output superpixels
+ * straight away, or stored for the bilinear demosaic. Calibration maps are
+ * rebuilt only when a calibration image changes (see rawbayer_calib.c), so
+ * they can be updated while the stream runs. No hot or bad pixel correction.
+ *
+ * Rows are cut into bands, one per thread. Inner loops have no branch on the
+ * input type or CFA pattern, and vectorize.
+ *
+ * Frames are accounted for with cnt0: a wake-up without a new frame is not
+ * processed.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "rawbayer_calib.h"
+#include "rawbayer_cfa.h"
+#include "rawbayer_demosaic.h"
+#include "stream_debayer.h"
+
+#define SDB_QUALITY_SUPERPIXEL 0
+#define SDB_QUALITY_BILINEAR   1
+
+// Minimum number of output rows per band
+#define SDB_MINROWS 8
+
+// Local variables pointers
+static char    *in_name;
+static char    *out_name;
+static int32_t *ptr_quality;
+static int32_t *ptr_packed;
+static char    *cfa_spec;
+static char    *bias_name;
+static char    *dark_name;
+static char    *flat_name;
+static int32_t *ptr_nthreads;
+
+static CLICMDARGDEF farg[] = {{
+        CLIARG_IMG,
+        ".in_name",
+        "input raw stream",
+        "im1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &in_name,
+        NULL
+    },
+    {
+        CLIARG_STR_NOT_IMG,
+        ".out_name",
+        "output RGB stream(s)",
+        "rgb",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &out_name,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".quality",
+        "0: superpixel, 1: bilinear",
+        "1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_quality,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".packed",
+        "single RGB cube output",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_packed,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".cfa",
+        "CFA pattern, or auto",
+        "auto",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &cfa_spec,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".bias",
+        "bias image, or none",
+        "none",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &bias_name,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".dark",
+        "dark image, or none",
+        "none",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &dark_name,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".flat",
+        "flat image, or none",
+        "none",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &flat_name,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".nthreads",
+        "number of threads",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_nthreads,
+        NULL
+    }
+};
+
+static CLICMDDATA CLIcmddata = {"streamdebayer",
+                                "live debayer of raw Bayer stream",
+                                CLICMD_FIELDS_DEFAULTS
+                               };
+
+static errno_t help_function()
+{
+    printf("Debayer each new frame of a raw Bayer stream into streams\n");
+    printf("<out_name>_R/_G/_B, or one 3-plane stream if packed.\n");
+    printf("quality 0: superpixel (half size), 1: bilinear (full size)\n");
+    printf("Optional bias, dark and flat calibration, fused with the\n");
+    printf("conversion; images may be updated while running.\n");
+    return RETURN_SUCCESS;
+}
+
+/*
+THE IMPORTANT, CUSTOM PART
+*/
+
+typedef struct
+{
+    IMGID        in_img;
+    long         xsize;
+    const float *offset;  // bias + dark, NULL if none
+    const float *invflat; // NULL if none
+    int          quality;
+    int          layout[2][2]; // color of CFA phase [jj & 1][ii & 1]
+
+    float *cal; // bilinear: calibrated frame
+    float *outr;
+    float *outg;
+    float *outb;
+
+    long   jj0; // band output rows [jj0, jj1)
+    long   jj1;
+    float *rowbuf; // superpixel: 2 rows
+} SDB_BAND;
+
+// dst = (src - off) * invflat, the calibration terms selected outside the
+// pixel loops
+#define SDB_CAL_ROW(dst, src, off, invflat, n)                                 \
+    if((off) != NULL && (invflat) != NULL)                                     \
+    {                                                                          \
+        for(long ii = 0; ii < (n); ii++)                                       \
+        {                                                                      \
+            (dst)[ii] = ((float) (src)[ii] - (off)[ii]) * (invflat)[ii];       \
+        }                                                                      \
+    }                                                                          \
+    else if((off) != NULL)                                                     \
+    {                                                                          \
+        for(long ii = 0; ii < (n); ii++)                                       \
+        {                                                                      \
+            (dst)[ii] = (float) (src)[ii] - (off)[ii];                         \
+        }                                                                      \
+    }                                                                          \
+    else if((invflat) != NULL)                                                 \
+    {                                                                          \
+        for(long ii = 0; ii < (n); ii++)                                       \
+        {                                                                      \
+            (dst)[ii] = (float) (src)[ii] * (invflat)[ii];                     \
+        }                                                                      \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        for(long ii = 0; ii < (n); ii++)                                       \
+        {                                                                      \
+            (dst)[ii] = (float) (src)[ii];                                     \
+        }                                                                      \
+    }
+
+// dst = (raw - offset) * invflat, input row jj
+static void sdb_cal_row(const SDB_BAND *band, long jj, float *__restrict dst)
+{
+    long         xsize   = band->xsize;
+    long         o       = jj * xsize;
+    IMAGE       *im      = band->in_img.im;
+    const float *off     = (band->offset != NULL) ? band->offset + o : NULL;
+    const float *invflat = (band->invflat != NULL) ? band->invflat + o : NULL;
+
+    switch(band->in_img.md->datatype)
+    {
+    case _DATATYPE_UINT8:
+        SDB_CAL_ROW(dst, im->array.UI8 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_INT8:
+        SDB_CAL_ROW(dst, im->array.SI8 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_UINT16:
+        SDB_CAL_ROW(dst, im->array.UI16 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_INT16:
+        SDB_CAL_ROW(dst, im->array.SI16 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_UINT32:
+        SDB_CAL_ROW(dst, im->array.UI32 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_INT32:
+        SDB_CAL_ROW(dst, im->array.SI32 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_UINT64:
+        SDB_CAL_ROW(dst, im->array.UI64 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_INT64:
+        SDB_CAL_ROW(dst, im->array.SI64 + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_FLOAT:
+        SDB_CAL_ROW(dst, im->array.F + o, off, invflat, xsize);
+        break;
+    case _DATATYPE_DOUBLE:
+        SDB_CAL_ROW(dst, im->array.D + o, off, invflat, xsize);
+        break;
+    }
+}
+
+// Superpixels of the CFA cells on rows r0 and r1 = r0 + 1, into output
+// pixel o onwards. Each color is read from its site in the first cell,
+// with a stride of 2 pixels.
+static void sdb_superpixel_row(const SDB_BAND *band,
+                               const float    *r0,
+                               const float    *r1,
+                               long            o)
+{
+    const float *pc[2];
+    int          ng = 0;
+    const float *pr = NULL;
+    const float *pb = NULL;
+
+    for(int py = 0; py < 2; py++)
+        for(int px = 0; px < 2; px++)
+        {
+            const float *p = (py == 0 ? r0 : r1) + px;
+            switch(band->layout[py][px])
+            {
+            case 0:
+                pr = p;
+                break;
+            case 1:
+                pc[ng++] = p;
+                break;
+            default:
+                pb = p;
+                break;
+            }
+        }
+
+    const float *__restrict pg0  = pc[0];
+    const float *__restrict pg1  = pc[1];
+    float *__restrict outr       = band->outr + o;
+    float *__restrict outg       = band->outg + o;
+    float *__restrict outb       = band->outb + o;
+    long                    nout = band->xsize / 2;
+
+    for(long i = 0; i < nout; i++)
+    {
+        outr[i] = pr[2 * i];
+        outg[i] = 0.5f * (pg0[2 * i] + pg1[2 * i]);
+        outb[i] = pb[2 * i];
+    }
+}
+
+static void *sdb_worker(void *ptr)
+{
+    SDB_BAND *band = (SDB_BAND *) ptr;
+
+    if(band->quality == SDB_QUALITY_SUPERPIXEL)
+    {
+        long xsize = band->xsize;
+        for(long jj = band->jj0; jj < band->jj1; jj++)
+        {
+            sdb_cal_row(band, 2 * jj, band->rowbuf);
+            sdb_cal_row(band, 2 * jj + 1, band->rowbuf + xsize);
+            sdb_superpixel_row(band,
+                               band->rowbuf,
+                               band->rowbuf + xsize,
+                               jj * (xsize / 2));
+        }
+    }
+    else
+    {
+        for(long jj = band->jj0; jj < band->jj1; jj++)
+        {
+            sdb_cal_row(band, jj, band->cal + jj * band->xsize);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+Run the band workers over nrows output rows
+Band 0, and any band whose thread cannot be created, runs in the caller
+*/
+static errno_t
+sdb_run_bands(SDB_BAND *bands, pthread_t *threads, long nbands, long nrows)
+{
+    for(long b = 0; b < nbands; b++)
+    {
+        bands[b].jj0 = nrows * b / nbands;
+        bands[b].jj1 = nrows * (b + 1) / nbands;
+    }
+    long nstarted = 1;
+    while(nstarted < nbands &&
+            pthread_create(&threads[nstarted],
+                           NULL,
+                           sdb_worker,
+                           &bands[nstarted]) == 0)
+    {
+        nstarted++;
+    }
+    for(long b = nstarted; b < nbands; b++)
+    {
+        sdb_worker(&bands[b]);
+    }
+    sdb_worker(&bands[0]);
+    for(long b = 1; b < nstarted; b++)
+    {
+        pthread_join(threads[b], NULL);
+    }
+
+    return RETURN_SUCCESS;
+}
+
+// Resolve, or (re)create as shared float, output stream name + suffix
+static IMGID
+sdb_output_resolve(const char *suffix, uint32_t xsize, uint32_t ysize,
+                   uint32_t zsize)
+{
+    char name[STRINGMAXLEN_IMAGE_NAME];
+    snprintf(name, sizeof(name), "%s%s", out_name, suffix);
+
+    IMGID img = mkIMGID_from_name(name);
+    if(resolveIMGID(&img, ERRMODE_WARN) || img.md->size[0] != xsize ||
+            img.md->size[1] != ysize ||
+            (zsize > 1 && (img.md->naxis != 3 || img.md->size[2] != zsize)) ||
+            img.md->datatype != _DATATYPE_FLOAT)
+    {
+        PRINT_WARNING("WARNING - output %s being (re)created", name);
+        if(zsize > 1)
+        {
+            img = makeIMGID_3D(name, xsize, ysize, zsize);
+        }
+        else
+        {
+            img = makeIMGID_2D(name, xsize, ysize);
+        }
+        img.datatype = _DATATYPE_FLOAT;
+        img.shared   = 1;
+        imcreateIMGID(&img);
+        resolveIMGID(&img, ERRMODE_ABORT);
+    }
+
+    return img;
+}
+
+/*
+BOILERPLATE
+*/
+
+static errno_t compute_function()
+{
+    DEBUG_TRACE_FSTART();
+
+    IMGID in_img = mkIMGID_from_name(in_name);
+    resolveIMGID(&in_img, ERRMODE_ABORT);
+
+    // Set in_img to be the trigger
+    strcpy(CLIcmddata.cmdsettings->triggerstreamname, in_name);
+    // for FPS mode:
+    if(data.fpsptr != NULL)
+    {
+        strcpy(data.fpsptr->cmdset.triggerstreamname, in_name);
+    }
+
+    long xsize = in_img.md->size[0];
+    long ysize = in_img.md->size[1];
+
+    if(in_img.md->datatype == _DATATYPE_COMPLEX_FLOAT ||
+            in_img.md->datatype == _DATATYPE_COMPLEX_DOUBLE)
+    {
+        PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+        abort(); // can't handle this error any other way
+    }
+
+    int quality = *ptr_quality;
+    if(quality != SDB_QUALITY_SUPERPIXEL && quality != SDB_QUALITY_BILINEAR)
+    {
+        PRINT_WARNING("quality %d unknown, using bilinear", quality);
+        quality = SDB_QUALITY_BILINEAR;
+    }
+    if(xsize < 2 || ysize < 2)
+    {
+        PRINT_ERROR("%s: %ld x %ld frame too small", in_name, xsize, ysize);
+        abort(); // can't handle this error any other way
+    }
+
+    RAWBAYER_CFA cfa;
+    if(rawbayer_cfa_resolve(cfa_spec, in_img, &cfa) != RETURN_SUCCESS)
+    {
+        abort(); // can't handle this error any other way
+    }
+    printf("CFA %s, offsets %d %d\n",
+           rawbayer_cfa_name(cfa.pattern),
+           cfa.xoffset,
+           cfa.yoffset);
+
+    // Superpixel: odd last row and column dropped
+    long xsize1 = (quality == SDB_QUALITY_SUPERPIXEL) ? xsize / 2 : xsize;
+    long ysize1 = (quality == SDB_QUALITY_SUPERPIXEL) ? ysize / 2 : ysize;
+    long n1     = xsize1 * ysize1;
+
+    // Resolve or create outputs, per need
+    IMGID out_img[3];
+    int   n_out = (*ptr_packed) ? 1 : 3;
+    float *outrgb[3];
+    if(n_out == 1)
+    {
+        out_img[0] = sdb_output_resolve("", xsize1, ysize1, 3);
+        for(int k = 0; k < 3; k++)
+        {
+            outrgb[k] = out_img[0].im->array.F + k * n1;
+        }
+    }
+    else
+    {
+        const char *suffix[3] = {"_R", "_G", "_B"};
+        for(int k = 0; k < 3; k++)
+        {
+            out_img[k] = sdb_output_resolve(suffix[k], xsize1, ysize1, 1);
+            outrgb[k]  = out_img[k].im->array.F;
+        }
+    }
+
+    /*
+    SETUP
+    */
+    RAWCAL_CTX rcal;
+    memset(&rcal, 0, sizeof(RAWCAL_CTX));
+    rcal.srcname[RAWCAL_BIAS] = bias_name;
+    rcal.srcname[RAWCAL_DARK] = dark_name;
+    rcal.srcname[RAWCAL_FLAT] = flat_name;
+    int docal                 = FALSE;
+    for(int k = 0; k < RAWCAL_NSRC; k++)
+    {
+        if(rcal.srcname[k] != NULL && strcmp(rcal.srcname[k], "none") == 0)
+        {
+            rcal.srcname[k] = NULL;
+        }
+        docal |= (rcal.srcname[k] != NULL);
+    }
+
+    long nbands = *ptr_nthreads;
+    if(nbands <= 0)
+    {
+        nbands = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(nbands > ysize1 / SDB_MINROWS)
+    {
+        nbands = ysize1 / SDB_MINROWS;
+    }
+    if(nbands < 1)
+    {
+        nbands = 1;
+    }
+
+    SDB_BAND  *bands   = (SDB_BAND *) malloc(sizeof(SDB_BAND) * nbands);
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nbands);
+    float     *rowbuf  = (float *) malloc(sizeof(float) * 2 * xsize * nbands);
+    // Bilinear: calibrated frame, or the input itself if float, uncalibrated
+    float *cal = NULL;
+    if(quality == SDB_QUALITY_BILINEAR &&
+            (docal || in_img.md->datatype != _DATATYPE_FLOAT))
+    {
+        cal = (float *) malloc(sizeof(float) * xsize * ysize);
+        if(cal == NULL)
+        {
+            PRINT_ERROR("malloc returns NULL pointer");
+            abort(); // can't handle this error any other way
+        }
+    }
+    if(bands == NULL || threads == NULL || rowbuf == NULL)
+    {
+        PRINT_ERROR("malloc returns NULL pointer");
+        abort(); // can't handle this error any other way
+    }
+    for(long b = 0; b < nbands; b++)
+    {
+        SDB_BAND *band = &bands[b];
+        band->in_img   = in_img;
+        band->xsize    = xsize;
+        band->offset   = NULL;
+        band->invflat  = NULL;
+        band->quality  = quality;
+        rawbayer_cfa_layout(&cfa, band->layout);
+        band->cal    = cal;
+        band->outr   = outrgb[0];
+        band->outg   = outrgb[1];
+        band->outb   = outrgb[2];
+        band->rowbuf = rowbuf + b * 2 * xsize;
+    }
+
+    // HOUSEKEEPING
+    uint64_t cnt0_last = in_img.md->cnt0;
+
+    /*
+    PROCESSINFO INIT
+    */
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+    // PROCESSINFO* processinfo now available
+
+    /*
+    LOOP
+    */
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    {
+        uint64_t cnt0_now = in_img.md->cnt0;
+        if(cnt0_now == cnt0_last)
+        {
+            continue; // No new frame: do not process the same frame twice
+        }
+        cnt0_last = cnt0_now;
+
+        if(docal)
+        {
+            if(rawbayer_ctx_update(&rcal, xsize, ysize) != RETURN_SUCCESS)
+            {
+                abort(); // can't handle this error any other way
+            }
+            for(long b = 0; b < nbands; b++)
+            {
+                bands[b].offset  = rcal.offset;
+                bands[b].invflat = rcal.invflat;
+            }
+        }
+
+        for(int k = 0; k < n_out; k++)
+        {
+            out_img[k].md->write = TRUE;
+        }
+
+        if(quality == SDB_QUALITY_SUPERPIXEL)
+        {
+            sdb_run_bands(bands, threads, nbands, ysize1);
+        }
+        else
+        {
+            const float *raw = in_img.im->array.F;
+            if(cal != NULL)
+            {
+                sdb_run_bands(bands, threads, nbands, ysize);
+                raw = cal;
+            }
+            if(rawbayer_demosaic(raw,
+                                 xsize,
+                                 ysize,
+                                 &cfa,
+                                 RAWBAYER_DEMOSAIC_BILINEAR,
+                                 nbands,
+                                 outrgb[0],
+                                 outrgb[1],
+                                 outrgb[2]) != RETURN_SUCCESS)
+            {
+                // Frame dropped, outputs not posted
+                PRINT_ERROR("demosaic failed, frame %lu",
+                            (unsigned long) cnt0_now);
+                for(int k = 0; k < n_out; k++)
+                {
+                    out_img[k].md->write = FALSE;
+                }
+                continue;
+            }
+        }
+
+        for(int k = 0; k < n_out; k++)
+        {
+            processinfo_update_output_stream(processinfo, out_img[k].ID);
+        }
+    }
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    /*
+    TEARDOWN
+    */
+    rawbayer_ctx_free(&rcal);
+    free(cal);
+    free(rowbuf);
+    free(threads);
+    free(bands);
+
+    DEBUG_TRACE_FEXIT();
+    return RETURN_SUCCESS;
+}
+
+/*
+CLI boilerplate
+*/
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_image_format__streamdebayer()
+{
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef IMAGE_FORMAT_STREAM_DEBAYER_H
+#define IMAGE_FORMAT_STREAM_DEBAYER_H
+
+errno_t CLIADDCMD_image_format__streamdebayer();
+
+#endif // IMAGE_FORMAT_STREAM_DEBAYER_H
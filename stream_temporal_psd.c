@@ -0,0 +1,635 @@
+/**
+ * @file    stream_temporal_psd.c
+ * @brief   Publishes per-pixel temporal power spectra of an image stream
+ *
+ * Vibration analysis of telemetry streams without dumping cubes to disk.
+ *
+ * Frames are gathered into a small frame-major staging buffer, which is
+ * flushed in blocks into a transposed (pixel-major, time contiguous) ring
+ * buffer of n_fft samples per pixel. Every n_fft/2 frames, the last n_fft
+ * samples of all pixels are windowed (Hann) and transformed by batched real
+ * FFTs. Power spectra are Welch-averaged over n_avg segments and published.
+ *
+ * Pixel selection:
+ *   mask image (pixels > 0.5 selected), if maskim exists
+ *   else binfact x binfact spatial binning, if binfact > 1
+ *   else all pixels
+ *
+ * Type specs: all input integer types + float32/64 allowed
+ *
+ * Input: raw camera stream name (string)
+ * Input: FFT segment length in frames (int)
+ * Input: number of Welch segments per published spectrum (int)
+ * Input: spatial binning factor (int), disregarded if <= 1
+ * Input: pixel mask image name (string), disregarded if not found
+ *
+ * Output: <in_name>_psd     (nfreq x npix, float32)
+ *         one-sided PSD, unit input^2 per (cycle / frame)
+ * Output: <in_name>_psdpix  (npix, uint32)
+ *         input pixel (or bin) index of each spectrum
+ */
+
+#include <math.h>
+
+#include <fftw3.h>
+
+#include "CommandLineInterface/CLIcore.h"
+
+// Number of frames staged before transposing into the ring buffer
+#define PSD_TBLOCK 16
+
+// Number of pixels transformed per FFT plan execution
+#define PSD_FFTBATCH 256
+
+#define PSD_PIXMODE_FULL 0
+#define PSD_PIXMODE_MASK 1
+#define PSD_PIXMODE_BIN  2
+
+// Local variables pointers
+static char    *in_name;
+static int32_t *ptr_n_fft;
+static int32_t *ptr_n_avg;
+static int32_t *ptr_binfact;
+static char    *maskim_name;
+
+static CLICMDARGDEF farg[] = {{
+        CLIARG_IMG,
+        ".in_name",
+        "input image",
+        "in_name",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &in_name,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".n_fft",
+        "FFT segment length (frames)",
+        "256",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_n_fft,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".n_avg",
+        "Welch segments per output",
+        "8",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_n_avg,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".binfact",
+        "Spatial binning factor",
+        "1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_binfact,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".maskim",
+        "Pixel mask image",
+        "none",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &maskim_name,
+        NULL
+    }
+};
+
+static CLICMDDATA CLIcmddata = {"stream_psd",
+                                "RT compute of per-pixel temporal PSD",
+                                CLICMD_FIELDS_DEFAULTS
+                               };
+
+static errno_t help_function()
+{
+    printf("Compute per-pixel temporal power spectra of image stream\n");
+    printf("Welch-averaged, 50%% overlapping Hann-windowed segments\n");
+    printf("Pixels: mask image if found, else binned, else all pixels\n");
+    printf("Output <in>_psd is nfreq x npix, nfreq = n_fft/2+1\n");
+    return RETURN_SUCCESS;
+}
+
+/*
+THE IMPORTANT, CUSTOM PART
+*/
+
+typedef struct
+{
+    int      mode;
+    uint32_t nx;
+    uint32_t ny;
+    int      binfact;
+    uint32_t nbx;
+    uint32_t nby;
+    long     npix;     // number of output spectra
+    long    *pixindex; // MASK mode: input pixel index of each spectrum
+} PSD_PIXMAP;
+
+static errno_t psd_pixmap_init(PSD_PIXMAP *pm, IMGID in_img)
+{
+    pm->nx       = in_img.md->size[0];
+    pm->ny       = in_img.md->size[1];
+    pm->binfact  = 1;
+    pm->nbx      = pm->nx;
+    pm->nby      = pm->ny;
+    pm->npix     = (long) pm->nx * pm->ny;
+    pm->pixindex = NULL;
+    pm->mode     = PSD_PIXMODE_FULL;
+
+    if(image_ID(maskim_name) != -1)
+    {
+        IMGID mask_img = mkIMGID_from_name(maskim_name);
+        resolveIMGID(&mask_img, ERRMODE_ABORT);
+
+        if(mask_img.md->datatype != _DATATYPE_FLOAT ||
+                mask_img.md->size[0] != pm->nx ||
+                mask_img.md->size[1] != pm->ny)
+        {
+            PRINT_ERROR("mask %s must be float, same size as input",
+                        maskim_name);
+            return RETURN_FAILURE;
+        }
+
+        pm->npix = 0;
+        for(long ii = 0; ii < (long) pm->nx * pm->ny; ++ii)
+        {
+            if(mask_img.im->array.F[ii] > 0.5)
+            {
+                pm->npix++;
+            }
+        }
+        if(pm->npix == 0)
+        {
+            PRINT_ERROR("mask %s selects no pixel", maskim_name);
+            return RETURN_FAILURE;
+        }
+
+        pm->pixindex = (long *) malloc(sizeof(long) * pm->npix);
+        long p       = 0;
+        for(long ii = 0; ii < (long) pm->nx * pm->ny; ++ii)
+        {
+            if(mask_img.im->array.F[ii] > 0.5)
+            {
+                pm->pixindex[p++] = ii;
+            }
+        }
+        pm->mode = PSD_PIXMODE_MASK;
+
+        if(*ptr_binfact > 1)
+        {
+            PRINT_WARNING("mask %s overrides binning", maskim_name);
+        }
+    }
+    else if(*ptr_binfact > 1)
+    {
+        pm->binfact = *ptr_binfact;
+        pm->nbx     = pm->nx / pm->binfact;
+        pm->nby     = pm->ny / pm->binfact;
+        pm->npix    = (long) pm->nbx * pm->nby;
+        if(pm->npix == 0)
+        {
+            PRINT_ERROR("binning factor %d larger than image", pm->binfact);
+            return RETURN_FAILURE;
+        }
+        pm->mode = PSD_PIXMODE_BIN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+#define PSD_GATHER(in_arr)                                                     \
+    {                                                                          \
+        switch (pm->mode)                                                      \
+        {                                                                      \
+        case PSD_PIXMODE_MASK:                                                 \
+            for (long p = 0; p < pm->npix; ++p)                                \
+            {                                                                  \
+                stage[p] = (float) in_img.im->array.in_arr[pm->pixindex[p]];   \
+            }                                                                  \
+            break;                                                             \
+        case PSD_PIXMODE_BIN:                                                  \
+            memset(stage, 0, sizeof(float) * pm->npix);                        \
+            for (uint32_t jj = 0; jj < pm->nby * pm->binfact; ++jj)            \
+            {                                                                  \
+                float *srow = stage + (jj / pm->binfact) * pm->nbx;            \
+                long   joff = (long) jj * pm->nx;                              \
+                for (uint32_t ii = 0; ii < pm->nbx * pm->binfact; ++ii)        \
+                {                                                              \
+                    srow[ii / pm->binfact] +=                                  \
+                        (float) in_img.im->array.in_arr[joff + ii];            \
+                }                                                              \
+            }                                                                  \
+            for (long p = 0; p < pm->npix; ++p)                                \
+            {                                                                  \
+                stage[p] *= binnorm;                                           \
+            }                                                                  \
+            break;                                                             \
+        default:                                                               \
+            for (long p = 0; p < pm->npix; ++p)                                \
+            {                                                                  \
+                stage[p] = (float) in_img.im->array.in_arr[p];                 \
+            }                                                                  \
+            break;                                                             \
+        }                                                                      \
+    }
+
+/**
+ * @brief Gather one frame into a staging row of pm->npix floats
+ */
+static errno_t psd_gather_frame(IMGID in_img, PSD_PIXMAP *pm, float *stage)
+{
+    float binnorm = 1.0f / (pm->binfact * pm->binfact);
+
+    switch(in_img.datatype)
+    {
+        case _DATATYPE_UINT8:
+            PSD_GATHER(UI8);
+            break;
+        case _DATATYPE_INT8:
+            PSD_GATHER(SI8);
+            break;
+        case _DATATYPE_UINT16:
+            PSD_GATHER(UI16);
+            break;
+        case _DATATYPE_INT16:
+            PSD_GATHER(SI16);
+            break;
+        case _DATATYPE_UINT32:
+            PSD_GATHER(UI32);
+            break;
+        case _DATATYPE_INT32:
+            PSD_GATHER(SI32);
+            break;
+        case _DATATYPE_UINT64:
+            PSD_GATHER(UI64);
+            break;
+        case _DATATYPE_INT64:
+            PSD_GATHER(SI64);
+            break;
+        case _DATATYPE_FLOAT:
+            PSD_GATHER(F);
+            break;
+        case _DATATYPE_DOUBLE:
+            PSD_GATHER(D);
+            break;
+        default:
+            PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+            return RETURN_FAILURE;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/**
+ * @brief Transpose nstage staged frames into the per-pixel ring buffer
+ *
+ * Each pixel receives nstage consecutive samples, so writes stay within
+ * one or two cache lines per pixel.
+ */
+static void psd_flush_stage(float *tbuf,
+                            float *stage,
+                            long   npix,
+                            int    n_fft,
+                            int    wpos,
+                            int    nstage)
+{
+    for(long p = 0; p < npix; ++p)
+    {
+        float *trow = tbuf + p * n_fft;
+        int    t    = wpos;
+        for(int s = 0; s < nstage; ++s)
+        {
+            trow[t] = stage[s * npix + p];
+            if(++t == n_fft)
+            {
+                t = 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Window, transform and accumulate one Welch segment for all pixels
+ *
+ * wpos is the ring position of the oldest sample.
+ */
+static void psd_segment(float         *tbuf,
+                        long           npix,
+                        int            n_fft,
+                        int            wpos,
+                        float         *window,
+                        float         *fftin,
+                        fftwf_complex *fftout,
+                        fftwf_plan     plan,
+                        float         *psd_acc)
+{
+    int nfreq = n_fft / 2 + 1;
+
+    for(long p0 = 0; p0 < npix; p0 += PSD_FFTBATCH)
+    {
+        long nb = npix - p0;
+        if(nb > PSD_FFTBATCH)
+        {
+            nb = PSD_FFTBATCH;
+        }
+
+        for(long b = 0; b < nb; ++b)
+        {
+            float *trow = tbuf + (p0 + b) * n_fft;
+            float *in   = fftin + b * n_fft;
+
+            // unwrap ring into time order
+            memcpy(in, trow + wpos, sizeof(float) * (n_fft - wpos));
+            memcpy(in + n_fft - wpos, trow, sizeof(float) * wpos);
+
+            float mean = 0.0f;
+            for(int k = 0; k < n_fft; ++k)
+            {
+                mean += in[k];
+            }
+            mean /= n_fft;
+
+            for(int k = 0; k < n_fft; ++k)
+            {
+                in[k] = (in[k] - mean) * window[k];
+            }
+        }
+        // partial last batch: zero inputs, outputs ignored
+        if(nb < PSD_FFTBATCH)
+        {
+            memset(fftin + nb * n_fft,
+                   0,
+                   sizeof(float) * (PSD_FFTBATCH - nb) * n_fft);
+        }
+
+        fftwf_execute(plan);
+
+        for(long b = 0; b < nb; ++b)
+        {
+            float         *acc = psd_acc + (p0 + b) * nfreq;
+            fftwf_complex *out = fftout + b * nfreq;
+            for(int f = 0; f < nfreq; ++f)
+            {
+                acc[f] += out[f][0] * out[f][0] + out[f][1] * out[f][1];
+            }
+        }
+    }
+}
+
+static errno_t psd_finalize(IMGID  out_img,
+                            float *psd_acc,
+                            float *fscale,
+                            long   npix,
+                            int    nfreq,
+                            int    n_seg)
+{
+    out_img.md->write = TRUE;
+
+    for(long p = 0; p < npix; ++p)
+    {
+        float *acc = psd_acc + p * nfreq;
+        float *out = out_img.im->array.F + p * nfreq;
+        for(int f = 0; f < nfreq; ++f)
+        {
+            out[f] = acc[f] * fscale[f] / n_seg;
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/*
+BOILERPLATE
+*/
+
+static errno_t compute_function()
+{
+    DEBUG_TRACE_FSTART();
+
+    IMGID in_img = mkIMGID_from_name(in_name);
+    resolveIMGID(&in_img, ERRMODE_ABORT);
+
+    // Set in_img to be the trigger
+    strcpy(CLIcmddata.cmdsettings->triggerstreamname, in_name);
+    // for FPS mode:
+    if(data.fpsptr != NULL)
+    {
+        strcpy(data.fpsptr->cmdset.triggerstreamname, in_name);
+    }
+
+    int n_fft = *ptr_n_fft;
+    if(n_fft < 4)
+    {
+        PRINT_ERROR("n_fft = %d, must be >= 4", n_fft);
+        DEBUG_TRACE_FEXIT();
+        return RETURN_FAILURE;
+    }
+    int nfreq = n_fft / 2 + 1;
+    int hop   = n_fft / 2;
+    int n_avg = *ptr_n_avg > 0 ? *ptr_n_avg : 1;
+
+    PSD_PIXMAP pm;
+    if(psd_pixmap_init(&pm, in_img) != RETURN_SUCCESS)
+    {
+        DEBUG_TRACE_FEXIT();
+        return RETURN_FAILURE;
+    }
+    long npix = pm.npix;
+
+    char out_psd_name[200];
+    strcpy(out_psd_name, in_name);
+    strcat(out_psd_name, "_psd");
+
+    char out_pix_name[200];
+    strcpy(out_pix_name, in_name);
+    strcat(out_pix_name, "_psdpix");
+
+    // Resolve or create outputs, per need
+    IMGID out_psd_img = mkIMGID_from_name(out_psd_name);
+    if(resolveIMGID(&out_psd_img, ERRMODE_WARN) ||
+            out_psd_img.md->size[0] != (uint32_t) nfreq ||
+            out_psd_img.md->size[1] != (uint32_t) npix)
+    {
+        PRINT_WARNING("WARNING - output psd image being (re)created");
+        out_psd_img          = makeIMGID_2D(out_psd_name, nfreq, npix);
+        out_psd_img.datatype = _DATATYPE_FLOAT;
+        out_psd_img.shared   = 1;
+        imcreateIMGID(&out_psd_img);
+        resolveIMGID(&out_psd_img, ERRMODE_ABORT);
+    }
+
+    IMGID out_pix_img = mkIMGID_from_name(out_pix_name);
+    if(resolveIMGID(&out_pix_img, ERRMODE_WARN) ||
+            out_pix_img.md->size[0] != (uint32_t) npix ||
+            out_pix_img.md->datatype != _DATATYPE_UINT32)
+    {
+        out_pix_img          = makeIMGID_2D(out_pix_name, npix, 1);
+        out_pix_img.datatype = _DATATYPE_UINT32;
+        out_pix_img.shared   = 1;
+        imcreateIMGID(&out_pix_img);
+        resolveIMGID(&out_pix_img, ERRMODE_ABORT);
+    }
+    out_pix_img.md->write = TRUE;
+    for(long p = 0; p < npix; ++p)
+    {
+        out_pix_img.im->array.UI32[p] =
+            (pm.mode == PSD_PIXMODE_MASK) ? pm.pixindex[p] : p;
+    }
+    ImageStreamIO_UpdateIm(out_pix_img.im);
+
+    /*
+    SETUP
+    */
+
+    // Hann window, and one-sided density scaling per frequency bin
+    float *window = (float *) malloc(sizeof(float) * n_fft);
+    float *fscale = (float *) malloc(sizeof(float) * nfreq);
+    double wss    = 0.0;
+    for(int k = 0; k < n_fft; ++k)
+    {
+        window[k] = 0.5 - 0.5 * cos(2.0 * M_PI * k / n_fft);
+        wss += window[k] * window[k];
+    }
+    for(int f = 0; f < nfreq; ++f)
+    {
+        fscale[f] = 2.0 / wss;
+    }
+    fscale[0] = 1.0 / wss;
+    if(n_fft % 2 == 0)
+    {
+        fscale[nfreq - 1] = 1.0 / wss;
+    }
+
+    float *stage   = (float *) malloc(sizeof(float) * PSD_TBLOCK * npix);
+    float *tbuf    = (float *) calloc(npix * n_fft, sizeof(float));
+    float *psd_acc = (float *) calloc(npix * nfreq, sizeof(float));
+
+    float *fftin =
+        (float *) fftwf_malloc(sizeof(float) * PSD_FFTBATCH * n_fft);
+    fftwf_complex *fftout = (fftwf_complex *) fftwf_malloc(
+                                sizeof(fftwf_complex) * PSD_FFTBATCH * nfreq);
+    fftwf_plan plan = fftwf_plan_many_dft_r2c(1,
+                      &n_fft,
+                      PSD_FFTBATCH,
+                      fftin,
+                      NULL,
+                      1,
+                      n_fft,
+                      fftout,
+                      NULL,
+                      1,
+                      nfreq,
+                      FFTW_MEASURE);
+
+    // HOUSEKEEPING
+    long n_frames  = 0; // frames written to ring buffer
+    int  wpos      = 0; // ring buffer write position
+    int  nstage    = 0; // frames waiting in staging buffer
+    int  since_seg = 0; // frames since last segment
+    int  n_seg     = 0; // segments accumulated in psd_acc
+
+    PRINT_WARNING("n_fft %d  n_avg %d  npix %ld  mode %d",
+                  n_fft,
+                  n_avg,
+                  npix,
+                  pm.mode);
+
+    /*
+    PROCESSINFO INIT
+    */
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+    // PROCESSINFO* processinfo now available
+
+    /*
+    LOOP
+    */
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    {
+        /*
+        STAGE
+        */
+        psd_gather_frame(in_img, &pm, stage + nstage * npix);
+        ++nstage;
+        ++since_seg;
+
+        int seg_due = (n_frames + nstage >= n_fft) && (since_seg >= hop);
+
+        if(nstage == PSD_TBLOCK || seg_due)
+        {
+            psd_flush_stage(tbuf, stage, npix, n_fft, wpos, nstage);
+            wpos = (wpos + nstage) % n_fft;
+            n_frames += nstage;
+            nstage = 0;
+        }
+
+        /*
+        SEGMENT
+        */
+        if(seg_due)
+        {
+            psd_segment(tbuf,
+                        npix,
+                        n_fft,
+                        wpos,
+                        window,
+                        fftin,
+                        fftout,
+                        plan,
+                        psd_acc);
+            since_seg = 0;
+            ++n_seg;
+        }
+
+        /*
+        FINALIZATION AND PUBLISH
+        */
+        if(n_seg >= n_avg)
+        {
+            psd_finalize(out_psd_img, psd_acc, fscale, npix, nfreq, n_seg);
+            processinfo_update_output_stream(processinfo, out_psd_img.ID);
+
+            memset(psd_acc, 0, sizeof(float) * npix * nfreq);
+            n_seg = 0;
+        }
+    }
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    /*
+    TEARDOWN
+    */
+
+    fftwf_destroy_plan(plan);
+    fftwf_free(fftin);
+    fftwf_free(fftout);
+
+    free(window);
+    free(fscale);
+    free(stage);
+    free(tbuf);
+    free(psd_acc);
+    free(pm.pixindex);
+
+    DEBUG_TRACE_FEXIT();
+    return RETURN_SUCCESS;
+}
+
+/*
+CLI boilerplate
+*/
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_image_format__temporal_psd()
+{
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
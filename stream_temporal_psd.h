@@ -0,0 +1,6 @@
+#ifndef STREAM_TEMPORAL_PSD_H
+#define STREAM_TEMPORAL_PSD_H
+
+errno_t CLIADDCMD_image_format__temporal_psd();
+
+#endif // STREAM_TEMPORAL_PSD_H
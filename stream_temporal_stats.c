@@ -9,11 +9,52 @@
  * Input: raw camera stream name (string)
  * Input: count per stat batch (int), disregarded if <= 0
  * Input: time timeout (float), disregarded if <= 0.0
+ * Input: min/max flag (int), also publish temporal min and max if > 0
+ * Input: moments flag (int), also publish skewness and kurtosis if > 0
+ * Input: slice mode flag (int), 3D input only
+ *        0: the whole volume is the pixel set, outputs are 3D
+ *        1: slices are successive frames, written one at a time with cnt1
+ *           the index of the last slice written; outputs are 2D and every
+ *           slice written since the previous wake-up is accumulated
+ * Input: autocorrelation flag (int), also publish lag-1 autocorrelation
+ * Input: reference pixels (string), "none" or up to TSTATS_MAXREFPIX
+ *        "x,y" or "x,y,z" separated by ':', in output pixel coordinates;
+ *        the covariance of every pixel with each of them is published
+ * Input: frame stats ring length (int), 0 to disable
+ * Input: saturation level (float), frame stats saturated pixel count
+ * Input: spatial binning factor (int), 1 for none
+ *        frames are binned binfact x binfact (mean of the bin) before the
+ *        temporal statistics; outputs are size[0]/binfact x size[1]/binfact,
+ *        edge rows/columns not filling a bin are ignored
  *
- * Output: Post UTR reduced stream (float 32)
+ * Batches are accumulated into two alternating accumulator sets: when a
+ * batch completes, finalization and publication run on a helper thread while
+ * the next batch accumulates into the other set.
+ *
+ * Output: <in_name>_ave, <in_name>_std
+ * Output: <in_name>_min, <in_name>_max     (min/max flag)
+ * Output: <in_name>_skew, <in_name>_kurt   (moments flag)
+ *         kurtosis is excess kurtosis (0 for gaussian noise)
+ * Output: <in_name>_acorr                  (autocorrelation flag)
+ *         lag-1 autocorrelation coefficient, over consecutive frame pairs
+ * Output: <in_name>_cov                    (reference pixels)
+ *         one covariance map per reference pixel, stacked along axis 3
+ * Output: <in_name>_fstats                 (frame stats ring length > 0)
+ *         float64 ring buffer of TSTATS_FSTAT_NCOL x ring length, one row
+ *         per accumulated frame: cnt0, mean, rms (about the mean), min,
+ *         max, saturated pixel count (>= saturation level) of the raw
+ *         frame; cnt1 is the last row written. Computed in the
+ *         accumulation (or binning) pass, over the binned area if binning
+ * Frames are accounted for with cnt0: a wake-up without a new frame is not
+ * accumulated, and frames written while lagging are either replayed from the
+ * slice circular buffer (slice mode) or counted as skipped.
+ *
+ * Output keyword NFRAMES: number of frames in the published batch
+ * Output keyword NSKIP:   number of input frames missed during the batch
  */
 
 #include <math.h>
+#include <pthread.h>
 
 #include "CommandLineInterface/CLIcore.h"
 #include "CommandLineInterface/timeutils.c"
@@ -24,6 +65,14 @@
 static char    *in_name;
 static int32_t *ptr_n_frames;
 static double  *ptr_timeout;
+static int32_t *ptr_minmax;
+static int32_t *ptr_moments;
+static int32_t *ptr_slicemode;
+static int32_t *ptr_autocorr;
+static char    *refpix_list;
+static int32_t *ptr_fstatlen;
+static double  *ptr_satlevel;
+static int32_t *ptr_binfact;
 
 static CLICMDARGDEF farg[] = {{
         CLIARG_IMG,
@@ -51,6 +100,78 @@ static CLICMDARGDEF farg[] = {{
         CLIARG_VISIBLE_DEFAULT,
         (void **) &ptr_timeout,
         NULL
+    },
+    {
+        CLIARG_INT32,
+        ".minmax",
+        "Publish temporal min/max",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_minmax,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".moments",
+        "Publish skewness/kurtosis",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_moments,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".slicemode",
+        "3D input: slices are frames",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_slicemode,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".autocorr",
+        "Publish lag-1 autocorrelation",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_autocorr,
+        NULL
+    },
+    {
+        CLIARG_STR,
+        ".refpix",
+        "Covariance ref pixels x,y:x,y",
+        "none",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &refpix_list,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".fstatlen",
+        "Frame stats ring length",
+        "0",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_fstatlen,
+        NULL
+    },
+    {
+        CLIARG_FLOAT64,
+        ".satlevel",
+        "Frame stats saturation level",
+        "65535",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_satlevel,
+        NULL
+    },
+    {
+        CLIARG_INT32,
+        ".binfact",
+        "Spatial binning factor",
+        "1",
+        CLIARG_VISIBLE_DEFAULT,
+        (void **) &ptr_binfact,
+        NULL
     }
 };
 
@@ -62,6 +183,13 @@ static CLICMDDATA CLIcmddata = {"stream_av_std",
 static errno_t help_function()
 {
     printf("Compute temporal average and st-dev of image stream\n");
+    printf("Optionally min/max and skewness/excess kurtosis, same pass\n");
+    printf("3D input: volume as pixels, or slices as frames (slicemode)\n");
+    printf("Keywords NFRAMES/NSKIP: frames used/missed per batch (cnt0)\n");
+    printf("Optionally lag-1 autocorrelation and covariance with\n");
+    printf("reference pixels (refpix \"x,y:x,y\"), same pass\n");
+    printf("fstatlen > 0: per-frame mean/rms/min/max/nsat ring stream\n");
+    printf("binfact > 1: stats of binfact x binfact binned pixels\n");
     return RETURN_SUCCESS;
 }
 
@@ -69,7 +197,199 @@ static errno_t help_function()
 THE IMPORTANT, CUSTOM PART
 */
 
-#define FOREACH_CAST(start, end, in_arr, out_type)                             \
+/*
+Per-frame spatial statistics, reduced in the same loop as the accumulation
+*/
+#define TSTATS_FSTAT_CNT0 0
+#define TSTATS_FSTAT_MEAN 1
+#define TSTATS_FSTAT_RMS  2
+#define TSTATS_FSTAT_MIN  3
+#define TSTATS_FSTAT_MAX  4
+#define TSTATS_FSTAT_NSAT 5
+#define TSTATS_FSTAT_NCOL 6
+
+typedef struct
+{
+    double satlevel;
+
+    long   n;
+    double sum;
+    double sum2;
+    double vmin;
+    double vmax;
+    long   nsat;
+} TSTATS_FSTAT;
+
+static inline void fstat_reset(TSTATS_FSTAT *fs, double satlevel)
+{
+    fs->satlevel = satlevel;
+    fs->n        = 0;
+    fs->sum      = 0.0;
+    fs->sum2     = 0.0;
+    fs->vmin     = HUGE_VAL;
+    fs->vmax     = -HUGE_VAL;
+    fs->nsat     = 0;
+}
+
+static inline void fstat_add(TSTATS_FSTAT *fs, double v)
+{
+    fs->sum += v;
+    fs->sum2 += v * v;
+    fs->vmin = v < fs->vmin ? v : fs->vmin;
+    fs->vmax = v > fs->vmax ? v : fs->vmax;
+    fs->nsat += (v >= fs->satlevel);
+}
+
+
+/*
+Spatial binning of one frame into the output type
+Each input row is added into its bin row; the binned frame is
+nbx * nby * n_planes, small enough to stay in cache for the accumulation
+Frame stats, if fs is not NULL, are reduced on the raw pixels read
+*/
+#define BIN_CAST(in_type, out_type)                                            \
+    {                                                                          \
+        in_type  *ptr_in  = (in_type *) frame;                                 \
+        out_type *ptr_out = (out_type *) bframe;                               \
+        out_type  norm    = (out_type) 1.0 / (binfact * binfact);              \
+        TSTATS_FSTAT fsl;                                                      \
+        fstat_reset(&fsl, do_fstat ? fs->satlevel : 0.0);                      \
+        memset(ptr_out, 0, sizeof(out_type) * n_bpixels);                      \
+        for (int pl = 0; pl < n_planes; pl++)                                  \
+        {                                                                      \
+            for (uint32_t jj = 0; jj < nby * binfact; jj++)                    \
+            {                                                                  \
+                in_type  *row  = ptr_in + ((long) pl * ny + jj) * nx;          \
+                out_type *brow =                                               \
+                    ptr_out + ((long) pl * nby + jj / binfact) * nbx;          \
+                for (uint32_t ib = 0; ib < nbx; ib++)                          \
+                {                                                              \
+                    out_type sum = 0;                                          \
+                    for (int k = 0; k < binfact; k++)                          \
+                    {                                                          \
+                        in_type x = row[ib * binfact + k];                     \
+                        sum += (out_type) x;                                   \
+                        if (do_fstat)                                          \
+                        {                                                      \
+                            fstat_add(&fsl, (double) x);                       \
+                        }                                                      \
+                    }                                                          \
+                    brow[ib] += sum;                                           \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+        for (long i = 0; i < n_bpixels; i++)                                   \
+        {                                                                      \
+            ptr_out[i] *= norm;                                                \
+        }                                                                      \
+        if (do_fstat)                                                          \
+        {                                                                      \
+            fsl.n = (long) nbx * binfact * nby * binfact * n_planes;           \
+            *fs   = fsl;                                                       \
+        }                                                                      \
+    }
+
+/**
+ * @brief Bin one frame of n_planes planes of nx x ny pixels into bframe
+ *
+ * bframe is of the output type of datatype (float or double), and holds
+ * (nx / binfact) * (ny / binfact) * n_planes pixels
+ */
+static errno_t bin_frame(void         *frame,
+                         uint8_t       datatype,
+                         uint32_t      nx,
+                         uint32_t      ny,
+                         int           n_planes,
+                         int           binfact,
+                         void         *bframe,
+                         TSTATS_FSTAT *fs)
+{
+    int      do_fstat  = (fs != NULL);
+    uint32_t nbx       = nx / binfact;
+    uint32_t nby       = ny / binfact;
+    long     n_bpixels = (long) nbx * nby * n_planes;
+
+    switch(datatype)
+    {
+        case _DATATYPE_UINT8:
+            BIN_CAST(uint8_t, float);
+            break;
+        case _DATATYPE_INT8:
+            BIN_CAST(int8_t, float);
+            break;
+        case _DATATYPE_UINT16:
+            BIN_CAST(uint16_t, float);
+            break;
+        case _DATATYPE_INT16:
+            BIN_CAST(int16_t, float);
+            break;
+        case _DATATYPE_UINT32:
+            BIN_CAST(uint32_t, float);
+            break;
+        case _DATATYPE_INT32:
+            BIN_CAST(int32_t, float);
+            break;
+        case _DATATYPE_UINT64:
+            BIN_CAST(uint64_t, double);
+            break;
+        case _DATATYPE_INT64:
+            BIN_CAST(int64_t, double);
+            break;
+        case _DATATYPE_FLOAT:
+            BIN_CAST(float, float);
+            break;
+        case _DATATYPE_DOUBLE:
+            BIN_CAST(double, double);
+            break;
+        case _DATATYPE_COMPLEX_FLOAT:
+        case _DATATYPE_COMPLEX_DOUBLE:
+        default:
+            PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+            return RETURN_FAILURE;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+#define TSTATS_MAXREFPIX 8
+
+/*
+Accumulators for one stats batch
+sum_x, sum_xx, val_min and val_max are of the output type (float or double)
+Higher moments and correlations are accumulated in double, about a
+per-pixel reference value (first frame of the batch) to avoid cancellation
+Optional buffers are NULL when disabled
+*/
+typedef struct
+{
+    int n_pixels;
+
+    void *sum_x;
+    void *sum_xx;
+
+    void *val_min;
+    void *val_max;
+
+    double *x_ref; // moments or correlations
+    double *sum_d;
+    double *sum_d2;
+    double *sum_d3; // moments
+    double *sum_d4;
+
+    // lag-1 autocorrelation: d_prev is the previous frame, about x_ref
+    double *d_prev;
+    double *sum_lag;
+    long    n_lag;     // number of consecutive frame pairs in sum_lag
+    int     lag_valid; // d_prev holds the frame just before the next one
+
+    // covariance with reference pixels, n_refpix maps of n_pixels
+    int     n_refpix;
+    long    refpix[TSTATS_MAXREFPIX];
+    double  d_refnow[TSTATS_MAXREFPIX];
+    double *sum_cross;
+} TSTATS_ACC;
+
+#define FOREACH_CAST(start, end, ptr_in, out_type)                             \
     {                                                                          \
         int       i;                                                           \
         int       j = end;                                                     \
@@ -78,13 +398,13 @@ THE IMPORTANT, CUSTOM PART
         out_type *ptr_sumxx = (out_type *) sum_xx;                             \
         for (i = start; i < j; i++)                                            \
         {                                                                      \
-            val          = (out_type) (in_img.im->array.in_arr[i]);            \
+            val          = (out_type) ((ptr_in)[i]);                           \
             ptr_sumx[i]  = val;                                                \
             ptr_sumxx[i] = val * val;                                          \
         }                                                                      \
     }
 
-#define FOREACH_CASTADD(start, end, in_arr, out_type)                          \
+#define FOREACH_CASTADD(start, end, ptr_in, out_type)                          \
     {                                                                          \
         int       i;                                                           \
         int       j = end;                                                     \
@@ -93,50 +413,374 @@ THE IMPORTANT, CUSTOM PART
         out_type *ptr_sumxx = (out_type *) sum_xx;                             \
         for (i = start; i < j; i++)                                            \
         {                                                                      \
-            val = (out_type) (in_img.im->array.in_arr[i]);                     \
+            val = (out_type) ((ptr_in)[i]);                                    \
+            ptr_sumx[i] += val;                                                \
+            ptr_sumxx[i] += val * val;                                         \
+        }                                                                      \
+    }
+
+// Same as FOREACH_CAST, plus optional min/max and higher moments
+#define FOREACH_CAST_EXT(start, end, ptr_in, out_type)                         \
+    {                                                                          \
+        int       i;                                                           \
+        int       j = end;                                                     \
+        out_type  val;                                                         \
+        out_type *ptr_sumx  = (out_type *) acc->sum_x;                         \
+        out_type *ptr_sumxx = (out_type *) acc->sum_xx;                        \
+        out_type *ptr_min   = (out_type *) acc->val_min;                       \
+        out_type *ptr_max   = (out_type *) acc->val_max;                       \
+        TSTATS_FSTAT fsl;                                                      \
+        fstat_reset(&fsl, do_fstat ? fs->satlevel : 0.0);                      \
+        for (i = start; i < j; i++)                                            \
+        {                                                                      \
+            val          = (out_type) ((ptr_in)[i]);                           \
+            ptr_sumx[i]  = val;                                                \
+            ptr_sumxx[i] = val * val;                                          \
+            if (do_fstat)                                                      \
+            {                                                                  \
+                fstat_add(&fsl, val);                                          \
+            }                                                                  \
+            if (do_minmax)                                                     \
+            {                                                                  \
+                ptr_min[i] = val;                                              \
+                ptr_max[i] = val;                                              \
+            }                                                                  \
+            if (do_shift)                                                      \
+            {                                                                  \
+                acc->x_ref[i]  = val;                                          \
+                acc->sum_d[i]  = 0.0;                                          \
+                acc->sum_d2[i] = 0.0;                                          \
+            }                                                                  \
+            if (do_moments)                                                    \
+            {                                                                  \
+                acc->sum_d3[i] = 0.0;                                          \
+                acc->sum_d4[i] = 0.0;                                          \
+            }                                                                  \
+            if (do_autocorr)                                                   \
+            {                                                                  \
+                acc->d_prev[i]  = 0.0;                                         \
+                acc->sum_lag[i] = 0.0;                                         \
+            }                                                                  \
+            for (int r = 0; r < acc->n_refpix; r++)                            \
+            {                                                                  \
+                acc->sum_cross[(long) r * acc->n_pixels + i] = 0.0;            \
+            }                                                                  \
+        }                                                                      \
+        if (do_fstat)                                                          \
+        {                                                                      \
+            fsl.n = j - (start);                                               \
+            *fs   = fsl;                                                       \
+        }                                                                      \
+    }
+
+// Same as FOREACH_CASTADD, plus optional min/max, moments, correlations
+#define FOREACH_CASTADD_EXT(start, end, ptr_in, out_type)                      \
+    {                                                                          \
+        int       i;                                                           \
+        int       j = end;                                                     \
+        out_type  val;                                                         \
+        double    d, d2;                                                       \
+        out_type *ptr_sumx  = (out_type *) acc->sum_x;                         \
+        out_type *ptr_sumxx = (out_type *) acc->sum_xx;                        \
+        out_type *ptr_min   = (out_type *) acc->val_min;                       \
+        out_type *ptr_max   = (out_type *) acc->val_max;                       \
+        TSTATS_FSTAT fsl;                                                      \
+        fstat_reset(&fsl, do_fstat ? fs->satlevel : 0.0);                      \
+        for (int r = 0; r < acc->n_refpix; r++)                                \
+        {                                                                      \
+            long p         = acc->refpix[r];                                   \
+            acc->d_refnow[r] =                                                 \
+                (double) ((out_type) ((ptr_in)[p])) - acc->x_ref[p];           \
+        }                                                                      \
+        for (i = start; i < j; i++)                                            \
+        {                                                                      \
+            val = (out_type) ((ptr_in)[i]);                                    \
             ptr_sumx[i] += val;                                                \
             ptr_sumxx[i] += val * val;                                         \
+            if (do_fstat)                                                      \
+            {                                                                  \
+                fstat_add(&fsl, val);                                          \
+            }                                                                  \
+            if (do_minmax)                                                     \
+            {                                                                  \
+                ptr_min[i] = val < ptr_min[i] ? val : ptr_min[i];              \
+                ptr_max[i] = val > ptr_max[i] ? val : ptr_max[i];              \
+            }                                                                  \
+            if (do_shift)                                                      \
+            {                                                                  \
+                d  = val - acc->x_ref[i];                                      \
+                d2 = d * d;                                                    \
+                acc->sum_d[i] += d;                                            \
+                acc->sum_d2[i] += d2;                                          \
+                if (do_moments)                                                \
+                {                                                              \
+                    acc->sum_d3[i] += d2 * d;                                  \
+                    acc->sum_d4[i] += d2 * d2;                                 \
+                }                                                              \
+                if (do_autocorr)                                               \
+                {                                                              \
+                    if (acc->lag_valid)                                        \
+                    {                                                          \
+                        acc->sum_lag[i] += d * acc->d_prev[i];                 \
+                    }                                                          \
+                    acc->d_prev[i] = d;                                        \
+                }                                                              \
+                for (int r = 0; r < acc->n_refpix; r++)                        \
+                {                                                              \
+                    acc->sum_cross[(long) r * acc->n_pixels + i] +=            \
+                        d * acc->d_refnow[r];                                  \
+                }                                                              \
+            }                                                                  \
         }                                                                      \
+        if (do_fstat)                                                          \
+        {                                                                      \
+            fsl.n = j - (start);                                               \
+            *fs   = fsl;                                                       \
+        }                                                                      \
+    }
+
+static errno_t tstats_acc_alloc(TSTATS_ACC *acc,
+                                int         n_pixels,
+                                int         sizeof_out,
+                                int         do_minmax,
+                                int         do_moments,
+                                int         do_autocorr,
+                                int         n_refpix,
+                                long       *refpix)
+{
+    memset(acc, 0, sizeof(TSTATS_ACC));
+    acc->n_pixels = n_pixels;
+
+    acc->sum_x  = malloc(n_pixels * sizeof_out);
+    acc->sum_xx = malloc(n_pixels * sizeof_out);
+
+    if(do_minmax)
+    {
+        acc->val_min = malloc(n_pixels * sizeof_out);
+        acc->val_max = malloc(n_pixels * sizeof_out);
+    }
+
+    if(do_moments || do_autocorr || n_refpix > 0)
+    {
+        acc->x_ref  = (double *) malloc(n_pixels * sizeof(double));
+        acc->sum_d  = (double *) malloc(n_pixels * sizeof(double));
+        acc->sum_d2 = (double *) malloc(n_pixels * sizeof(double));
+    }
+
+    if(do_moments)
+    {
+        acc->sum_d3 = (double *) malloc(n_pixels * sizeof(double));
+        acc->sum_d4 = (double *) malloc(n_pixels * sizeof(double));
+    }
+
+    if(do_autocorr)
+    {
+        acc->d_prev  = (double *) malloc(n_pixels * sizeof(double));
+        acc->sum_lag = (double *) malloc(n_pixels * sizeof(double));
+    }
+
+    if(n_refpix > 0)
+    {
+        acc->n_refpix = n_refpix;
+        memcpy(acc->refpix, refpix, n_refpix * sizeof(long));
+        acc->sum_cross =
+            (double *) malloc((long) n_refpix * n_pixels * sizeof(double));
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static errno_t tstats_acc_free(TSTATS_ACC *acc)
+{
+    // free(NULL) is a no-op for disabled buffers
+    free(acc->sum_x);
+    free(acc->sum_xx);
+    free(acc->val_min);
+    free(acc->val_max);
+    free(acc->x_ref);
+    free(acc->sum_d);
+    free(acc->sum_d2);
+    free(acc->sum_d3);
+    free(acc->sum_d4);
+    free(acc->d_prev);
+    free(acc->sum_lag);
+    free(acc->sum_cross);
+
+    return RETURN_SUCCESS;
+}
+
+static errno_t ave_std_accumulate_ext(void         *frame,
+                                      uint8_t       datatype,
+                                      int           n_pixels,
+                                      TSTATS_ACC   *acc,
+                                      int           reset,
+                                      TSTATS_FSTAT *fs)
+{
+    int do_fstat    = (fs != NULL);
+    int do_minmax   = (acc->val_min != NULL);
+    int do_shift    = (acc->x_ref != NULL);
+    int do_moments  = (acc->sum_d3 != NULL);
+    int do_autocorr = (acc->d_prev != NULL);
+
+    if(reset)
+    {
+        switch(datatype)
+        {
+            case _DATATYPE_UINT8:
+                FOREACH_CAST_EXT(0, n_pixels, (uint8_t *) frame, float);
+                break;
+            case _DATATYPE_INT8:
+                FOREACH_CAST_EXT(0, n_pixels, (int8_t *) frame, float);
+                break;
+            case _DATATYPE_UINT16:
+                FOREACH_CAST_EXT(0, n_pixels, (uint16_t *) frame, float);
+                break;
+            case _DATATYPE_INT16:
+                FOREACH_CAST_EXT(0, n_pixels, (int16_t *) frame, float);
+                break;
+            case _DATATYPE_UINT32:
+                FOREACH_CAST_EXT(0, n_pixels, (uint32_t *) frame, float);
+                break;
+            case _DATATYPE_INT32:
+                FOREACH_CAST_EXT(0, n_pixels, (int32_t *) frame, float);
+                break;
+            case _DATATYPE_UINT64:
+                FOREACH_CAST_EXT(0, n_pixels, (uint64_t *) frame, double);
+                break;
+            case _DATATYPE_INT64:
+                FOREACH_CAST_EXT(0, n_pixels, (int64_t *) frame, double);
+                break;
+            case _DATATYPE_FLOAT:
+                FOREACH_CAST_EXT(0, n_pixels, (float *) frame, float);
+                break;
+            case _DATATYPE_DOUBLE:
+                FOREACH_CAST_EXT(0, n_pixels, (double *) frame, double);
+                break;
+            case _DATATYPE_COMPLEX_FLOAT:
+            case _DATATYPE_COMPLEX_DOUBLE:
+            default:
+                PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+                return RETURN_FAILURE;
+        }
+    }
+    else
+    {
+        switch(datatype)
+        {
+            case _DATATYPE_UINT8:
+                FOREACH_CASTADD_EXT(0, n_pixels, (uint8_t *) frame, float);
+                break;
+            case _DATATYPE_INT8:
+                FOREACH_CASTADD_EXT(0, n_pixels, (int8_t *) frame, float);
+                break;
+            case _DATATYPE_UINT16:
+                FOREACH_CASTADD_EXT(0, n_pixels, (uint16_t *) frame, float);
+                break;
+            case _DATATYPE_INT16:
+                FOREACH_CASTADD_EXT(0, n_pixels, (int16_t *) frame, float);
+                break;
+            case _DATATYPE_UINT32:
+                FOREACH_CASTADD_EXT(0, n_pixels, (uint32_t *) frame, float);
+                break;
+            case _DATATYPE_INT32:
+                FOREACH_CASTADD_EXT(0, n_pixels, (int32_t *) frame, float);
+                break;
+            case _DATATYPE_UINT64:
+                FOREACH_CASTADD_EXT(0, n_pixels, (uint64_t *) frame, double);
+                break;
+            case _DATATYPE_INT64:
+                FOREACH_CASTADD_EXT(0, n_pixels, (int64_t *) frame, double);
+                break;
+            case _DATATYPE_FLOAT:
+                FOREACH_CASTADD_EXT(0, n_pixels, (float *) frame, float);
+                break;
+            case _DATATYPE_DOUBLE:
+                FOREACH_CASTADD_EXT(0, n_pixels, (double *) frame, double);
+                break;
+            case _DATATYPE_COMPLEX_FLOAT:
+            case _DATATYPE_COMPLEX_DOUBLE:
+            default:
+                PRINT_ERROR("COMPLEX TYPES UNSUPPORTED");
+                return RETURN_FAILURE;
+        }
     }
 
-static errno_t
-ave_std_accumulate(IMGID in_img, void *sum_x, void *sum_xx, int reset)
+    // Lag pairs: the first frame of a batch has d = 0 and pairs with the
+    // next one; a frame following missed frames does not pair
+    if(reset)
+    {
+        acc->n_lag = 0;
+    }
+    else if(acc->lag_valid)
+    {
+        ++acc->n_lag;
+    }
+    acc->lag_valid = TRUE;
+
+    return RETURN_SUCCESS;
+}
+
+/**
+ * @brief Accumulate one frame of n_pixels of type datatype
+ *
+ * frame points into the input stream (whole frame, or one slice of a 3D
+ * stream in slice mode), or to the binned frame buffer.
+ * Frame stats are reduced into fs in the same loop, if fs is not NULL.
+ */
+static errno_t ave_std_accumulate(void         *frame,
+                                  uint8_t       datatype,
+                                  int           n_pixels,
+                                  TSTATS_ACC   *acc,
+                                  int           reset,
+                                  TSTATS_FSTAT *fs)
 {
-    int n_pixels = in_img.md->size[0] * in_img.md->size[1];
+    // Optional accumulators: take the extended loop, still a single pass
+    if(acc->val_min != NULL || acc->x_ref != NULL || fs != NULL)
+    {
+        return ave_std_accumulate_ext(frame,
+                                      datatype,
+                                      n_pixels,
+                                      acc,
+                                      reset,
+                                      fs);
+    }
+
+    void *sum_x  = acc->sum_x;
+    void *sum_xx = acc->sum_xx;
 
     if(reset)
     {
-        switch(in_img.datatype)
+        switch(datatype)
         {
             case _DATATYPE_UINT8:
-                FOREACH_CAST(0, n_pixels, UI8, float);
+                FOREACH_CAST(0, n_pixels, (uint8_t *) frame, float);
                 break;
             case _DATATYPE_INT8:
-                FOREACH_CAST(0, n_pixels, SI8, float);
+                FOREACH_CAST(0, n_pixels, (int8_t *) frame, float);
                 break;
             case _DATATYPE_UINT16:
-                FOREACH_CAST(0, n_pixels, UI16, float);
+                FOREACH_CAST(0, n_pixels, (uint16_t *) frame, float);
                 break;
             case _DATATYPE_INT16:
-                FOREACH_CAST(0, n_pixels, SI16, float);
+                FOREACH_CAST(0, n_pixels, (int16_t *) frame, float);
                 break;
             case _DATATYPE_UINT32:
-                FOREACH_CAST(0, n_pixels, UI32, float);
+                FOREACH_CAST(0, n_pixels, (uint32_t *) frame, float);
                 break;
             case _DATATYPE_INT32:
-                FOREACH_CAST(0, n_pixels, SI32, float);
+                FOREACH_CAST(0, n_pixels, (int32_t *) frame, float);
                 break;
             case _DATATYPE_UINT64:
-                FOREACH_CAST(0, n_pixels, UI64, double);
+                FOREACH_CAST(0, n_pixels, (uint64_t *) frame, double);
                 break;
             case _DATATYPE_INT64:
-                FOREACH_CAST(0, n_pixels, SI64, double);
+                FOREACH_CAST(0, n_pixels, (int64_t *) frame, double);
                 break;
             case _DATATYPE_FLOAT:
-                FOREACH_CAST(0, n_pixels, F, float);
+                FOREACH_CAST(0, n_pixels, (float *) frame, float);
                 break;
             case _DATATYPE_DOUBLE:
-                FOREACH_CAST(0, n_pixels, D, double);
+                FOREACH_CAST(0, n_pixels, (double *) frame, double);
                 break;
             case _DATATYPE_COMPLEX_FLOAT:
             case _DATATYPE_COMPLEX_DOUBLE:
@@ -147,37 +791,37 @@ ave_std_accumulate(IMGID in_img, void *sum_x, void *sum_xx, int reset)
     }
     else
     {
-        switch(in_img.datatype)
+        switch(datatype)
         {
             case _DATATYPE_UINT8:
-                FOREACH_CASTADD(0, n_pixels, UI8, float);
+                FOREACH_CASTADD(0, n_pixels, (uint8_t *) frame, float);
                 break;
             case _DATATYPE_INT8:
-                FOREACH_CASTADD(0, n_pixels, SI8, float);
+                FOREACH_CASTADD(0, n_pixels, (int8_t *) frame, float);
                 break;
             case _DATATYPE_UINT16:
-                FOREACH_CASTADD(0, n_pixels, UI16, float);
+                FOREACH_CASTADD(0, n_pixels, (uint16_t *) frame, float);
                 break;
             case _DATATYPE_INT16:
-                FOREACH_CASTADD(0, n_pixels, SI16, float);
+                FOREACH_CASTADD(0, n_pixels, (int16_t *) frame, float);
                 break;
             case _DATATYPE_UINT32:
-                FOREACH_CASTADD(0, n_pixels, UI32, float);
+                FOREACH_CASTADD(0, n_pixels, (uint32_t *) frame, float);
                 break;
             case _DATATYPE_INT32:
-                FOREACH_CASTADD(0, n_pixels, SI32, float);
+                FOREACH_CASTADD(0, n_pixels, (int32_t *) frame, float);
                 break;
             case _DATATYPE_UINT64:
-                FOREACH_CASTADD(0, n_pixels, UI64, double);
+                FOREACH_CASTADD(0, n_pixels, (uint64_t *) frame, double);
                 break;
             case _DATATYPE_INT64:
-                FOREACH_CASTADD(0, n_pixels, SI64, double);
+                FOREACH_CASTADD(0, n_pixels, (int64_t *) frame, double);
                 break;
             case _DATATYPE_FLOAT:
-                FOREACH_CASTADD(0, n_pixels, F, float);
+                FOREACH_CASTADD(0, n_pixels, (float *) frame, float);
                 break;
             case _DATATYPE_DOUBLE:
-                FOREACH_CASTADD(0, n_pixels, D, double);
+                FOREACH_CASTADD(0, n_pixels, (double *) frame, double);
                 break;
             case _DATATYPE_COMPLEX_FLOAT:
             case _DATATYPE_COMPLEX_DOUBLE:
@@ -193,7 +837,7 @@ ave_std_accumulate(IMGID in_img, void *sum_x, void *sum_xx, int reset)
 
 errno_t ave_finalize(IMGID out_ave_img, void *sum_x, int n_frames_acc)
 {
-    int n_pixels = out_ave_img.md->size[0] * out_ave_img.md->size[1];
+    int n_pixels = out_ave_img.md->nelement;
     // TODO MACRO this if a third type may occur
 
     out_ave_img.md->write = TRUE;
@@ -226,7 +870,7 @@ errno_t ave_finalize(IMGID out_ave_img, void *sum_x, int n_frames_acc)
 errno_t
 std_finalize(IMGID out_std_img, void *sum_x, void *sum_xx, int n_frames_acc)
 {
-    int n_pixels = out_std_img.md->size[0] * out_std_img.md->size[1];
+    int n_pixels = out_std_img.md->nelement;
 
     out_std_img.md->write = TRUE;
 
@@ -263,10 +907,424 @@ std_finalize(IMGID out_std_img, void *sum_x, void *sum_xx, int n_frames_acc)
     return RETURN_SUCCESS;
 }
 
+errno_t
+minmax_finalize(IMGID out_min_img, IMGID out_max_img, TSTATS_ACC *acc)
+{
+    int n_pixels = out_min_img.md->nelement;
+    int typesize = ImageStreamIO_typesize(out_min_img.datatype);
+
+    // Accumulators are already of the output type
+    out_min_img.md->write = TRUE;
+    memcpy(out_min_img.im->array.raw, acc->val_min, n_pixels * typesize);
+
+    out_max_img.md->write = TRUE;
+    memcpy(out_max_img.im->array.raw, acc->val_max, n_pixels * typesize);
+
+    return RETURN_SUCCESS;
+}
+
+errno_t moments_finalize(IMGID       out_skew_img,
+                         IMGID       out_kurt_img,
+                         TSTATS_ACC *acc,
+                         int         n_frames_acc)
+{
+    int n_pixels = out_skew_img.md->nelement;
+
+    if(out_skew_img.datatype != _DATATYPE_FLOAT &&
+            out_skew_img.datatype != _DATATYPE_DOUBLE)
+    {
+        PRINT_ERROR("TYPE UNSUPPORTED");
+        return RETURN_FAILURE;
+    }
+
+    out_skew_img.md->write = TRUE;
+    out_kurt_img.md->write = TRUE;
+
+    for(int ii = 0; ii < n_pixels; ++ii)
+    {
+        // Central moments from moments about x_ref
+        double m1 = acc->sum_d[ii] / n_frames_acc;
+        double e2 = acc->sum_d2[ii] / n_frames_acc;
+        double e3 = acc->sum_d3[ii] / n_frames_acc;
+        double e4 = acc->sum_d4[ii] / n_frames_acc;
+
+        double mu2 = e2 - m1 * m1;
+        double mu3 = e3 - 3.0 * m1 * e2 + 2.0 * m1 * m1 * m1;
+        double mu4 =
+            e4 - 4.0 * m1 * e3 + 6.0 * m1 * m1 * e2 - 3.0 * m1 * m1 * m1 * m1;
+
+        double skew = 0.0;
+        double kurt = 0.0;
+        if(mu2 > 0.0)
+        {
+            skew = mu3 / (mu2 * sqrt(mu2));
+            kurt = mu4 / (mu2 * mu2) - 3.0;
+        }
+
+        if(out_skew_img.datatype == _DATATYPE_FLOAT)
+        {
+            out_skew_img.im->array.F[ii] = skew;
+            out_kurt_img.im->array.F[ii] = kurt;
+        }
+        else
+        {
+            out_skew_img.im->array.D[ii] = skew;
+            out_kurt_img.im->array.D[ii] = kurt;
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+errno_t
+autocorr_finalize(IMGID out_acorr_img, TSTATS_ACC *acc, int n_frames_acc)
+{
+    int n_pixels = out_acorr_img.md->nelement;
+
+    if(out_acorr_img.datatype != _DATATYPE_FLOAT &&
+            out_acorr_img.datatype != _DATATYPE_DOUBLE)
+    {
+        PRINT_ERROR("TYPE UNSUPPORTED");
+        return RETURN_FAILURE;
+    }
+
+    out_acorr_img.md->write = TRUE;
+
+    for(int ii = 0; ii < n_pixels; ++ii)
+    {
+        // Lag-1 covariance over consecutive pairs, about the batch mean
+        double m1   = acc->sum_d[ii] / n_frames_acc;
+        double mu2  = acc->sum_d2[ii] / n_frames_acc - m1 * m1;
+        double rho1 = 0.0;
+        if(mu2 > 0.0 && acc->n_lag > 0)
+        {
+            rho1 = (acc->sum_lag[ii] / acc->n_lag - m1 * m1) / mu2;
+        }
+
+        if(out_acorr_img.datatype == _DATATYPE_FLOAT)
+        {
+            out_acorr_img.im->array.F[ii] = rho1;
+        }
+        else
+        {
+            out_acorr_img.im->array.D[ii] = rho1;
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+errno_t cov_finalize(IMGID out_cov_img, TSTATS_ACC *acc, int n_frames_acc)
+{
+    long n_pixels = acc->n_pixels;
+
+    if(out_cov_img.datatype != _DATATYPE_FLOAT &&
+            out_cov_img.datatype != _DATATYPE_DOUBLE)
+    {
+        PRINT_ERROR("TYPE UNSUPPORTED");
+        return RETURN_FAILURE;
+    }
+
+    out_cov_img.md->write = TRUE;
+
+    for(int r = 0; r < acc->n_refpix; ++r)
+    {
+        double  sum_ref = acc->sum_d[acc->refpix[r]];
+        double *cross   = acc->sum_cross + r * n_pixels;
+        for(long ii = 0; ii < n_pixels; ++ii)
+        {
+            double cov = (cross[ii] - acc->sum_d[ii] * sum_ref / n_frames_acc) /
+                         (n_frames_acc - 1);
+
+            if(out_cov_img.datatype == _DATATYPE_FLOAT)
+            {
+                out_cov_img.im->array.F[r * n_pixels + ii] = cov;
+            }
+            else
+            {
+                out_cov_img.im->array.D[r * n_pixels + ii] = cov;
+            }
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
 /*
 BOILERPLATE
 */
 
+// Extra output keywords, indexed after the input keywords
+#define TSTATS_KW_NFRAMES 0
+#define TSTATS_KW_NSKIP   1
+#define TSTATS_NBKW_EXTRA 4
+
+/*
+Output streams, optional ones only resolved when enabled
+*/
+typedef struct
+{
+    int do_minmax;
+    int do_moments;
+    int do_autocorr;
+    int n_refpix;
+
+    IMGID ave;
+    IMGID std;
+    IMGID min;
+    IMGID max;
+    IMGID skew;
+    IMGID kurt;
+    IMGID acorr;
+    IMGID cov;
+
+    // processinfo output updates come from the compute loop (fstats) and
+    // from the publisher thread: serialized here
+    pthread_mutex_t postmutex;
+} TSTATS_OUT;
+
+static void
+stats_post(TSTATS_OUT *out, PROCESSINFO *processinfo, imageID ID)
+{
+    pthread_mutex_lock(&out->postmutex);
+    processinfo_update_output_stream(processinfo, ID);
+    pthread_mutex_unlock(&out->postmutex);
+}
+
+/**
+ * @brief Resolve or create output <in_name><suffix>
+ *
+ * out_tmpl is a copy of the input IMGID with datatype and shape of the
+ * output. Its keywords are copied to the output.
+ */
+static IMGID stats_output_resolve(IMGID out_tmpl, const char *suffix)
+{
+    char out_name[200];
+    strcpy(out_name, in_name);
+    strcat(out_name, suffix);
+
+    uint64_t nelement = 1;
+    for(int k = 0; k < out_tmpl.naxis; ++k)
+    {
+        nelement *= out_tmpl.size[k];
+    }
+
+    IMGID out_img = mkIMGID_from_name(out_name);
+    if(resolveIMGID(&out_img, ERRMODE_WARN))
+    {
+        PRINT_WARNING("WARNING - output %s not found and being created",
+                      out_name);
+        imcreatelikewiseIMGID(&out_img, &out_tmpl);
+        resolveIMGID(&out_img, ERRMODE_ABORT);
+    }
+    if(out_img.md->nelement != nelement ||
+            out_img.md->datatype != out_tmpl.datatype)
+    {
+        PRINT_ERROR("output %s exists with wrong size or type", out_name);
+        abort(); // can't handle this error any other way
+    }
+    if(out_img.md->NBkw < out_tmpl.NBkw)
+    {
+        PRINT_WARNING("output %s has no room for stats keywords", out_name);
+    }
+
+    /*
+     Keyword setup - initialization
+    */
+    for(int kw = 0; kw < out_tmpl.md->NBkw && kw < out_img.md->NBkw; ++kw)
+    {
+        strcpy(out_img.im->kw[kw].name, out_tmpl.im->kw[kw].name);
+        out_img.im->kw[kw].type  = out_tmpl.im->kw[kw].type;
+        out_img.im->kw[kw].value = out_tmpl.im->kw[kw].value;
+        strcpy(out_img.im->kw[kw].comment, out_tmpl.im->kw[kw].comment);
+    }
+
+    return out_img;
+}
+
+// Keyword value carry-over
+static void stats_kw_carryover(IMGID out_img, IMGID in_img)
+{
+    for(int kw = 0; kw < in_img.md->NBkw && kw < out_img.md->NBkw; ++kw)
+    {
+        out_img.im->kw[kw].value = in_img.im->kw[kw].value;
+    }
+}
+
+// Set integer keyword at index kw, if the output has room for it
+static void stats_kw_set_long(
+    IMGID out_img, int kw, const char *name, long value, const char *comment)
+{
+    if(kw >= out_img.md->NBkw)
+    {
+        return;
+    }
+    strcpy(out_img.im->kw[kw].name, name);
+    out_img.im->kw[kw].type       = 'L';
+    out_img.im->kw[kw].value.numl = value;
+    strcpy(out_img.im->kw[kw].comment, comment);
+}
+
+// Keywords of all enabled outputs for the batch about to be published
+static void stats_kw_update(TSTATS_OUT *out,
+                            IMGID       in_img,
+                            int         n_frames_acc,
+                            int         n_skip_acc)
+{
+    IMGID *imgs[8] = {&out->ave, &out->std, NULL, NULL, NULL, NULL, NULL, NULL};
+    if(out->do_minmax)
+    {
+        imgs[2] = &out->min;
+        imgs[3] = &out->max;
+    }
+    if(out->do_moments)
+    {
+        imgs[4] = &out->skew;
+        imgs[5] = &out->kurt;
+    }
+    if(out->do_autocorr)
+    {
+        imgs[6] = &out->acorr;
+    }
+    if(out->n_refpix > 0)
+    {
+        imgs[7] = &out->cov;
+    }
+
+    int kw0 = in_img.md->NBkw; // extra keywords follow the input ones
+    for(int k = 0; k < 8; ++k)
+    {
+        if(imgs[k] != NULL)
+        {
+            stats_kw_carryover(*imgs[k], in_img);
+            stats_kw_set_long(*imgs[k],
+                              kw0 + TSTATS_KW_NFRAMES,
+                              "NFRAMES",
+                              n_frames_acc,
+                              "Number of frames in stats batch");
+            stats_kw_set_long(*imgs[k],
+                              kw0 + TSTATS_KW_NSKIP,
+                              "NSKIP",
+                              n_skip_acc,
+                              "Frames written but missed in batch");
+        }
+    }
+}
+
+static errno_t stats_publish(TSTATS_OUT  *out,
+                             TSTATS_ACC  *acc,
+                             int          n_frames_acc,
+                             PROCESSINFO *processinfo)
+{
+    ave_finalize(out->ave, acc->sum_x, n_frames_acc);
+    stats_post(out, processinfo, out->ave.ID);
+
+    if(out->do_minmax)
+    {
+        minmax_finalize(out->min, out->max, acc);
+        stats_post(out, processinfo, out->min.ID);
+        stats_post(out, processinfo, out->max.ID);
+    }
+
+    if(n_frames_acc >= 2)
+    {
+        std_finalize(out->std, acc->sum_x, acc->sum_xx, n_frames_acc);
+        stats_post(out, processinfo, out->std.ID);
+
+        if(out->do_moments)
+        {
+            moments_finalize(out->skew, out->kurt, acc, n_frames_acc);
+            stats_post(out, processinfo, out->skew.ID);
+            stats_post(out, processinfo, out->kurt.ID);
+        }
+
+        if(out->do_autocorr)
+        {
+            autocorr_finalize(out->acorr, acc, n_frames_acc);
+            stats_post(out, processinfo, out->acorr.ID);
+        }
+
+        if(out->n_refpix > 0)
+        {
+            cov_finalize(out->cov, acc, n_frames_acc);
+            stats_post(out, processinfo, out->cov.ID);
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+/*
+Publisher thread: finalizes and publishes one accumulator set while the
+compute loop accumulates into the other one
+*/
+typedef struct
+{
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    int pending; // batch handed over, not yet published
+    int quit;
+
+    TSTATS_OUT  *out;
+    TSTATS_ACC  *acc;
+    int          n_frames_acc;
+    PROCESSINFO *processinfo;
+} TSTATS_PUBLISHER;
+
+static void *stats_publisher_thread(void *ptr)
+{
+    TSTATS_PUBLISHER *pub = (TSTATS_PUBLISHER *) ptr;
+
+    pthread_mutex_lock(&pub->mutex);
+    while(1)
+    {
+        while(!pub->pending && !pub->quit)
+        {
+            pthread_cond_wait(&pub->cond, &pub->mutex);
+        }
+        if(!pub->pending)
+        {
+            break; // quit, nothing left to publish
+        }
+        pthread_mutex_unlock(&pub->mutex);
+
+        stats_publish(pub->out, pub->acc, pub->n_frames_acc, pub->processinfo);
+
+        pthread_mutex_lock(&pub->mutex);
+        pub->pending = FALSE;
+        pthread_cond_broadcast(&pub->cond);
+    }
+    pthread_mutex_unlock(&pub->mutex);
+
+    return NULL;
+}
+
+// Wait until the previous batch is published
+static void stats_publisher_wait(TSTATS_PUBLISHER *pub)
+{
+    pthread_mutex_lock(&pub->mutex);
+    while(pub->pending)
+    {
+        pthread_cond_wait(&pub->cond, &pub->mutex);
+    }
+    pthread_mutex_unlock(&pub->mutex);
+}
+
+// Hand over a completed accumulator set; caller has waited for the previous
+static void stats_publisher_post(TSTATS_PUBLISHER *pub,
+                                 TSTATS_ACC       *acc,
+                                 int               n_frames_acc)
+{
+    pthread_mutex_lock(&pub->mutex);
+    pub->acc          = acc;
+    pub->n_frames_acc = n_frames_acc;
+    pub->pending      = TRUE;
+    pthread_cond_broadcast(&pub->cond);
+    pthread_mutex_unlock(&pub->mutex);
+}
+
 static errno_t compute_function()
 {
     DEBUG_TRACE_FSTART();
@@ -287,66 +1345,177 @@ static errno_t compute_function()
     uint8_t _DATATYPE_OUTPUT       = ImageStreamIO_floattype(_DATATYPE_INPUT);
     uint8_t SIZEOF_DATATYPE_OUTPUT = ImageStreamIO_typesize(_DATATYPE_OUTPUT);
 
-    char out_ave_name[200];
-    strcpy(out_ave_name, in_name);
-    strcat(out_ave_name, "_ave");
+    // HANDLE GEOMETRY
+    // 3D input: either the whole volume is the pixel set (outputs are 3D),
+    // or slices are successive frames written one at a time (outputs 2D)
+    int naxis     = in_img.md->naxis;
+    int slicemode = (naxis == 3) && (*ptr_slicemode > 0);
+    int n_slices  = (naxis == 3) ? in_img.md->size[2] : 1;
+    int n_pixels  = in_img.md->size[0] * in_img.md->size[1];
+    int n_planes  = (naxis == 3 && !slicemode) ? n_slices : 1;
+    n_pixels *= n_planes;
 
-    char out_std_name[200];
-    strcpy(out_std_name, in_name);
-    strcat(out_std_name, "_std");
+    // Spatial binning: stats run on the binned pixels (n_stat_pixels)
+    int binfact = (*ptr_binfact > 1) ? *ptr_binfact : 1;
+    if(binfact > (int) in_img.md->size[0] ||
+            binfact > (int) in_img.md->size[1])
+    {
+        PRINT_ERROR("binfact %d larger than image %u x %u",
+                    binfact,
+                    in_img.md->size[0],
+                    in_img.md->size[1]);
+        abort(); // can't handle this error any other way
+    }
+    uint32_t nbx           = in_img.md->size[0] / binfact;
+    uint32_t nby           = in_img.md->size[1] / binfact;
+    int      n_stat_pixels = nbx * nby * n_planes;
+    int      typesize_in   = ImageStreamIO_typesize(_DATATYPE_INPUT);
 
-    // Resolve or create outputs, per need
-    IMGID out_ave_img = mkIMGID_from_name(out_ave_name);
-    if(resolveIMGID(&out_ave_img, ERRMODE_WARN))
+    void *bframe = NULL;
+    if(binfact > 1)
     {
-        PRINT_WARNING(
-            "WARNING - output average image not found and being created");
-        in_img.datatype = _DATATYPE_OUTPUT; // To be passed to out_ave_img
-        imcreatelikewiseIMGID(&out_ave_img, &in_img);
-        in_img.datatype = _DATATYPE_INPUT; // Revert !
-        resolveIMGID(&out_ave_img, ERRMODE_ABORT);
+        bframe = malloc((size_t) n_stat_pixels * SIZEOF_DATATYPE_OUTPUT);
     }
 
-    IMGID out_std_img = mkIMGID_from_name(out_std_name);
-    if(resolveIMGID(&out_std_img, ERRMODE_WARN))
+    IMGID out_tmpl    = in_img;
+    out_tmpl.datatype = _DATATYPE_OUTPUT;
+    out_tmpl.NBkw     = in_img.md->NBkw + TSTATS_NBKW_EXTRA;
+    out_tmpl.naxis    = naxis;
+    for(int k = 0; k < 3; ++k)
+    {
+        out_tmpl.size[k] = (k < naxis) ? in_img.md->size[k] : 0;
+    }
+    out_tmpl.size[0] = nbx;
+    out_tmpl.size[1] = nby;
+    if(slicemode)
     {
-        PRINT_WARNING("WARNING - output std image not found and being created");
-        in_img.datatype = _DATATYPE_OUTPUT; // To be passed to out_std_img
-        imcreatelikewiseIMGID(&out_std_img, &in_img);
-        in_img.datatype = _DATATYPE_INPUT; // Revert !
-        resolveIMGID(&out_std_img, ERRMODE_ABORT);
+        out_tmpl.naxis   = 2;
+        out_tmpl.size[2] = 0;
     }
 
-    /*
-     Keyword setup - initialization
-    */
+    // Resolve or create outputs, per need
+    TSTATS_OUT out;
+    memset(&out, 0, sizeof(TSTATS_OUT));
+    pthread_mutex_init(&out.postmutex, NULL);
+    out.do_minmax   = (*ptr_minmax > 0);
+    out.do_moments  = (*ptr_moments > 0);
+    out.do_autocorr = (*ptr_autocorr > 0);
 
-    for(int kw = 0; kw < in_img.md->NBkw; ++kw)
+    // Reference pixels, as linear indices into the (binned) pixel set
+    long  refpix[TSTATS_MAXREFPIX];
+    char  refpix_str[STRINGMAXLEN_IMGNAME];
+    char *saveptr = NULL;
+    strncpy(refpix_str, refpix_list, STRINGMAXLEN_IMGNAME - 1);
+    refpix_str[STRINGMAXLEN_IMGNAME - 1] = '\0';
+    if(strcmp(refpix_str, "none") != 0)
     {
-        // AVE
-        strcpy(out_ave_img.im->kw[kw].name, in_img.im->kw[kw].name);
-        out_ave_img.im->kw[kw].type  = in_img.im->kw[kw].type;
-        out_ave_img.im->kw[kw].value = in_img.im->kw[kw].value;
-        strcpy(out_ave_img.im->kw[kw].comment, in_img.im->kw[kw].comment);
-        // STD
-        strcpy(out_std_img.im->kw[kw].name, in_img.im->kw[kw].name);
-        out_std_img.im->kw[kw].type  = in_img.im->kw[kw].type;
-        out_std_img.im->kw[kw].value = in_img.im->kw[kw].value;
-        strcpy(out_std_img.im->kw[kw].comment, in_img.im->kw[kw].comment);
+        for(char *tok = strtok_r(refpix_str, ":", &saveptr); tok != NULL;
+                tok = strtok_r(NULL, ":", &saveptr))
+        {
+            int x = 0;
+            int y = 0;
+            int z = 0;
+            int n = sscanf(tok, "%d,%d,%d", &x, &y, &z);
+            if(n < 2 || x < 0 || y < 0 || z < 0 || x >= (int) nbx ||
+                    y >= (int) nby || z >= n_planes)
+            {
+                PRINT_ERROR("refpix %s invalid or outside %u x %u x %d",
+                            tok,
+                            nbx,
+                            nby,
+                            n_planes);
+                abort(); // can't handle this error any other way
+            }
+            if(out.n_refpix == TSTATS_MAXREFPIX)
+            {
+                PRINT_WARNING("more than %d refpix, ignoring %s",
+                              TSTATS_MAXREFPIX,
+                              tok);
+                break;
+            }
+            refpix[out.n_refpix++] = ((long) z * nby + y) * nbx + x;
+        }
+    }
+
+    out.ave = stats_output_resolve(out_tmpl, "_ave");
+    out.std = stats_output_resolve(out_tmpl, "_std");
+    if(out.do_minmax)
+    {
+        out.min = stats_output_resolve(out_tmpl, "_min");
+        out.max = stats_output_resolve(out_tmpl, "_max");
+    }
+    if(out.do_moments)
+    {
+        out.skew = stats_output_resolve(out_tmpl, "_skew");
+        out.kurt = stats_output_resolve(out_tmpl, "_kurt");
+    }
+    if(out.do_autocorr)
+    {
+        out.acorr = stats_output_resolve(out_tmpl, "_acorr");
+    }
+    if(out.n_refpix > 0)
+    {
+        // One map per reference pixel, stacked along axis 3
+        IMGID cov_tmpl   = out_tmpl;
+        cov_tmpl.naxis   = 3;
+        cov_tmpl.size[2] = out.n_refpix * n_planes;
+        out.cov          = stats_output_resolve(cov_tmpl, "_cov");
+    }
+
+    // Frame stats ring buffer, one row per frame
+    int           fstatlen = (*ptr_fstatlen > 0) ? *ptr_fstatlen : 0;
+    TSTATS_FSTAT  fstat;
+    TSTATS_FSTAT *fs = NULL;
+    IMGID         fstat_img;
+    if(fstatlen > 0)
+    {
+        char fstat_name[200];
+        strcpy(fstat_name, in_name);
+        strcat(fstat_name, "_fstats");
+
+        fstat_img = mkIMGID_from_name(fstat_name);
+        if(resolveIMGID(&fstat_img, ERRMODE_WARN) ||
+                fstat_img.md->size[0] != TSTATS_FSTAT_NCOL ||
+                fstat_img.md->size[1] != (uint32_t) fstatlen ||
+                fstat_img.md->datatype != _DATATYPE_DOUBLE)
+        {
+            PRINT_WARNING("WARNING - output fstats image being (re)created");
+            fstat_img = makeIMGID_2D(fstat_name, TSTATS_FSTAT_NCOL, fstatlen);
+            fstat_img.datatype = _DATATYPE_DOUBLE;
+            fstat_img.shared   = 1;
+            imcreateIMGID(&fstat_img);
+            resolveIMGID(&fstat_img, ERRMODE_ABORT);
+        }
+        fstat_reset(&fstat, *ptr_satlevel);
+        fs = &fstat;
     }
 
     /*
     SETUP
     */
 
-    int n_pixels = in_img.md->size[0] * in_img.md->size[1];
-
-    void *sum_x  = malloc(n_pixels * SIZEOF_DATATYPE_OUTPUT);
-    void *sum_xx = malloc(n_pixels * SIZEOF_DATATYPE_OUTPUT);
+    // Ping-pong accumulator sets
+    TSTATS_ACC acc[2];
+    int        buf_pp = 0;
+    for(int pp = 0; pp < 2; ++pp)
+    {
+        tstats_acc_alloc(&acc[pp],
+                         n_stat_pixels,
+                         SIZEOF_DATATYPE_OUTPUT,
+                         out.do_minmax,
+                         out.do_moments,
+                         out.do_autocorr,
+                         out.n_refpix,
+                         refpix);
+    }
 
     // HOUSEKEEPING
     int n_frames_acc   = 0;
-    int just_published = FALSE;
+    int n_skip_acc     = 0; // frames written but not accumulated, this batch
+    int just_published = TRUE; // first frame initializes the accumulators
+
+    // Frame accounting: cnt0 counts frames (slices) written to the input
+    uint64_t cnt0_last = in_img.md->cnt0;
 
     struct timespec time1;
     struct timespec time2;
@@ -355,6 +1524,10 @@ static errno_t compute_function()
 
     PRINT_WARNING("Timeout: %f", *ptr_timeout);
     PRINT_WARNING("Frames: %d", *ptr_n_frames);
+    PRINT_WARNING("Pixels: %d  slice mode: %d  binning: %d",
+                  n_pixels,
+                  slicemode,
+                  binfact);
 
     /*
     PROCESSINFO INIT
@@ -362,6 +1535,14 @@ static errno_t compute_function()
     INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
     // PROCESSINFO* processinfo now available
 
+    TSTATS_PUBLISHER pub;
+    memset(&pub, 0, sizeof(TSTATS_PUBLISHER));
+    pub.out         = &out;
+    pub.processinfo = processinfo;
+    pthread_mutex_init(&pub.mutex, NULL);
+    pthread_cond_init(&pub.cond, NULL);
+    pthread_create(&pub.thread, NULL, stats_publisher_thread, &pub);
+
     /*
     LOOP
     */
@@ -370,47 +1551,124 @@ static errno_t compute_function()
 
     {
         /*
-        ACCUMULATE
-        */
-        ave_std_accumulate(in_img, sum_x, sum_xx, just_published);
-        just_published = FALSE;
-        ++n_frames_acc;
-        /*
-        PRE - FINALIZE
+        FRAME ACCOUNTING
+        Frames written since the last wake-up, from cnt0
+        2D / volume: only the latest frame is available, others are skipped
+        slice mode: replay the slices still in the circular buffer, ending
+        at the last slice written (cnt1)
         */
+        uint64_t cnt0_now  = in_img.md->cnt0;
+        long     n_written = (long)(cnt0_now - cnt0_last);
+        cnt0_last          = cnt0_now;
 
-        /*
-        FINALIZATION AND PUBLISH
-        */
-        clock_gettime(CLOCK_MILK, &time2);
+        if(n_written == 0)
+        {
+            continue; // No new frame: do not count the same frame twice
+        }
+        if(n_written < 0)
+        {
+            PRINT_WARNING("cnt0 went backwards (%lu), resync", cnt0_now);
+            n_written = 1;
+        }
 
-        if((n_frames_acc >= *ptr_n_frames ||
-                timespec_diff_double(time1, time2) > *ptr_timeout))
+        long n_new       = 1;
+        long slice_first = 0;
+        if(slicemode)
         {
-            if(n_frames_acc >= 1)
+            n_new = (n_written < n_slices) ? n_written : n_slices;
+            slice_first =
+                ((long) in_img.md->cnt1 - n_new + 1 + n_slices) % n_slices;
+        }
+        n_skip_acc += n_written - n_new;
+
+        for(long fr = 0; fr < n_new; ++fr)
+        {
+            long frame_offset = 0;
+            if(slicemode)
             {
-                // Keyword value carry-over
-                for(int kw = 0; kw < in_img.md->NBkw; ++kw)
-                {
-                    out_ave_img.im->kw[kw].value = in_img.im->kw[kw].value;
-                    out_std_img.im->kw[kw].value = in_img.im->kw[kw].value;
-                }
-
-                ave_finalize(out_ave_img, sum_x, n_frames_acc);
-                processinfo_update_output_stream(processinfo, out_ave_img.ID);
-
-                if(n_frames_acc >= 2)
-                {
-                    std_finalize(out_std_img, sum_x, sum_xx, n_frames_acc);
-                    processinfo_update_output_stream(processinfo,
-                                                     out_std_img.ID);
-                }
+                frame_offset = ((slice_first + fr) % n_slices) * n_pixels;
+            }
+
+            /*
+            ACCUMULATE
+            */
+            if(fr == 0 && n_written > n_new)
+            {
+                acc[buf_pp].lag_valid = FALSE; // frames missed just before
+            }
+            void *frame =
+                (char *) in_img.im->array.raw + frame_offset * typesize_in;
+            if(binfact > 1)
+            {
+                bin_frame(frame,
+                          _DATATYPE_INPUT,
+                          in_img.md->size[0],
+                          in_img.md->size[1],
+                          n_planes,
+                          binfact,
+                          bframe,
+                          fs);
+                ave_std_accumulate(bframe,
+                                   _DATATYPE_OUTPUT,
+                                   n_stat_pixels,
+                                   &acc[buf_pp],
+                                   just_published,
+                                   NULL);
+            }
+            else
+            {
+                ave_std_accumulate(frame,
+                                   _DATATYPE_INPUT,
+                                   n_pixels,
+                                   &acc[buf_pp],
+                                   just_published,
+                                   fs);
+            }
+
+            if(fs != NULL)
+            {
+                // Append one row to the ring, cnt1 is the last row written
+                uint32_t row = (fstat_img.md->cnt1 + 1) % fstatlen;
+                double  *fsrow =
+                    fstat_img.im->array.D + (long) row * TSTATS_FSTAT_NCOL;
+                double mean = fs->sum / fs->n;
+                double var  = fs->sum2 / fs->n - mean * mean;
+
+                fstat_img.md->write = TRUE;
+                fsrow[TSTATS_FSTAT_CNT0] = cnt0_now - (n_new - 1 - fr);
+                fsrow[TSTATS_FSTAT_MEAN] = mean;
+                fsrow[TSTATS_FSTAT_RMS]  = (var > 0.0) ? sqrt(var) : 0.0;
+                fsrow[TSTATS_FSTAT_MIN]  = fs->vmin;
+                fsrow[TSTATS_FSTAT_MAX]  = fs->vmax;
+                fsrow[TSTATS_FSTAT_NSAT] = fs->nsat;
+                fstat_img.md->cnt1       = row;
+                stats_post(&out, processinfo, fstat_img.ID);
+            }
+            just_published = FALSE;
+            ++n_frames_acc;
+
+            /*
+            FINALIZATION AND PUBLISH
+            */
+            clock_gettime(CLOCK_MILK, &time2);
+
+            if((n_frames_acc >= *ptr_n_frames ||
+                    timespec_diff_double(time1, time2) > *ptr_timeout))
+            {
+                // Outputs are free once the previous batch is published
+                stats_publisher_wait(&pub);
+                stats_kw_update(&out, in_img, n_frames_acc, n_skip_acc);
+                stats_publisher_post(&pub, &acc[buf_pp], n_frames_acc);
+
+                // Ping-pong toggle
+                buf_pp = 1 - buf_pp;
 
                 // TODO update the timeout timespec
 
                 just_published = TRUE;
                 clock_gettime(CLOCK_MILK, &time1);
                 n_frames_acc = 0;
+                n_skip_acc   = 0;
             }
         }
     }
@@ -421,8 +1679,21 @@ static errno_t compute_function()
     TEARDOWN
     */
 
-    free(sum_x);
-    free(sum_xx);
+    // Publisher exits after the pending batch, if any
+    pthread_mutex_lock(&pub.mutex);
+    pub.quit = TRUE;
+    pthread_cond_broadcast(&pub.cond);
+    pthread_mutex_unlock(&pub.mutex);
+    pthread_join(pub.thread, NULL);
+    pthread_mutex_destroy(&pub.mutex);
+    pthread_cond_destroy(&pub.cond);
+    pthread_mutex_destroy(&out.postmutex);
+
+    for(int pp = 0; pp < 2; ++pp)
+    {
+        tstats_acc_free(&acc[pp]);
+    }
+    free(bframe);
 
     DEBUG_TRACE_FEXIT();
     return RETURN_SUCCESS;
@@ -0,0 +1,249 @@
+/**
+ * @file    combineHDR_bench.c
+ * @brief   combineHDR compose kernel benchmark
+ *
+ * Times the row compose kernel of the module (hdr_compose_rows) against the
+ * original per-pixel kernel, kept here as the reference, on a synthetic
+ * cube and layer map, single thread. Reports the time per pass and the
+ * largest difference relative to the image maximum.
+ *
+ * Usage: combineHDR_bench [xsize ysize zsize binstep npass]
+ * Build: see combineHDR_bench.sh
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../combineHDR_kernels.h"
+
+/*
+Reference compose kernel, per pixel
+Layer map interpolated bilinearly per pixel, exposures read at a stride of
+xsize * ysize; the last bin row/column extrapolate and the layer is not
+clamped: the layer map must keep it within [0, zsize - 1]
+*/
+static void compose_rows_ref(float *__restrict out,
+                             const float *__restrict cube,
+                             const float *__restrict layermap,
+                             const float *__restrict layermapg,
+                             const float *etimearray,
+                             uint32_t     xsize,
+                             uint32_t     ysize,
+                             uint32_t     xsize1,
+                             uint32_t     ysize1,
+                             uint32_t     zsize,
+                             uint32_t     jjstart,
+                             uint32_t     jjend)
+{
+    for(uint32_t jj = jjstart; jj < jjend; jj++)
+    {
+        float    y   = 1.0 * jj / ysize;
+        uint32_t jj1 = (uint32_t)(y * ysize1);
+        if(jj1 == ysize1 - 1)
+        {
+            jj1 = ysize1 - 2;
+        }
+        float jj1frac = y * ysize1 - jj1;
+
+        for(uint32_t ii = 0; ii < xsize; ii++)
+        {
+            float    x   = 1.0 * ii / xsize;
+            uint32_t ii1 = (uint32_t)(x * xsize1);
+            if(ii1 == xsize1 - 1)
+            {
+                ii1 = xsize1 - 2;
+            }
+            float ii1frac = x * xsize1 - ii1;
+
+            // get layer
+            float layer00 = layermap[jj1 * xsize1 + ii1];
+            float layer10 = layermap[jj1 * xsize1 + ii1 + 1];
+            float layer01 = layermap[(jj1 + 1) * xsize1 + ii1];
+            float layer11 = layermap[(jj1 + 1) * xsize1 + ii1 + 1];
+
+            float layer = layer00 * (1.0 - ii1frac) * (1.0 - jj1frac) +
+                          layer01 * (1.0 - ii1frac) * jj1frac +
+                          layer10 * ii1frac * (1.0 - jj1frac) +
+                          layer11 * ii1frac * jj1frac;
+
+            uint32_t layer0 = (uint32_t) layer;
+            uint32_t layer1 = layer0 + 1;
+            if(layer1 == zsize)
+            {
+                layer1 = layer0;
+            }
+            float layercoeff = layer - 1.0 * layer0;
+
+            float pval0 =
+                cube[(long) layer0 * xsize * ysize + jj * xsize + ii] /
+                etimearray[layer0];
+            float pval1 =
+                cube[(long) layer1 * xsize * ysize + jj * xsize + ii] /
+                etimearray[layer1];
+
+            double alpha0 = 10.0;
+            double layerg = layermapg[jj1 * xsize1 + ii1];
+            if(layerg > 3.0)
+            {
+                layerg = 3.0;
+            }
+            double layercoeff1 = 1.0 / pow(alpha0, layerg);
+
+            out[jj * xsize + ii] =
+                layercoeff1 * (pval0 * (1.0 - layercoeff) + pval1 * layercoeff);
+        }
+    }
+}
+
+static double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + 1.0e-9 * (t1->tv_nsec - t0->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t xsize   = (argc > 1) ? atoi(argv[1]) : 2000;
+    uint32_t ysize   = (argc > 2) ? atoi(argv[2]) : 1500;
+    uint32_t zsize   = (argc > 3) ? atoi(argv[3]) : 4;
+    uint32_t binstep = (argc > 4) ? atoi(argv[4]) : 5;
+    int      npass   = (argc > 5) ? atoi(argv[5]) : 10;
+
+    if(zsize < 2 || binstep < 1 || xsize / binstep < 2 ||
+            ysize / binstep < 2 || npass < 1)
+    {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+    uint32_t xsize1 = xsize / binstep;
+    uint32_t ysize1 = ysize / binstep;
+    long     npix   = (long) xsize * ysize;
+    long     npix1  = (long) xsize1 * ysize1;
+
+    float *cube      = (float *) malloc(sizeof(float) * npix * zsize);
+    float *etime     = (float *) malloc(sizeof(float) * zsize);
+    float *layermap  = (float *) malloc(sizeof(float) * npix1);
+    float *layermapg = (float *) malloc(sizeof(float) * npix1);
+    float *outref    = (float *) malloc(sizeof(float) * npix);
+    float *outrow    = (float *) malloc(sizeof(float) * npix);
+    const float **layers = (const float **) malloc(sizeof(float *) * zsize);
+    if(cube == NULL || etime == NULL || layermap == NULL ||
+            layermapg == NULL || outref == NULL || outrow == NULL ||
+            layers == NULL)
+    {
+        fprintf(stderr, "malloc returns NULL pointer\n");
+        return 1;
+    }
+
+    // Exposures of a smooth scene, longest first, 4x apart
+    for(uint32_t kk = 0; kk < zsize; kk++)
+    {
+        etime[kk]  = powf(4.0f, zsize - 1 - kk);
+        layers[kk] = cube + kk * npix;
+        for(uint32_t jj = 0; jj < ysize; jj++)
+        {
+            for(uint32_t ii = 0; ii < xsize; ii++)
+            {
+                float flux = 10.0f * expf(6.0f * ii / xsize) *
+                             (1.0f + 0.3f * sinf(0.05f * jj));
+                cube[kk * npix + (long) jj * xsize + ii] = flux * etime[kk];
+            }
+        }
+    }
+
+    // Smooth layer map within [0.5, zsize - 1.5]: the extrapolated last
+    // bins of the reference stay inside the cube
+    for(uint32_t jj1 = 0; jj1 < ysize1; jj1++)
+    {
+        for(uint32_t ii1 = 0; ii1 < xsize1; ii1++)
+        {
+            float s = 0.5f + 0.5f * sinf(0.02f * ii1) * cosf(0.03f * jj1);
+            layermap[(long) jj1 * xsize1 + ii1]  = 0.5f + (zsize - 2) * s;
+            layermapg[(long) jj1 * xsize1 + ii1] = 0.5f * s;
+        }
+    }
+
+    double dt[2];
+    for(int kernel = 0; kernel < 2; kernel++)
+    {
+        struct timespec t0;
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(int pass = 0; pass < npass; pass++)
+        {
+            if(kernel == 0)
+            {
+                compose_rows_ref(outref,
+                                 cube,
+                                 layermap,
+                                 layermapg,
+                                 etime,
+                                 xsize,
+                                 ysize,
+                                 xsize1,
+                                 ysize1,
+                                 zsize,
+                                 0,
+                                 ysize);
+            }
+            else
+            {
+                hdr_compose_rows(outrow,
+                                 NULL,
+                                 NULL,
+                                 layers,
+                                 layermap,
+                                 layermapg,
+                                 etime,
+                                 1.0,
+                                 0.0,
+                                 xsize,
+                                 ysize,
+                                 xsize1,
+                                 ysize1,
+                                 zsize,
+                                 0,
+                                 ysize);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        dt[kernel] = elapsed(&t0, &t1) / npass;
+    }
+
+    double vmax  = 0.0;
+    double dfmax = 0.0;
+    for(long ii = 0; ii < npix; ii++)
+    {
+        double df = fabs(outrow[ii] - outref[ii]);
+        vmax      = (fabs(outref[ii]) > vmax) ? fabs(outref[ii]) : vmax;
+        dfmax     = (df > dfmax) ? df : dfmax;
+    }
+
+    printf("compose bench %u x %u x %u, binstep %u, %d passes\n",
+           xsize,
+           ysize,
+           zsize,
+           binstep,
+           npass);
+    printf("  reference : %10.3f ms  %8.1f Mpix/s\n",
+           1.0e3 * dt[0],
+           1.0e-6 * npix / dt[0]);
+    printf("  row kernel: %10.3f ms  %8.1f Mpix/s  (x %.1f)\n",
+           1.0e3 * dt[1],
+           1.0e-6 * npix / dt[1],
+           dt[0] / dt[1]);
+    printf("  max difference / max value: %g\n",
+           (vmax > 0.0) ? dfmax / vmax : dfmax);
+
+    free(cube);
+    free(etime);
+    free(layermap);
+    free(layermapg);
+    free(outref);
+    free(outrow);
+    free(layers);
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# Compose kernel benchmark: reference vs row kernel, single thread
+# Synthetic cube, arguments: [xsize ysize zsize binstep npass]
+# Links the installed module library (MILK_INSTALLDIR, default /usr/local/milk)
+
+MILK_INSTALLDIR=${MILK_INSTALLDIR:-/usr/local/milk}
+BENCHDIR=$(dirname "$0")
+
+gcc -O3 -march=native -o /tmp/combineHDR_bench \
+    "${BENCHDIR}/combineHDR_bench.c" \
+    -L"${MILK_INSTALLDIR}/lib" -Wl,-rpath,"${MILK_INSTALLDIR}/lib" \
+    -lmilkimageformat -lm || exit 1
+
+/tmp/combineHDR_bench "$@"